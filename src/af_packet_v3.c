@@ -32,11 +32,15 @@
 #include <math.h>
 
 #include "af_packet_v3.h"
+#include "af_xdp.h"
+#include "socket_filter.h"
+#include "topology.h"
 #include "signal_handling.h"
 #include "libmerc/utils.h"
-#include "rnd_pkt_drop.h"
+#include "flow_sampler.h"
 #include "output.h"
 #include "pkt_processing.h"
+#include "thread_stats.h"
 
 /*
  * The thread_storage, stats_tracking, and ring_limits structs are
@@ -65,8 +69,11 @@ struct ring_limits {
 struct stats_tracking {
   struct thread_storage *tstor;
   int num_threads;
-  uint64_t received_packets;
-  uint64_t received_bytes;
+  uint64_t received_packets;  /* Totals of the per-thread counters, */
+  uint64_t received_bytes;    /* as of the last stats interval      */
+  uint64_t no_output;
+  uint64_t llq_full;
+  uint64_t llq_shed[RECORD_PRIORITIES];
   uint64_t socket_packets;
   uint64_t socket_drops;
   uint64_t socket_freezes;
@@ -90,9 +97,10 @@ struct thread_storage {
   uint8_t *mapped_buffer;   /* The pointer to the mmap()'d region */
   struct tpacket_block_desc **block_header; /* The pointer to each block in the mmap()'d region */
   struct tpacket_req3 ring_params; /* The ring allocation params to setsockopt() */
+  const struct socket_filter *filter; /* The kernel-side packet filter, or NULL */
   struct stats_tracking *statst;   /* A pointer to the struct with the stats counters */
-  double *block_streak_hist;  /* The block streak histogram */
-  pthread_mutex_t bstreak_m;  /* The block streak mutex */
+  struct ring_usage_hist block_streak_hist; /* The block streak histogram */
+  struct thread_counters last_counters;     /* Counters at the last stats interval (stats thread only) */
   int *t_start_p;             /* The clean start predicate */
   pthread_cond_t *t_start_c;  /* The clean start condition */
   pthread_mutex_t *t_start_m; /* The clean start mutex */
@@ -147,13 +155,19 @@ void af_packet_stats(int sockfd, struct stats_tracking *statst) {
 }
 
 void process_all_packets_in_block(struct tpacket_block_desc *block_hdr,
-                                  struct stats_tracking *statst,
                                   struct pkt_proc *pkt_processor) {
   int num_pkts = block_hdr->hdr.bh1.num_pkts, i;
   unsigned long byte_count = 0;
   struct tpacket3_hdr *pkt_hdr;
   //struct timespec ts;
-  struct packet_info pi;
+
+  /*
+   * packets are handed to the packet processor in batches of up to
+   * APPLY_BATCH_SIZE, which amortizes the per-call overhead
+   */
+  struct packet_info pi[APPLY_BATCH_SIZE];
+  uint8_t *eth[APPLY_BATCH_SIZE];
+  size_t batch_len = 0;
 
   pkt_hdr = (struct tpacket3_hdr *) ((uint8_t *) block_hdr + block_hdr->hdr.bh1.offset_to_first_pkt);
   for (i = 0; i < num_pkts; ++i) {
@@ -166,23 +180,34 @@ void process_all_packets_in_block(struct tpacket_block_desc *block_hdr,
       byte_count += pkt_hdr->tp_snaplen;
 
     /* Grab the times */
-    pi.ts.tv_sec = pkt_hdr->tp_sec;
-    pi.ts.tv_nsec = pkt_hdr->tp_nsec;
+    pi[batch_len].ts.tv_sec = pkt_hdr->tp_sec;
+    pi[batch_len].ts.tv_nsec = pkt_hdr->tp_nsec;
 
-    pi.caplen = pkt_hdr->tp_snaplen;
-    pi.len = pkt_hdr->tp_snaplen;
+    pi[batch_len].caplen = pkt_hdr->tp_snaplen;
+    pi[batch_len].len = pkt_hdr->tp_snaplen;
+    pi[batch_len].seq = 0;
 
-    uint8_t *eth = (uint8_t *)pkt_hdr + pkt_hdr->tp_mac;
-    pkt_processor->apply(&pi, eth);
+    eth[batch_len] = (uint8_t *)pkt_hdr + pkt_hdr->tp_mac;
+    if (++batch_len == APPLY_BATCH_SIZE) {
+      pkt_processor->apply_batch(pi, eth, batch_len);
+      batch_len = 0;
+    }
 
     pkt_hdr = (struct tpacket3_hdr *) ((uint8_t *)pkt_hdr + pkt_hdr->tp_next_offset);
   }
+  if (batch_len > 0) {
+    pkt_processor->apply_batch(pi, eth, batch_len);
+  }
 
-  /* Atomic operations
-   * https://gcc.gnu.org/onlinedocs/gcc-4.1.0/gcc/Atomic-Builtins.html
-   */
-  __sync_add_and_fetch(&(statst->received_packets), num_pkts);
-  __sync_add_and_fetch(&(statst->received_bytes), byte_count);
+  /* the kernel fills blocks in order, so no later packet is older than this one */
+  if (num_pkts > 0) {
+    struct timespec last_ts = { (time_t)block_hdr->hdr.bh1.ts_last_pkt.ts_sec, (long)block_hdr->hdr.bh1.ts_last_pkt.ts_nsec };
+    pkt_processor->advance(&last_ts);
+  }
+
+  /* Only this thread writes its counters, so no locked instructions are needed */
+  counter_add(&(pkt_processor->counters.packets), num_pkts);
+  counter_add(&(pkt_processor->counters.bytes), byte_count);
 }
 
 void check_socket_drops(int duration, uint64_t sdps, uint64_t sfps, int *socket_drops, int *zero_drops) {
@@ -244,9 +269,17 @@ void *stats_thread_func(void *statst_arg) {
    */
   enable_all_signals();
 
+  /*
+   * The stats thread reads the per-thread counters and histograms
+   * without locking; the histogram deltas are written into bstreak_hist
+   */
+  uint64_t *bstreak_hist = (uint64_t *)calloc(statst->tstor[0].block_streak_hist.num_bins, sizeof(uint64_t));
+  if (bstreak_hist == NULL) {
+    perror("could not allocate memory for block streak histogram snapshot");
+    exit(255);
+  }
+
   while (sig_close_flag == 0) {
-    uint64_t packets_before = statst->received_packets;
-    uint64_t bytes_before = statst->received_bytes;
     uint64_t socket_packets_before = statst->socket_packets;
     uint64_t socket_drops_before = statst->socket_drops;
     uint64_t socket_freezes_before = statst->socket_freezes;
@@ -269,18 +302,29 @@ void *stats_thread_func(void *statst_arg) {
     double tot_rusage = 0;   /* Sum of all threads rusage */
     double worst_rusage = 0; /* Worst average rbuffer usage */
     double worst_i_rusage = 0; /* Worst instantaneous rbuffer usage */
+    struct thread_counters interval = {}; /* Sum of all threads' counters over this interval */
     for (int thread = 0; thread < statst->num_threads; thread++) {
-      af_packet_stats(statst->tstor[thread].sockfd, statst);
-
-      int thread_block_count = statst->tstor[thread].ring_params.tp_block_nr;
-      double *bstreak_hist = statst->tstor[thread].block_streak_hist;
-
-      /* Get the lock for the bstreak histogram computation */
-      err = pthread_mutex_lock(&(statst->tstor[thread].bstreak_m));
-      if (err != 0) {
-	fprintf(stderr, "%s: stats func error acquiring bstreak mutex lock\n", strerror(err));
-	exit(255);
+      struct thread_storage *ts = &(statst->tstor[thread]);
+      af_packet_stats(ts->sockfd, statst);
+
+      struct thread_counters now, delta;
+      thread_counters_read(&(ts->pkt_processor->counters), &now);
+      delta.packets   = now.packets - ts->last_counters.packets;
+      delta.bytes     = now.bytes - ts->last_counters.bytes;
+      delta.no_output = now.no_output - ts->last_counters.no_output;
+      delta.llq_full  = now.llq_full - ts->last_counters.llq_full;
+      for (int p = 0; p < RECORD_PRIORITIES; p++) {
+        delta.llq_shed[p] = now.llq_shed[p] - ts->last_counters.llq_shed[p];
+        interval.llq_shed[p] += delta.llq_shed[p];
       }
+      ts->last_counters = now;
+      interval.packets   += delta.packets;
+      interval.bytes     += delta.bytes;
+      interval.no_output += delta.no_output;
+      interval.llq_full  += delta.llq_full;
+
+      int thread_block_count = ts->ring_params.tp_block_nr;
+      ts->block_streak_hist.interval(bstreak_hist);
 
       /* First compute the time total */
       double ttot = 0;
@@ -293,9 +337,7 @@ void *stats_thread_func(void *statst_arg) {
 	    worst_i_rusage = utmp;
 	  }
 	}
-	//fprintf(stderr, "%d: %lu\n", i, bstreak_hist[i]);
       }
-      //fprintf(stderr, "time total: %f\n", ttot);
 
       /* Now compute the average (weighted) ring usage */
       double rusage = 0;
@@ -305,27 +347,30 @@ void *stats_thread_func(void *statst_arg) {
 	}
       }
 
-      /* Now clear the bstreak histogram */
-      for (int i = 0; i <= thread_block_count; i++) {
-	bstreak_hist[i] = 0;
-      }
-
-      err = pthread_mutex_unlock(&(statst->tstor[thread].bstreak_m));
-      if (err != 0) {
-	fprintf(stderr, "%s: stats func error releasing bstreak mutex lock\n", strerror(err));
-	exit(255);
+      if (statst->verbosity && statst->num_threads > 1) {
+        fprintf(stderr,
+                "Thread %d: %" PRIu64 " packets; avg. rbuf %4.1f%%; No Output %" PRIu64 "; Queue Full %" PRIu64 "; "
+                "Queue Shed %" PRIu64 "/%" PRIu64 "/%" PRIu64 "\n",
+                thread, delta.packets, rusage * 100.0, delta.no_output, delta.llq_full,
+                delta.llq_shed[record_priority_low], delta.llq_shed[record_priority_normal], delta.llq_shed[record_priority_high]);
       }
 
-      //fprintf(stderr, "[thread %d] Got ring usage of %4f\n", thread, rusage);
       tot_rusage += rusage;
       if (rusage > worst_rusage) {
 	worst_rusage = rusage;
       }
     }
+    statst->received_packets += interval.packets;
+    statst->received_bytes += interval.bytes;
+    statst->no_output += interval.no_output;
+    statst->llq_full += interval.llq_full;
+    for (int p = 0; p < RECORD_PRIORITIES; p++) {
+      statst->llq_shed[p] += interval.llq_shed[p];
+    }
 
     /* The per-second stats scaled by the time delta */
-    double pps  = (statst->received_packets - packets_before) / time_d;      /* packets */
-    double byps  = (statst->received_bytes - bytes_before) / time_d;         /* bytes */
+    double pps  = interval.packets / time_d;      /* packets */
+    double byps  = interval.bytes / time_d;       /* bytes */
     double spps = (statst->socket_packets - socket_packets_before) / time_d; /* socket packets */
 
     /* The socket stats that don't need to be scaled */
@@ -376,10 +421,14 @@ void *stats_thread_func(void *statst_arg) {
                 "%7.03f%s Packets/s; Data Rate %7.03f%s bytes/s; "
                 "Ethernet Rate (est.) %7.03f%s bits/s; "
                 "Socket Packets %7.03f%s; Socket Drops %" PRIu64 " (packets); Socket Freezes %" PRIu64 "; "
+                "No Output %" PRIu64 " (packets); Queue Full %" PRIu64 " (packets); "
+                "Queue Shed %" PRIu64 "/%" PRIu64 "/%" PRIu64 " (low/normal/high priority records); "
                 "All threads avg. rbuf %4.1f%%; Worst thread avg. rbuf %4.1f%%; Worst instantaneous rbuf %4.1f%%\n",
                 r_pps, r_pps_s, r_byps, r_byps_s,
                 r_ebips, r_ebips_s,
                 r_spps, r_spps_s, sdps, sfps,
+                interval.no_output, interval.llq_full,
+                interval.llq_shed[record_priority_low], interval.llq_shed[record_priority_normal], interval.llq_shed[record_priority_high],
                 (tot_rusage / (statst->num_threads)) * 100.0, worst_rusage * 100.0,
                 worst_i_rusage * 100.0);
     }
@@ -391,6 +440,7 @@ void *stats_thread_func(void *statst_arg) {
     }
   }
 
+  free(bstreak_hist);
   return NULL;
 }
 
@@ -447,6 +497,18 @@ int create_dedicated_socket(struct thread_storage *thread_stor, int fanout_arg)
     return -1;
   }
 
+  /*
+   * attach the packet filter before the socket is bound, so that
+   * the ring only ever holds packets that could produce output
+   */
+  if (thread_stor->filter) {
+    err = socket_filter_attach(sockfd, thread_stor->filter);
+    if (err) {
+      fprintf(stderr, "%s: could not attach packet filter for thread %d\n", strerror(errno), thread_stor->tnum);
+      return -1;
+    }
+  }
+
   /*
    * set up RX_RING
    */
@@ -565,9 +627,7 @@ int af_packet_rx_ring_fanout_capture(struct thread_storage *thread_stor) {
    */
   int sockfd = thread_stor->sockfd;
   struct tpacket_block_desc **block_header = thread_stor->block_header;
-  struct stats_tracking *statst = thread_stor->statst;
-  double *block_streak_hist = thread_stor->block_streak_hist;
-  pthread_mutex_t *bstreak_m = &(thread_stor->bstreak_m);
+  struct ring_usage_hist *block_streak_hist = &(thread_stor->block_streak_hist);
   struct pkt_proc *pkt_processor = thread_stor->pkt_processor;
 
   /* We got the clean start all clear so we can get started but
@@ -576,6 +636,7 @@ int af_packet_rx_ring_fanout_capture(struct thread_storage *thread_stor) {
    * the kernel
    */
   uint32_t thread_block_count = thread_stor->ring_params.tp_block_nr;
+  long heartbeat_lag = 2L * thread_stor->ring_params.tp_retire_blk_tov * 1000000L; /* nanoseconds */
   af_packet_stats(sockfd, NULL); // Discard bogus stats
   for (unsigned int b = 0; b < thread_block_count; b++) {
     if ((block_header[b]->hdr.bh1.block_status & TP_STATUS_USER) == 0) {
@@ -659,24 +720,9 @@ int af_packet_rx_ring_fanout_capture(struct thread_storage *thread_stor) {
 	bstreak = thread_block_count;
       }
 
-      /* The use of a mutex can be justified in this case
-       * because 1) this will rarely ever clash with the stats
-       * thread and 2) there aren't any blocks for us to process
-       * at the moment so we can take a tiny bit of time tracking
-       * stats and such
-       */
-      err = pthread_mutex_lock(bstreak_m);
-      if (err != 0) {
-	fprintf(stderr, "%s: error acquiring bstreak mutex lock\n", strerror(err));
-	exit(255);
-      }
-
-      block_streak_hist[bstreak] += time_d;
-
-      err = pthread_mutex_unlock(bstreak_m);
-      if (err != 0) {
-	fprintf(stderr, "%s: error releasing bstreak mutex lock\n", strerror(err));
-	exit(255);
+      /* The histogram is sequence locked, so this never waits on the stats thread */
+      if (time_d > 0) {
+	block_streak_hist->add(bstreak, (uint64_t)(time_d * 1000000000.0));
       }
 
       bstreak = 0;
@@ -709,10 +755,26 @@ int af_packet_rx_ring_fanout_capture(struct thread_storage *thread_stor) {
 	}
       }
 
+      /* No packet remains to be processed except those in blocks
+       * that the kernel has not yet returned, which it does within
+       * two block timeouts of the first packet in a block, so the
+       * output thread need not wait for any older packet.
+       */
+      struct timespec now;
+      clock_gettime(CLOCK_REALTIME, &now);
+      now.tv_sec -= heartbeat_lag / 1000000000L;
+      now.tv_nsec -= heartbeat_lag % 1000000000L;
+      if (now.tv_nsec < 0) {
+        now.tv_sec -= 1;
+        now.tv_nsec += 1000000000L;
+      }
+      pkt_processor->advance(&now);
+
       /* Now that we've done the housekeeping, poll the kernel for
-       * when data has been returned to us
+       * when data has been returned to us; the wait is short, so that
+       * the output thread hears from an idle thread often
        */
-      polret = poll(&psockfd, 1, 1000); /* Let poll wait up to a second */
+      polret = poll(&psockfd, 1, LLQ_HEARTBEAT_MSEC);
       if (polret < 0) {
 	perror("poll returned error");
       } else if (polret == 0) {
@@ -731,7 +793,7 @@ int af_packet_rx_ring_fanout_capture(struct thread_storage *thread_stor) {
       bstreak++; /* We've gotten another block */
 
       /* We found data, process it! */
-      process_all_packets_in_block(block_header[cb], statst, pkt_processor);
+      process_all_packets_in_block(block_header[cb], pkt_processor);
 
       /* Reset our accounting */
       pstreak = 0; /* Reset the poll streak tracking */
@@ -771,6 +833,10 @@ void *packet_capture_thread_func(void *arg)  {
 enum status bind_and_dispatch(struct mercury_config *cfg,
                               mercury_context mc,
                               struct output_file *out_ctx) {
+  if (cfg->capture_engine == capture_engine_xdp) {
+    return xdp_bind_and_dispatch(cfg, mc, out_ctx);
+  }
+
   /* initialize the ring limits from the configuration */
   struct ring_limits rl;
   ring_limits_init(&rl, cfg->buffer_fraction);
@@ -850,6 +916,22 @@ enum status bind_and_dispatch(struct mercury_config *cfg,
   thread_ring_req.tp_retire_blk_tov = rl.af_blocktimeout;
   thread_ring_req.tp_feature_req_word = TP_FT_REQ_FILL_RXHASH;
   
+  /*
+   * compile the protocol selection into a kernel-side packet filter,
+   * which is shared by all of the sockets
+   */
+  static struct socket_filter filter;
+  if (socket_filter_compile(&filter, mc, cfg->snaplen) != status_ok) {
+    exit(255);
+  }
+  if (cfg->verbosity) {
+    fprintf(stderr, "packet filter has %u instructions", filter.prog.len);
+    if (cfg->snaplen) {
+      fprintf(stderr, ", snaplen %u", cfg->snaplen);
+    }
+    fprintf(stderr, "\n");
+  }
+
   /* Get all the thread storage ready and allocate the sockets */
   for (int thread = 0; thread < num_threads; thread++) {
     /* Init the thread storage for this thread */
@@ -868,19 +950,6 @@ enum status bind_and_dispatch(struct mercury_config *cfg,
       exit(255);
     }
 
-    pthread_mutexattr_t m_attr;
-    err = pthread_mutexattr_init(&m_attr);
-    if (err) {
-      fprintf(stderr, "%s: error initializing block streak mutex attributes for thread %d\n", strerror(err), thread);
-      exit(255);
-    }
-
-    err = pthread_mutex_init(&(tstor[thread].bstreak_m), &m_attr);
-    if (err) {
-      fprintf(stderr, "%s: error initializing block streak mutex for thread %d\n", strerror(err), thread);
-      exit(255);
-    }
-
     tstor[thread].tnum = thread;
     tstor[thread].tid = 0;
     tstor[thread].sockfd = -1;
@@ -890,12 +959,14 @@ enum status bind_and_dispatch(struct mercury_config *cfg,
     tstor[thread].t_start_c = &t_start_c;
     tstor[thread].t_start_m = &t_start_m;
 
-    tstor[thread].block_streak_hist = (double *)calloc(thread_ring_blockcount + 1, sizeof(double));
-    if (!(tstor[thread].block_streak_hist)) {
+    if (!tstor[thread].block_streak_hist.init(thread_ring_blockcount + 1)) {
       perror("could not allocate memory for thread stats block streak histogram\n");
+      exit(255);
     }
+    memset(&(tstor[thread].last_counters), 0, sizeof(tstor[thread].last_counters));
 
     memcpy(&(tstor[thread].ring_params), &thread_ring_req, sizeof(thread_ring_req));
+    tstor[thread].filter = &filter;
 
     err = create_dedicated_socket(&(tstor[thread]), fanout_arg);
 
@@ -941,6 +1012,9 @@ enum status bind_and_dispatch(struct mercury_config *cfg,
       fprintf(stderr, "%s: error initializing attributes for thread %d\n", strerror(err), thread);
       exit(255);
     }
+    if (topology_set_worker_affinity(&thread_attributes, thread) != status_ok) {
+      exit(255);
+    }
 
     err = pthread_create(&(tstor[thread].tid), &thread_attributes, packet_capture_thread_func, &(tstor[thread]));
     if (err) {
@@ -950,12 +1024,7 @@ enum status bind_and_dispatch(struct mercury_config *cfg,
   }
 
   /* Wake up output thread so it's polling the queues waiting for data */
-  out_ctx->t_output_p = 1;
-  err = pthread_cond_broadcast(&(out_ctx->t_output_c)); /* Wake up output */
-  if (err != 0) {
-      printf("%s: error broadcasting all clear on output start condition\n", strerror(err));
-      exit(255);
-  }
+  output_thread_start(out_ctx);
 
   /* At this point all threads are started but they're waiting on
      the clean start condition
@@ -978,11 +1047,21 @@ enum status bind_and_dispatch(struct mercury_config *cfg,
     pthread_join(tstor[thread].tid, NULL);
   }
 
-  /* free up resources */
+  /* free up resources, after taking the final counter values */
+  struct thread_counters total = {};
   for (int thread = 0; thread < num_threads; thread++) {
+    const struct thread_counters *c = &(tstor[thread].pkt_processor->counters);
+    total.packets   += c->packets;
+    total.bytes     += c->bytes;
+    total.no_output += c->no_output;
+    total.llq_full  += c->llq_full;
+    for (int p = 0; p < RECORD_PRIORITIES; p++) {
+      total.llq_shed[p] += c->llq_shed[p];
+    }
+
     free(tstor[thread].block_header);
     munmap(tstor[thread].mapped_buffer, tstor[thread].ring_params.tp_block_size * tstor[thread].ring_params.tp_block_nr);
-    free(tstor[thread].block_streak_hist);
+    tstor[thread].block_streak_hist.free_bins();
     close(tstor[thread].sockfd);
     delete tstor[thread].pkt_processor;
   }
@@ -993,8 +1072,14 @@ enum status bind_and_dispatch(struct mercury_config *cfg,
 	  "%" PRIu64 " bytes captured\n"
 	  "%" PRIu64 " packets seen by socket\n"
 	  "%" PRIu64 " packets dropped\n"
-	  "%" PRIu64 " socket queue freezes\n",
-	  statst.received_packets, statst.received_bytes, statst.socket_packets, statst.socket_drops, statst.socket_freezes);
+	  "%" PRIu64 " socket queue freezes\n"
+	  "%" PRIu64 " packets without output\n"
+	  "%" PRIu64 " packets dropped due to full output queue\n"
+	  "%" PRIu64 " records shed to keep output queue headroom "
+	  "(%" PRIu64 " low, %" PRIu64 " normal, %" PRIu64 " high priority)\n",
+	  total.packets, total.bytes, statst.socket_packets, statst.socket_drops, statst.socket_freezes,
+	  total.no_output, total.llq_full, thread_counters_shed(&total),
+	  total.llq_shed[record_priority_low], total.llq_shed[record_priority_normal], total.llq_shed[record_priority_high]);
 
   return status_ok;
 }
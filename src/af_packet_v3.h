@@ -15,4 +15,6 @@ enum status bind_and_dispatch(struct mercury_config *cfg,
                               mercury_context mc,
                               struct output_file *out_ctx);
 
+void check_socket_drops(int duration, uint64_t sdps, uint64_t sfps, int *socket_drops, int *zero_drops);
+
 #endif /* AF_PACKET_V3 */
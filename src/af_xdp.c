@@ -0,0 +1,728 @@
+/*
+ * af_xdp.c
+ *
+ * interface to AF_XDP (XSK) sockets, with one UMEM and one RX ring
+ * per worker thread
+ *
+ * Copyright (c) 2021 Cisco Systems, Inc. All rights reserved.
+ * License at https://github.com/cisco/mercury/blob/master/LICENSE
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stddef.h>
+#include <errno.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <poll.h>
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <net/if.h>
+#include <linux/if_xdp.h>
+#include <linux/if_link.h>
+#include <linux/bpf.h>
+
+#include <time.h>
+#include <math.h>
+
+#include "af_xdp.h"
+#include "af_packet_v3.h"
+#include "signal_handling.h"
+#include "libmerc/utils.h"
+#include "flow_sampler.h"
+#include "output.h"
+#include "pkt_processing.h"
+#include "thread_stats.h"
+#include "topology.h"
+
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+/*
+ * UMEM and ring geometry.  Each worker thread owns XDP_NUM_FRAMES
+ * frames of XDP_FRAME_SIZE bytes; every frame is always in exactly
+ * one of the fill ring, the RX ring, or the hands of the packet
+ * processor, so the fill ring is sized to hold all of them and can
+ * never overflow.  Ring sizes must be powers of two.
+ */
+#define XDP_FRAME_SIZE  4096
+#define XDP_NUM_FRAMES  4096
+#define XDP_RING_SIZE   XDP_NUM_FRAMES
+
+/*
+ * struct xdp_queue is a single-producer, single-consumer ring that
+ * is shared with the kernel through mmap()
+ */
+struct xdp_queue {
+    uint32_t *producer;
+    uint32_t *consumer;
+    uint32_t *flags;
+    void *ring;
+    uint32_t mask;
+    void *map;
+    size_t map_len;
+};
+
+struct xdp_stats_tracking {
+    struct xdp_thread_storage *tstor;
+    int num_threads;
+    struct thread_counters received;  /* Totals of the per-thread counters */
+    uint64_t socket_drops;
+    uint64_t fill_ring_empty;
+    int *t_start_p;             /* The clean start predicate */
+    pthread_cond_t *t_start_c;  /* The clean start condition */
+    pthread_mutex_t *t_start_m; /* The clean start mutex */
+    int verbosity;
+};
+
+/*
+ * struct xdp_thread_storage stores information about each thread,
+ * including its AF_XDP socket, UMEM, and rings
+ */
+struct xdp_thread_storage {
+    struct pkt_proc *pkt_processor;
+    int tnum;                 /* Thread Number, which is also the receive queue number */
+    pthread_t tid;            /* Thread ID */
+    int xsk_fd;               /* AF_XDP socket owned by this thread */
+    int ifindex;              /* The index of the interface to bind the socket to */
+    const char *if_name;      /* The name of the interface to bind the socket to */
+    uint8_t *umem;            /* The packet buffer area shared with the kernel */
+    struct xdp_queue rx;      /* RX ring (kernel produces, we consume) */
+    struct xdp_queue fill;    /* Fill ring (we produce, kernel consumes) */
+    bool need_wakeup;         /* Socket was bound with XDP_USE_NEED_WAKEUP */
+    struct xdp_statistics last_xdp_stats; /* Previous (cumulative) kernel stats */
+    struct xdp_stats_tracking *statst;
+    int *t_start_p;             /* The clean start predicate */
+    pthread_cond_t *t_start_c;  /* The clean start condition */
+    pthread_mutex_t *t_start_m; /* The clean start mutex */
+};
+
+static int sig_close_workers = 0; /* Packet proccessing var, see af_packet_v3.c */
+
+static int sys_bpf(enum bpf_cmd cmd, union bpf_attr *attr) {
+    return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+/*
+ * xdp_xskmap_create() creates the map that the XDP program uses to
+ * find the AF_XDP socket for each receive queue
+ */
+static int xdp_xskmap_create(unsigned int max_entries) {
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = BPF_MAP_TYPE_XSKMAP;
+    attr.key_size = sizeof(int);
+    attr.value_size = sizeof(int);
+    attr.max_entries = max_entries;
+    return sys_bpf(BPF_MAP_CREATE, &attr);
+}
+
+/*
+ * xdp_redirect_prog_load() loads a minimal XDP program, equivalent to
+ *
+ *    return bpf_redirect_map(&xsks_map, ctx->rx_queue_index, XDP_PASS);
+ *
+ * so that packets on queues without a mercury socket are passed up
+ * the stack as usual.  It is hand-assembled so that mercury does not
+ * depend on libbpf or a BPF compiler.
+ */
+static int xdp_redirect_prog_load(int map_fd) {
+    struct bpf_insn prog[] = {
+        { BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_1, offsetof(struct xdp_md, rx_queue_index), 0 },
+        { BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0, map_fd },
+        { 0, 0, 0, 0, 0 },
+        { BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_3, 0, 0, XDP_PASS },
+        { BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map },
+        { BPF_JMP | BPF_EXIT, 0, 0, 0, 0 }
+    };
+    static char license[] = "GPL";
+    char log_buf[4096] = { 0 };
+
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_XDP;
+    attr.insn_cnt = sizeof(prog) / sizeof(prog[0]);
+    attr.insns = (uint64_t)(uintptr_t)prog;
+    attr.license = (uint64_t)(uintptr_t)license;
+    attr.log_buf = (uint64_t)(uintptr_t)log_buf;
+    attr.log_size = sizeof(log_buf);
+    attr.log_level = 1;
+    int prog_fd = sys_bpf(BPF_PROG_LOAD, &attr);
+    if (prog_fd < 0 && log_buf[0] != '\0') {
+        fprintf(stderr, "BPF verifier log:\n%s\n", log_buf);
+    }
+    return prog_fd;
+}
+
+/*
+ * xdp_prog_attach() attaches the XDP program to an interface through
+ * a BPF link, preferring native (driver) mode and falling back to
+ * generic (skb) mode; closing the returned file descriptor detaches
+ * the program
+ */
+static int xdp_prog_attach(int prog_fd, int ifindex, int verbosity) {
+    const uint32_t modes[] = { XDP_FLAGS_DRV_MODE, XDP_FLAGS_SKB_MODE };
+    int link_fd = -1;
+    for (uint32_t mode : modes) {
+        union bpf_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.link_create.prog_fd = prog_fd;
+        attr.link_create.target_ifindex = ifindex;
+        attr.link_create.attach_type = BPF_XDP;
+        attr.link_create.flags = mode;
+        link_fd = sys_bpf(BPF_LINK_CREATE, &attr);
+        if (link_fd >= 0) {
+            if (verbosity) {
+                fprintf(stderr, "attached XDP program in %s mode\n", mode == XDP_FLAGS_DRV_MODE ? "native" : "generic");
+            }
+            return link_fd;
+        }
+        if (errno == EBUSY || errno == EEXIST) {
+            fprintf(stderr, "error: another XDP program is already attached to interface %d\n", ifindex);
+            return -1;
+        }
+    }
+    return link_fd;
+}
+
+/*
+ * xdp_num_rx_queues() returns the number of receive queues of an
+ * interface, as reported by sysfs, or 0 if that cannot be determined
+ */
+static int xdp_num_rx_queues(const char *if_name) {
+    char path[FILENAME_MAX];
+    snprintf(path, sizeof(path), "/sys/class/net/%s/queues", if_name);
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+        return 0;
+    }
+    int count = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strncmp(entry->d_name, "rx-", 3) == 0) {
+            count++;
+        }
+    }
+    closedir(dir);
+    return count;
+}
+
+static int xdp_queue_mmap(struct xdp_queue *q,
+                          int fd,
+                          const struct xdp_ring_offset *off,
+                          size_t entry_size,
+                          off_t pgoff) {
+    q->map_len = off->desc + XDP_RING_SIZE * entry_size;
+    q->map = mmap(NULL, q->map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, pgoff);
+    if (q->map == MAP_FAILED) {
+        q->map = NULL;
+        return -1;
+    }
+    q->producer = (uint32_t *)((uint8_t *)q->map + off->producer);
+    q->consumer = (uint32_t *)((uint8_t *)q->map + off->consumer);
+    q->flags = (uint32_t *)((uint8_t *)q->map + off->flags);
+    q->ring = (uint8_t *)q->map + off->desc;
+    q->mask = XDP_RING_SIZE - 1;
+    return 0;
+}
+
+/*
+ * create_dedicated_xsk() sets up the UMEM, rings, and AF_XDP socket
+ * for a single thread, binds it to the receive queue with the same
+ * number as the thread, and registers it in the XSKMAP
+ */
+static int create_dedicated_xsk(struct xdp_thread_storage *thread_stor, int map_fd) {
+    int sockfd = socket(AF_XDP, SOCK_RAW, 0);
+    if (sockfd == -1) {
+        fprintf(stderr, "%s: could not create AF_XDP socket for thread %d\n", strerror(errno), thread_stor->tnum);
+        return -1;
+    }
+    thread_stor->xsk_fd = sockfd;
+
+    size_t umem_len = (size_t)XDP_NUM_FRAMES * XDP_FRAME_SIZE;
+    void *umem = mmap(NULL, umem_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (umem == MAP_FAILED) {
+        fprintf(stderr, "%s: could not allocate UMEM for thread %d\n", strerror(errno), thread_stor->tnum);
+        return -1;
+    }
+    thread_stor->umem = (uint8_t *)umem;
+
+    struct xdp_umem_reg umem_reg;
+    memset(&umem_reg, 0, sizeof(umem_reg));
+    umem_reg.addr = (uint64_t)(uintptr_t)umem;
+    umem_reg.len = umem_len;
+    umem_reg.chunk_size = XDP_FRAME_SIZE;
+    umem_reg.headroom = 0;
+    if (setsockopt(sockfd, SOL_XDP, XDP_UMEM_REG, &umem_reg, sizeof(umem_reg)) != 0) {
+        fprintf(stderr, "%s: could not register UMEM for thread %d\n", strerror(errno), thread_stor->tnum);
+        return -1;
+    }
+
+    /*
+     * the kernel requires a completion ring before it will bind the
+     * socket, even though we never transmit
+     */
+    int ring_size = XDP_RING_SIZE;
+    if (setsockopt(sockfd, SOL_XDP, XDP_UMEM_FILL_RING, &ring_size, sizeof(ring_size)) != 0 ||
+        setsockopt(sockfd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &ring_size, sizeof(ring_size)) != 0 ||
+        setsockopt(sockfd, SOL_XDP, XDP_RX_RING, &ring_size, sizeof(ring_size)) != 0) {
+        fprintf(stderr, "%s: could not set AF_XDP ring sizes for thread %d\n", strerror(errno), thread_stor->tnum);
+        return -1;
+    }
+
+    struct xdp_mmap_offsets off;
+    socklen_t optlen = sizeof(off);
+    if (getsockopt(sockfd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen) != 0) {
+        fprintf(stderr, "%s: could not get AF_XDP ring offsets for thread %d\n", strerror(errno), thread_stor->tnum);
+        return -1;
+    }
+    if (xdp_queue_mmap(&thread_stor->rx, sockfd, &off.rx, sizeof(struct xdp_desc), XDP_PGOFF_RX_RING) != 0 ||
+        xdp_queue_mmap(&thread_stor->fill, sockfd, &off.fr, sizeof(uint64_t), XDP_UMEM_PGOFF_FILL_RING) != 0) {
+        fprintf(stderr, "%s: mmap of AF_XDP rings failed for thread %d\n", strerror(errno), thread_stor->tnum);
+        return -1;
+    }
+
+    /* hand every frame to the kernel */
+    uint64_t *fill_addrs = (uint64_t *)thread_stor->fill.ring;
+    for (uint32_t i = 0; i < XDP_NUM_FRAMES; i++) {
+        fill_addrs[i] = (uint64_t)i * XDP_FRAME_SIZE;
+    }
+    __atomic_store_n(thread_stor->fill.producer, XDP_NUM_FRAMES, __ATOMIC_RELEASE);
+
+    /* bind to the queue, trying zero-copy mode before copy mode */
+    const uint16_t bind_flags[] = { XDP_ZEROCOPY | XDP_USE_NEED_WAKEUP, XDP_COPY | XDP_USE_NEED_WAKEUP, XDP_COPY };
+    int err = -1;
+    for (uint16_t flags : bind_flags) {
+        struct sockaddr_xdp sxdp;
+        memset(&sxdp, 0, sizeof(sxdp));
+        sxdp.sxdp_family = AF_XDP;
+        sxdp.sxdp_ifindex = thread_stor->ifindex;
+        sxdp.sxdp_queue_id = thread_stor->tnum;
+        sxdp.sxdp_flags = flags;
+        err = bind(sockfd, (struct sockaddr *)&sxdp, sizeof(sxdp));
+        if (err == 0) {
+            thread_stor->need_wakeup = flags & XDP_USE_NEED_WAKEUP;
+            fprintf(stderr, "Bound AF_XDP socket to %s queue %d in %s mode for thread %d\n",
+                    thread_stor->if_name, thread_stor->tnum, (flags & XDP_ZEROCOPY) ? "zero-copy" : "copy", thread_stor->tnum);
+            break;
+        }
+    }
+    if (err != 0) {
+        fprintf(stderr, "%s: could not bind AF_XDP socket to %s queue %d\n", strerror(errno), thread_stor->if_name, thread_stor->tnum);
+        return -1;
+    }
+
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    int key = thread_stor->tnum;
+    attr.map_fd = map_fd;
+    attr.key = (uint64_t)(uintptr_t)&key;
+    attr.value = (uint64_t)(uintptr_t)&sockfd;
+    if (sys_bpf(BPF_MAP_UPDATE_ELEM, &attr) != 0) {
+        fprintf(stderr, "%s: could not add AF_XDP socket for thread %d to XSKMAP\n", strerror(errno), thread_stor->tnum);
+        return -1;
+    }
+
+    memset(&thread_stor->last_xdp_stats, 0, sizeof(thread_stor->last_xdp_stats));
+
+    return 0;
+}
+
+/*
+ * xdp_socket_stats() accumulates the drop counters of an AF_XDP
+ * socket into statst; unlike PACKET_STATISTICS, XDP_STATISTICS
+ * reports cumulative values, so only the increase since the previous
+ * call is added
+ */
+static void xdp_socket_stats(struct xdp_thread_storage *thread_stor, struct xdp_stats_tracking *statst) {
+    struct xdp_statistics xs;
+    socklen_t optlen = sizeof(xs);
+    if (getsockopt(thread_stor->xsk_fd, SOL_XDP, XDP_STATISTICS, &xs, &optlen) != 0) {
+        perror("error: could not get statistics for AF_XDP socket");
+        return;
+    }
+    const struct xdp_statistics &last = thread_stor->last_xdp_stats;
+    statst->socket_drops += (xs.rx_dropped - last.rx_dropped) + (xs.rx_ring_full - last.rx_ring_full);
+    statst->fill_ring_empty += xs.rx_fill_ring_empty_descs - last.rx_fill_ring_empty_descs;
+    thread_stor->last_xdp_stats = xs;
+}
+
+/*
+ * xdp_counters_total() sets statst->received to the sum of the
+ * per-thread counters, which are read without locking
+ */
+static void xdp_counters_total(struct xdp_stats_tracking *statst) {
+    memset(&statst->received, 0, sizeof(statst->received));
+    for (int thread = 0; thread < statst->num_threads; thread++) {
+        struct thread_counters c;
+        thread_counters_read(&statst->tstor[thread].pkt_processor->counters, &c);
+        statst->received.packets   += c.packets;
+        statst->received.bytes     += c.bytes;
+        statst->received.no_output += c.no_output;
+        statst->received.llq_full  += c.llq_full;
+        for (int p = 0; p < RECORD_PRIORITIES; p++) {
+            statst->received.llq_shed[p] += c.llq_shed[p];
+        }
+    }
+}
+
+static void *xdp_stats_thread_func(void *statst_arg) {
+    struct xdp_stats_tracking *statst = (struct xdp_stats_tracking *)statst_arg;
+    int duration = 0, socket_drops = 0, zero_drops = 0;
+
+    int err = pthread_mutex_lock(statst->t_start_m);
+    if (err != 0) {
+        fprintf(stderr, "%s: error locking clean start mutex for stats thread\n", strerror(err));
+        exit(255);
+    }
+    while (*(statst->t_start_p) != 1) {
+        err = pthread_cond_wait(statst->t_start_c, statst->t_start_m);
+        if (err != 0) {
+            fprintf(stderr, "%s: error waiting on clean start condition for stats thread\n", strerror(err));
+            exit(255);
+        }
+    }
+    err = pthread_mutex_unlock(statst->t_start_m);
+    if (err != 0) {
+        fprintf(stderr, "%s: error unlocking clean start mutex for stats thread\n", strerror(err));
+        exit(255);
+    }
+
+    /* enable all signals so that this thread shuts down first */
+    enable_all_signals();
+
+    while (sig_close_flag == 0) {
+        struct thread_counters before = statst->received;
+        uint64_t drops_before = statst->socket_drops;
+        uint64_t fill_empty_before = statst->fill_ring_empty;
+
+        sleep(1);
+
+        for (int thread = 0; thread < statst->num_threads; thread++) {
+            xdp_socket_stats(&statst->tstor[thread], statst);
+        }
+        xdp_counters_total(statst);
+        uint64_t pps = statst->received.packets - before.packets;
+        uint64_t byps = statst->received.bytes - before.bytes;
+        uint64_t sdps = statst->socket_drops - drops_before;
+        uint64_t sfes = statst->fill_ring_empty - fill_empty_before;
+
+        if (statst->verbosity) {
+            fprintf(stderr,
+                    "Stats: %" PRIu64 " Packets/s; Data Rate %" PRIu64 " bytes/s; "
+                    "Socket Drops %" PRIu64 " (packets); Fill Ring Empty %" PRIu64 "; "
+                    "No Output %" PRIu64 " (packets); Queue Full %" PRIu64 " (packets); "
+                    "Queue Shed %" PRIu64 "/%" PRIu64 "/%" PRIu64 " (low/normal/high priority records)\n",
+                    pps, byps, sdps, sfes,
+                    statst->received.no_output - before.no_output,
+                    statst->received.llq_full - before.llq_full,
+                    statst->received.llq_shed[record_priority_low] - before.llq_shed[record_priority_low],
+                    statst->received.llq_shed[record_priority_normal] - before.llq_shed[record_priority_normal],
+                    statst->received.llq_shed[record_priority_high] - before.llq_shed[record_priority_high]);
+        }
+
+        duration++;
+        if (get_percent_accept() > 0) {
+            check_socket_drops(duration, sdps, sfes, &socket_drops, &zero_drops);
+        }
+    }
+
+    return NULL;
+}
+
+static int xdp_rx_ring_capture(struct xdp_thread_storage *thread_stor) {
+
+    /* wait for the clean start condition, as in af_packet_v3.c */
+    int err = pthread_mutex_lock(thread_stor->t_start_m);
+    if (err != 0) {
+        fprintf(stderr, "%s: error locking clean start mutex for thread %lu\n", strerror(err), thread_stor->tid);
+        exit(255);
+    }
+    while (*(thread_stor->t_start_p) != 1) {
+        err = pthread_cond_wait(thread_stor->t_start_c, thread_stor->t_start_m);
+        if (err != 0) {
+            fprintf(stderr, "%s: error waiting on clean start condition for thread %lu\n", strerror(err), thread_stor->tid);
+            exit(255);
+        }
+    }
+    err = pthread_mutex_unlock(thread_stor->t_start_m);
+    if (err != 0) {
+        fprintf(stderr, "%s: error unlocking clean start mutex for thread %lu\n", strerror(err), thread_stor->tid);
+        exit(255);
+    }
+
+    struct xdp_queue *rx = &thread_stor->rx;
+    struct xdp_queue *fill = &thread_stor->fill;
+    const struct xdp_desc *rx_descs = (const struct xdp_desc *)rx->ring;
+    uint64_t *fill_addrs = (uint64_t *)fill->ring;
+    uint8_t *umem = thread_stor->umem;
+    struct pkt_proc *pkt_processor = thread_stor->pkt_processor;
+
+    fprintf(stderr, "Thread %d with thread id %lu started...\n", thread_stor->tnum, thread_stor->tid);
+
+    struct pollfd psockfd;
+    memset(&psockfd, 0, sizeof(psockfd));
+    psockfd.fd = thread_stor->xsk_fd;
+    psockfd.events = POLLIN;
+
+    int haveflushed = 0;
+    struct packet_info pi[APPLY_BATCH_SIZE];
+    uint8_t *eth[APPLY_BATCH_SIZE];
+    while (sig_close_workers == 0) {
+
+        uint32_t cons = *rx->consumer;
+        uint32_t avail = __atomic_load_n(rx->producer, __ATOMIC_ACQUIRE) - cons;
+        if (avail == 0) {
+            /* flush once before waiting, as in the AF_PACKET loop */
+            if (haveflushed == 0) {
+                pkt_processor->flush();
+                haveflushed = 1;
+                continue;
+            }
+            /*
+             * each packet is stamped when it is dequeued, so no later
+             * packet is older than now; the wait is short, so that the
+             * output thread hears from an idle thread often
+             */
+            struct timespec now;
+            clock_gettime(CLOCK_REALTIME, &now);
+            pkt_processor->advance(&now);
+            if (poll(&psockfd, 1, LLQ_HEARTBEAT_MSEC) < 0 && errno != EINTR) {
+                perror("poll returned error");
+            }
+            continue;
+        }
+        haveflushed = 0;
+        if (avail > APPLY_BATCH_SIZE) {
+            avail = APPLY_BATCH_SIZE;
+        }
+
+        /*
+         * XDP does not deliver a per-packet timestamp, so each batch
+         * is stamped with the time at which it was dequeued
+         */
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+
+        uint64_t byte_count = 0;
+        for (uint32_t i = 0; i < avail; i++) {
+            const struct xdp_desc *desc = &rx_descs[(cons + i) & rx->mask];
+            pi[i].ts = ts;
+            pi[i].caplen = desc->len;
+            pi[i].len = desc->len;
+            pi[i].seq = 0;
+            eth[i] = umem + desc->addr;
+            byte_count += desc->len;
+        }
+        pkt_processor->apply_batch(pi, eth, avail);
+        pkt_processor->advance(&ts);
+
+        /* return the frames (not the packet offsets within them) to the kernel */
+        uint32_t fill_prod = *fill->producer;
+        for (uint32_t i = 0; i < avail; i++) {
+            const struct xdp_desc *desc = &rx_descs[(cons + i) & rx->mask];
+            fill_addrs[(fill_prod + i) & fill->mask] = desc->addr & ~((uint64_t)XDP_FRAME_SIZE - 1);
+        }
+        __atomic_store_n(rx->consumer, cons + avail, __ATOMIC_RELEASE);
+        __atomic_store_n(fill->producer, fill_prod + avail, __ATOMIC_RELEASE);
+
+        if (thread_stor->need_wakeup && (__atomic_load_n(fill->flags, __ATOMIC_RELAXED) & XDP_RING_NEED_WAKEUP)) {
+            recvfrom(thread_stor->xsk_fd, NULL, 0, MSG_DONTWAIT, NULL, NULL);
+        }
+
+        counter_add(&(pkt_processor->counters.packets), avail);
+        counter_add(&(pkt_processor->counters.bytes), byte_count);
+    }
+
+    fprintf(stderr, "Thread %d with thread id %lu exiting...\n", thread_stor->tnum, thread_stor->tid);
+    return 0;
+}
+
+static void *xdp_capture_thread_func(void *arg) {
+    struct xdp_thread_storage *thread_stor = (struct xdp_thread_storage *)arg;
+
+    disable_all_signals();
+
+    if (xdp_rx_ring_capture(thread_stor) < 0) {
+        fprintf(stdout, "error: could not perform packet capture\n");
+        exit(255);
+    }
+    return NULL;
+}
+
+enum status xdp_bind_and_dispatch(struct mercury_config *cfg,
+                                  mercury_context mc,
+                                  struct output_file *out_ctx) {
+    int err;
+    int num_threads = cfg->num_threads;
+
+    int ifindex = if_nametoindex(cfg->capture_interface);
+    if (ifindex == 0) {
+        fprintf(stderr, "error: can't get interface number for interface %s\n", cfg->capture_interface);
+        return status_err;
+    }
+    int num_queues = xdp_num_rx_queues(cfg->capture_interface);
+    if (num_queues > 0 && num_threads > num_queues) {
+        fprintf(stderr, "error: interface %s has %d receive queue(s), but %d threads were requested; "
+                "use --threads=%d, or increase the number of queues with 'ethtool -L'\n",
+                cfg->capture_interface, num_queues, num_threads, num_queues);
+        return status_err;
+    }
+    if (num_queues > num_threads) {
+        fprintf(stderr, "warning: interface %s has %d receive queues, but only the first %d will be captured\n",
+                cfg->capture_interface, num_queues, num_threads);
+    }
+
+    int map_fd = xdp_xskmap_create(num_threads);
+    if (map_fd < 0) {
+        fprintf(stderr, "%s: could not create XSKMAP\n", strerror(errno));
+        return status_err;
+    }
+    int prog_fd = xdp_redirect_prog_load(map_fd);
+    if (prog_fd < 0) {
+        fprintf(stderr, "%s: could not load XDP program\n", strerror(errno));
+        return status_err;
+    }
+    int link_fd = xdp_prog_attach(prog_fd, ifindex, cfg->verbosity);
+    if (link_fd < 0) {
+        fprintf(stderr, "%s: could not attach XDP program to interface %s\n", strerror(errno), cfg->capture_interface);
+        return status_err;
+    }
+
+    int t_start_p = 0;
+    pthread_cond_t t_start_c  = PTHREAD_COND_INITIALIZER;
+    pthread_mutex_t t_start_m = PTHREAD_MUTEX_INITIALIZER;
+
+    struct xdp_stats_tracking statst;
+    memset(&statst, 0, sizeof(statst));
+    statst.num_threads = num_threads;
+    statst.t_start_p = &t_start_p;
+    statst.t_start_c = &t_start_c;
+    statst.t_start_m = &t_start_m;
+    statst.verbosity = cfg->verbosity;
+
+    struct xdp_thread_storage *tstor = (struct xdp_thread_storage *)calloc(num_threads, sizeof(struct xdp_thread_storage));
+    if (tstor == NULL) {
+        perror("could not allocate memory for struct xdp_thread_storage array\n");
+        return status_err;
+    }
+    statst.tstor = tstor;
+
+    for (int thread = 0; thread < num_threads; thread++) {
+        tstor[thread].tnum = thread;
+        tstor[thread].tid = 0;
+        tstor[thread].xsk_fd = -1;
+        tstor[thread].ifindex = ifindex;
+        tstor[thread].if_name = cfg->capture_interface;
+        tstor[thread].statst = &statst;
+        tstor[thread].t_start_p = &t_start_p;
+        tstor[thread].t_start_c = &t_start_c;
+        tstor[thread].t_start_m = &t_start_m;
+
+        if (create_dedicated_xsk(&tstor[thread], map_fd) != 0) {
+            fprintf(stderr, "error creating AF_XDP socket for thread %d\n", thread);
+            exit(255);
+        }
+    }
+
+    /* drop privileges from root to normal user */
+    if (drop_root_privileges(cfg->user, cfg->working_dir) != status_ok) {
+        return status_err;
+    }
+    if (cfg->user) {
+        fprintf(stderr, "running as user %s\n", cfg->user);
+    } else {
+        fprintf(stderr, "dropped root privileges\n");
+    }
+
+    for (int thread = 0; thread < num_threads; thread++) {
+        tstor[thread].pkt_processor = pkt_proc_new_from_config(cfg, mc, thread, &out_ctx->qs.queue[thread]);
+        if (tstor[thread].pkt_processor == NULL) {
+            printf("error: could not initialize frame handler\n");
+            return status_err;
+        }
+    }
+
+    pthread_t stats_thread;
+    err = pthread_create(&stats_thread, NULL, xdp_stats_thread_func, &statst);
+    if (err != 0) {
+        perror("error creating stats thread");
+    }
+
+    for (int thread = 0; thread < num_threads; thread++) {
+        pthread_attr_t thread_attributes;
+        err = pthread_attr_init(&thread_attributes);
+        if (err) {
+            fprintf(stderr, "%s: error initializing attributes for thread %d\n", strerror(err), thread);
+            exit(255);
+        }
+        if (topology_set_worker_affinity(&thread_attributes, thread) != status_ok) {
+            exit(255);
+        }
+        err = pthread_create(&(tstor[thread].tid), &thread_attributes, xdp_capture_thread_func, &(tstor[thread]));
+        if (err) {
+            fprintf(stderr, "%s: error creating af_xdp capture thread %d\n", strerror(err), thread);
+            exit(255);
+        }
+    }
+
+    /* Wake up output thread so it's polling the queues waiting for data */
+    output_thread_start(out_ctx);
+
+    t_start_p = 1;
+    err = pthread_cond_broadcast(&t_start_c);
+    if (err != 0) {
+        printf("%s: error broadcasting all clear on clean start condition\n", strerror(err));
+        exit(255);
+    }
+
+    /* Wait for the stats thread to close (which only happens on a sigint/sigterm) */
+    pthread_join(stats_thread, NULL);
+
+    sig_close_workers = 1;
+
+    for (int thread = 0; thread < num_threads; thread++) {
+        pthread_join(tstor[thread].tid, NULL);
+    }
+
+    /* closing the link detaches the XDP program from the interface */
+    close(link_fd);
+    close(prog_fd);
+    close(map_fd);
+
+    xdp_counters_total(&statst);
+    for (int thread = 0; thread < num_threads; thread++) {
+        xdp_socket_stats(&tstor[thread], &statst);
+        close(tstor[thread].xsk_fd);
+        munmap(tstor[thread].rx.map, tstor[thread].rx.map_len);
+        munmap(tstor[thread].fill.map, tstor[thread].fill.map_len);
+        munmap(tstor[thread].umem, (size_t)XDP_NUM_FRAMES * XDP_FRAME_SIZE);
+        delete tstor[thread].pkt_processor;
+    }
+    free(tstor);
+
+    fprintf(stderr, "--\n"
+            "%" PRIu64 " packets captured\n"
+            "%" PRIu64 " bytes captured\n"
+            "%" PRIu64 " packets dropped\n"
+            "%" PRIu64 " fill ring empty events\n"
+            "%" PRIu64 " packets without output\n"
+            "%" PRIu64 " packets dropped due to full output queue\n"
+            "%" PRIu64 " records shed to keep output queue headroom "
+            "(%" PRIu64 " low, %" PRIu64 " normal, %" PRIu64 " high priority)\n",
+            statst.received.packets, statst.received.bytes, statst.socket_drops, statst.fill_ring_empty,
+            statst.received.no_output, statst.received.llq_full, thread_counters_shed(&statst.received),
+            statst.received.llq_shed[record_priority_low], statst.received.llq_shed[record_priority_normal],
+            statst.received.llq_shed[record_priority_high]);
+
+    return status_ok;
+}
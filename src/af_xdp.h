@@ -0,0 +1,25 @@
+/*
+ * af_xdp.h
+ *
+ * Copyright (c) 2021 Cisco Systems, Inc. All rights reserved.
+ * License at https://github.com/cisco/mercury/blob/master/LICENSE
+ */
+
+#ifndef AF_XDP_H
+#define AF_XDP_H
+
+#include "mercury.h"
+#include "output.h"
+
+/*
+ * xdp_bind_and_dispatch() is the AF_XDP counterpart of
+ * bind_and_dispatch(); it creates one AF_XDP socket, UMEM, and RX
+ * ring per worker thread, with worker thread i bound to receive
+ * queue i of the capture interface, and feeds each packet to that
+ * thread's pkt_proc.
+ */
+enum status xdp_bind_and_dispatch(struct mercury_config *cfg,
+                                  mercury_context mc,
+                                  struct output_file *out_ctx);
+
+#endif /* AF_XDP_H */
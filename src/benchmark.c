@@ -0,0 +1,430 @@
+/*
+ * benchmark.c
+ *
+ * in-memory replay of packet files, for measuring the throughput of
+ * packet processing independently of file i/o
+ *
+ * Copyright (c) 2021 Cisco Systems, Inc.  All rights reserved.  License at
+ * https://github.com/cisco/mercury/blob/master/LICENSE
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "benchmark.h"
+#include "pcap_reader.h"
+#include "pkt_processing.h"
+#include "flow_hash.h"
+#include "signal_handling.h"
+#include "topology.h"
+#include "libmerc/utils.h"
+
+#define BILLION 1000000000L
+
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+/*
+ * struct packet_arena is the memory into which all of the packets are
+ * loaded; it is backed by huge pages (MAP_HUGETLB) if any are
+ * available, and otherwise by ordinary pages that are advised to be
+ * transparent huge pages
+ */
+struct packet_arena {
+    uint8_t *data;
+    size_t size;
+    size_t used;
+    bool hugetlb;
+};
+
+static enum status packet_arena_init(struct packet_arena *a, size_t size) {
+    a->used = 0;
+    a->hugetlb = false;
+#ifdef MAP_HUGETLB
+    a->size = (size + HUGE_PAGE_SIZE - 1) & ~((size_t)HUGE_PAGE_SIZE - 1);
+    a->data = (uint8_t *)mmap(NULL, a->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (a->data != MAP_FAILED) {
+        a->hugetlb = true;
+        return status_ok;
+    }
+#endif
+    a->size = size;
+    a->data = (uint8_t *)mmap(NULL, a->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (a->data == MAP_FAILED) {
+        fprintf(stderr, "%s: could not allocate %zu bytes for packets\n", strerror(errno), size);
+        a->data = NULL;
+        return status_err;
+    }
+#ifdef MADV_HUGEPAGE
+    madvise(a->data, a->size, MADV_HUGEPAGE);
+#endif
+    return status_ok;
+}
+
+static void packet_arena_free(struct packet_arena *a) {
+    if (a->data) {
+        munmap(a->data, a->size);
+        a->data = NULL;
+    }
+}
+
+/*
+ * struct packet_list holds the packets that are processed by a thread
+ * (or, while loading, all of the packets), in the form expected by
+ * pkt_proc::apply_batch()
+ */
+struct packet_list {
+    struct packet_info *pi;
+    uint8_t **eth;
+    size_t num_packets;
+    uint64_t bytes;
+};
+
+static enum status packet_list_alloc(struct packet_list *list, size_t n) {
+    list->pi = (struct packet_info *)malloc(n * sizeof(struct packet_info));
+    list->eth = (uint8_t **)malloc(n * sizeof(uint8_t *));
+    list->num_packets = 0;
+    list->bytes = 0;
+    if (n && (list->pi == NULL || list->eth == NULL)) {
+        fprintf(stderr, "error: could not allocate memory for %zu packets\n", n);
+        return status_err;
+    }
+    return status_ok;
+}
+
+static void packet_list_free(struct packet_list *list) {
+    free(list->pi);
+    free(list->eth);
+    list->pi = NULL;
+    list->eth = NULL;
+    list->num_packets = 0;
+}
+
+static enum status packet_list_append(struct packet_list *list, size_t *capacity,
+                                      const struct packet_info *pi, uint8_t *eth) {
+    if (list->num_packets == *capacity) {
+        size_t n = *capacity ? *capacity * 2 : 65536;
+        struct packet_info *tmp_pi = (struct packet_info *)realloc(list->pi, n * sizeof(struct packet_info));
+        if (tmp_pi == NULL) {
+            return status_err;
+        }
+        list->pi = tmp_pi;
+        uint8_t **tmp_eth = (uint8_t **)realloc(list->eth, n * sizeof(uint8_t *));
+        if (tmp_eth == NULL) {
+            return status_err;
+        }
+        list->eth = tmp_eth;
+        *capacity = n;
+    }
+    list->pi[list->num_packets] = *pi;
+    list->eth[list->num_packets] = eth;
+    list->num_packets++;
+    list->bytes += pi->caplen;
+    return status_ok;
+}
+
+/*
+ * file_packet_bytes() adds the total length of the packets in the
+ * file fname, as they are read, to *bytes; the packets of a compressed
+ * file take more room than the file does.  Each packet is read into
+ * buf, which has room for BUFLEN bytes.
+ */
+static enum status file_packet_bytes(const char *fname, size_t *bytes, uint8_t *buf) {
+    struct pcap_file f;
+    if (pcap_file_open(&f, fname, io_direction_reader, 0) != status_ok) {
+        fprintf(stderr, "error: could not open pcap input file %s\n", fname);
+        return status_err;
+    }
+    enum status status;
+    struct pcap_pkthdr pkthdr;
+    while ((status = pcap_file_read_packet(&f, &pkthdr, buf)) == status_ok) {
+        *bytes += pkthdr.caplen;
+    }
+    pcap_file_close(&f);
+
+    return status == status_err_no_more_data ? status_ok : status;
+}
+
+/*
+ * load_file() copies every packet in the file fname into the arena,
+ * reading each into buf (as with file_packet_bytes()) and checking
+ * that it fits, and appends them to list
+ */
+static enum status load_file(const char *fname, struct packet_arena *arena,
+                             struct packet_list *list, size_t *capacity, uint8_t *buf) {
+    struct pcap_file f;
+    if (pcap_file_open(&f, fname, io_direction_reader, 0) != status_ok) {
+        fprintf(stderr, "error: could not open pcap input file %s\n", fname);
+        return status_err;
+    }
+    enum status status;
+    struct pcap_pkthdr pkthdr;
+    while ((status = pcap_file_read_packet(&f, &pkthdr, buf)) == status_ok) {
+        if (pkthdr.caplen > arena->size - arena->used) {
+            fprintf(stderr, "error: the packets in %s do not fit in the %zu bytes allocated for them\n", fname, arena->size);
+            status = status_err;
+            break;
+        }
+        memcpy(arena->data + arena->used, buf, pkthdr.caplen);
+        struct packet_info pi;
+        packet_info_init_from_pkthdr(&pi, &pkthdr);
+        pi.seq = list->num_packets;
+        if (packet_list_append(list, capacity, &pi, arena->data + arena->used) != status_ok) {
+            fprintf(stderr, "error: could not allocate memory for packet list\n");
+            status = status_err;
+            break;
+        }
+        arena->used += pkthdr.caplen;
+    }
+    pcap_file_close(&f);
+
+    return status == status_err_no_more_data ? status_ok : status;
+}
+
+/*
+ * struct benchmark_thread holds the packets, packet processor, and
+ * results of a benchmark worker thread
+ */
+struct benchmark_thread {
+    int tnum;
+    pthread_t tid;
+    struct packet_list packets;
+    int loop_count;
+    struct pkt_proc *pkt_processor;
+    struct ll_queue *llq;
+    bool discard;                 /* no output thread reads llq        */
+    pthread_barrier_t *start;
+    uint64_t packets_processed;
+    uint64_t nano_seconds;
+};
+
+/*
+ * discard_output() empties a queue that is not read by the output
+ * thread, so that its messages can be reused
+ */
+static void discard_output(struct ll_queue *llq) {
+    while (llq->head() != nullptr) {
+        llq->pop();
+    }
+    llq->release();
+}
+
+static void *benchmark_thread_func(void *arg) {
+    struct benchmark_thread *bt = (struct benchmark_thread *)arg;
+    struct timer t;
+
+    pthread_barrier_wait(bt->start);
+    timer_start(&t);
+    for (int i = 0; i < bt->loop_count && sig_close_flag == 0; i++) {
+        for (size_t offset = 0; offset < bt->packets.num_packets; offset += APPLY_BATCH_SIZE) {
+            size_t n = bt->packets.num_packets - offset;
+            if (n > APPLY_BATCH_SIZE) {
+                n = APPLY_BATCH_SIZE;
+            }
+            bt->pkt_processor->apply_batch(&bt->packets.pi[offset], &bt->packets.eth[offset], n);
+            bt->pkt_processor->advance(&bt->packets.pi[offset + n - 1].ts);
+            if (bt->discard) {
+                discard_output(bt->llq);
+            }
+        }
+        bt->packets_processed += bt->packets.num_packets;
+    }
+    bt->nano_seconds = timer_stop(&t);
+    bt->pkt_processor->finalize();  // clear out buffers
+
+    return NULL;
+}
+
+static void fprint_rates(FILE *f, uint64_t packets, uint64_t bytes, uint64_t records, uint64_t nano_seconds, uint64_t busy_nano_seconds) {
+    double seconds = (double)nano_seconds / BILLION;
+    fprintf(f, "\"packets\":%" PRIu64 ",\"bytes\":%" PRIu64 ",\"records\":%" PRIu64 ",\"seconds\":%.6f,", packets, bytes, records, seconds);
+    fprintf(f, "\"packets_per_second\":%.1f,\"bytes_per_second\":%.1f,\"records_per_second\":%.1f,\"ns_per_packet\":%.1f",
+            seconds ? packets / seconds : 0.0,
+            seconds ? bytes / seconds : 0.0,
+            seconds ? records / seconds : 0.0,
+            packets ? (double)busy_nano_seconds / packets : 0.0);
+}
+
+static void benchmark_report(FILE *f, const struct benchmark_thread *bt, int num_threads,
+                             int num_files, const struct packet_arena *arena, bool discard) {
+    uint64_t packets = 0, bytes = 0, records = 0, nano_seconds = 0, busy_nano_seconds = 0;
+
+    fprintf(f, "{\"benchmark\":{\"files\":%d,\"threads\":%d,\"loop_count\":%d,\"sink\":\"%s\",\"hugetlb\":%s,\"per_thread\":[",
+            num_files, num_threads, bt[0].loop_count, discard ? "null" : "output", arena->hugetlb ? "true" : "false");
+    for (int i = 0; i < num_threads; i++) {
+        int loops = bt[i].packets.num_packets ? bt[i].packets_processed / bt[i].packets.num_packets : 0;
+        uint64_t thread_bytes = bt[i].packets.bytes * loops;
+        const struct thread_counters *c = &bt[i].pkt_processor->counters;
+        uint64_t thread_records = bt[i].packets_processed - c->no_output - c->llq_full - thread_counters_shed(c);
+        fprintf(f, "%s{\"thread\":%d,", i ? "," : "", bt[i].tnum);
+        fprint_rates(f, bt[i].packets_processed, thread_bytes, thread_records, bt[i].nano_seconds, bt[i].nano_seconds);
+        fprintf(f, "}");
+
+        packets += bt[i].packets_processed;
+        bytes += thread_bytes;
+        records += thread_records;
+        busy_nano_seconds += bt[i].nano_seconds;
+        if (bt[i].nano_seconds > nano_seconds) {
+            nano_seconds = bt[i].nano_seconds;  // all threads start together
+        }
+    }
+    fprintf(f, "],\"total\":{");
+    fprint_rates(f, packets, bytes, records, nano_seconds, busy_nano_seconds);
+    fprintf(f, "}}}\n");
+}
+
+enum status benchmark_dispatch(struct mercury_config *cfg, mercury_context mc, struct output_file *of) {
+    enum status status;
+    struct timer t;
+
+    struct input_file_list files;
+    status = input_file_list_init(&files, cfg->read_filename);
+    if (status != status_ok) {
+        return status;
+    }
+
+    /*
+     * the arena is sized to hold every packet in the files, which are
+     * read once to find their total length, since a compressed file
+     * is smaller than its packets
+     */
+    uint8_t *buf = (uint8_t *)malloc(BUFLEN);
+    if (buf == NULL) {
+        fprintf(stderr, "error: could not allocate packet buffer\n");
+        input_file_list_free(&files);
+        return status_err;
+    }
+    size_t total_size = 0;
+    for (int i = 0; i < files.num_files && status == status_ok; i++) {
+        struct stat st;
+        if (stat(files.filenames[i], &st) != 0 || !S_ISREG(st.st_mode)) {
+            fprintf(stderr, "error: benchmark input %s is not a regular file\n", files.filenames[i]);
+            status = status_err;
+            break;
+        }
+        status = file_packet_bytes(files.filenames[i], &total_size, buf);
+    }
+
+    struct packet_arena arena;
+    if (status != status_ok || packet_arena_init(&arena, total_size ? total_size : 1) != status_ok) {
+        free(buf);
+        input_file_list_free(&files);
+        return status_err;
+    }
+
+    timer_start(&t);
+    struct packet_list all = { NULL, NULL, 0, 0 };
+    size_t capacity = 0;
+    for (int i = 0; i < files.num_files && status == status_ok; i++) {
+        status = load_file(files.filenames[i], &arena, &all, &capacity, buf);
+    }
+    free(buf);
+    if (cfg->verbosity) {
+        fprintf(stderr, "loaded %zu packets (%" PRIu64 " bytes) from %d file(s) into %s memory in %.3f seconds\n",
+                all.num_packets, all.bytes, files.num_files, arena.hugetlb ? "huge page" : "ordinary",
+                (double)timer_stop(&t) / BILLION);
+    }
+
+    /*
+     * divide the packets among the threads by flow, as receive-side
+     * scaling would, so that the flow tables of each thread see whole
+     * flows
+     */
+    int num_threads = cfg->num_threads;
+    struct benchmark_thread *bt = new benchmark_thread[num_threads]();
+    int *owner = (int *)malloc(all.num_packets * sizeof(int) + 1);
+    size_t *count = (size_t *)calloc(num_threads, sizeof(size_t));
+    if (status == status_ok && (owner == NULL || count == NULL)) {
+        fprintf(stderr, "error: could not allocate memory for packet list\n");
+        status = status_err;
+    }
+    for (size_t i = 0; i < all.num_packets && status == status_ok; i++) {
+        struct flow_fields ff;
+        owner[i] = flow_fields_parse(&ff, all.eth[i], all.pi[i].caplen) ? flow_fields_hash(&ff, 0) % num_threads : 0;
+        count[owner[i]]++;
+    }
+    for (int thread = 0; thread < num_threads && status == status_ok; thread++) {
+        status = packet_list_alloc(&bt[thread].packets, count[thread]);
+    }
+    for (size_t i = 0; i < all.num_packets && status == status_ok; i++) {
+        struct packet_list *list = &bt[owner[i]].packets;
+        list->pi[list->num_packets] = all.pi[i];
+        list->eth[list->num_packets] = all.eth[i];
+        list->num_packets++;
+        list->bytes += all.pi[i].caplen;
+    }
+    free(owner);
+    free(count);
+    packet_list_free(&all);
+
+    /*
+     * records go to the output thread if an output file was
+     * configured, and otherwise to queues of our own, which are
+     * emptied after each batch
+     */
+    bool discard = cfg->fingerprint_filename == NULL && cfg->write_filename == NULL;
+    struct thread_queues null_qs = { 0, 0, NULL, 0 };
+    if (status == status_ok && discard) {
+        thread_queues_init(&null_qs, num_threads, false);
+    }
+    pthread_barrier_t start;
+    pthread_barrier_init(&start, NULL, num_threads);
+
+    for (int thread = 0; thread < num_threads && status == status_ok; thread++) {
+        bt[thread].tnum = thread;
+        bt[thread].loop_count = cfg->loop_count;
+        bt[thread].llq = discard ? &null_qs.queue[thread] : &of->qs.queue[thread];
+        bt[thread].discard = discard;
+        bt[thread].start = &start;
+        bt[thread].pkt_processor = pkt_proc_new_from_config(cfg, mc, thread, bt[thread].llq);
+        if (bt[thread].pkt_processor == NULL) {
+            printf("error: could not initialize frame handler\n");
+            status = status_err;
+        }
+    }
+
+    if (status == status_ok) {
+        output_thread_start(of);
+
+        for (int thread = 0; thread < num_threads; thread++) {
+            pthread_attr_t thread_attributes;
+            int err = pthread_attr_init(&thread_attributes);
+            if (err) {
+                fprintf(stderr, "%s: error initializing attributes for thread %d\n", strerror(err), thread);
+                exit(255);
+            }
+            if (topology_set_worker_affinity(&thread_attributes, thread) != status_ok) {
+                exit(255);
+            }
+            err = pthread_create(&bt[thread].tid, &thread_attributes, benchmark_thread_func, &bt[thread]);
+            if (err) {
+                fprintf(stderr, "%s: error creating benchmark thread %d\n", strerror(err), thread);
+                exit(255);
+            }
+            pthread_attr_destroy(&thread_attributes);
+        }
+        for (int thread = 0; thread < num_threads; thread++) {
+            pthread_join(bt[thread].tid, NULL);
+        }
+
+        benchmark_report(stdout, bt, num_threads, files.num_files, &arena, discard);
+    }
+
+    for (int thread = 0; thread < num_threads; thread++) {
+        delete bt[thread].pkt_processor;
+        packet_list_free(&bt[thread].packets);
+    }
+    delete[] bt;
+    pthread_barrier_destroy(&start);
+    if (null_qs.queue) {
+        thread_queues_free(&null_qs);
+    }
+    packet_arena_free(&arena);
+    input_file_list_free(&files);
+
+    return status;
+}
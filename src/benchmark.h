@@ -0,0 +1,31 @@
+/*
+ * benchmark.h
+ *
+ * in-memory replay of packet files, for measuring the throughput of
+ * packet processing independently of file i/o
+ *
+ * Copyright (c) 2021 Cisco Systems, Inc.  All rights reserved.  License at
+ * https://github.com/cisco/mercury/blob/master/LICENSE
+ */
+
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+#include "mercury.h"
+#include "output.h"
+#include "libmerc/libmerc.h"
+
+/*
+ * benchmark_dispatch() loads all of the packets in the files named by
+ * cfg->read_filename into memory (backed by huge pages, if possible),
+ * divides them among cfg->num_threads worker threads by flow, and has
+ * each thread apply a packet processor from pkt_proc_new_from_config()
+ * to its packets cfg->loop_count times.  If an output file was
+ * configured, records are written to the queues of the output thread
+ * of; otherwise, they are discarded as soon as they are written.  A
+ * report of the throughput of each thread, and of all threads, is
+ * then printed to stdout as a JSON object.
+ */
+enum status benchmark_dispatch(struct mercury_config *cfg, mercury_context mc, struct output_file *of);
+
+#endif /* BENCHMARK_H */
@@ -14,6 +14,9 @@
 #include <errno.h>
 #include <thread>
 #include "config.h"
+#include "direct_io.h"
+#include "gzip_io.h"
+#include "deferred_json.h"
 #include "libmerc/libmerc.h"
 
 char *command_get_argument(const char *command, char *line) {
@@ -69,6 +72,114 @@ enum status argument_parse_as_float(const char *arg, float *variable_to_set) {
     return status_err;
 }
 
+enum status argument_parse_as_capture_engine(const char *arg, enum capture_engine *variable_to_set) {
+    if (strcmp(arg, "af_packet") == 0) {
+        *variable_to_set = capture_engine_af_packet;
+        return status_ok;
+    } else if (strcmp(arg, "xdp") == 0) {
+        *variable_to_set = capture_engine_xdp;
+        return status_ok;
+    }
+    return status_err;
+}
+
+enum status argument_parse_as_numa_node(const char *arg, int *variable_to_set) {
+    if (strcmp(arg, "auto") == 0) {
+        *variable_to_set = NUMA_NODE_AUTO;
+        return status_ok;
+    }
+    int node;
+    if (argument_parse_as_int(arg, &node) == status_ok && node >= 0) {
+        *variable_to_set = node;
+        return status_ok;
+    }
+    return status_err;
+}
+
+enum status argument_parse_as_direct_io_depth(const char *arg, unsigned int *variable_to_set) {
+    int depth;
+    if (argument_parse_as_int(arg, &depth) == status_ok && depth >= 1 && depth <= DIRECT_IO_MAX_DEPTH) {
+        *variable_to_set = depth;
+        return status_ok;
+    }
+    return status_err;
+}
+
+/*
+ * argument_parse_as_compress() accepts a gzip level, or a format
+ * (gzip or zstd) optionally followed by a colon and a level of that
+ * format; a format on its own has its default level
+ */
+enum status argument_parse_as_compress(const char *arg, enum compress_format *format, int *level) {
+    enum compress_format f = compress_format_gzip;
+    int max_level = 9;
+    if (strncmp(arg, "gzip", 4) == 0 || strncmp(arg, "zstd", 4) == 0) {
+        if (arg[0] == 'z') {
+            f = compress_format_zstd;
+            max_level = ZSTD_MAX_LEVEL;
+        }
+        arg += 4;
+        if (*arg == '\0') {
+            *format = f;
+            *level = f == compress_format_zstd ? ZSTD_DEFAULT_LEVEL : GZIP_DEFAULT_LEVEL;
+            return status_ok;
+        }
+        if (*arg++ != ':') {
+            return status_err;
+        }
+    }
+    int z;
+    if (argument_parse_as_int(arg, &z) == status_ok && z >= 1 && z <= max_level) {
+        *format = f;
+        *level = z;
+        return status_ok;
+    }
+    return status_err;
+}
+
+enum status argument_parse_as_output_wakeup(const char *arg, enum output_wakeup *variable_to_set) {
+    if (strcmp(arg, "poll") == 0) {
+        *variable_to_set = output_wakeup_poll;
+        return status_ok;
+    } else if (strcmp(arg, "event") == 0) {
+        *variable_to_set = output_wakeup_event;
+        return status_ok;
+    }
+    return status_err;
+}
+
+enum status argument_parse_as_stream_policy(const char *arg, enum stream_policy *variable_to_set) {
+    if (strcmp(arg, "drop-oldest") == 0) {
+        *variable_to_set = stream_policy_drop_oldest;
+        return status_ok;
+    } else if (strcmp(arg, "drop-newest") == 0) {
+        *variable_to_set = stream_policy_drop_newest;
+        return status_ok;
+    } else if (strcmp(arg, "block") == 0) {
+        *variable_to_set = stream_policy_block;
+        return status_ok;
+    }
+    return status_err;
+}
+
+enum status argument_parse_as_deferred_json_threads(const char *arg, int *variable_to_set) {
+    int threads;
+    if (argument_parse_as_int(arg, &threads) == status_ok && threads >= 0 && threads <= DEFERRED_JSON_MAX_THREADS) {
+        *variable_to_set = threads;
+        return status_ok;
+    }
+    return status_err;
+}
+
+enum status argument_parse_as_repeat_window(const char *arg, unsigned int *variable_to_set) {
+    int window;
+    if (argument_parse_as_int(arg, &window) == status_ok && window >= 1 && window <= MAX_REPEAT_WINDOW) {
+        *variable_to_set = window;
+        return status_ok;
+    }
+    return status_err;
+}
+
 static enum status mercury_config_parse_line(struct mercury_config *cfg,
                                              struct libmerc_config &global_vars,
                                              char *line) {
@@ -86,6 +197,10 @@ static enum status mercury_config_parse_line(struct mercury_config *cfg,
         cfg->fingerprint_filename = strdup(arg);
         return status_ok;
 
+    } else if ((arg = command_get_argument("capture-engine=", line)) != NULL) {
+        /* note: must precede capture=, which matches on its prefix */
+        return argument_parse_as_capture_engine(arg, &cfg->capture_engine);
+
     } else if ((arg = command_get_argument("capture=", line)) != NULL) {
         cfg->capture_interface = strdup(arg);
         return status_ok;
@@ -112,6 +227,43 @@ static enum status mercury_config_parse_line(struct mercury_config *cfg,
         }
         return status_ok;
 
+    } else if ((arg = command_get_argument("snaplen=", line)) != NULL) {
+        int snaplen = 0;
+        if (argument_parse_as_int(arg, &snaplen) == status_ok && snaplen >= 0) {
+            cfg->snaplen = snaplen;
+            return status_ok;
+        }
+        return status_err;
+
+    } else if ((arg = command_get_argument("numa=", line)) != NULL) {
+        return argument_parse_as_numa_node(arg, &cfg->numa_node);
+
+    } else if ((arg = command_get_argument("direct-io=", line)) != NULL) {
+        return argument_parse_as_direct_io_depth(arg, &cfg->direct_io_depth);
+
+    } else if ((arg = command_get_argument("compress=", line)) != NULL) {
+        return argument_parse_as_compress(arg, &cfg->compress_format, &cfg->compress_level);
+
+    } else if ((arg = command_get_argument("per-thread-output=", line)) != NULL) {
+        return argument_parse_as_boolean(arg, &cfg->per_thread_output);
+
+    } else if ((arg = command_get_argument("stream-policy=", line)) != NULL) {
+        return argument_parse_as_stream_policy(arg, &cfg->stream_policy);
+
+    } else if ((arg = command_get_argument("stream=", line)) != NULL) {
+        cfg->stream_path = strdup(arg);
+        return status_ok;
+
+    } else if ((arg = command_get_argument("deferred-json=", line)) != NULL) {
+        return argument_parse_as_deferred_json_threads(arg, &cfg->deferred_json_threads);
+
+    } else if ((arg = command_get_argument("wakeup=", line)) != NULL) {
+        return argument_parse_as_output_wakeup(arg, &cfg->output_wakeup);
+
+    } else if ((arg = command_get_argument("cpu-affinity=", line)) != NULL) {
+        cfg->cpu_affinity = strdup(arg);
+        return status_ok;
+
     } else if ((arg = command_get_argument("limit=", line)) != NULL) {
         return argument_parse_as_uint64(arg, &cfg->rotate);
 
@@ -129,6 +281,13 @@ static enum status mercury_config_parse_line(struct mercury_config *cfg,
         global_vars.packet_filter_cfg = strdup(arg);
         return status_ok;
 
+    } else if ((arg = command_get_argument("fields=", line)) != NULL) {
+        global_vars.output_fields = strdup(arg);
+        return status_ok;
+
+    } else if ((arg = command_get_argument("suppress-repeats=", line)) != NULL) {
+        return argument_parse_as_repeat_window(arg, &global_vars.repeat_window);
+
     } else if ((arg = command_get_argument("dns-json", line)) != NULL) {
         global_vars.dns_json_output = true;
         return status_ok;
@@ -141,6 +300,10 @@ static enum status mercury_config_parse_line(struct mercury_config *cfg,
         global_vars.metadata_output = true;
         return status_ok;
 
+    } else if ((arg = command_get_argument("binary", line)) != NULL) {
+        global_vars.binary_output = true;
+        return status_ok;
+
     } else if ((arg = command_get_argument("nonselected-tcp-data", line)) != NULL) {
         global_vars.output_tcp_initial_data = true;
         return status_ok;
@@ -17,4 +17,21 @@ enum status mercury_config_read_from_file(struct mercury_config &cfg,
                                           struct libmerc_config &global_vars,
                                           const char *filename);
 
+enum status argument_parse_as_capture_engine(const char *arg,
+                                             enum capture_engine *variable_to_set);
+
+enum status argument_parse_as_numa_node(const char *arg, int *variable_to_set);
+
+enum status argument_parse_as_direct_io_depth(const char *arg, unsigned int *variable_to_set);
+
+enum status argument_parse_as_compress(const char *arg, enum compress_format *format, int *level);
+
+enum status argument_parse_as_output_wakeup(const char *arg, enum output_wakeup *variable_to_set);
+
+enum status argument_parse_as_stream_policy(const char *arg, enum stream_policy *variable_to_set);
+
+enum status argument_parse_as_deferred_json_threads(const char *arg, int *variable_to_set);
+
+enum status argument_parse_as_repeat_window(const char *arg, unsigned int *variable_to_set);
+
 #endif /* CONFIG_H */
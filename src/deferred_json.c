@@ -0,0 +1,245 @@
+/*
+ * deferred_json.c
+ *
+ * rendering of binary records as JSON on the output side, by a pool
+ * of formatter threads
+ *
+ * Copyright (c) 2021 Cisco Systems, Inc.  All rights reserved.  License at
+ * https://github.com/cisco/mercury/blob/master/LICENSE
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "deferred_json.h"
+#include "libmerc/mbin_decoder.h"
+
+#define RENDERED_NONE SIZE_MAX   /* offset of a record that was not rendered */
+
+/*
+ * struct json_render_chunk holds the records rendered by one thread,
+ * and the buffer into which they are rendered; a record's rendering
+ * is kept as an offset into the buffer until the chunk is finished,
+ * since the buffer may be moved when it grows
+ */
+struct json_render_chunk {
+    struct json_renderer *renderer;
+    struct iovec *records;
+    int n;
+    char *buf;
+    size_t size;
+    size_t *offsets;
+    int offsets_size;
+};
+
+struct json_renderer {
+    unsigned int num_threads;
+    pthread_t *threads;
+    struct json_render_chunk *chunks;  /* chunks[0] is rendered by the caller */
+    pthread_mutex_t m;
+    pthread_cond_t start;              /* signalled when a batch is handed over  */
+    pthread_cond_t done;               /* signalled when the last chunk is done  */
+    uint64_t generation;               /* number of batches handed over          */
+    unsigned int pending;              /* chunks of the batch not yet rendered   */
+    bool closing;
+};
+
+static bool json_render_chunk_grow(struct json_render_chunk *c, size_t needed) {
+    size_t size = c->size ? c->size : 1 << 16;
+    while (size < needed) {
+        size *= 2;
+    }
+    char *buf = (char *)realloc(c->buf, size);
+    if (buf == NULL) {
+        return false;
+    }
+    c->buf = buf;
+    c->size = size;
+    return true;
+}
+
+/*
+ * json_render_chunk_render() renders each binary record in c, growing
+ * its buffer whenever a record does not fit; a record that cannot be
+ * rendered gets a length of zero
+ */
+static void json_render_chunk_render(struct json_render_chunk *c) {
+    if (c->offsets_size < c->n) {
+        size_t *offsets = (size_t *)realloc(c->offsets, c->n * sizeof(size_t));
+        if (offsets == NULL) {
+            for (int i = 0; i < c->n; i++) {
+                c->records[i].iov_len = 0;
+            }
+            return;
+        }
+        c->offsets = offsets;
+        c->offsets_size = c->n;
+    }
+
+    size_t off = 0;
+    for (int i = 0; i < c->n; i++) {
+        struct iovec *r = &c->records[i];
+        c->offsets[i] = RENDERED_NONE;
+        if (!mbin_is_record(r->iov_base, r->iov_len)) {
+            continue;
+        }
+
+        // JSON is usually two to four times the size of a binary
+        // record; if it does not fit, try again with more room
+        //
+        size_t needed = off + 4 * r->iov_len + 4096;
+        while (true) {
+            if (c->size < needed && !json_render_chunk_grow(c, needed)) {
+                r->iov_len = 0;
+                break;
+            }
+            struct buffer_stream buf{c->buf + off, (int)(c->size - off)};
+            if (mbin_record_write_json(buf, r->iov_base, r->iov_len)) {
+                c->offsets[i] = off;
+                r->iov_len = buf.length();
+                off += buf.length();
+                break;
+            }
+            if (buf.trunc == 0 || needed - off > 64 * r->iov_len + 65536) {
+                r->iov_len = 0;  // malformed
+                break;
+            }
+            needed = off + 2 * (c->size - off);
+        }
+    }
+    for (int i = 0; i < c->n; i++) {
+        if (c->offsets[i] != RENDERED_NONE) {
+            c->records[i].iov_base = c->buf + c->offsets[i];
+        }
+    }
+}
+
+/*
+ * json_render_func() is run by each formatter thread; it renders its
+ * own chunk of each batch that is handed over, until the renderer is
+ * destroyed
+ */
+static void *json_render_func(void *arg) {
+    struct json_render_chunk *c = (struct json_render_chunk *)arg;
+    struct json_renderer *r = c->renderer;
+    uint64_t seen = 0;
+
+    pthread_mutex_lock(&r->m);
+    while (true) {
+        while (r->generation == seen && !r->closing) {
+            pthread_cond_wait(&r->start, &r->m);
+        }
+        if (r->closing) {
+            break;
+        }
+        seen = r->generation;
+        if (c->n == 0) {
+            continue;  // a small batch, which needs fewer threads
+        }
+        pthread_mutex_unlock(&r->m);
+
+        json_render_chunk_render(c);
+
+        pthread_mutex_lock(&r->m);
+        if (--r->pending == 0) {
+            pthread_cond_signal(&r->done);
+        }
+    }
+    pthread_mutex_unlock(&r->m);
+
+    return NULL;
+}
+
+struct json_renderer *json_renderer_create(unsigned int num_threads) {
+    struct json_renderer *r = (struct json_renderer *)calloc(1, sizeof(struct json_renderer));
+    if (r == NULL) {
+        fprintf(stderr, "error: could not allocate JSON renderer\n");
+        return NULL;
+    }
+    r->num_threads = num_threads > DEFERRED_JSON_MAX_THREADS ? DEFERRED_JSON_MAX_THREADS : num_threads;
+    r->chunks = (struct json_render_chunk *)calloc(r->num_threads + 1, sizeof(struct json_render_chunk));
+    r->threads = (pthread_t *)calloc(r->num_threads + 1, sizeof(pthread_t));
+    if (r->chunks == NULL || r->threads == NULL) {
+        fprintf(stderr, "error: could not allocate JSON renderer\n");
+        free(r->chunks);
+        free(r->threads);
+        free(r);
+        return NULL;
+    }
+    pthread_mutex_init(&r->m, NULL);
+    pthread_cond_init(&r->start, NULL);
+    pthread_cond_init(&r->done, NULL);
+    for (unsigned int i = 0; i <= r->num_threads; i++) {
+        r->chunks[i].renderer = r;
+    }
+    for (unsigned int i = 1; i <= r->num_threads; i++) {
+        int err = pthread_create(&r->threads[i], NULL, json_render_func, &r->chunks[i]);
+        if (err != 0) {
+            fprintf(stderr, "%s: error creating formatter thread\n", strerror(err));
+            exit(255);
+        }
+    }
+    return r;
+}
+
+void json_renderer_render(struct json_renderer *r, struct iovec *records, int n) {
+
+    /*
+     * every thread gets at least DEFERRED_JSON_MIN_CHUNK records, so
+     * that a trickle of records is rendered by the caller alone
+     */
+    unsigned int num_chunks = (n + DEFERRED_JSON_MIN_CHUNK - 1) / DEFERRED_JSON_MIN_CHUNK;
+    if (num_chunks > r->num_threads + 1) {
+        num_chunks = r->num_threads + 1;
+    }
+    if (num_chunks <= 1) {
+        r->chunks[0].records = records;
+        r->chunks[0].n = n;
+        json_render_chunk_render(&r->chunks[0]);
+        return;
+    }
+
+    pthread_mutex_lock(&r->m);
+    int start = 0;
+    for (unsigned int i = 0; i <= r->num_threads; i++) {
+        int end = i < num_chunks ? (int)(((uint64_t)n * (i + 1)) / num_chunks) : start;
+        r->chunks[i].records = records + start;
+        r->chunks[i].n = end - start;
+        start = end;
+    }
+    r->pending = num_chunks - 1;
+    r->generation++;
+    pthread_cond_broadcast(&r->start);
+    pthread_mutex_unlock(&r->m);
+
+    json_render_chunk_render(&r->chunks[0]);
+
+    pthread_mutex_lock(&r->m);
+    while (r->pending) {
+        pthread_cond_wait(&r->done, &r->m);
+    }
+    pthread_mutex_unlock(&r->m);
+}
+
+void json_renderer_destroy(struct json_renderer *r) {
+    pthread_mutex_lock(&r->m);
+    r->closing = true;
+    pthread_cond_broadcast(&r->start);
+    pthread_mutex_unlock(&r->m);
+    for (unsigned int i = 1; i <= r->num_threads; i++) {
+        pthread_join(r->threads[i], NULL);
+    }
+    for (unsigned int i = 0; i <= r->num_threads; i++) {
+        free(r->chunks[i].buf);
+        free(r->chunks[i].offsets);
+    }
+    pthread_mutex_destroy(&r->m);
+    pthread_cond_destroy(&r->start);
+    pthread_cond_destroy(&r->done);
+    free(r->chunks);
+    free(r->threads);
+    free(r);
+}
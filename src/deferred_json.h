@@ -0,0 +1,47 @@
+/*
+ * deferred_json.h
+ *
+ * rendering of binary records as JSON on the output side, by a pool
+ * of formatter threads
+ *
+ * Copyright (c) 2021 Cisco Systems, Inc.  All rights reserved.  License at
+ * https://github.com/cisco/mercury/blob/master/LICENSE
+ */
+
+#ifndef DEFERRED_JSON_H
+#define DEFERRED_JSON_H
+
+#include <stddef.h>
+#include <sys/uio.h>
+#include "mercury.h"
+
+#define DEFERRED_JSON_DEFAULT_THREADS  2    /* formatter threads, by default         */
+#define DEFERRED_JSON_MAX_THREADS      64
+#define DEFERRED_JSON_MIN_CHUNK        16   /* fewest records rendered per thread    */
+
+struct json_renderer;
+
+/*
+ * json_renderer_create() returns a renderer that uses num_threads
+ * formatter threads as well as the calling thread, or none if
+ * num_threads is zero, or NULL if it could not be created
+ */
+struct json_renderer *json_renderer_create(unsigned int num_threads);
+
+/*
+ * json_renderer_render() replaces each of the n binary records in
+ * records (see libmerc/mbin.h) with its rendering as a line of JSON,
+ * identical to what libmerc would have written; a record that is not
+ * a binary record is left as it is, and one that cannot be decoded is
+ * replaced with an empty record.  The rendered records stay valid
+ * until the next call.  The records are divided among the threads in
+ * contiguous chunks, so their order is unchanged.
+ */
+void json_renderer_render(struct json_renderer *r, struct iovec *records, int n);
+
+/*
+ * json_renderer_destroy() stops the formatter threads and frees r
+ */
+void json_renderer_destroy(struct json_renderer *r);
+
+#endif /* DEFERRED_JSON_H */
@@ -0,0 +1,463 @@
+/*
+ * direct_io.c
+ *
+ * output file writer that gathers records into large aligned buffers
+ * and writes them with O_DIRECT, through io_uring when it is available
+ *
+ * Copyright (c) 2021 Cisco Systems, Inc.  All rights reserved.  License at
+ * https://github.com/cisco/mercury/blob/master/LICENSE
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE            /* get O_DIRECT and fallocate() */
+#endif
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#include "direct_io.h"
+
+#define DIRECT_IO_ALIGNMENT     4096                /* of offsets and lengths, for O_DIRECT  */
+#define DIRECT_IO_PREALLOCATE   (100 * 1024 * 1024) /* as in pcap_file_open()                */
+
+/*
+ * struct direct_uring holds an io_uring instance, set up and used
+ * through system calls, along with its mapped rings
+ */
+struct direct_uring {
+    int fd;                    /* io_uring file descriptor, or -1 if unavailable */
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    size_t sq_ring_len;
+    void *cq_ring;
+    size_t cq_ring_len;
+    size_t sqes_len;
+};
+
+struct direct_buffer {
+    uint8_t *data;             /* DIRECT_IO_BUFFER_SIZE bytes, aligned          */
+    struct iovec iov;          /* data and length of the write                  */
+    off_t offset;              /* file offset of the write                      */
+    bool busy;                 /* being written, or waiting to be written       */
+};
+
+struct direct_writer {
+    int fd;
+    bool o_direct;             /* fd was opened with O_DIRECT                   */
+    struct direct_uring ring;
+    struct direct_buffer *bufs;
+    unsigned int depth;        /* number of buffers                             */
+    unsigned int cur;          /* buffer being filled                           */
+    size_t fill;               /* bytes in the buffer being filled              */
+    off_t offset;              /* file offset of the buffer being filled        */
+    unsigned int oldest;       /* first busy buffer, without io_uring           */
+    off_t allocated;           /* end of preallocated space, or 0 if none       */
+};
+
+static void direct_uring_free(struct direct_uring *r) {
+    if (r->sqes) {
+        munmap(r->sqes, r->sqes_len);
+    }
+    if (r->cq_ring && r->cq_ring != r->sq_ring) {
+        munmap(r->cq_ring, r->cq_ring_len);
+    }
+    if (r->sq_ring) {
+        munmap(r->sq_ring, r->sq_ring_len);
+    }
+    if (r->fd >= 0) {
+        close(r->fd);
+    }
+    memset(r, 0, sizeof(*r));
+    r->fd = -1;
+}
+
+/*
+ * direct_uring_init() sets up an io_uring with room for entries
+ * submissions, and returns false if that is not possible (as with
+ * kernels older than 5.1, or where it is disallowed)
+ */
+static bool direct_uring_init(struct direct_uring *r, unsigned int entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    memset(r, 0, sizeof(*r));
+    r->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0) {
+        r->fd = -1;
+        return false;
+    }
+
+    r->sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    r->cq_ring_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    bool single_mmap = false;
+#ifdef IORING_FEAT_SINGLE_MMAP
+    single_mmap = p.features & IORING_FEAT_SINGLE_MMAP;
+#endif
+    if (single_mmap && r->cq_ring_len > r->sq_ring_len) {
+        r->sq_ring_len = r->cq_ring_len;
+    }
+    void *sq = mmap(NULL, r->sq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED) {
+        direct_uring_free(r);
+        return false;
+    }
+    r->sq_ring = sq;
+    void *cq = sq;
+    if (!single_mmap) {
+        cq = mmap(NULL, r->cq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED) {
+            direct_uring_free(r);
+            return false;
+        }
+    }
+    r->cq_ring = cq;
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    void *sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        direct_uring_free(r);
+        return false;
+    }
+    r->sqes = (struct io_uring_sqe *)sqes;
+
+    r->sq_tail  = (unsigned int *)((uint8_t *)sq + p.sq_off.tail);
+    r->sq_mask  = (unsigned int *)((uint8_t *)sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned int *)((uint8_t *)sq + p.sq_off.array);
+    r->cq_head  = (unsigned int *)((uint8_t *)cq + p.cq_off.head);
+    r->cq_tail  = (unsigned int *)((uint8_t *)cq + p.cq_off.tail);
+    r->cq_mask  = (unsigned int *)((uint8_t *)cq + p.cq_off.ring_mask);
+    r->cqes     = (struct io_uring_cqe *)((uint8_t *)cq + p.cq_off.cqes);
+    return true;
+}
+
+static enum status direct_pwrite(int fd, const uint8_t *data, size_t len, off_t offset) {
+    while (len > 0) {
+        ssize_t n = pwrite(fd, data, len, offset);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("error: could not write output file");
+            return status_err;
+        }
+        data += n;
+        len -= n;
+        offset += n;
+    }
+    return status_ok;
+}
+
+/*
+ * direct_uring_submit() queues the write of buffer i; if that is not
+ * possible, the buffer is written synchronously instead
+ */
+static enum status direct_uring_submit(struct direct_writer *w, unsigned int i) {
+    struct direct_uring *r = &w->ring;
+    struct direct_buffer *b = &w->bufs[i];
+    unsigned int tail = *r->sq_tail;
+    unsigned int idx = tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = w->fd;
+    sqe->addr = (uintptr_t)&b->iov;
+    sqe->len = 1;
+    sqe->off = b->offset;
+    sqe->user_data = i;
+    r->sq_array[idx] = idx;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    while (syscall(__NR_io_uring_enter, r->fd, 1, 0, 0, NULL, 0) < 0) {
+        if (errno != EINTR) {
+            perror("warning: could not submit write to io_uring");
+            __atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+            b->busy = false;
+            return direct_pwrite(w->fd, (const uint8_t *)b->iov.iov_base, b->iov.iov_len, b->offset);
+        }
+    }
+    return status_ok;
+}
+
+/*
+ * direct_uring_reap() waits for at least one write to complete, and
+ * marks the buffers of all completed writes as free; a short write is
+ * finished synchronously.  It returns status_err if it could not
+ * wait, and sets *write_status to status_err if a write failed.
+ */
+static enum status direct_uring_reap(struct direct_writer *w, enum status *write_status) {
+    struct direct_uring *r = &w->ring;
+
+    while (syscall(__NR_io_uring_enter, r->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0) {
+        if (errno != EINTR) {
+            perror("error: could not wait for io_uring completion");
+            return status_err;
+        }
+    }
+    unsigned int head = *r->cq_head;
+    while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+        struct direct_buffer *b = &w->bufs[cqe->user_data];
+        if (cqe->res < 0) {
+            fprintf(stderr, "error: %s: could not write output file\n", strerror(-cqe->res));
+            *write_status = status_err;
+        } else if ((size_t)cqe->res < b->iov.iov_len) {
+            if (direct_pwrite(w->fd, (const uint8_t *)b->iov.iov_base + cqe->res, b->iov.iov_len - cqe->res, b->offset + cqe->res) != status_ok) {
+                *write_status = status_err;
+            }
+        }
+        b->busy = false;
+        head++;
+    }
+    __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    return status_ok;
+}
+
+/*
+ * direct_writer_flush() writes all busy buffers, which are contiguous
+ * in the file, with a single pwritev(); it is used when io_uring is
+ * not available
+ */
+static enum status direct_writer_flush(struct direct_writer *w) {
+    struct iovec iov[DIRECT_IO_MAX_DEPTH];
+    unsigned int n = 0;
+    off_t offset = w->bufs[w->oldest].offset;
+    for (unsigned int i = w->oldest; n < w->depth && w->bufs[i].busy; i = (i + 1) % w->depth) {
+        iov[n++] = w->bufs[i].iov;
+    }
+
+    ssize_t written;
+    do {
+        written = pwritev(w->fd, iov, n, offset);
+    } while (written < 0 && errno == EINTR);
+    if (written < 0) {
+        perror("warning: could not write output file with pwritev");
+        written = 0;
+    }
+
+    enum status status = status_ok;
+    size_t done = written;
+    for (unsigned int j = 0; j < n; j++) {
+        struct direct_buffer *b = &w->bufs[(w->oldest + j) % w->depth];
+        if (done >= b->iov.iov_len) {
+            done -= b->iov.iov_len;
+        } else {
+            if (direct_pwrite(w->fd, (const uint8_t *)b->iov.iov_base + done, b->iov.iov_len - done, b->offset + done) != status_ok) {
+                status = status_err;
+            }
+            done = 0;
+        }
+        b->busy = false;
+    }
+    w->oldest = (w->oldest + n) % w->depth;
+    return status;
+}
+
+/*
+ * direct_writer_wait() returns when buffer i is free to be filled
+ */
+static enum status direct_writer_wait(struct direct_writer *w, unsigned int i) {
+    enum status status = status_ok;
+    while (w->bufs[i].busy) {
+        if (w->ring.fd < 0) {
+            status = direct_writer_flush(w);
+        } else if (direct_uring_reap(w, &status) != status_ok) {
+            return status_err;
+        }
+    }
+    return status;
+}
+
+/*
+ * direct_writer_preallocate() extends the preallocated space of the
+ * file, in steps of DIRECT_IO_PREALLOCATE bytes, before it is reached
+ */
+static void direct_writer_preallocate(struct direct_writer *w, off_t end) {
+    if (w->allocated > 0 && end + DIRECT_IO_BUFFER_SIZE > w->allocated) {
+        if (fallocate(w->fd, FALLOC_FL_KEEP_SIZE, w->offset, DIRECT_IO_PREALLOCATE) != 0) {
+            w->allocated = 0;  // do not try again
+        } else {
+            w->allocated = w->offset + DIRECT_IO_PREALLOCATE;
+        }
+    }
+}
+
+/*
+ * direct_writer_submit() starts writing the len bytes in the buffer
+ * being filled, and moves on to the next buffer, once it is free
+ */
+static enum status direct_writer_submit(struct direct_writer *w, size_t len) {
+    enum status status = status_ok;
+    struct direct_buffer *b = &w->bufs[w->cur];
+    b->iov.iov_base = b->data;
+    b->iov.iov_len = len;
+    b->offset = w->offset;
+    b->busy = true;
+    direct_writer_preallocate(w, w->offset + len);
+    if (w->ring.fd >= 0) {
+        status = direct_uring_submit(w, w->cur);
+    }
+    w->offset += len;
+    w->cur = (w->cur + 1) % w->depth;
+    w->fill = 0;
+    if (direct_writer_wait(w, w->cur) != status_ok) {
+        status = status_err;
+    }
+    return status;
+}
+
+enum status direct_writer_write(struct direct_writer *w, const void *data, size_t len) {
+    enum status status = status_ok;
+    const uint8_t *d = (const uint8_t *)data;
+    while (len > 0) {
+        size_t n = DIRECT_IO_BUFFER_SIZE - w->fill;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(w->bufs[w->cur].data + w->fill, d, n);
+        w->fill += n;
+        d += n;
+        len -= n;
+        if (w->fill == DIRECT_IO_BUFFER_SIZE && direct_writer_submit(w, DIRECT_IO_BUFFER_SIZE) != status_ok) {
+            status = status_err;
+        }
+    }
+    return status;
+}
+
+static void direct_writer_free(struct direct_writer *w) {
+    if (w->bufs) {
+        for (unsigned int i = 0; i < w->depth; i++) {
+            free(w->bufs[i].data);
+        }
+        free(w->bufs);
+    }
+    direct_uring_free(&w->ring);
+    free(w);
+}
+
+struct direct_writer *direct_writer_open(const char *fname, const char *mode, unsigned int queue_depth) {
+    bool append = mode != NULL && mode[0] == 'a';
+    int flags = O_CREAT | (append ? O_RDWR : O_WRONLY | O_TRUNC);  // appending reads the last block
+    bool o_direct = true;
+    int fd = open(fname, flags | O_DIRECT, 0666);
+    if (fd < 0 && errno == EINVAL) {
+        o_direct = false;  // the file system does not support O_DIRECT
+        fd = open(fname, flags, 0666);
+    }
+    if (fd < 0) {
+        fprintf(stderr, "%s: error opening output file %s\n", strerror(errno), fname);
+        return NULL;
+    }
+
+    struct direct_writer *w = (struct direct_writer *)calloc(1, sizeof(struct direct_writer));
+    if (w == NULL) {
+        fprintf(stderr, "error: could not allocate output writer\n");
+        close(fd);
+        return NULL;
+    }
+    w->fd = fd;
+    w->o_direct = o_direct;
+    w->ring.fd = -1;
+    w->depth = queue_depth < 1 ? 1 : queue_depth > DIRECT_IO_MAX_DEPTH ? DIRECT_IO_MAX_DEPTH : queue_depth;
+    w->bufs = (struct direct_buffer *)calloc(w->depth, sizeof(struct direct_buffer));
+    if (w->bufs == NULL) {
+        fprintf(stderr, "error: could not allocate output buffers\n");
+        close(fd);
+        direct_writer_free(w);
+        return NULL;
+    }
+    for (unsigned int i = 0; i < w->depth; i++) {
+        void *data;
+        if (posix_memalign(&data, DIRECT_IO_ALIGNMENT, DIRECT_IO_BUFFER_SIZE) != 0) {
+            fprintf(stderr, "error: could not allocate output buffers\n");
+            close(fd);
+            direct_writer_free(w);
+            return NULL;
+        }
+        w->bufs[i].data = (uint8_t *)data;
+    }
+
+    if (append) {
+        /*
+         * writes must start at an aligned offset, so the partial block
+         * at the end of the file is read into the first buffer
+         */
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            fprintf(stderr, "%s: error getting size of output file %s\n", strerror(errno), fname);
+            close(fd);
+            direct_writer_free(w);
+            return NULL;
+        }
+        w->fill = st.st_size % DIRECT_IO_ALIGNMENT;
+        w->offset = st.st_size - w->fill;
+        if (w->fill > 0 && pread(fd, w->bufs[0].data, DIRECT_IO_ALIGNMENT, w->offset) < (ssize_t)w->fill) {
+            fprintf(stderr, "%s: error reading output file %s\n", strerror(errno), fname);
+            close(fd);
+            direct_writer_free(w);
+            return NULL;
+        }
+    }
+
+    if (fallocate(fd, FALLOC_FL_KEEP_SIZE, w->offset, DIRECT_IO_PREALLOCATE) != 0) {
+        printf("warning: %s: Could not pre-allocate %d MB disk space for output file %s\n",
+               strerror(errno), DIRECT_IO_PREALLOCATE / (1024 * 1024), fname);
+    } else {
+        w->allocated = w->offset + DIRECT_IO_PREALLOCATE;
+    }
+
+    direct_uring_init(&w->ring, w->depth);
+
+    return w;
+}
+
+enum status direct_writer_close(struct direct_writer *w) {
+    enum status status = status_ok;
+    for (unsigned int i = 0; i < w->depth; i++) {
+        if (direct_writer_wait(w, i) != status_ok) {
+            status = status_err;
+        }
+    }
+
+    /*
+     * with O_DIRECT, the last buffer is written out to the end of its
+     * final block, and the file is then truncated to its exact length
+     */
+    off_t end = w->offset + w->fill;
+    if (w->fill > 0) {
+        size_t len = w->fill;
+        if (w->o_direct) {
+            len = (len + DIRECT_IO_ALIGNMENT - 1) & ~((size_t)DIRECT_IO_ALIGNMENT - 1);
+            memset(w->bufs[w->cur].data + w->fill, 0, len - w->fill);
+        }
+        if (direct_pwrite(w->fd, w->bufs[w->cur].data, len, w->offset) != status_ok) {
+            status = status_err;
+        }
+    }
+    if (ftruncate(w->fd, end) != 0) {
+        perror("error: could not set length of output file");
+        status = status_err;
+    }
+    if (close(w->fd) != 0) {
+        perror("error: could not close output file");
+        status = status_err;
+    }
+    direct_writer_free(w);
+    return status;
+}
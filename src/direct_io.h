@@ -0,0 +1,46 @@
+/*
+ * direct_io.h
+ *
+ * output file writer that gathers records into large aligned buffers
+ * and writes them with O_DIRECT, through io_uring when it is available
+ *
+ * Copyright (c) 2021 Cisco Systems, Inc.  All rights reserved.  License at
+ * https://github.com/cisco/mercury/blob/master/LICENSE
+ */
+
+#ifndef DIRECT_IO_H
+#define DIRECT_IO_H
+
+#include <stddef.h>
+#include "mercury.h"
+
+#define DIRECT_IO_DEFAULT_DEPTH  8          /* buffers in flight, by default  */
+#define DIRECT_IO_MAX_DEPTH      256
+#define DIRECT_IO_BUFFER_SIZE    (1 << 20)  /* bytes per write                */
+
+struct direct_writer;
+
+/*
+ * direct_writer_open() creates the file fname, or opens it for
+ * appending if mode starts with 'a' (as with fopen()), and returns a
+ * writer that keeps up to queue_depth buffers of DIRECT_IO_BUFFER_SIZE
+ * bytes in flight at once, or NULL if the file could not be opened.
+ * If the file system does not support O_DIRECT, the buffers are
+ * written through the page cache instead; if io_uring is unavailable,
+ * the buffers are written synchronously, queue_depth at a time, with
+ * pwritev().  Disk space is preallocated as in pcap_file_open().
+ */
+struct direct_writer *direct_writer_open(const char *fname, const char *mode, unsigned int queue_depth);
+
+/*
+ * direct_writer_write() appends the len bytes at data to the file
+ */
+enum status direct_writer_write(struct direct_writer *w, const void *data, size_t len);
+
+/*
+ * direct_writer_close() writes out all buffered data, sets the file
+ * to its exact length, closes it, and frees w
+ */
+enum status direct_writer_close(struct direct_writer *w);
+
+#endif /* DIRECT_IO_H */
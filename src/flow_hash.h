@@ -0,0 +1,120 @@
+/*
+ * flow_hash.h
+ *
+ * minimal parsing of Ethernet/IP/TCP/UDP headers, and a symmetric
+ * hash of the resulting flow key, for use where a full parse would be
+ * too costly (packet sampling and sharding)
+ *
+ * Copyright (c) 2021 Cisco Systems, Inc.  All rights reserved.  License at
+ * https://github.com/cisco/mercury/blob/master/LICENSE
+ */
+
+#ifndef FLOW_HASH_H
+#define FLOW_HASH_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include "libmerc/eth.h"
+
+/*
+ * struct flow_fields refers to the parts of a packet that identify its
+ * flow; it is set by flow_fields_parse()
+ */
+struct flow_fields {
+    const uint8_t *src;        /* source address                            */
+    const uint8_t *dst;        /* destination address                       */
+    size_t addr_len;           /* 4 (IPv4) or 16 (IPv6)                     */
+    uint8_t protocol;          /* IP protocol number                        */
+    const uint8_t *transport;  /* TCP or UDP header, or NULL (ports absent) */
+    size_t transport_len;      /* bytes from transport to end of packet     */
+};
+
+/*
+ * flow_fields_parse() sets ff to the flow fields of the Ethernet frame
+ * eth of length len, which may have up to two VLAN tags, and returns
+ * true if it is an IP packet.  The transport header is only set for
+ * TCP and UDP packets that are not IPv4 fragments and that are long
+ * enough to hold it.
+ */
+static inline bool flow_fields_parse(struct flow_fields *ff, const uint8_t *eth, size_t len) {
+    if (len < 14) {
+        return false;
+    }
+    size_t offset = 12;
+    uint16_t ethertype = (uint16_t)eth[offset] << 8 | eth[offset + 1];
+    offset += 2;
+    for (int tags = 0; tags < 2 && (ethertype == ETH_TYPE_VLAN || ethertype == ETH_TYPE_1AD); tags++) {
+        if (len < offset + 4) {
+            return false;
+        }
+        ethertype = (uint16_t)eth[offset + 2] << 8 | eth[offset + 3];
+        offset += 4;
+    }
+
+    size_t l4;
+    bool fragment = false;
+    if (ethertype == ETH_TYPE_IP && len >= offset + 20) {
+        const uint8_t *ip = eth + offset;
+        ff->protocol = ip[9];
+        ff->src = ip + 12;
+        ff->dst = ip + 16;
+        ff->addr_len = 4;
+        l4 = offset + (ip[0] & 0x0f) * 4;
+        fragment = ((ip[6] & 0x3f) | ip[7]) != 0;
+    } else if (ethertype == ETH_TYPE_IPV6 && len >= offset + 40) {
+        const uint8_t *ip = eth + offset;
+        ff->protocol = ip[6];
+        ff->src = ip + 8;
+        ff->dst = ip + 24;
+        ff->addr_len = 16;
+        l4 = offset + 40;
+    } else {
+        return false;
+    }
+
+    ff->transport = nullptr;
+    ff->transport_len = 0;
+    if (!fragment && (ff->protocol == 6 || ff->protocol == 17)) {
+        size_t hdr_len = ff->protocol == 6 ? 20 : 8;
+        if (len >= l4 + hdr_len) {
+            ff->transport = eth + l4;
+            ff->transport_len = len - l4;
+        }
+    }
+    return true;
+}
+
+/* mix64() is the splitmix64 finalizer */
+static inline uint64_t mix64(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+static inline uint64_t endpoint_hash(const uint8_t *addr, size_t addr_len, const uint8_t *port) {
+    uint64_t h = port ? ((uint64_t)port[0] << 8 | port[1]) : 0;
+    for (size_t i = 0; i < addr_len; i += 4) {
+        uint32_t word;
+        memcpy(&word, addr + i, sizeof(word));
+        h = mix64(h ^ word);
+    }
+    return h;
+}
+
+/*
+ * flow_fields_hash() returns a hash of the flow key in ff that is the
+ * same for both directions of a flow, since the endpoint hashes are
+ * combined by addition; salt is mixed into the result
+ */
+static inline uint64_t flow_fields_hash(const struct flow_fields *ff, uint64_t salt) {
+    const uint8_t *src_port = ff->transport;
+    const uint8_t *dst_port = ff->transport ? ff->transport + 2 : nullptr;
+    uint64_t h = endpoint_hash(ff->src, ff->addr_len, src_port) + endpoint_hash(ff->dst, ff->addr_len, dst_port);
+    return mix64(h ^ ff->protocol ^ salt);
+}
+
+#endif /* FLOW_HASH_H */
@@ -0,0 +1,121 @@
+/**
+ * flow_sampler.c
+ *
+ * flow-consistent packet sampling, to enable testing that adaptively
+ * finds the maximum packet throughput
+ *
+ * Copyright (c) 2021 Cisco Systems, Inc.  All rights reserved.  License at
+ * https://github.com/cisco/mercury/blob/master/LICENSE
+ */
+
+#include <time.h>
+#include <sys/random.h>
+
+#include "flow_sampler.h"
+#include "flow_hash.h"
+
+/*
+ * percent_accept is only written by the main thread (before any
+ * workers start) and the stats thread, so relaxed atomic loads and
+ * stores suffice; workers never write shared state
+ */
+static int percent_accept = 0; /* default */
+
+/*
+ * salt is mixed into every flow hash so that the set of sampled flows
+ * cannot be predicted from outside; it is set along with the initial
+ * percentage, before any worker threads are created
+ */
+static uint64_t salt = 0;
+
+int get_percent_accept(void) {
+    return __atomic_load_n(&percent_accept, __ATOMIC_RELAXED);
+}
+
+void set_percent_accept(unsigned int p) {
+    if (salt == 0 && getrandom(&salt, sizeof(salt), 0) != sizeof(salt)) {
+        salt = (uint64_t)time(NULL) | 1;
+    }
+    __atomic_store_n(&percent_accept, p, __ATOMIC_RELAXED);
+}
+
+int increment_percent_accept(int incr) {
+    int val = get_percent_accept();
+    int new_val = val + incr;
+    if (new_val <= 10 || new_val >= 100) {
+       /* do not set the value out of range 10 to 100 */
+       return val;
+    }
+    __atomic_store_n(&percent_accept, new_val, __ATOMIC_RELAXED);
+    return new_val;
+}
+
+/*
+ * per_thread_random() returns a pseudorandom number from the
+ * calling thread's own xorshift64 generator
+ */
+static uint64_t per_thread_random(void) {
+    static thread_local uint64_t state = 0;
+    if (state == 0) {
+        state = mix64(salt ^ (uintptr_t)&state) | 1;
+    }
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+static inline bool accept_hash(uint64_t h, int percent) {
+    return (int)(h % 100) < percent;
+}
+
+/*
+ * is_handshake() returns true if the transport payload p of length
+ * len, following the transport header th, starts a TLS ClientHello or
+ * ServerHello record (over TCP) or is a QUIC Initial packet (over
+ * UDP).  A QUIC Initial has the header form and fixed bits set, long
+ * packet type zero, a nonzero version (zero marks version
+ * negotiation), and a destination connection ID of at most 20 bytes.
+ * One in sixteen DNS and other UDP payloads starts the same way, so
+ * only UDP packets to or from port 443 are considered.
+ */
+static inline bool is_handshake(uint8_t protocol, const uint8_t *th, const uint8_t *p, size_t len) {
+    if (protocol == 6) {
+        return len >= 6 && p[0] == 0x16 && p[1] == 0x03 && (p[5] == 0x01 || p[5] == 0x02);
+    }
+    uint16_t src_port = (uint16_t)th[0] << 8 | th[1];
+    uint16_t dst_port = (uint16_t)th[2] << 8 | th[3];
+    if (src_port != 443 && dst_port != 443) {
+        return false;
+    }
+    return len >= 7 && (p[0] & 0xf0) == 0xc0 && (p[1] | p[2] | p[3] | p[4]) != 0 && p[5] <= 20;
+}
+
+bool flow_sampler_drop(const uint8_t *eth, size_t len) {
+    int percent = get_percent_accept();
+    if (percent <= 0 || percent >= 100) {
+        return false;
+    }
+
+    struct flow_fields ff;
+    if (!flow_fields_parse(&ff, eth, len)) {
+        return !accept_hash(per_thread_random(), percent);
+    }
+
+    /* TCP or UDP: handshake detection */
+    if (ff.transport) {
+        const uint8_t *th = ff.transport;
+        size_t hdr_len = 8;
+        if (ff.protocol == 6) {
+            if (th[13] & 0x02) {
+                return false;  /* SYN */
+            }
+            hdr_len = (th[12] >> 4) * 4;
+        }
+        if (ff.transport_len > hdr_len && is_handshake(ff.protocol, th, th + hdr_len, ff.transport_len - hdr_len)) {
+            return false;
+        }
+    }
+
+    return !accept_hash(flow_fields_hash(&ff, salt), percent);
+}
@@ -0,0 +1,40 @@
+/*
+ * flow_sampler.h
+ *
+ * flow-consistent packet sampling, to enable testing that adaptively
+ * finds the maximum packet throughput
+ *
+ * Copyright (c) 2021 Cisco Systems, Inc.  All rights reserved.  License at
+ * https://github.com/cisco/mercury/blob/master/LICENSE
+ */
+
+#ifndef FLOW_SAMPLER_H
+#define FLOW_SAMPLER_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * the percentage of flows that are accepted is set by the main thread
+ * and adjusted by the stats thread; zero means that sampling is off
+ */
+int get_percent_accept(void);
+
+void set_percent_accept(unsigned int p);
+
+int increment_percent_accept(int incr);
+
+/*
+ * flow_sampler_drop() returns true if the Ethernet frame eth of
+ * length len should be discarded.  Packets are selected by a
+ * symmetric hash of their flow key, so that both directions of a
+ * flow are either kept or discarded together, and decreasing the
+ * percentage only ever removes flows.  Handshake packets (TCP SYNs,
+ * TLS ClientHellos and ServerHellos, and QUIC Initial packets on port
+ * 443) are always kept, so that bulk data is shed first.  Non-IP packets
+ * are sampled with a per-thread random number generator.  This
+ * function is safe to call from multiple threads.
+ */
+bool flow_sampler_drop(const uint8_t *eth, size_t len);
+
+#endif /* FLOW_SAMPLER_H */
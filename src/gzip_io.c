@@ -0,0 +1,442 @@
+/*
+ * gzip_io.c
+ *
+ * output file writer that compresses records into gzip members (or
+ * zstd frames) on a pool of threads, and writes them in order from a
+ * background thread
+ *
+ * Copyright (c) 2021 Cisco Systems, Inc.  All rights reserved.  License at
+ * https://github.com/cisco/mercury/blob/master/LICENSE
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "gzip_io.h"
+#include "direct_io.h"
+
+/*
+ * A frame holds up to GZIP_FRAME_SIZE bytes of records, which are
+ * compressed into a gzip member (or a zstd frame) of their own, so
+ * that frames can be compressed independently.  Each frame is filled
+ * by the caller, compressed by one of the compressor threads, and
+ * written by the writer thread, which then makes it free again.
+ */
+enum gzip_frame_state {
+    gzip_frame_free = 0,
+    gzip_frame_filled,
+    gzip_frame_compressed
+};
+
+struct gzip_frame {
+    uint8_t *in;                  /* records                                    */
+    size_t in_len;
+    uint8_t *out;                 /* gzip member or zstd frame                  */
+    size_t out_len;
+    char *fname;                  /* file that starts with this frame, or NULL  */
+    enum gzip_frame_state state;
+};
+
+/*
+ * The frames form a ring, in which frame number n is frames[n %
+ * num_frames]; frames below fill have been handed over by the caller,
+ * those below next_compress have been taken by a compressor, and those
+ * below next_write have been written.  Every field below the mutex is
+ * protected by it.
+ */
+struct gzip_writer {
+    const char *mode;
+    enum compress_format format;
+    int level;
+    unsigned int direct_io_depth;
+    size_t out_size;              /* room for a full frame, once compressed     */
+    struct timespec fill_start;   /* when the first record entered the frame    */
+
+    /* the current file, which only the writer thread uses once it starts */
+    FILE *file;
+    struct direct_writer *direct;
+
+    unsigned int num_threads;
+    pthread_t *compressors;
+    pthread_t writer;
+
+    pthread_mutex_t m;
+    pthread_cond_t filled;        /* signalled when a frame is handed over      */
+    pthread_cond_t compressed;    /* signalled when a frame is compressed       */
+    pthread_cond_t written;       /* signalled when a frame is free again       */
+    struct gzip_frame *frames;
+    unsigned int num_frames;
+    uint64_t fill;
+    uint64_t next_compress;
+    uint64_t next_write;
+    bool closing;                 /* no more frames will be handed over         */
+    enum status status;           /* status_err once a write or open has failed */
+};
+
+static struct gzip_frame *gzip_writer_frame(struct gzip_writer *w, uint64_t n) {
+    return &w->frames[n % w->num_frames];
+}
+
+static enum status gzip_writer_file_open(struct gzip_writer *w, const char *fname) {
+    if (w->direct_io_depth) {
+        w->direct = direct_writer_open(fname, w->mode, w->direct_io_depth);
+        return w->direct ? status_ok : status_err;
+    }
+    w->file = fopen(fname, w->mode);
+    if (w->file == NULL) {
+        fprintf(stderr, "%s: error opening output file %s\n", strerror(errno), fname);
+        return status_err;
+    }
+    return status_ok;
+}
+
+static enum status gzip_writer_file_close(struct gzip_writer *w) {
+    enum status status = status_ok;
+    if (w->direct) {
+        status = direct_writer_close(w->direct);
+        w->direct = nullptr;
+    } else if (w->file) {
+        if (fclose(w->file) != 0) {
+            perror("error: could not close output file");
+            status = status_err;
+        }
+        w->file = NULL;
+    }
+    return status;
+}
+
+static enum status gzip_writer_file_write(struct gzip_writer *w, const uint8_t *data, size_t len) {
+    if (w->direct) {
+        return direct_writer_write(w->direct, data, len);
+    }
+    if (w->file && fwrite(data, len, 1, w->file) != 1) {
+        perror("error: could not write output file");
+        return status_err;
+    }
+    return status_ok;
+}
+
+static void gzip_writer_fail(struct gzip_writer *w) {
+    pthread_mutex_lock(&w->m);
+    w->status = status_err;
+    pthread_mutex_unlock(&w->m);
+}
+
+/*
+ * gzip_compress_func() is run by each compressor thread; it takes the
+ * oldest frame that no compressor has taken, until the writer is
+ * closing and none is left
+ */
+static void *gzip_compress_func(void *arg) {
+    struct gzip_writer *w = (struct gzip_writer *)arg;
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+    if (w->format == compress_format_gzip && deflateInit2(&z, w->level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {  // 15 + 16: gzip header
+        fprintf(stderr, "error: could not initialize gzip compression\n");
+        exit(255);
+    }
+#ifdef HAVE_ZSTD
+    ZSTD_CCtx *zstd = NULL;
+    if (w->format == compress_format_zstd && (zstd = ZSTD_createCCtx()) == NULL) {
+        fprintf(stderr, "error: could not initialize zstd compression\n");
+        exit(255);
+    }
+#endif
+
+    pthread_mutex_lock(&w->m);
+    while (true) {
+        while (w->next_compress == w->fill && !w->closing) {
+            pthread_cond_wait(&w->filled, &w->m);
+        }
+        if (w->next_compress == w->fill) {
+            break;  // closing, and every frame has been taken
+        }
+        struct gzip_frame *f = gzip_writer_frame(w, w->next_compress++);
+        pthread_mutex_unlock(&w->m);
+
+        f->out_len = 0;
+#ifdef HAVE_ZSTD
+        if (f->in_len > 0 && w->format == compress_format_zstd) {
+            size_t len = ZSTD_compressCCtx(zstd, f->out, w->out_size, f->in, f->in_len, w->level);
+            if (ZSTD_isError(len)) {
+                fprintf(stderr, "error: could not compress output (%s)\n", ZSTD_getErrorName(len));
+                exit(255);
+            }
+            f->out_len = len;
+        }
+#endif
+        if (f->in_len > 0 && w->format == compress_format_gzip) {
+            deflateReset(&z);
+            z.next_in = f->in;
+            z.avail_in = f->in_len;
+            z.next_out = f->out;
+            z.avail_out = w->out_size;
+            if (deflate(&z, Z_FINISH) != Z_STREAM_END) {
+                fprintf(stderr, "error: could not compress output\n");
+                exit(255);  // the output buffer is large enough for any frame
+            }
+            f->out_len = w->out_size - z.avail_out;
+        }
+
+        pthread_mutex_lock(&w->m);
+        f->state = gzip_frame_compressed;
+        pthread_cond_broadcast(&w->compressed);
+    }
+    pthread_mutex_unlock(&w->m);
+    if (w->format == compress_format_gzip) {
+        deflateEnd(&z);
+    }
+#ifdef HAVE_ZSTD
+    ZSTD_freeCCtx(zstd);
+#endif
+
+    return NULL;
+}
+
+/*
+ * gzip_write_func() is run by the writer thread; it writes each
+ * frame in order, once it is compressed, after switching to the next
+ * file if the frame starts one
+ */
+static void *gzip_write_func(void *arg) {
+    struct gzip_writer *w = (struct gzip_writer *)arg;
+
+    pthread_mutex_lock(&w->m);
+    while (true) {
+        struct gzip_frame *f = gzip_writer_frame(w, w->next_write);
+        while (!(w->next_write < w->fill && f->state == gzip_frame_compressed) && !(w->closing && w->next_write == w->fill)) {
+            pthread_cond_wait(&w->compressed, &w->m);
+        }
+        if (w->next_write == w->fill) {
+            break;  // closing, and every frame has been written
+        }
+        pthread_mutex_unlock(&w->m);
+
+        if (f->fname) {
+            if (gzip_writer_file_close(w) != status_ok || gzip_writer_file_open(w, f->fname) != status_ok) {
+                gzip_writer_fail(w);
+            }
+            free(f->fname);
+            f->fname = NULL;
+        }
+        if (f->out_len > 0 && gzip_writer_file_write(w, f->out, f->out_len) != status_ok) {
+            gzip_writer_fail(w);
+        }
+
+        pthread_mutex_lock(&w->m);
+        f->in_len = 0;
+        f->state = gzip_frame_free;
+        w->next_write++;
+        pthread_cond_broadcast(&w->written);
+    }
+    pthread_mutex_unlock(&w->m);
+
+    return NULL;
+}
+
+/*
+ * gzip_writer_submit() hands the frame being filled over to the
+ * compressors, and then waits until the next frame is free
+ */
+static void gzip_writer_submit(struct gzip_writer *w) {
+    pthread_mutex_lock(&w->m);
+    gzip_writer_frame(w, w->fill)->state = gzip_frame_filled;
+    w->fill++;
+    pthread_cond_broadcast(&w->filled);
+    struct gzip_frame *next = gzip_writer_frame(w, w->fill);
+    while (next->state != gzip_frame_free) {
+        pthread_cond_wait(&w->written, &w->m);
+    }
+    pthread_mutex_unlock(&w->m);
+}
+
+enum status gzip_writer_write(struct gzip_writer *w, const void *data, size_t len) {
+    const uint8_t *d = (const uint8_t *)data;
+    struct gzip_frame *f = gzip_writer_frame(w, w->fill);
+    if (f->in_len > 0 && f->in_len + len > GZIP_FRAME_SIZE) {
+        gzip_writer_submit(w);  // keep each record within one frame, if it fits
+        f = gzip_writer_frame(w, w->fill);
+    }
+    while (len > 0) {
+        if (f->in_len == 0) {
+            clock_gettime(CLOCK_MONOTONIC, &w->fill_start);
+        }
+        size_t n = GZIP_FRAME_SIZE - f->in_len;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(f->in + f->in_len, d, n);
+        f->in_len += n;
+        d += n;
+        len -= n;
+        if (f->in_len == GZIP_FRAME_SIZE) {
+            gzip_writer_submit(w);
+            f = gzip_writer_frame(w, w->fill);
+        }
+    }
+    return status_ok;
+}
+
+void gzip_writer_flush(struct gzip_writer *w) {
+    if (gzip_writer_frame(w, w->fill)->in_len == 0) {
+        return;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (now.tv_sec - w->fill_start.tv_sec >= GZIP_FLUSH_SEC) {
+        gzip_writer_submit(w);
+    }
+}
+
+enum status gzip_writer_rotate(struct gzip_writer *w, const char *fname) {
+    struct gzip_frame *f = gzip_writer_frame(w, w->fill);
+    if (f->in_len > 0 || f->fname) {
+        gzip_writer_submit(w);
+        f = gzip_writer_frame(w, w->fill);
+    }
+    f->fname = strdup(fname);
+    if (f->fname == NULL) {
+        fprintf(stderr, "error: could not allocate output file name\n");
+        return status_err;
+    }
+    return status_ok;
+}
+
+static void gzip_writer_free(struct gzip_writer *w) {
+    if (w->frames) {
+        for (unsigned int i = 0; i < w->num_frames; i++) {
+            free(w->frames[i].in);
+            free(w->frames[i].out);
+            free(w->frames[i].fname);
+        }
+        free(w->frames);
+    }
+    free(w->compressors);
+    pthread_mutex_destroy(&w->m);
+    pthread_cond_destroy(&w->filled);
+    pthread_cond_destroy(&w->compressed);
+    pthread_cond_destroy(&w->written);
+    free(w);
+}
+
+struct gzip_writer *gzip_writer_open(const char *fname, const char *mode, enum compress_format format, int level,
+                                     unsigned int num_threads, unsigned int direct_io_depth) {
+    struct gzip_writer *w = (struct gzip_writer *)calloc(1, sizeof(struct gzip_writer));
+    if (w == NULL) {
+        fprintf(stderr, "error: could not allocate output writer\n");
+        return NULL;
+    }
+    w->mode = mode;
+    w->format = format;
+    w->level = level;
+    w->direct_io_depth = direct_io_depth;
+    w->status = status_ok;
+    w->num_threads = num_threads < 1 ? 1 : num_threads;
+    pthread_mutex_init(&w->m, NULL);
+    pthread_cond_init(&w->filled, NULL);
+    pthread_cond_init(&w->compressed, NULL);
+    pthread_cond_init(&w->written, NULL);
+
+    if (format == compress_format_zstd) {
+#ifdef HAVE_ZSTD
+        w->out_size = ZSTD_compressBound(GZIP_FRAME_SIZE);
+#else
+        fprintf(stderr, "error: zstd compression is not supported by this build (libzstd was not found by configure)\n");
+        gzip_writer_free(w);
+        return NULL;
+#endif
+    } else {
+        z_stream z;
+        memset(&z, 0, sizeof(z));
+        if (deflateInit2(&z, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            fprintf(stderr, "error: could not initialize gzip compression at level %d\n", level);
+            gzip_writer_free(w);
+            return NULL;
+        }
+        w->out_size = deflateBound(&z, GZIP_FRAME_SIZE);
+        deflateEnd(&z);
+    }
+
+    /*
+     * each compressor can work on a frame while the caller fills one
+     * and the writer writes another
+     */
+    w->num_frames = 2 * w->num_threads + 2;
+    w->frames = (struct gzip_frame *)calloc(w->num_frames, sizeof(struct gzip_frame));
+    if (w->frames == NULL) {
+        fprintf(stderr, "error: could not allocate output buffers\n");
+        gzip_writer_free(w);
+        return NULL;
+    }
+    for (unsigned int i = 0; i < w->num_frames; i++) {
+        w->frames[i].in = (uint8_t *)malloc(GZIP_FRAME_SIZE);
+        w->frames[i].out = (uint8_t *)malloc(w->out_size);
+        if (w->frames[i].in == NULL || w->frames[i].out == NULL) {
+            fprintf(stderr, "error: could not allocate output buffers\n");
+            gzip_writer_free(w);
+            return NULL;
+        }
+    }
+
+    /* the first file is opened here, so that an error is seen at once */
+    if (gzip_writer_file_open(w, fname) != status_ok) {
+        gzip_writer_free(w);
+        return NULL;
+    }
+
+    w->compressors = (pthread_t *)calloc(w->num_threads, sizeof(pthread_t));
+    if (w->compressors == NULL) {
+        fprintf(stderr, "error: could not allocate output threads\n");
+        gzip_writer_file_close(w);
+        gzip_writer_free(w);
+        return NULL;
+    }
+    for (unsigned int i = 0; i < w->num_threads; i++) {
+        int err = pthread_create(&w->compressors[i], NULL, gzip_compress_func, w);
+        if (err != 0) {
+            fprintf(stderr, "%s: error creating compressor thread\n", strerror(err));
+            exit(255);
+        }
+    }
+    int err = pthread_create(&w->writer, NULL, gzip_write_func, w);
+    if (err != 0) {
+        fprintf(stderr, "%s: error creating compressed output thread\n", strerror(err));
+        exit(255);
+    }
+
+    return w;
+}
+
+enum status gzip_writer_close(struct gzip_writer *w) {
+    struct gzip_frame *f = gzip_writer_frame(w, w->fill);
+    if (f->in_len > 0 || f->fname) {
+        gzip_writer_submit(w);
+    }
+    pthread_mutex_lock(&w->m);
+    w->closing = true;
+    pthread_cond_broadcast(&w->filled);
+    pthread_cond_broadcast(&w->compressed);
+    pthread_mutex_unlock(&w->m);
+
+    for (unsigned int i = 0; i < w->num_threads; i++) {
+        pthread_join(w->compressors[i], NULL);
+    }
+    pthread_join(w->writer, NULL);
+
+    enum status status = w->status;
+    if (gzip_writer_file_close(w) != status_ok) {
+        status = status_err;
+    }
+    gzip_writer_free(w);
+
+    return status;
+}
@@ -0,0 +1,80 @@
+/*
+ * gzip_io.h
+ *
+ * output file writer that compresses records into gzip members (or
+ * zstd frames) on a pool of threads, and writes them in order from a
+ * background thread
+ *
+ * Copyright (c) 2021 Cisco Systems, Inc.  All rights reserved.  License at
+ * https://github.com/cisco/mercury/blob/master/LICENSE
+ */
+
+#ifndef GZIP_IO_H
+#define GZIP_IO_H
+
+#include <stddef.h>
+#include "mercury.h"
+
+#define GZIP_DEFAULT_LEVEL    6          /* zlib compression level, by default   */
+#define ZSTD_DEFAULT_LEVEL    3          /* zstd compression level, by default   */
+#define ZSTD_MAX_LEVEL        19         /* highest zstd level without --ultra   */
+#define GZIP_DEFAULT_THREADS  4          /* compressor threads, by default       */
+#define GZIP_FRAME_SIZE       (1 << 20)  /* bytes of records per gzip member     */
+#define GZIP_FLUSH_SEC        1          /* longest wait of records in a frame   */
+
+struct gzip_writer;
+
+/*
+ * gzip_writer_open() creates the file fname, or opens it for appending
+ * if mode starts with 'a' (as with fopen()), and returns a writer that
+ * gathers records into frames of GZIP_FRAME_SIZE bytes, each of which
+ * is compressed at the given level into a gzip member, or a zstd frame
+ * if format is compress_format_zstd, of its own by one of num_threads
+ * threads; the members are written to the file in order by another
+ * thread, through a direct_writer if direct_io_depth is nonzero.  A
+ * file made of several gzip members is read by gzip and zlib as a
+ * single stream, as is one made of several zstd frames by zstd.  It
+ * returns NULL if the file could not be opened, or if zstd is asked
+ * for and this build does not have libzstd.
+ */
+struct gzip_writer *gzip_writer_open(const char *fname, const char *mode, enum compress_format format, int level,
+                                     unsigned int num_threads, unsigned int direct_io_depth);
+
+/*
+ * compress_format_suffix() returns the file name suffix of format,
+ * without the dot
+ */
+static inline const char *compress_format_suffix(enum compress_format format) {
+    return format == compress_format_zstd ? "zst" : "gz";
+}
+
+/*
+ * gzip_writer_write() appends the len bytes at data to the file; it
+ * only waits if every frame is still being compressed or written
+ */
+enum status gzip_writer_write(struct gzip_writer *w, const void *data, size_t len);
+
+/*
+ * gzip_writer_flush() hands over the frame being filled, if its first
+ * record has waited for GZIP_FLUSH_SEC, so that records are not held
+ * back indefinitely when they arrive slowly
+ */
+void gzip_writer_flush(struct gzip_writer *w);
+
+/*
+ * gzip_writer_rotate() starts a new file fname, opened with the same
+ * mode, for all later records; the previous file is finished and
+ * closed, and the new one opened, by the writer thread, so the caller
+ * does not wait for either.  An error in opening the new file is
+ * reported on stderr, and by gzip_writer_close().
+ */
+enum status gzip_writer_rotate(struct gzip_writer *w, const char *fname);
+
+/*
+ * gzip_writer_close() compresses and writes out all remaining records,
+ * closes the file, stops the threads and frees w; it returns status_err
+ * if any file could not be opened or written
+ */
+enum status gzip_writer_close(struct gzip_writer *w);
+
+#endif /* GZIP_IO_H */
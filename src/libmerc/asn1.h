@@ -482,6 +482,9 @@ struct json_object_asn1 : public json_object {
     explicit json_object_asn1(struct json_array &array);
 
     void print_key_oid(const char *k, const struct datum &value) {
+        if (!selects(k)) {
+            return;
+        }
         const char *output = datum_get_oid_string(&value);
         write_comma(comma);
         if (output != oid_empty_string) {
@@ -496,6 +499,9 @@ struct json_object_asn1 : public json_object {
     }
 
     void print_key_bitstring_flags(const char *name, const struct datum &value, char * const *flags) {
+        if (!selects(name)) {
+            return;
+        }
         struct json_array a{*this, name};
         if (value.data) {
             struct datum p = value;
@@ -533,6 +539,9 @@ struct json_object_asn1 : public json_object {
     }
 
     void print_key_escaped_string(const char *k, const struct datum &value) {
+        if (!selects(k)) {
+            return;
+        }
         write_comma(comma);
         fprintf_json_string_escaped(*b, k, value.data, value.data_end - value.data);
     }
@@ -545,6 +554,9 @@ struct json_object_asn1 : public json_object {
      * "2015-10-28 18:52:12"
      */
     void print_key_utctime(const char *key, const uint8_t *data, unsigned int len) {
+        if (!selects(key)) {
+            return;
+        }
         write_comma(comma);
         b->snprintf("\"%s\":\"", key);
         if (len != 13) {
@@ -584,6 +596,9 @@ struct json_object_asn1 : public json_object {
      *  seconds is zero.
      */
     void print_key_generalized_time(const char *key, const uint8_t *data, unsigned int len) {
+        if (!selects(key)) {
+            return;
+        }
         write_comma(comma);
         b->snprintf("\"%s\":\"", key);
         if (len != 15) {
@@ -614,6 +629,9 @@ struct json_object_asn1 : public json_object {
     }
 
     void print_key_ip_address(const char *name, const datum &value) {
+        if (!selects(name)) {
+            return;
+        }
         write_comma(comma);
         b->snprintf("\"%s\":\"", name);
         fprintf_ip_address(*b, value.data, value.data_end - value.data);
@@ -628,6 +646,9 @@ struct json_array_asn1 : public json_array {
     explicit json_array_asn1(struct buffer_stream *b) : json_array(b) { }
     explicit json_array_asn1(struct json_object &object, const char *name) : json_array(object, name) { }
     void print_oid(const struct datum &value) {
+        if (skipped) {
+            return;
+        }
         const char *output = datum_get_oid_string(&value);
         write_comma(comma);
         if (output != oid_empty_string) {
@@ -1009,6 +1030,9 @@ struct tlv {
         if ((unsigned)value.length() != length) { o.print_key_string("truncated", name); }
     }
     void print_as_json_ip_address(struct json_object_asn1 &o, const char *name) const {
+        if (!o.selects(name)) {
+            return;
+        }
         o.write_comma(o.comma);
         o.b->snprintf("\"%s\":\"", name);
         fprintf_ip_address(*o.b, value.data, value.data_end - value.data);
@@ -1018,6 +1042,9 @@ struct tlv {
     }
 
     void print_as_json_bitstring(struct json_object &o, const char *name, bool comma=false) const {
+        if (!o.selects(name)) {
+            return;
+        }
         const char *format_string = "\"%s\":[";
         if (comma) {
             format_string = ",\"%s\":[";
@@ -12,6 +12,7 @@
 #include <stdarg.h>
 #include <time.h>
 #include <stdint.h>
+#include "mbin.h"
 
 /* append_null(...)
  * This is a special append function because all other append_...() functions
@@ -698,16 +699,146 @@ static inline int append_raw_as_base64(char *dstr, int *doff, int dlen, int *tru
 
 /*
  * struct buffer_stream
+ *
+ * A buffer_stream in binary mode writes a binary record (see mbin.h)
+ * instead of JSON text: json_object and json_array write tokens with
+ * the mbin_*() functions, and whatever is written with the text
+ * functions is gathered into mbin_text tokens.
  */
 
+struct json_projection;
+
 struct buffer_stream {
     char *dstr;
     int doff;
     int dlen;
     int trunc;
+    bool binary = false;         /* writing a binary record               */
+    bool comma_pending = false;  /* next token is preceded by a comma     */
+    int text_len_off = -1;       /* length of open mbin_text token, or -1 */
+    const struct json_projection *fields = nullptr;  /* members of records to write (see json_object.h) */
 
     buffer_stream(char *dstr, int dlen) : dstr{dstr}, doff{0}, dlen{dlen}, trunc{0} {};
 
+    /*
+     * if binary is true, the buffer_stream writes a binary record,
+     * starting with room for its header, which is filled in by
+     * mbin_end_record()
+     */
+    buffer_stream(char *dstr, int dlen, bool binary) : buffer_stream{dstr, dlen} {
+        if (binary) {
+            this->binary = true;
+            uint8_t header[MBIN_HEADER_LEN] = { 0 };
+            append_memcpy(dstr, &doff, dlen, &trunc, header, sizeof(header));
+        }
+    }
+
+    /*
+     * mbin_token() writes the tag of a token of the given type, and
+     * its key, if there is one, after closing any open mbin_text token
+     */
+    void mbin_token(enum mbin_type type, const char *key=nullptr) {
+        mbin_end_text();
+        uint8_t tag = type;
+        if (comma_pending) {
+            tag |= MBIN_COMMA;
+            comma_pending = false;
+        }
+        if (key) {
+            tag |= MBIN_KEYED;
+        }
+        append_putc(dstr, &doff, dlen, &trunc, tag);
+        if (key) {
+            mbin_bytes(key, strlen(key));
+        }
+    }
+
+    void mbin_varint(uint64_t x) {
+        uint8_t tmp[10];
+        append_memcpy(dstr, &doff, dlen, &trunc, tmp, mbin_put_varint(tmp, x));
+    }
+
+    void mbin_bytes(const void *data, size_t length) {
+        mbin_varint(length);
+        if (length) {
+            append_memcpy(dstr, &doff, dlen, &trunc, data, length);
+        }
+    }
+
+    void mbin_raw(const void *data, size_t length) {
+        append_memcpy(dstr, &doff, dlen, &trunc, data, length);
+    }
+
+    /*
+     * mbin_end_record() closes any open mbin_text token and fills in
+     * the record header, and returns the length of the record, or
+     * zero if it is empty or did not fit into the buffer
+     */
+    size_t mbin_end_record() {
+        mbin_end_text();
+        if (trunc || doff <= MBIN_HEADER_LEN || doff - MBIN_HEADER_LEN > MBIN_MAX_LENGTH) {
+            return 0;
+        }
+        mbin_put_header((uint8_t *)dstr, doff - MBIN_HEADER_LEN);
+        return doff;
+    }
+
+    /*
+     * rewind() discards everything written after offset off, which
+     * must be where a token started
+     */
+    void rewind(int off) {
+        doff = off;
+        text_len_off = -1;
+        comma_pending = false;
+    }
+
+private:
+
+    /*
+     * text() is called before any text is written; in binary mode, it
+     * opens an mbin_text token, if none is open, whose length is
+     * filled in by mbin_end_text(), or else writes any pending comma
+     * into the open token
+     */
+    void text() {
+        if (binary && (text_len_off < 0 || comma_pending)) {
+            mbin_begin_text();
+        }
+    }
+
+    void mbin_begin_text() {
+        if (text_len_off >= 0) {
+            comma_pending = false;
+            append_putc(dstr, &doff, dlen, &trunc, ',');
+            return;
+        }
+        mbin_token(mbin_text);
+        uint8_t len[MBIN_TEXT_LEN_LEN] = { 0 };
+        text_len_off = doff;
+        append_memcpy(dstr, &doff, dlen, &trunc, len, sizeof(len));
+    }
+
+    void mbin_end_text() {
+        if (text_len_off < 0) {
+            return;
+        }
+        if (trunc == 0) {
+            size_t len = doff - text_len_off - MBIN_TEXT_LEN_LEN;
+            if (len >> (7 * MBIN_TEXT_LEN_LEN)) {
+                trunc = 1;               // text token too long
+            } else {
+                uint8_t *p = (uint8_t *)dstr + text_len_off;
+                p[0] = (len & 0x7f) | 0x80;
+                p[1] = ((len >> 7) & 0x7f) | 0x80;
+                p[2] = (len >> 14) & 0x7f;
+            }
+        }
+        text_len_off = -1;
+    }
+
+public:
+
     size_t write(FILE *f) {
         return fwrite(dstr, 1, doff, f);
     }
@@ -727,6 +858,7 @@ struct buffer_stream {
         if (trunc == 1) {
             return 0;
         }
+        text();
 
         /* Check to make sure the offset isn't already longer than the length */
         if (doff >= dlen) {
@@ -760,30 +892,37 @@ struct buffer_stream {
     }
 
     void strncpy(const char *sstr) {
+        text();
         append_strncpy(dstr, &doff, dlen, &trunc, sstr);
     }
 
     void puts(const char *sstr) {
+        text();
         append_strncpy(dstr, &doff, dlen, &trunc, sstr);
     }
 
     void write_char(char schr) {
+        text();
         append_putc(dstr, &doff, dlen, &trunc, schr);
     }
 
     void json_string(const char *key, const uint8_t *data, unsigned int len) {
+        text();
         append_json_string(dstr, &doff, dlen, &trunc, key, data, len);
     }
 
     void json_string_escaped(const char *key, const uint8_t *data, unsigned int len) {
+        text();
         append_json_string_escaped(dstr, &doff, dlen, &trunc, key, data, len);
     }
 
     void json_string_escaped(const uint8_t *data, unsigned int len) {
+        text();
         append_json_string_no_key(dstr, &doff, dlen, &trunc, data, len);
     }
 
     void json_hex_string(const uint8_t *data, unsigned int len) {
+        text();
         append_json_hex_string(dstr, &doff, dlen, &trunc, data, len);
     }
 
@@ -791,42 +930,52 @@ struct buffer_stream {
         if (data == NULL) {
             return;
         }
+        text();
         append_raw_as_hex(dstr, &doff, dlen, &trunc, data, len);
     }
 
     void raw_as_base64(const unsigned char *data, size_t input_length) {
+        text();
         append_raw_as_base64(dstr, &doff, dlen, &trunc, data, input_length);
     }
 
     void memcpy(const void *src, ssize_t length) {
+        text();
         append_memcpy(dstr, &doff, dlen, &trunc, src, length);
     }
 
     void write_timestamp(const struct timespec *ts) {
+        text();
         append_timestamp(dstr, &doff, dlen, &trunc, ts);
     }
 
     void write_timestamp_as_string(const struct timespec *ts) {
+        text();
         append_timestamp_as_string(dstr, &doff, dlen, &trunc, ts);
     }
 
     void write_uint8(uint8_t n) {
+        text();
         append_uint8(dstr, &doff, dlen, &trunc, n);
     }
 
     void write_uint16(uint16_t n) {
+        text();
         append_uint16(dstr, &doff, dlen, &trunc, n);
     }
 
     void write_hex_uint16(uint16_t n) {
+        text();
         append_uint16_hex(dstr, &doff, dlen, &trunc, n);
     }
 
     void write_ipv6_addr(const uint8_t *v6) {
+        text();
         append_ipv6_addr(dstr, &doff, dlen, &trunc, v6);
     }
 
     void write_ipv4_addr(const uint8_t *v4) {
+        text();
         append_ipv4_addr(dstr, &doff, dlen, &trunc, v4);
     }
 
@@ -493,6 +493,9 @@ struct dns_packet {
             return;
         }
         const char *key = (header->flags & 0x8000) ?  "response" : "query";
+        if (!o.selects(key)) {
+            return;
+        }
         struct json_object dns_json{o, key};
         //dns_json.print_key_uint("qdcount", qdcount);
         //dns_json.print_key_uint("ancount", ancount);
@@ -198,6 +198,22 @@ unsigned char smtp_client_value[] = {
     0x45, 0x48, 0x4c, 0x4f, 0x20, 0x00, 0x00, 0x00
 };
 
+const struct msg_pattern tcp_msg_patterns[] = {
+    { tls_client_hello_mask,    tls_client_hello_value    },
+    { tls_server_hello_mask,    tls_server_hello_value    },
+    { tls_server_cert_mask,     tls_server_cert_value     },
+    { http_client_mask,         http_client_value         },
+    { http_client_post_mask,    http_client_post_value    },
+    { http_client_connect_mask, http_client_connect_value },
+    { http_client_put_mask,     http_client_put_value     },
+    { http_client_head_mask,    http_client_head_value    },
+    { http_server_mask,         http_server_value         },
+    { ssh_mask,                 ssh_value                 },
+    { ssh_kex_mask,             ssh_kex_value             },
+    { smtp_client_mask,         smtp_client_value         },
+    { smtp_server_mask,         smtp_server_value         },
+    { nullptr,                  nullptr                   }
+};
 
 enum tcp_msg_type get_message_type(const uint8_t *tcp_data,
                                    unsigned int len) {
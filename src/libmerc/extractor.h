@@ -17,6 +17,21 @@
 #include "proto_identify.h"
 
 
+/*
+ * struct msg_pattern holds pointers to a mask and value that are
+ * compared to the first eight bytes of a TCP or UDP Data field by
+ * get_message_type() or udp_get_message_type(); a pattern whose mask
+ * has been zeroed by proto_ident_config() can never match.  The
+ * tables tcp_msg_patterns[] and udp_msg_patterns[] are terminated by
+ * an entry with null pointers, and are used to build kernel-side
+ * packet filters that agree with those functions.
+ */
+struct msg_pattern {
+    const unsigned char *mask;
+    const unsigned char *value;
+};
+
+extern const struct msg_pattern tcp_msg_patterns[];
 
 enum tcp_msg_type get_message_type(const uint8_t *tcp_data,
                                    unsigned int len);
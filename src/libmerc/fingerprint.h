@@ -25,6 +25,14 @@ struct fingerprint {
     enum fingerprint_type get_type() { return type; }
 
     void write(struct json_object &record) {
+        write(record, type, fp_str);
+    }
+
+    /*
+     * write() writes the fingerprints object of a record holding the
+     * fingerprint fp_str of type fp_type
+     */
+    static void write(struct json_object &record, enum fingerprint_type fp_type, const char *fp_str) {
         const char *name[] = {
             "unknown",
             "tls",
@@ -37,11 +45,11 @@ struct fingerprint {
             "dhcp",
             "smtp_server"
         };
-        if (type > (sizeof(name)/sizeof(const char *))) {
-            type = fingerprint_type_unknown;  // error: unknown type
+        if (fp_type > (sizeof(name)/sizeof(const char *))) {
+            fp_type = fingerprint_type_unknown;  // error: unknown type
         }
         struct json_object fps{record, "fingerprints"};
-        fps.print_key_string(name[type], fp_str);
+        fps.print_key_string(name[fp_type], fp_str);
         fps.close();
     }
 };
@@ -122,6 +122,10 @@ void http_headers::fingerprint(struct buffer_stream &buf, std::unordered_map<std
 
 void http_request::write_json(struct json_object &record, bool output_metadata) {
 
+    if (!record.selects("http")) {
+        return;
+    }
+
     // list of http header names to be printed out
     //
     std::unordered_map<std::basic_string<uint8_t>, std::string> header_names_to_print = {
@@ -181,6 +185,10 @@ void http_response::parse(struct datum &p) {
 
 void http_response::write_json(struct json_object &record) {
 
+    if (!record.selects("http")) {
+        return;
+    }
+
     // list of http header names to be printed out
     //
     std::unordered_map<std::basic_string<uint8_t>, std::string> header_names_to_print = {
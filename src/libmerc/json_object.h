@@ -9,60 +9,178 @@
 
 #include "buffer_stream.h"
 #include "datum.h"
+#include "json_projection.h"
 
 /*
  * json_object and json_array serialize JSON objects and arrays,
- * respectively, into a buffer
+ * respectively, into a buffer; if the buffer_stream is in binary
+ * mode, they write the tokens of a binary record instead (see mbin.h)
+ *
+ * If the buffer_stream has a json_projection, only the members that
+ * it selects are written; an object or array that is not selected is
+ * skipped, and so is everything written into it.  An object of
+ * which only some members are selected is left out if none of them
+ * is written, and so is a record.  Callers that do costly work to
+ * produce a member can check selects() first.
  */
 
 struct json_object {
     buffer_stream *b;
     bool comma = false;
+    const json_projection *fields = nullptr;  /* selects the members to write, or nullptr for all */
+    bool skipped = false;                     /* not selected; nothing is written */
+    int start = -1;                           /* offset in b of this object      */
+    bool *parent_comma = nullptr;             /* comma of the enclosing object or array */
+    bool parent_had_comma = false;
+
+    /*
+     * selects() returns true if the member k is to be written
+     */
+    bool selects(const char *k) const {
+        return !skipped && (fields == nullptr || fields->member(k) != nullptr);
+    }
+
+    /*
+     * select() returns true if the member k is to be written, and
+     * sets m to the projection of its own members
+     */
+    bool select(const char *k, const json_projection **m) const {
+        if (skipped) {
+            return false;
+        }
+        if (fields == nullptr) {
+            *m = nullptr;
+            return true;
+        }
+        const json_projection *p = fields->member(k);
+        if (p == nullptr) {
+            return false;
+        }
+        *m = p->all ? nullptr : p;
+        return true;
+    }
     void write_comma(bool &c) {
         if (c) {
-            b->write_char(',');
+            if (b->binary) {
+                b->comma_pending = true;
+            } else {
+                b->write_char(',');
+            }
         } else {
             c = true;
         }
     }
-    explicit json_object(struct buffer_stream *buf) : b{buf} {
+
+    /*
+     * begin() notes where this object starts, so that close() can
+     * remove it, and writes the comma that separates it from the
+     * previous member of its parent
+     */
+    void begin(bool &c) {
+        start = b->doff;
+        parent_comma = &c;
+        parent_had_comma = c;
+        write_comma(c);
+    }
+    explicit json_object(struct buffer_stream *buf) : b{buf}, fields{buf->fields}, start{buf->doff} {
+        if (b->binary) {
+            b->mbin_token(mbin_object);
+            return;
+        }
         b->write_char('{');
     }
     explicit json_object(struct buffer_stream *buf, const char *name) : b{buf} {
+        if (b->binary) {
+            b->mbin_token(mbin_object, name);
+            return;
+        }
         b->write_char('\"');
         b->puts(name);
         b->puts("\":{");
     }
     json_object(struct json_object &object, const char *name) : b{object.b} {
-        write_comma(object.comma);
+        if (!object.select(name, &fields)) {
+            skipped = true;
+            return;
+        }
+        begin(object.comma);
+        if (b->binary) {
+            b->mbin_token(mbin_object, name);
+            return;
+        }
         b->write_char('\"');
         b->puts(name);
         b->puts("\":{");
     }
-    json_object(struct json_object &object) : b{object.b} {
-        write_comma(object.comma);
+    json_object(struct json_object &object) : b{object.b}, fields{object.fields}, skipped{object.skipped} {
+        if (skipped) {
+            return;
+        }
+        begin(object.comma);
+        if (b->binary) {
+            b->mbin_token(mbin_object);
+            return;
+        }
         b->write_char('{');
     }
     explicit json_object(struct json_array &array);
     void reinit(struct json_array &array);
     void close() {
+        if (skipped) {
+            return;
+        }
+        if (fields && !comma && start >= 0) {
+            b->rewind(start);  // none of its selected members was written
+            if (parent_comma) {
+                *parent_comma = parent_had_comma;
+            }
+            return;
+        }
+        if (b->binary) {
+            b->mbin_token(mbin_object_end);
+            return;
+        }
         b->write_char('}');
     }
     void print_key_json_string(const char *k, const uint8_t *v, size_t length) {
+        if (!selects(k)) {
+            return;
+        }
         if (v) {
             write_comma(comma);
+            if (b->binary) {
+                b->mbin_token(mbin_escaped, k);
+                b->mbin_bytes(v, length);
+                return;
+            }
             b->json_string_escaped(k, v, length);
         }
     }
     void print_key_json_string(const char *k, const struct datum &d) {
+        if (!selects(k)) {
+            return;
+        }
         if (d.is_not_readable()) {
             return;
         }
         write_comma(comma);
+        if (b->binary) {
+            b->mbin_token(mbin_escaped, k);
+            b->mbin_bytes(d.data, d.length());
+            return;
+        }
         b->json_string_escaped(k, d.data, d.length());
     }
     void print_key_string(const char *k, const char *v) {
+        if (!selects(k)) {
+            return;
+        }
         write_comma(comma);
+        if (b->binary) {
+            b->mbin_token(mbin_string, k);
+            b->mbin_bytes(v, strlen(v));
+            return;
+        }
         b->write_char('\"');
         b->puts(k);
         b->puts("\":\"");
@@ -70,7 +188,14 @@ struct json_object {
         b->write_char('\"');
     }
     void print_key_bool(const char *k, bool x) {
+        if (!selects(k)) {
+            return;
+        }
         write_comma(comma);
+        if (b->binary) {
+            b->mbin_token(x ? mbin_true : mbin_false, k);
+            return;
+        }
         b->write_char('\"');
         b->puts(k);
         b->puts("\":");
@@ -81,13 +206,28 @@ struct json_object {
         }
     }
     void print_key_null(const char *k) {
+        if (!selects(k)) {
+            return;
+        }
         write_comma(comma);
+        if (b->binary) {
+            b->mbin_token(mbin_null, k);
+            return;
+        }
         b->write_char('\"');
         b->puts(k);
         b->puts("\":null");
     }
     void print_key_uint8(const char *k, uint8_t u) {
+        if (!selects(k)) {
+            return;
+        }
         write_comma(comma);
+        if (b->binary) {
+            b->mbin_token(mbin_uint, k);
+            b->mbin_varint(u);
+            return;
+        }
         b->write_char('\"');
         b->puts(k);
         b->write_char('\"');
@@ -95,7 +235,15 @@ struct json_object {
         b->write_uint8(u);
     }
     void print_key_uint16(const char *k, uint16_t u) {
+        if (!selects(k)) {
+            return;
+        }
         write_comma(comma);
+        if (b->binary) {
+            b->mbin_token(mbin_uint, k);
+            b->mbin_varint(u);
+            return;
+        }
         b->write_char('\"');
         b->puts(k);
         b->write_char('\"');
@@ -103,19 +251,55 @@ struct json_object {
         b->write_uint16(u);
     }
     void print_key_uint(const char *k, unsigned long int u) {
+        if (!selects(k)) {
+            return;
+        }
         write_comma(comma);
+        if (b->binary) {
+            b->mbin_token(mbin_uint, k);
+            b->mbin_varint(u);
+            return;
+        }
         b->snprintf("\"%s\":%lu", k, u);
     }
     void print_key_int(const char *k, long int i) {
+        if (!selects(k)) {
+            return;
+        }
         write_comma(comma);
+        if (b->binary) {
+            b->mbin_token(mbin_int, k);
+            b->mbin_varint(mbin_zigzag(i));
+            return;
+        }
         b->snprintf("\"%s\":%ld", k, i);
     }
     void print_key_float(const char *k, double d) {
+        if (!selects(k)) {
+            return;
+        }
         write_comma(comma);
+        if (b->binary) {
+            b->mbin_token(mbin_float, k);
+            b->mbin_raw(&d, sizeof(d));
+            return;
+        }
         b->snprintf("\"%s\":%f", k, d);
     }
     void print_key_hex(const char *k, const struct datum &value) {
+        if (!selects(k)) {
+            return;
+        }
         write_comma(comma);
+        if (b->binary) {
+            b->mbin_token(mbin_hex, k);
+            if (value.data && value.data_end && value.data_end > value.data) {
+                b->mbin_bytes(value.data, value.data_end - value.data);
+            } else {
+                b->mbin_varint(0);
+            }
+            return;
+        }
         b->write_char('\"');
         b->puts(k);
         b->puts("\":\"");
@@ -125,7 +309,20 @@ struct json_object {
         b->write_char('\"');
     }
     void print_key_base64(const char *k, const struct datum &value) {
+        if (!selects(k)) {
+            return;
+        }
         write_comma(comma);
+        if (b->binary) {
+            if (value.data && value.data_end) {
+                b->mbin_token(mbin_base64, k);
+                b->mbin_bytes(value.data, value.data_end - value.data);
+            } else {
+                b->mbin_token(mbin_text, k);   // key with no value, as in JSON
+                b->mbin_varint(0);
+            }
+            return;
+        }
         b->write_char('\"');
         b->puts(k);
         b->puts("\":");
@@ -134,14 +331,32 @@ struct json_object {
         }
     }
     void print_key_timestamp(const char *k, struct timespec *ts) {
+        if (!selects(k)) {
+            return;
+        }
         write_comma(comma);
+        if (b->binary) {
+            b->mbin_token(mbin_timestamp, k);
+            b->mbin_varint(ts->tv_sec);
+            b->mbin_varint(ts->tv_nsec);
+            return;
+        }
         b->write_char('\"');
         b->puts(k);
         b->puts("\":");
         b->write_timestamp(ts);
     }
     void print_key_timestamp_as_string(const char *k, struct timespec *ts) {
+        if (!selects(k)) {
+            return;
+        }
         write_comma(comma);
+        if (b->binary) {
+            b->mbin_token(mbin_timestamp_string, k);
+            b->mbin_varint(ts->tv_sec);
+            b->mbin_varint(ts->tv_nsec);
+            return;
+        }
         b->write_char('\"');
         b->puts(k);
         b->puts("\":\"");
@@ -149,6 +364,9 @@ struct json_object {
         b->write_char('\"');
     }
      template <typename T> void print_key_value(const char *k, T &w) {
+        if (!selects(k)) {
+            return;
+        }
         write_comma(comma);
         b->write_char('\"');
         b->puts(k);
@@ -157,7 +375,15 @@ struct json_object {
         b->write_char('\"');
      }
     void print_key_ipv4_addr(const char *k, const uint8_t *a) {
+        if (!selects(k)) {
+            return;
+        }
         write_comma(comma);
+        if (b->binary) {
+            b->mbin_token(mbin_ipv4_addr, k);
+            b->mbin_raw(a, 4);
+            return;
+        }
         b->write_char('\"');
         b->puts(k);
         b->puts("\":");
@@ -166,7 +392,15 @@ struct json_object {
         b->write_char('\"');
     }
     void print_key_ipv6_addr(const char *k, const uint8_t *a) {
+        if (!selects(k)) {
+            return;
+        }
         write_comma(comma);
+        if (b->binary) {
+            b->mbin_token(mbin_ipv6_addr, k);
+            b->mbin_raw(a, 16);
+            return;
+        }
         b->write_char('\"');
         b->puts(k);
         b->puts("\":");
@@ -175,6 +409,9 @@ struct json_object {
         b->write_char('\"');
     }
     void print_key_datum(const char *k, const struct datum &d) {
+        if (!selects(k)) {
+            return;
+        }
         write_comma(comma);
         b->write_char('\"');
         b->puts(k);
@@ -188,27 +425,59 @@ struct json_object {
 struct json_array {
     buffer_stream *b;
     bool comma = false;
+    const json_projection *fields = nullptr;  /* selects the members of its objects, or nullptr for all */
+    bool skipped = false;                     /* not selected; nothing is written */
     void write_comma(bool &c) {
         if (c) {
-            b->write_char(',');
+            if (b->binary) {
+                b->comma_pending = true;
+            } else {
+                b->write_char(',');
+            }
         } else {
             c = true;
         }
     }
     explicit json_array(struct buffer_stream *buf) : b{buf} {
+        if (b->binary) {
+            b->mbin_token(mbin_array);
+            return;
+        }
         b->write_char('[');
     }
     json_array(struct json_object &object, const char *name) : b{object.b} {
+        if (!object.select(name, &fields)) {
+            skipped = true;
+            return;
+        }
         write_comma(object.comma);
+        if (b->binary) {
+            b->mbin_token(mbin_array, name);
+            return;
+        }
         b->write_char('\"');
         b->puts(name);
         b->puts("\":[");
     }
     void close() {
+        if (skipped) {
+            return;
+        }
+        if (b->binary) {
+            b->mbin_token(mbin_array_end);
+            return;
+        }
         b->write_char(']');
     }
     void print_bool(bool x) {
+        if (skipped) {
+            return;
+        }
         write_comma(comma);
+        if (b->binary) {
+            b->mbin_token(x ? mbin_true : mbin_false);
+            return;
+        }
         if (x) {
             b->puts("true");
         } else {
@@ -216,37 +485,92 @@ struct json_array {
         }
     }
     void print_null() {
+        if (skipped) {
+            return;
+        }
         write_comma(comma);
+        if (b->binary) {
+            b->mbin_token(mbin_null);
+            return;
+        }
         b->puts("null");
     }
     void print_uint(unsigned long int u) {
+        if (skipped) {
+            return;
+        }
         write_comma(comma);
+        if (b->binary) {
+            b->mbin_token(mbin_uint);
+            b->mbin_varint(u);
+            return;
+        }
         b->snprintf("%lu", u);
     }
     void print_int(long int i) {
+        if (skipped) {
+            return;
+        }
         write_comma(comma);
+        if (b->binary) {
+            b->mbin_token(mbin_int);
+            b->mbin_varint(mbin_zigzag(i));
+            return;
+        }
         b->snprintf("%ld", i);
     }
     void print_float(double d) {
+        if (skipped) {
+            return;
+        }
         write_comma(comma);
+        if (b->binary) {
+            b->mbin_token(mbin_float);
+            b->mbin_raw(&d, sizeof(d));
+            return;
+        }
         b->snprintf("%f", d);
     }
     void print_string(const char *s) {
+        if (skipped) {
+            return;
+        }
         write_comma(comma);
+        if (b->binary) {
+            b->mbin_token(mbin_string);
+            b->mbin_bytes(s, strlen(s));
+            return;
+        }
         b->write_char('\"');
         b->puts(s);
         b->write_char('\"');
     }
     void print_json_string(struct datum &d) {
+        if (skipped) {
+            return;
+        }
         if (d.is_not_readable()) {
             return;
         }
         write_comma(comma);
+        if (b->binary) {
+            b->mbin_token(mbin_escaped);
+            b->mbin_bytes(d.data, d.length());
+            return;
+        }
         b->json_string_escaped(d.data, d.length());
 
     }
     void print_base64(const uint8_t *data, size_t length) {
+        if (skipped) {
+            return;
+        }
         write_comma(comma);
+        if (b->binary) {
+            b->mbin_token(mbin_base64);
+            b->mbin_bytes(data, data ? length : 0);
+            return;
+        }
         if (data) {
             b->raw_as_base64(data, length);
         } else {
@@ -255,7 +579,19 @@ struct json_array {
         }
     }
     void print_hex(const struct datum &value) {
+        if (skipped) {
+            return;
+        }
         write_comma(comma);
+        if (b->binary) {
+            b->mbin_token(mbin_hex);
+            if (value.data && value.data_end) {
+                b->mbin_bytes(value.data, value.data_end - value.data);
+            } else {
+                b->mbin_varint(0);
+            }
+            return;
+        }
         b->write_char('\"');
         if (value.data && value.data_end) {
             b->raw_as_hex(value.data, value.data_end - value.data);
@@ -264,12 +600,31 @@ struct json_array {
     }
 };
 
-inline json_object::json_object(struct json_array &array) : b{array.b} {
-    write_comma(array.comma);
+inline json_object::json_object(struct json_array &array) : b{array.b}, fields{array.fields}, skipped{array.skipped} {
+    if (skipped) {
+        return;
+    }
+    begin(array.comma);
+    if (b->binary) {
+        b->mbin_token(mbin_object);
+        return;
+    }
     b->write_char('{');
 }
 
 inline void json_object::reinit(struct json_array &array) {
+    if (skipped) {
+        return;
+    }
+    start = -1;  // the object that ends here is written as it is
+    if (b->binary) {
+        b->mbin_token(mbin_object_end);
+        b->comma_pending = true;
+        b->mbin_token(mbin_object);
+        comma = false;
+        array.comma = true;
+        return;
+    }
     b->write_char('}');
     b->write_char(',');
     b->write_char('{');
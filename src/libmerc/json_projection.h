@@ -0,0 +1,153 @@
+/*
+ * json_projection.h
+ *
+ * selection of the members of JSON records to be written
+ *
+ * Copyright (c) 2021 Cisco Systems, Inc. All rights reserved.
+ * License at https://github.com/cisco/mercury/blob/master/LICENSE
+ */
+
+#ifndef JSON_PROJECTION_H
+#define JSON_PROJECTION_H
+
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <string>
+#include <vector>
+
+/*
+ * struct json_projection is a compiled list of fields, each of which
+ * is a dotted path of member names such as tls.client.server_name,
+ * that selects which members of a JSON record are written.  Each
+ * node of the tree holds the members selected within one object; a
+ * member that is selected as a whole (all) has no nodes of its own.
+ * A member of an array applies to each element of the array, so
+ * tls.server.certs.cert.subject selects the subject of each
+ * certificate.
+ *
+ * A field that starts with '@' names a profile, which stands for the
+ * list of fields given for it in json_projection::profiles.
+ */
+struct json_projection {
+    std::string name;
+    bool all = false;
+    std::vector<json_projection> members;
+
+    /*
+     * member() returns the node for the member named k, or nullptr
+     * if it is not selected
+     */
+    const json_projection *member(const char *k) const {
+        for (const auto &m : members) {
+            if (strcmp(m.name.c_str(), k) == 0) {
+                return &m;
+            }
+        }
+        return nullptr;
+    }
+
+    /*
+     * compile() sets this node, the root, to select the fields in
+     * the comma-separated list, and returns false, after reporting
+     * why on stderr, if the list is not valid
+     */
+    bool compile(const char *list) {
+        members.clear();
+        all = false;
+        return add_list(list, 0);
+    }
+
+    struct profile {
+        const char *name;
+        const char *fields;
+    };
+
+    static constexpr profile profiles[] = {
+        { "flow",    "src_ip,dst_ip,protocol,src_port,dst_port,event_start" },
+        { "minimal", "@flow,fingerprints,analysis,tls.client.server_name,http.request.host,http.request.user_agent" },
+        { "tls",     "@flow,fingerprints.tls,fingerprints.tls_server,fingerprints.quic,tls.client.server_name,analysis" },
+        { "http",    "@flow,fingerprints.http,fingerprints.http_server,http.request.method,http.request.host,"
+                     "http.request.uri,http.request.user_agent,http.response.status_code,http.response.server,analysis" },
+        { "ssh",     "@flow,fingerprints.ssh,fingerprints.ssh_kex,ssh.init,analysis" },
+        { "dns",     "@flow,dns" },
+    };
+
+private:
+
+    static constexpr int max_profile_depth = 4;
+
+    bool add_list(const char *list, int depth) {
+        const char *p = list;
+        while (true) {
+            const char *end = strchr(p, ',');
+            if (end == nullptr) {
+                end = p + strlen(p);
+            }
+            while (p < end && isspace((unsigned char)*p)) {
+                p++;
+            }
+            const char *last = end;
+            while (last > p && isspace((unsigned char)last[-1])) {
+                last--;
+            }
+            if (last > p && !add_field(std::string{p, last}, depth)) {
+                return false;
+            }
+            if (*end == '\0') {
+                return true;
+            }
+            p = end + 1;
+        }
+    }
+
+    bool add_field(const std::string &field, int depth) {
+        if (field[0] == '@') {
+            if (depth < max_profile_depth) {
+                for (const auto &prof : profiles) {
+                    if (field.compare(1, std::string::npos, prof.name) == 0) {
+                        return add_list(prof.fields, depth + 1);
+                    }
+                }
+            }
+            fprintf(stderr, "error: unknown output field profile \"%s\"\n", field.c_str());
+            return false;
+        }
+        json_projection *node = this;
+        size_t start = 0;
+        while (true) {
+            size_t dot = field.find('.', start);
+            std::string name = field.substr(start, dot == std::string::npos ? std::string::npos : dot - start);
+            if (name.empty() || name.find_first_not_of("abcdefghijklmnopqrstuvwxyz"
+                                                       "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+                                                       "0123456789_-") != std::string::npos) {
+                fprintf(stderr, "error: invalid output field \"%s\"\n", field.c_str());
+                return false;
+            }
+            if (node->all) {
+                return true;  // already selected as a whole
+            }
+            json_projection *next = nullptr;
+            for (auto &m : node->members) {
+                if (m.name == name) {
+                    next = &m;
+                    break;
+                }
+            }
+            if (next == nullptr) {
+                node->members.push_back(json_projection{});
+                next = &node->members.back();
+                next->name = name;
+            }
+            node = next;
+            if (dot == std::string::npos) {
+                node->all = true;
+                node->members.clear();
+                return true;
+            }
+            start = dot + 1;
+        }
+    }
+};
+
+#endif // JSON_PROJECTION_H
@@ -5,6 +5,7 @@
 
 #include <map>
 #include <algorithm>
+#include <cinttypes>
 
 #include "libmerc.h"
 #include "version.h"
@@ -84,6 +85,80 @@ size_t mercury_packet_processor_write_json(mercury_packet_processor processor, v
     return 0;
 }
 
+size_t mercury_packet_processor_write_json_batch(mercury_packet_processor processor,
+                                                 size_t num_packets,
+                                                 uint8_t **packets,
+                                                 const size_t *lengths,
+                                                 struct timespec *ts,
+                                                 size_t num_buffers,
+                                                 void **buffers,
+                                                 size_t buffer_size,
+                                                 size_t *output_lengths,
+                                                 size_t *output_packets,
+                                                 size_t *num_outputs)
+{
+    // the headers of packet i + prefetch_distance are pulled into
+    // cache while packet i is being parsed
+    //
+    constexpr size_t prefetch_distance = 2;
+
+    size_t i = 0;
+    size_t used = 0;
+    try {
+        for (size_t j = 0; j < prefetch_distance && j < num_packets; j++) {
+            __builtin_prefetch(packets[j]);
+            __builtin_prefetch(packets[j] + 64);
+        }
+        for ( ; i < num_packets && used < num_buffers; i++) {
+            if (i + prefetch_distance < num_packets) {
+                __builtin_prefetch(packets[i + prefetch_distance]);
+                __builtin_prefetch(packets[i + prefetch_distance] + 64);
+            }
+            size_t len = processor->write_json(buffers[used], buffer_size, packets[i], lengths[i], &ts[i], NULL);
+            if (len > 0) {
+                output_lengths[used] = len;
+                output_packets[used] = i;
+                used++;
+            }
+        }
+    }
+    catch (char const *s) {
+        fprintf(stderr, "%s\n", s);
+        i++;   // skip the packet that caused the exception
+    }
+    catch (...) {
+        i++;
+    }
+    *num_outputs = used;
+    return i;
+}
+
+size_t mercury_packet_processor_write_repeats(mercury_packet_processor processor, void *buffer, size_t buffer_size, struct timespec *ts, bool all)
+{
+    try {
+        return processor->write_repeats(buffer, buffer_size, ts, all);
+    }
+    catch (char const *s) {
+        fprintf(stderr, "%s\n", s);
+    }
+    catch (...) {
+        ;
+    }
+    return 0;
+}
+
+void mercury_packet_processor_set_min_priority(mercury_packet_processor processor, enum record_priority min_priority)
+{
+    processor->min_priority = min_priority;
+}
+
+void mercury_packet_processor_get_records_shed(mercury_packet_processor processor, uint64_t records_shed[RECORD_PRIORITIES])
+{
+    for (size_t p = 0; p < RECORD_PRIORITIES; p++) {
+        records_shed[p] = processor->records_shed[p];
+    }
+}
+
 size_t mercury_packet_processor_ip_write_json(mercury_packet_processor processor, void *buffer, size_t buffer_size, uint8_t *packet, size_t length, struct timespec* ts)
 {
     try {
@@ -398,6 +473,15 @@ bool mercury_write_stats_data(mercury_context mc, const char *stats_data_file_pa
         return false;
     }
     mc->aggregator.gzprint(stats_data_file);
+
+    uint64_t shed[RECORD_PRIORITIES];
+    for (size_t p = 0; p < RECORD_PRIORITIES; p++) {
+        shed[p] = mc->records_shed[p].exchange(0, std::memory_order_relaxed);
+    }
+    if (shed[record_priority_low] || shed[record_priority_normal] || shed[record_priority_high]) {
+        gzprintf(stats_data_file, "{\"records_shed\":{\"low\":%" PRIu64 ",\"normal\":%" PRIu64 ",\"high\":%" PRIu64 "}}\n",
+                 shed[record_priority_low], shed[record_priority_normal], shed[record_priority_high]);
+    }
     gzclose(stats_data_file);
 
     return true;
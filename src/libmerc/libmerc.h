@@ -18,6 +18,9 @@
 #define DEFAULT_RESOURCE_DIR "/usr/local/share/mercury"
 #endif
 
+#define DEFAULT_REPEAT_WINDOW   60      /* seconds, when repeats are suppressed */
+#define MAX_REPEAT_WINDOW       86400
+
 
 // The LIBMERC_DLL_EXPORTED attribute can be applied to a function or
 // variable to indicate that it should be exported from a shared
@@ -61,7 +64,10 @@ struct libmerc_config {
         packet_filter_cfg{NULL},
         fp_proc_threshold{0.0},
         proc_dst_threshold{0.0},
-        max_stats_entries{0}
+        max_stats_entries{0},
+        repeat_window{0},
+        binary_output{false},
+        output_fields{NULL}
     {}
 #endif
 
@@ -83,6 +89,9 @@ struct libmerc_config {
     float fp_proc_threshold;   /* remove processes with less than <var> weight    */
     float proc_dst_threshold;  /* remove destinations with less than <var> weight */
     size_t max_stats_entries;  /* max num entries in stats tables                 */
+    unsigned int repeat_window; /* seconds over which repeats are counted, or 0  */
+    bool binary_output;         /* write binary records, not JSON               */
+    char *output_fields;        /* fields of JSON records to write, or NULL for all */
 };
 
 /**
@@ -90,7 +99,7 @@ struct libmerc_config {
  * minimal, default configuration.
  */
 #ifndef __cplusplus
-#define libmerc_config_init() {false,false,false,false,false,false,false,false,NULL,NULL,enc_key_type_none,NULL,0.0,0.0,0}
+#define libmerc_config_init() {false,false,false,false,false,false,false,false,NULL,NULL,enc_key_type_none,NULL,0.0,0.0,0,0,false,NULL}
 #endif
 
 
@@ -162,7 +171,9 @@ void mercury_packet_processor_destruct(mercury_packet_processor mpp);
 
 /**
  * mercury_packet_processor_write_json() processes a packet and timestamp and
- * writes the resulting JSON into a buffer.
+ * writes the resulting JSON into a buffer.  If binary_output is set in the
+ * libmerc_config, a binary record (see mbin.h) is written instead of JSON,
+ * by this and the other write_json functions.
  *
  * @param processor (input) is a packet processor context to be used
  * @param buffer (output) - location to which JSON will be written
@@ -182,6 +193,43 @@ size_t mercury_packet_processor_write_json(mercury_packet_processor processor,
                                            size_t length,
                                            struct timespec* ts);
 
+/**
+ * mercury_packet_processor_write_json_batch() processes an array of
+ * packets, in order, and writes the JSON output of each packet that
+ * produces any into the next unused buffer of the array buffers.
+ * Processing stops early if all of the buffers have been used, so
+ * that callers can reserve output buffers in bulk without knowing
+ * in advance which packets will produce output.
+ *
+ * @param processor (input) is a packet processor context to be used
+ * @param num_packets (input) - number of packets
+ * @param packets (input) - array of locations of packets, each starting with ethernet header
+ * @param lengths (input) - array of packet lengths
+ * @param ts (input) - array of timestamps associated with the packets
+ * @param num_buffers (input) - number of output buffers
+ * @param buffers (input) - array of locations to which JSON will be written
+ * @param buffer_size (input) - length of each buffer in bytes
+ * @param output_lengths (output) - array of num_buffers lengths of the JSON written into each buffer
+ * @param output_packets (output) - array of num_buffers indexes of the packet whose JSON was written into each buffer
+ * @param num_outputs (output) - number of buffers used
+ *
+ * @return the number of packets processed.
+ */
+#ifdef __cplusplus
+extern "C" LIBMERC_DLL_EXPORTED
+#endif
+size_t mercury_packet_processor_write_json_batch(mercury_packet_processor processor,
+                                                 size_t num_packets,
+                                                 uint8_t **packets,
+                                                 const size_t *lengths,
+                                                 struct timespec *ts,
+                                                 size_t num_buffers,
+                                                 void **buffers,
+                                                 size_t buffer_size,
+                                                 size_t *output_lengths,
+                                                 size_t *output_packets,
+                                                 size_t *num_outputs);
+
 /**
  * mercury_packet_processor_ip_write_json() processes a packet and
  * timestamp and writes the resulting JSON into a buffer.
@@ -203,6 +251,81 @@ size_t mercury_packet_processor_ip_write_json(mercury_packet_processor processor
                                               uint8_t *packet,
                                               size_t length,
                                               struct timespec* ts);
+
+/**
+ * mercury_packet_processor_write_repeats() writes the summary of the
+ * events that were suppressed as repeats (see repeat_window in
+ * libmerc_config) in the next repeat window that has closed, once the
+ * windows that have ended by the time ts have been closed.  It should
+ * be called after packets are processed, and from time to time when
+ * none arrive, until it returns zero; when the processor is done, it
+ * should be called with all set to true, which closes every window.
+ *
+ * @param processor (input) is a packet processor context to be used
+ * @param buffer (output) - location to which JSON will be written
+ * @param buffer_size (input) - length of buffer in bytes
+ * @param ts (input) - pointer to the current time, the summary's event_start
+ * @param all (input) - close all of the repeat windows
+ *
+ * @return the number of bytes of JSON output written, or zero if no
+ * summary is left to write.
+ */
+#ifdef __cplusplus
+extern "C" LIBMERC_DLL_EXPORTED
+#endif
+size_t mercury_packet_processor_write_repeats(mercury_packet_processor processor,
+                                              void *buffer,
+                                              size_t buffer_size,
+                                              struct timespec *ts,
+                                              bool all);
+
+/**
+ * enum record_priority ranks the records written by a packet
+ * processor by their value, so that a caller that cannot keep up with
+ * its output can shed the records of low priority first.
+ */
+enum record_priority {
+    record_priority_low    = 0,  /**< e.g. DNS, and initial data of nonselected flows */
+    record_priority_normal = 1,  /**< e.g. TCP SYNs, HTTP, SSH                          */
+    record_priority_high   = 2   /**< e.g. TLS and QUIC client hellos, certificates    */
+};
+
+#define RECORD_PRIORITIES 3      /* the number of values of enum record_priority */
+
+/**
+ * mercury_packet_processor_set_min_priority() sets the lowest
+ * priority of the records that a packet processor writes.  A packet
+ * whose record would be of a lower priority is parsed, so that flow
+ * state stays current, but its record is shed: it is neither analyzed
+ * nor formatted, and the write_json functions write nothing for it.
+ * The minimum is record_priority_low, so that every record is written,
+ * until this function is called.
+ *
+ * @param processor (input) is a packet processor context to be used
+ * @param min_priority (input) - the lowest priority of the records to be written
+ */
+#ifdef __cplusplus
+extern "C" LIBMERC_DLL_EXPORTED
+#endif
+void mercury_packet_processor_set_min_priority(mercury_packet_processor processor,
+                                               enum record_priority min_priority);
+
+/**
+ * mercury_packet_processor_get_records_shed() writes the number of
+ * records of each priority that a packet processor has shed since it
+ * was constructed into records_shed, which is indexed by enum
+ * record_priority.  Those records are also counted in the stats data
+ * of its mercury_context (see mercury_write_stats_data()).
+ *
+ * @param processor (input) is a packet processor context to be used
+ * @param records_shed (output) - array of RECORD_PRIORITIES counts
+ */
+#ifdef __cplusplus
+extern "C" LIBMERC_DLL_EXPORTED
+#endif
+void mercury_packet_processor_get_records_shed(mercury_packet_processor processor,
+                                               uint64_t records_shed[RECORD_PRIORITIES]);
+
 /**
  * enum fingerprint_status represents the status of a fingerprint
  * relative to the library's knowledge about fingerprints, based on
@@ -475,6 +598,12 @@ bool mercury_get_stats_data(void **data_ptr, size_t *num_bytes_ptr);
  * RAM for data storage; if it runs out of storage, it will stop
  * accumulating data.
  *
+ * If any of the context's packet processors have shed records (see
+ * mercury_packet_processor_set_min_priority()) since the previous
+ * call, the file ends with a line that counts them by priority, such
+ * as {"records_shed":{"low":120,"normal":4,"high":0}}, which has no
+ * src_ip; those counts are flushed along with the rest of the data.
+ *
  * @return true on success, false otherwise.
  */
 #ifdef __cplusplus
@@ -0,0 +1,158 @@
+/*
+ * mbin.h
+ *
+ * compact binary record format, an alternative to JSON output
+ *
+ * Copyright (c) 2021 Cisco Systems, Inc. All rights reserved.
+ * License at https://github.com/cisco/mercury/blob/master/LICENSE
+ */
+
+#ifndef MBIN_H
+#define MBIN_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+/*
+ * A binary record holds the same information as a JSON record, as a
+ * sequence of tokens that mirror the calls made to json_object and
+ * json_array, so that it can be turned back into the identical JSON
+ * text (see mbin_decoder.h).  Values are stored in their native form:
+ * byte strings that JSON shows in hex or base64, and addresses and
+ * timestamps, are copied as they are, and strings are not escaped.
+ *
+ * A record starts with a four-byte header: the format version (one
+ * byte, less than 0x20, so that it cannot be mistaken for the start
+ * of a JSON record) and the length of the rest of the record (three
+ * bytes, little endian).  Records follow one another with nothing in
+ * between.
+ *
+ * Each token starts with a tag byte, whose low six bits give its type;
+ * the bit MBIN_COMMA is set if a comma precedes the token in JSON, and
+ * the bit MBIN_KEYED if the token is an object member, in which case
+ * its key follows the tag.  Lengths, keys and integers are encoded as
+ * varints (LEB128: seven bits per byte, least significant first, with
+ * the high bit set on all but the last byte), and a key is a varint
+ * length followed by that many bytes.  After the tag and key, a token
+ * holds
+ *
+ *    mbin_object, mbin_object_end,
+ *    mbin_array, mbin_array_end,
+ *    mbin_true, mbin_false, mbin_null  nothing
+ *    mbin_string, mbin_escaped,
+ *    mbin_hex, mbin_base64, mbin_text  varint length, then that many bytes
+ *    mbin_uint                         varint
+ *    mbin_int                          zigzag-encoded varint
+ *    mbin_float                        IEEE 754 double, little endian
+ *    mbin_timestamp,
+ *    mbin_timestamp_string             varint seconds, varint nanoseconds
+ *    mbin_ipv4_addr                    four bytes, network order
+ *    mbin_ipv6_addr                    sixteen bytes, network order
+ *
+ * An mbin_text token holds JSON text that is copied to the output as
+ * it is; it carries the output of code that writes JSON directly to a
+ * buffer_stream, rather than through json_object (e.g. certificates).
+ */
+
+#define MBIN_VERSION      1
+#define MBIN_HEADER_LEN   4
+#define MBIN_MAX_LENGTH   0xffffff  /* longest record, after its header */
+
+#define MBIN_COMMA        0x80
+#define MBIN_KEYED        0x40
+#define MBIN_TYPE_MASK    0x3f
+
+#define MBIN_TEXT_LEN_LEN 3  /* text lengths are padded to three bytes */
+
+enum mbin_type {
+    mbin_text             = 1,   /* JSON text, copied as it is            */
+    mbin_object           = 2,
+    mbin_object_end       = 3,
+    mbin_array            = 4,
+    mbin_array_end        = 5,
+    mbin_string           = 6,   /* string, written without escaping      */
+    mbin_escaped          = 7,   /* string, written with JSON escaping    */
+    mbin_hex              = 8,   /* bytes, written as a hex string        */
+    mbin_base64           = 9,   /* bytes, written as a base64 string     */
+    mbin_uint             = 10,
+    mbin_int              = 11,
+    mbin_float            = 12,
+    mbin_true             = 13,
+    mbin_false            = 14,
+    mbin_null             = 15,
+    mbin_timestamp        = 16,  /* written as seconds.nanoseconds        */
+    mbin_timestamp_string = 17,  /* written as a date and time string     */
+    mbin_ipv4_addr        = 18,
+    mbin_ipv6_addr        = 19,
+};
+
+/*
+ * mbin_put_varint() writes x as a varint at p, and returns the number
+ * of bytes written, which is at most ten
+ */
+static inline size_t mbin_put_varint(uint8_t *p, uint64_t x) {
+    size_t n = 0;
+    while (x >= 0x80) {
+        p[n++] = (x & 0x7f) | 0x80;
+        x >>= 7;
+    }
+    p[n++] = x;
+    return n;
+}
+
+/*
+ * mbin_get_varint() reads a varint from p, advances p past it, and
+ * returns true, or returns false if it does not end before end
+ */
+static inline bool mbin_get_varint(const uint8_t **p, const uint8_t *end, uint64_t *x) {
+    uint64_t value = 0;
+    for (unsigned int shift = 0; *p < end && shift < 64; shift += 7) {
+        uint8_t byte = *(*p)++;
+        value |= (uint64_t)(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) {
+            *x = value;
+            return true;
+        }
+    }
+    return false;
+}
+
+static inline uint64_t mbin_zigzag(int64_t i) {
+    return ((uint64_t)i << 1) ^ (uint64_t)(i >> 63);
+}
+
+static inline int64_t mbin_unzigzag(uint64_t u) {
+    return (int64_t)(u >> 1) ^ -(int64_t)(u & 1);
+}
+
+static inline void mbin_put_header(uint8_t *p, size_t length) {
+    p[0] = MBIN_VERSION;
+    p[1] = length & 0xff;
+    p[2] = (length >> 8) & 0xff;
+    p[3] = (length >> 16) & 0xff;
+}
+
+/*
+ * mbin_is_record() returns true if the len bytes at p start with the
+ * header of a binary record, rather than with a JSON record
+ */
+static inline bool mbin_is_record(const void *p, size_t len) {
+    return len >= MBIN_HEADER_LEN && *(const uint8_t *)p == MBIN_VERSION;
+}
+
+/*
+ * mbin_record_length() returns the total length of the record at p,
+ * including its header, or zero if the len bytes at p do not hold a
+ * complete record of a known version
+ */
+static inline size_t mbin_record_length(const void *p, size_t len) {
+    const uint8_t *h = (const uint8_t *)p;
+    if (!mbin_is_record(p, len)) {
+        return 0;
+    }
+    size_t total = MBIN_HEADER_LEN + (h[1] | (h[2] << 8) | ((size_t)h[3] << 16));
+    return total <= len ? total : 0;
+}
+
+#endif /* MBIN_H */
@@ -0,0 +1,190 @@
+/*
+ * mbin_decoder.h
+ *
+ * conversion of binary records (see mbin.h) into JSON
+ *
+ * Copyright (c) 2021 Cisco Systems, Inc. All rights reserved.
+ * License at https://github.com/cisco/mercury/blob/master/LICENSE
+ */
+
+#ifndef MBIN_DECODER_H
+#define MBIN_DECODER_H
+
+#include "mbin.h"
+#include "buffer_stream.h"
+
+/*
+ * mbin_token_bytes() reads a varint length from p, and sets data to
+ * the bytes that follow it, advancing p past them; it returns false
+ * if they do not end before end
+ */
+static inline bool mbin_token_bytes(const uint8_t **p, const uint8_t *end, const uint8_t **data, uint64_t *length) {
+    if (!mbin_get_varint(p, end, length) || *length > (uint64_t)(end - *p)) {
+        return false;
+    }
+    *data = *p;
+    *p += *length;
+    return true;
+}
+
+static inline bool mbin_token_timespec(const uint8_t **p, const uint8_t *end, struct timespec *ts) {
+    uint64_t sec, nsec;
+    if (!mbin_get_varint(p, end, &sec) || !mbin_get_varint(p, end, &nsec)) {
+        return false;
+    }
+    ts->tv_sec = sec;
+    ts->tv_nsec = nsec;
+    return true;
+}
+
+/*
+ * mbin_record_write_json() writes the record of len bytes at record,
+ * which must start with its header, as a line of JSON text into buf,
+ * which is identical to the one that mercury would have written; it
+ * returns false if the record is malformed, or does not fit into buf
+ */
+static inline bool mbin_record_write_json(struct buffer_stream &buf, const void *record, size_t len) {
+    size_t record_len = mbin_record_length(record, len);
+    if (record_len == 0) {
+        return false;
+    }
+    const uint8_t *p = (const uint8_t *)record + MBIN_HEADER_LEN;
+    const uint8_t *end = (const uint8_t *)record + record_len;
+    const uint8_t *data;
+    uint64_t length;
+    uint64_t u;
+    struct timespec ts;
+    double d;
+
+    while (p < end) {
+        uint8_t tag = *p++;
+        if (tag & MBIN_COMMA) {
+            buf.write_char(',');
+        }
+        if (tag & MBIN_KEYED) {
+            if (!mbin_token_bytes(&p, end, &data, &length)) {
+                return false;
+            }
+            buf.write_char('\"');
+            buf.memcpy(data, length);
+            buf.puts("\":");
+        }
+        switch (tag & MBIN_TYPE_MASK) {
+        case mbin_text:
+            if (!mbin_token_bytes(&p, end, &data, &length)) {
+                return false;
+            }
+            buf.memcpy(data, length);
+            break;
+        case mbin_object:
+            buf.write_char('{');
+            break;
+        case mbin_object_end:
+            buf.write_char('}');
+            break;
+        case mbin_array:
+            buf.write_char('[');
+            break;
+        case mbin_array_end:
+            buf.write_char(']');
+            break;
+        case mbin_string:
+            if (!mbin_token_bytes(&p, end, &data, &length)) {
+                return false;
+            }
+            buf.write_char('\"');
+            buf.memcpy(data, length);
+            buf.write_char('\"');
+            break;
+        case mbin_escaped:
+            if (!mbin_token_bytes(&p, end, &data, &length)) {
+                return false;
+            }
+            buf.json_string_escaped(data, length);
+            break;
+        case mbin_hex:
+            if (!mbin_token_bytes(&p, end, &data, &length)) {
+                return false;
+            }
+            buf.write_char('\"');
+            if (length) {
+                buf.raw_as_hex(data, length);
+            }
+            buf.write_char('\"');
+            break;
+        case mbin_base64:
+            if (!mbin_token_bytes(&p, end, &data, &length)) {
+                return false;
+            }
+            buf.raw_as_base64(data, length);
+            break;
+        case mbin_uint:
+            if (!mbin_get_varint(&p, end, &u)) {
+                return false;
+            }
+            buf.snprintf("%lu", u);
+            break;
+        case mbin_int:
+            if (!mbin_get_varint(&p, end, &u)) {
+                return false;
+            }
+            buf.snprintf("%ld", mbin_unzigzag(u));
+            break;
+        case mbin_float:
+            if (end - p < (ssize_t)sizeof(d)) {
+                return false;
+            }
+            memcpy(&d, p, sizeof(d));
+            p += sizeof(d);
+            buf.snprintf("%f", d);
+            break;
+        case mbin_true:
+            buf.puts("true");
+            break;
+        case mbin_false:
+            buf.puts("false");
+            break;
+        case mbin_null:
+            buf.puts("null");
+            break;
+        case mbin_timestamp:
+            if (!mbin_token_timespec(&p, end, &ts)) {
+                return false;
+            }
+            buf.write_timestamp(&ts);
+            break;
+        case mbin_timestamp_string:
+            if (!mbin_token_timespec(&p, end, &ts)) {
+                return false;
+            }
+            buf.write_char('\"');
+            buf.write_timestamp_as_string(&ts);
+            buf.write_char('\"');
+            break;
+        case mbin_ipv4_addr:
+            if (end - p < 4) {
+                return false;
+            }
+            buf.write_char('\"');
+            buf.write_ipv4_addr(p);
+            buf.write_char('\"');
+            p += 4;
+            break;
+        case mbin_ipv6_addr:
+            if (end - p < 16) {
+                return false;
+            }
+            buf.write_char('\"');
+            buf.write_ipv6_addr(p);
+            buf.write_char('\"');
+            p += 16;
+            break;
+        default:
+            return false;
+        }
+    }
+    buf.write_char('\n');
+    return buf.trunc == 0;
+}
+
+#endif /* MBIN_DECODER_H */
@@ -69,7 +69,8 @@ size_t stateful_pkt_proc::ip_write_json(void *buffer,
                                         struct timespec *ts,
                                         struct tcp_reassembler *reassembler) {
 
-    struct buffer_stream buf{(char *)buffer, buffer_size};
+    struct buffer_stream buf{(char *)buffer, buffer_size, global_vars.binary_output};
+    buf.fields = output_fields;
     struct key k;
     struct datum pkt{ip_packet, ip_packet+length};
     size_t transport_proto = 0;
@@ -115,13 +116,13 @@ size_t stateful_pkt_proc::ip_write_json(void *buffer,
             if (global_vars.output_tcp_initial_data) {
                 tcp_flow_table.syn_packet(k, ts->tv_sec, ntohl(tcp_pkt.header->seq));
             }
-            if (select_tcp_syn) {
+            if (select_tcp_syn && !shed(record_priority_normal)) {
                 struct json_object record{&buf};
                 struct json_object fps{record, "fingerprints"};
                 fps.print_key_value("tcp", tcp_pkt);
                 fps.close();
                 if (global_vars.metadata_output) {
-                    tcp_pkt.write_json(fps);
+                    tcp_pkt.write_json(record);
                 }
                 // note: we could check for non-empty data field
                 write_flow_key(record, k);
@@ -135,13 +136,13 @@ size_t stateful_pkt_proc::ip_write_json(void *buffer,
             }
 
 #ifdef REPORT_SYN_ACK
-            if (select_tcp_syn) {
+            if (select_tcp_syn && !shed(record_priority_normal)) {
                 struct json_object record{&buf};
                 struct json_object fps{record, "fingerprints"};
                 fps.print_key_value("tcp_server", tcp_pkt);
                 fps.close();
                 if (global_vars.metadata_output) {
-                    tcp_pkt.write_json(fps);
+                    tcp_pkt.write_json(record);
                 }
                 write_flow_key(record, k);
                 record.print_key_timestamp("event_start", ts);
@@ -197,7 +198,7 @@ size_t stateful_pkt_proc::ip_write_json(void *buffer,
         case udp_msg_type_quic:
             {
                 struct quic_initial_packet quic_pkt{pkt};
-                if (quic_pkt.is_not_empty()) {
+                if (quic_pkt.is_not_empty() && !shed(record_priority_high)) {
                     struct json_object json_record{&buf};
                     struct quic_initial_packet_crypto quic_pkt_crypto{quic_pkt};
                     quic_pkt_crypto.decrypt(quic_pkt.data.data, quic_pkt.data.length());
@@ -225,7 +226,7 @@ size_t stateful_pkt_proc::ip_write_json(void *buffer,
             {
                 wireguard_handshake_init wg;
                 wg.parse(pkt);
-                if (wg.is_valid()) {
+                if (wg.is_valid() && !shed(record_priority_normal)) {
                     struct json_object record{&buf};
                     wg.write_json(record);
                     write_flow_key(record, k);
@@ -238,7 +239,7 @@ size_t stateful_pkt_proc::ip_write_json(void *buffer,
             {
                 if (global_vars.dns_json_output) {
                     struct dns_packet dns_pkt{pkt};
-                    if (dns_pkt.is_not_empty()) {
+                    if (dns_pkt.is_not_empty() && !shed(record_priority_low)) {
                         struct json_object json_record{&buf};
                         struct json_object json_dns{json_record, "dns"};
                         dns_pkt.write_json(json_dns);
@@ -247,7 +248,7 @@ size_t stateful_pkt_proc::ip_write_json(void *buffer,
                         json_record.print_key_timestamp("event_start", ts);
                         json_record.close();
                     }
-                } else {
+                } else if (!shed(record_priority_low)) {
                     struct json_object json_record{&buf};
                     struct json_object json_dns{json_record, "dns"};
                     json_dns.print_key_base64("base64", pkt);
@@ -267,7 +268,7 @@ size_t stateful_pkt_proc::ip_write_json(void *buffer,
                 if (handshake.msg_type == handshake_type::client_hello) {
                     struct tls_client_hello hello;
                     hello.parse(handshake.body);
-                    if (hello.is_not_empty()) {
+                    if (hello.is_not_empty() && !shed(record_priority_high)) {
                         struct json_object record{&buf};
                         struct json_object fps{record, "fingerprints"};
                         fps.print_key_value("dtls", hello);
@@ -284,7 +285,7 @@ size_t stateful_pkt_proc::ip_write_json(void *buffer,
             {
                 struct dhcp_discover dhcp_disco;
                 dhcp_disco.parse(pkt);
-                if (dhcp_disco.is_not_empty()) {
+                if (dhcp_disco.is_not_empty() && !shed(record_priority_normal)) {
                     struct json_object record{&buf};
                     struct json_object fps{record, "fingerprints"};
                     fps.print_key_value("dhcp", dhcp_disco);
@@ -307,7 +308,7 @@ size_t stateful_pkt_proc::ip_write_json(void *buffer,
         case udp_msg_type_dtls_certificate:
             // cases that fall through here are not yet supported
         case udp_msg_type_unknown:
-            if (is_new) {
+            if (is_new && !shed(record_priority_low)) {
                 struct json_object record{&buf};
                 struct json_object udp{record, "udp"};
                 udp.print_key_hex("data", pkt);
@@ -321,6 +322,9 @@ size_t stateful_pkt_proc::ip_write_json(void *buffer,
         }
     }
 
+    if (buf.binary) {
+        return buf.mbin_end_record();
+    }
     if (buf.length() != 0 && buf.trunc == 0) {
         buf.strncpy("\n");
         return buf.length();
@@ -602,6 +606,28 @@ struct is_not_empty {
     }
 };
 
+// get_priority returns the priority of the record written for a
+// TCP message (see enum record_priority in libmerc.h)
+//
+struct get_priority {
+    template <typename T>
+    enum record_priority operator()(T &) {
+        return record_priority_normal;
+    }
+
+    enum record_priority operator()(tls_client_hello &) {
+        return record_priority_high;
+    }
+
+    enum record_priority operator()(tls_server_hello_and_certificate &) {
+        return record_priority_high;
+    }
+
+    enum record_priority operator()(unknown_initial_packet &) {
+        return record_priority_low;
+    }
+};
+
 struct write_metadata {
     struct json_object &record;
     bool metadata_output_;
@@ -721,6 +747,30 @@ struct do_analysis {
 
 };
 
+/*
+ * set_destination sets the destination context of a message, if it
+ * has one, and returns its server name, or an empty string
+ */
+struct set_destination {
+    const struct key &k_;
+    struct analysis_context &analysis_;
+
+    set_destination(const struct key &k,
+                    struct analysis_context &analysis) :
+        k_{k},
+        analysis_{analysis}
+    {}
+
+    const char *operator()(tls_client_hello &r) {
+        analysis_.destination.init(r, k_);
+        return analysis_.destination.sn_str;
+    }
+
+    template <typename T>
+    const char *operator()(T &) { return ""; }
+
+};
+
 struct do_observation {
     const struct key &k_;
     struct analysis_context &analysis_;
@@ -880,6 +930,31 @@ void stateful_pkt_proc::tcp_data_write_json(struct buffer_stream &buf,
 
         std::visit(compute_fingerprint{analysis.fp}, x);
 
+        // a repeat of an event seen within the repeat window is
+        // counted, but neither analyzed nor written
+        //
+        if (repeats.is_enabled() && analysis.fp.get_type() != fingerprint_type_unknown) {
+            const char *server_name = std::visit(set_destination{k, analysis}, x);
+            uint64_t h = repeat_table::hash(k, analysis.fp.fp_str, server_name);
+            if (repeats.suppress(h, ts, k, analysis.fp, server_name)) {
+                if (global_vars.do_analysis && mq) {
+                    std::visit(do_observation{k, analysis, mq}, x);
+                }
+                return;
+            }
+        }
+
+        // a record that is shed is neither analyzed nor written, but
+        // is still observed, so that the stats data stays complete
+        //
+        if (shed(std::visit(get_priority{}, x))) {
+            if (global_vars.do_analysis && mq) {
+                std::visit(set_destination{k, analysis}, x);
+                std::visit(do_observation{k, analysis, mq}, x);
+            }
+            return;
+        }
+
         bool output_analysis = false;
         if (global_vars.do_analysis) {
             output_analysis = std::visit(do_analysis{k, analysis, c}, x);
@@ -912,6 +987,51 @@ void stateful_pkt_proc::tcp_data_write_json(struct buffer_stream &buf,
 
 }
 
+size_t stateful_pkt_proc::write_repeats(void *buffer,
+                                        size_t buffer_size,
+                                        struct timespec *ts,
+                                        bool all) {
+
+    repeats.expire(ts, all);
+
+    // a summary that is projected away entirely, or that does not
+    // fit into the buffer, is dropped, and the next one is tried
+    //
+    for (const struct repeat_summary *r = repeats.summary(); r != nullptr; r = repeats.summary()) {
+        struct buffer_stream buf{(char *)buffer, buffer_size, global_vars.binary_output};
+        buf.fields = output_fields;
+        struct json_object record{&buf};
+        fingerprint::write(record, r->fp_type, r->fingerprint.c_str());
+        if (r->server_name.length()) {
+            struct json_object json_tls{record, "tls"};
+            struct json_object json_client{json_tls, "client"};
+            json_client.print_key_json_string("server_name", (const uint8_t *)r->server_name.data(), r->server_name.length());
+            json_client.close();
+            json_tls.close();
+        }
+        struct json_object json_repeats{record, "repeats"};
+        json_repeats.print_key_uint("count", r->count);
+        json_repeats.print_key_timestamp("window_start", (struct timespec *)&r->window_start);
+        json_repeats.print_key_timestamp("last_seen", (struct timespec *)&r->last_seen);
+        json_repeats.close();
+        write_flow_key(record, r->k);
+        record.print_key_timestamp("event_start", ts);
+        record.close();
+        repeats.pop_summary();
+
+        if (buf.binary) {
+            size_t length = buf.mbin_end_record();
+            if (length) {
+                return length;
+            }
+        } else if (buf.length() != 0 && buf.trunc == 0) {
+            buf.strncpy("\n");
+            return buf.length();
+        }
+    }
+    return 0;
+}
+
 bool stateful_pkt_proc::tcp_data_set_analysis_result(struct analysis_result *r,
                                                      struct datum &pkt,
                                                      const struct key &k,
@@ -11,10 +11,13 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <sys/time.h>
+#include <atomic>
 #include "extractor.h"
 #include "packet.h"
 #include "analysis.h"
 #include "libmerc.h"
+#include "json_projection.h"
+#include "repeats.h"
 
 //extern struct mercury *global_context; // defined in libmerc.cc  // TODO: delete
 
@@ -29,8 +32,10 @@ struct mercury {
     struct libmerc_config global_vars;
     data_aggregator aggregator;
     classifier *c;
+    json_projection output_fields;
+    std::atomic<uint64_t> records_shed[RECORD_PRIORITIES];  /* since the last stats data was written */
 
-    mercury(const struct libmerc_config *vars, int verbosity) : aggregator{vars->max_stats_entries}, c{nullptr} {
+    mercury(const struct libmerc_config *vars, int verbosity) : aggregator{vars->max_stats_entries}, c{nullptr}, records_shed{} {
         global_vars = *vars;
         global_vars.resources = vars->resources;
         global_vars.packet_filter_cfg = vars->packet_filter_cfg; // TODO: deep copy
@@ -38,6 +43,9 @@ struct mercury {
         if (status) {
             throw (const char *)"error: proto_ident_config() failed"; // failure
         }
+        if (vars->output_fields && !output_fields.compile(vars->output_fields)) {
+            throw (const char *)"error: could not compile output fields"; // failure
+        }
         if (global_vars.do_analysis) {
             c = analysis_init_from_archive(verbosity, global_vars.resources,
                                            vars->enc_key, vars->key_type,
@@ -63,11 +71,15 @@ struct stateful_pkt_proc {
     struct tcp_reassembler *reassembler_ptr;
     struct tcp_initial_message_filter tcp_init_msg_filter;
     struct analysis_context analysis;
+    struct repeat_table repeats;
     struct message_queue *mq;
     mercury_context m;
     classifier *c;
     data_aggregator *ag;
     libmerc_config global_vars;
+    const json_projection *output_fields;  /* selects what is written, or nullptr for everything */
+    enum record_priority min_priority;     /* records of lower priority are shed */
+    uint64_t records_shed[RECORD_PRIORITIES];
 
     explicit stateful_pkt_proc(mercury_context mc, size_t prealloc_size=0) :
         ip_flow_table{prealloc_size},
@@ -76,11 +88,15 @@ struct stateful_pkt_proc {
         reassembler_ptr{&reassembler},
         tcp_init_msg_filter{},
         analysis{},
+        repeats{mc->global_vars.repeat_window},
         mq{nullptr},
         m{mc},
         c{nullptr},
         ag{nullptr},
-        global_vars{}
+        global_vars{},
+        output_fields{nullptr},
+        min_priority{record_priority_low},
+        records_shed{}
     {
 
         // set config and classifier to (refer to) context m
@@ -90,6 +106,9 @@ struct stateful_pkt_proc {
         }
         this->c = m->c;
         this->global_vars = m->global_vars;
+        if (global_vars.output_fields) {
+            output_fields = &m->output_fields;
+        }
 
         //fprintf(stderr, "note: setting classifier to %p, setting global_vars to %p\n", (void *)m->c, (void *)&m->global_vars));
         // }
@@ -122,6 +141,21 @@ struct stateful_pkt_proc {
         tcp_flow_table.count_all();
     }
 
+    /*
+     * shed() returns true if a record of priority p is to be shed,
+     * rather than analyzed and written, and counts it if so; it is
+     * called once the kind of record that a packet yields is known,
+     * and before any of that record is formatted
+     */
+    bool shed(enum record_priority p) {
+        if (p >= min_priority) {
+            return false;
+        }
+        records_shed[p]++;
+        m->records_shed[p].fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
     size_t write_json(void *buffer,
                       size_t buffer_size,
                       uint8_t *packet,
@@ -145,6 +179,18 @@ struct stateful_pkt_proc {
                              struct timespec *ts,
                              struct tcp_reassembler *reassembler);
 
+    /*
+     * write_repeats() closes the repeat windows that have ended by the
+     * time ts, or all of them, if all is true, and writes the summary
+     * of the repeats in the next closed window into buffer, with ts
+     * as its event_start; it returns the length written, or zero when
+     * there is no summary left to write, and is called until it does
+     */
+    size_t write_repeats(void *buffer,
+                         size_t buffer_size,
+                         struct timespec *ts,
+                         bool all);
+
     size_t ip_write_json(void *buffer,
                          size_t buffer_size,
                          const uint8_t *ip_packet,
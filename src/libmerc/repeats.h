@@ -0,0 +1,243 @@
+/*
+ * repeats.h
+ *
+ * suppression of repeated events
+ *
+ * Copyright (c) 2021 Cisco Systems, Inc. All rights reserved.
+ * License at https://github.com/cisco/mercury/blob/master/LICENSE
+ */
+
+#ifndef REPEATS_H
+#define REPEATS_H
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include "tcp.h"
+#include "fingerprint.h"
+
+/*
+ * struct repeat_summary reports the repeats of an event that were
+ * suppressed in one window: count is the number of them, window_start
+ * is the time of the event that opened the window, and last_seen is
+ * the time of the last repeat.  The event is identified by the flow
+ * key of its first repeat, its fingerprint, and its server name.
+ */
+struct repeat_summary {
+    struct key k;
+    enum fingerprint_type fp_type;
+    std::string fingerprint;
+    std::string server_name;
+    uint32_t count;
+    struct timespec window_start;
+    struct timespec last_seen;
+};
+
+/*
+ * struct repeat_table remembers the events seen by one thread, each
+ * identified by a hash of its source address, fingerprint, destination
+ * address and port, and server name.  The first event with a given
+ * hash opens a window of window seconds, and the repeats within that
+ * window are counted rather than reported.  When the window closes,
+ * because an event arrives or expire() is called after it ends, or
+ * because the event is evicted, a summary of its repeats, if there
+ * were any, is made ready to be written; the next event with that
+ * hash is reported, and opens the next window.
+ *
+ * The table holds at most capacity events, so that its memory is
+ * bounded; when it is full, an event is evicted with the clock
+ * algorithm, which passes over the events that have been seen since
+ * the hand last passed them.  Only the events with repeats in their
+ * window hold a (pending) summary.
+ */
+struct repeat_table {
+
+    static constexpr size_t default_capacity = 16384;
+
+    repeat_table(unsigned int window_sec, size_t capacity=default_capacity) :
+        window{window_sec},
+        capacity{capacity},
+        hand{0}
+    {
+        if (window) {
+            entries.reserve(capacity);
+            index.reserve(capacity);
+        }
+    }
+
+    bool is_enabled() const { return window != 0; }
+
+    /*
+     * suppress() returns true if the event with hash h, seen at time
+     * ts, is a repeat within an open window, in which case it is
+     * counted in that window's summary, and false otherwise
+     */
+    bool suppress(uint64_t h,
+                  const struct timespec *ts,
+                  const struct key &k,
+                  const struct fingerprint &fp,
+                  const char *server_name) {
+
+        auto it = index.find(h);
+        if (it != index.end()) {
+            size_t i = it->second;
+            struct entry &e = entries[i];
+            e.referenced = true;
+            if (ts->tv_sec >= e.window_start.tv_sec && ts->tv_sec - e.window_start.tv_sec < (time_t)window) {
+                if (e.pending == nullptr) {
+                    e.pending.reset(new repeat_summary{k, fp.type, fp.fp_str, server_name, 0, e.window_start, *ts});
+                    expiry.push_back({ e.window_start.tv_sec + (time_t)window, i, h });
+                    if (expiry.size() > 2 * capacity) {
+                        compact_expiry();
+                    }
+                }
+                e.pending->count++;
+                e.pending->last_seen = *ts;
+                return true;
+            }
+            close(e);
+            e.window_start = *ts;
+            return false;
+        }
+
+        size_t i;
+        if (entries.size() < capacity) {
+            i = entries.size();
+            entries.emplace_back();
+        } else {
+            i = evict();
+        }
+        entries[i].hash = h;
+        entries[i].window_start = *ts;
+        entries[i].referenced = false;
+        index[h] = i;
+        return false;
+    }
+
+    /*
+     * expire() closes the windows that have ended by the time ts, or
+     * all of the windows, if all is true, so that the summaries of
+     * their repeats are ready
+     */
+    void expire(const struct timespec *ts, bool all) {
+        while (!expiry.empty() && (all || expiry.front().end <= ts->tv_sec)) {
+            struct expiry_item x = expiry.front();
+            expiry.pop_front();
+            if (is_current(x)) {
+                close(entries[x.i]);
+            }
+        }
+    }
+
+    /*
+     * summary() returns the next summary that is ready to be written,
+     * or nullptr if there is none; pop_summary() removes it, once it
+     * has been written
+     */
+    const struct repeat_summary *summary() const {
+        return ready.empty() ? nullptr : ready.front().get();
+    }
+
+    void pop_summary() { ready.pop_front(); }
+
+    /*
+     * hash() returns the hash that identifies an event; the source
+     * port is not part of it, so that the events of successive
+     * connections are repeats of each other
+     */
+    static uint64_t hash(const struct key &k, const char *fingerprint, const char *server_name) {
+        uint64_t h = fnv_offset_basis;
+        if (k.ip_vers == 6) {
+            h = fnv1a(h, &k.addr.ipv6.src, sizeof(k.addr.ipv6.src));
+            h = fnv1a(h, &k.addr.ipv6.dst, sizeof(k.addr.ipv6.dst));
+        } else {
+            h = fnv1a(h, &k.addr.ipv4.src, sizeof(k.addr.ipv4.src));
+            h = fnv1a(h, &k.addr.ipv4.dst, sizeof(k.addr.ipv4.dst));
+        }
+        h = fnv1a(h, &k.dst_port, sizeof(k.dst_port));
+        h = fnv1a(h, fingerprint, strlen(fingerprint) + 1);
+        h = fnv1a(h, server_name, strlen(server_name) + 1);
+        return h;
+    }
+
+private:
+
+    struct entry {
+        uint64_t hash;
+        struct timespec window_start;
+        bool referenced;
+        std::unique_ptr<struct repeat_summary> pending;  /* repeats in this window, if any */
+    };
+
+    /*
+     * an expiry_item holds the end of the window of the entry i, when
+     * it has hash; the item is stale if the entry has moved on since
+     */
+    struct expiry_item {
+        time_t end;
+        size_t i;
+        uint64_t hash;
+    };
+
+    unsigned int window;
+    size_t capacity;
+    size_t hand;
+    std::vector<struct entry> entries;
+    std::unordered_map<uint64_t, size_t> index;
+    std::deque<struct expiry_item> expiry;                  /* in order of end, for the most part */
+    std::deque<std::unique_ptr<struct repeat_summary>> ready;
+
+    void close(struct entry &e) {
+        if (e.pending) {
+            ready.push_back(std::move(e.pending));
+        }
+    }
+
+    bool is_current(const struct expiry_item &x) const {
+        const struct entry &e = entries[x.i];
+        return e.hash == x.hash && e.pending && e.window_start.tv_sec + (time_t)window == x.end;
+    }
+
+    // each entry has at most one current item, so dropping the stale
+    // ones bounds the queue by the capacity of the table
+    //
+    void compact_expiry() {
+        std::deque<struct expiry_item> current;
+        for (const auto &x : expiry) {
+            if (is_current(x)) {
+                current.push_back(x);
+            }
+        }
+        expiry.swap(current);
+    }
+
+    size_t evict() {
+        while (entries[hand].referenced) {
+            entries[hand].referenced = false;
+            hand = (hand + 1) % capacity;
+        }
+        size_t i = hand;
+        close(entries[i]);
+        index.erase(entries[i].hash);
+        hand = (hand + 1) % capacity;
+        return i;
+    }
+
+    static constexpr uint64_t fnv_offset_basis = 0xcbf29ce484222325;
+    static constexpr uint64_t fnv_prime = 0x100000001b3;
+
+    static uint64_t fnv1a(uint64_t h, const void *data, size_t length) {
+        const uint8_t *d = (const uint8_t *)data;
+        for (size_t i = 0; i < length; i++) {
+            h = (h ^ d[i]) * fnv_prime;
+        }
+        return h;
+    }
+};
+
+#endif /* REPEATS_H */
@@ -631,6 +631,10 @@ unsigned char tls_server_hello::value[8] = {
 
 void tls_server_certificate::write_json(struct json_array &a, bool json_output) const {
 
+    if (a.skipped) {
+        return;  // don't parse certificates that won't be written
+    }
+
     struct datum tmp_cert_list = certificate_list;
     while (datum_get_data_length(&tmp_cert_list) > 0) {
 
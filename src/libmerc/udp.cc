@@ -9,6 +9,7 @@
 
 
 #include "extractor.h"
+#include "udp.h"
 #include "proto_identify.h"
 #include "match.h"
 #include "utils.h"
@@ -113,6 +114,17 @@ struct pi_container quic = {
     QUIC_PORT
 };
 
+const struct msg_pattern udp_msg_patterns[] = {
+    { dhcp_client_mask,        dhcp_client_value        },
+    { dtls_client_hello_mask,  dtls_client_hello_value  },
+    { dtls_server_hello_mask,  dtls_server_hello_value  },
+    { dns_server_mask,         dns_server_value         },
+    { dns_client_mask,         dns_client_value         },
+    { wireguard_mask,          wireguard_value          },
+    { quic_mask,               quic_value               },
+    { nullptr,                 nullptr                  }
+};
+
 enum udp_msg_type udp_get_message_type(const uint8_t *udp_data,
                                    unsigned int len) {
 
@@ -54,6 +54,8 @@ struct udp_packet {
 
 };
 
+extern const struct msg_pattern udp_msg_patterns[];  // see extractor.h
+
 enum udp_msg_type udp_get_message_type(const uint8_t *udp_data,
                                        unsigned int len);
 
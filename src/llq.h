@@ -8,64 +8,339 @@
 #ifndef LLQ_H
 #define LLQ_H
 
+#include <stdint.h>
+#include <time.h>
 #include <unistd.h>
+#include <limits.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "libmerc/libmerc.h"
 
-#define LLQ_MSG_SIZE 16384   /* The number of bytes allowed for each message in the lockless queue */
-#define LLQ_DEPTH    2048    /* The number of "buckets" (queue messages) allowed */
-#define LLQ_MAX_AGE  5       /* Maximum age (in seconds) messages are allowed to sit in a queue */
+#define LLQ_MSG_SIZE  16384            /* The number of bytes allowed for each message in the lockless queue */
+#define LLQ_RING_SIZE (8 * 1024 * 1024) /* The number of bytes of messages in each queue (a power of two) */
+#define LLQ_ALIGN     64               /* Messages start on cache line boundaries */
+#define LLQ_HEARTBEAT_MSEC 10          /* Longest interval (in milliseconds) between watermarks of an idle capture thread */
+#define LLQ_READ_WAIT_NSEC 1000000000L /* Longest wait (in nanoseconds) of the reader for a writer, with wakeups */
+#define LLQ_WAIT_NSEC 1000000          /* Longest wait (in nanoseconds) of a writer for room, with wakeups */
 
-/* The message object suitable for the std::priority_queue */
+/*
+ * when a non-blocking writer falls behind, it sheds records of low
+ * priority (see enum record_priority in libmerc.h) first: a record is
+ * only written to the queue if the ring holds no more than the
+ * shedding threshold for its priority, so the space above each
+ * threshold is reserved for records of higher priority
+ */
+#define LLQ_SHED_LOW    (LLQ_RING_SIZE / 2)      /* threshold of low-priority messages    */
+#define LLQ_SHED_NORMAL (LLQ_RING_SIZE / 4 * 3)  /* threshold of normal-priority messages */
+
+/*
+ * llq_futex_wait() waits until *addr is changed from val and then
+ * woken by llq_futex_wake(), or until nsec nanoseconds have passed,
+ * or a signal arrives; it returns at once if *addr is not val
+ */
+static inline void llq_futex_wait(uint32_t *addr, uint32_t val, long nsec) {
+    struct timespec timeout = { nsec / 1000000000, nsec % 1000000000 };
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, &timeout, NULL, 0);
+}
+
+static inline void llq_futex_wake(uint32_t *addr) {
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+/*
+ * A message in the ring: this header is followed by len bytes of
+ * data, and then by padding up to the next multiple of LLQ_ALIGN.  A
+ * message whose len is LLQ_WRAP marks the unused space at the end of
+ * the ring that the writer skipped over, since a message must be
+ * contiguous.
+ */
 struct llq_msg {
-    volatile int used; /* The flag that says if this object is actually in use (if not, it's available) */
-    char buf[LLQ_MSG_SIZE];
-    ssize_t len;
+    uint32_t len;      /* number of bytes of data                              */
+    uint32_t size;     /* number of bytes from this message to the next one    */
     struct timespec ts;
+    uint64_t seq;      /* input packet number, used instead of ts when merging by sequence */
 
-    void send(ssize_t length) {
-        len = length;
-        // A full memory barrier prevents the following flag set from happening too soon
-        __sync_synchronize();
-        used = 1;
-    }
+    char *buf() { return (char *)(this + 1); }
 };
 
+#define LLQ_WRAP UINT32_MAX
+
+/*
+ * a watermark of LLQ_WATERMARK_END indicates that no more messages
+ * will be published to a queue
+ */
+#define LLQ_WATERMARK_END UINT64_MAX
+
+/*
+ * llq_time_watermark() returns the watermark of a queue whose writer
+ * will publish no message with a timestamp earlier than ts
+ */
+static inline uint64_t llq_time_watermark(const struct timespec *ts) {
+    return (uint64_t)ts->tv_sec * 1000000000 + ts->tv_nsec;
+}
 
-/* a "lockless" queue */
+/*
+ * a "lockless" queue with a single writer (a worker thread) and a
+ * single reader (the output thread), holding variable-length messages
+ * in a byte ring.  The writer and reader each advance a byte count
+ * (widx and ridx) that is only ever increased, so that the amount of
+ * data in the ring is widx - ridx.  The reader consumes messages in
+ * place, and releases their space (by advancing ridx) once it is done
+ * with them, which can be several messages later.  Each side keeps a
+ * private copy of the other's count, which is only reloaded when it
+ * would otherwise find the ring full (or empty), to keep cache lines
+ * from bouncing between the two threads.
+ *
+ * By default, the reader polls the queues, and a blocking writer polls
+ * for room.  With wakeups enabled (wakeup is not nullptr), each side
+ * instead sleeps on a futex, after setting a flag that asks the other
+ * side to wake it; the flag is only set by a reader that has found its
+ * queues empty (or its merge stalled), or by a writer that has found
+ * its queue full, so a wakeup is only sent on the transition from empty
+ * to non-empty, or from full to not full.
+ */
 struct ll_queue {
-    int qnum;  /* This is the queue number and is only needed for debugging */
-    int ridx;  /* The read index */
-    int widx;  /* The write index */
-    struct llq_msg msgs[LLQ_DEPTH];
+    int qnum;          /* This is the queue number and is only needed for debugging */
+    uint8_t *ring;     /* LLQ_RING_SIZE bytes, allocated by thread_queues_init() */
+
+    /*
+     * written by the writer and read by the reader
+     */
+    alignas(64) uint64_t widx;  /* bytes published to the reader                   */
+
+    /*
+     * watermark is set by the writer to indicate that every message
+     * that sorts before it has already been published to this queue:
+     * when the output is merged by sequence number, every message with
+     * a smaller seq, and otherwise, every message with a timestamp
+     * earlier than llq_time_watermark(ts)
+     */
+    uint64_t watermark;
+
+    uint64_t wpos;              /* bytes written, including unpublished messages   */
+    uint64_t ridx_cache;        /* the writer's copy of ridx                       */
+    uint32_t *wakeup;           /* futex on which the reader sleeps, or nullptr    */
+    uint32_t reader_waiting;    /* set by the reader before it sleeps              */
+
+    /*
+     * written by the reader and read by the writer
+     */
+    alignas(64) uint64_t ridx;  /* bytes released by the reader                    */
+    uint64_t rpos;              /* bytes consumed by the reader                    */
+    uint64_t widx_cache;        /* the reader's copy of widx                       */
+    uint64_t progress_seen;     /* progress() when the reader last looked          */
+    uint32_t room;              /* futex on which a blocking writer sleeps         */
+    uint32_t writer_waiting;    /* set by the writer before it sleeps              */
+
+    struct llq_msg *msg_at(uint64_t idx) {
+        return (struct llq_msg *)(ring + idx % LLQ_RING_SIZE);
+    }
+
+    bool has_room(size_t n) {
+        if (LLQ_RING_SIZE - (wpos - ridx_cache) >= n) {
+            return true;
+        }
+        ridx_cache = __atomic_load_n(&ridx, __ATOMIC_ACQUIRE);
+        return LLQ_RING_SIZE - (wpos - ridx_cache) >= n;
+    }
+
+    /*
+     * wait_for_room() pauses a blocking writer that has found the ring
+     * too full to hold n bytes
+     */
+    void wait_for_room(size_t n) {
+        if (wakeup == nullptr) {
+            usleep(50); // sleep for fifty microseconds
+            return;
+        }
+        uint32_t val = __atomic_load_n(&room, __ATOMIC_ACQUIRE);
+        __atomic_store_n(&writer_waiting, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);  // set the flag before looking at ridx
+        if (!has_room(n)) {
+            llq_futex_wait(&room, val, LLQ_WAIT_NSEC);
+        }
+    }
 
-    static const size_t msg_length = LLQ_DEPTH;
+    /*
+     * min_priority() returns the lowest priority of the records that
+     * can be written to the queue, given how far the ring is filled
+     * and the shedding thresholds; records of high priority can
+     * always be written
+     */
+    enum record_priority min_priority() {
+        if (wpos - ridx_cache > LLQ_SHED_LOW) {
+            ridx_cache = __atomic_load_n(&ridx, __ATOMIC_ACQUIRE);
+        }
+        const uint64_t used = wpos - ridx_cache;
+        if (used <= LLQ_SHED_LOW) {
+            return record_priority_low;
+        }
+        return used <= LLQ_SHED_NORMAL ? record_priority_normal : record_priority_high;
+    }
 
+    /*
+     * init_msg() returns a message with room for LLQ_MSG_SIZE bytes of
+     * data, with its timestamp set to sec and nsec, or nullptr if the
+     * queue is full; if blocking is true, it waits until there is room.
+     * The message is not visible to the reader until it is committed
+     * and then published.
+     */
     struct llq_msg *init_msg(bool blocking, unsigned int sec, unsigned int nsec) {
-        struct llq_msg *m = &msgs[widx];
-        if (blocking) {
-            while (m->used != 0) {
-                usleep(50); // sleep for fifty microseconds
+        const size_t need = sizeof(struct llq_msg) + LLQ_MSG_SIZE;
+        size_t offset = wpos % LLQ_RING_SIZE;
+        size_t skip = LLQ_RING_SIZE - offset < need ? LLQ_RING_SIZE - offset : 0;
+        if (!has_room(skip + need)) {
+            publish();  // the reader cannot make room by reading unpublished messages
+            if (!blocking) {
+                // the queue is full; the caller accounts for the drop
+                return nullptr;
+            }
+            while (!has_room(skip + need)) {
+                wait_for_room(skip + need);
             }
         }
-        if (m->used == 0) {
+        if (skip) {
+            struct llq_msg *m = msg_at(wpos);
+            m->len = LLQ_WRAP;
+            m->size = skip;
+            wpos += skip;
+        }
+        struct llq_msg *m = msg_at(wpos);
+        m->ts.tv_sec = sec;
+        m->ts.tv_nsec = nsec;
+        m->seq = 0;
+        m->buf()[0] = '\0';
+        return m;
+    }
+
+    /*
+     * commit_msg() ends the message m returned by init_msg(), which
+     * holds len bytes of data, so that the next message follows it
+     */
+    void commit_msg(struct llq_msg *m, size_t len) {
+        m->len = len;
+        m->size = (sizeof(struct llq_msg) + len + LLQ_ALIGN - 1) & ~(size_t)(LLQ_ALIGN - 1);
+        wpos += m->size;
+    }
+
+    /*
+     * publish() hands all committed messages to the reader, with a
+     * single release store
+     */
+    void publish() {
+        if (widx == wpos) {
+            return;
+        }
+        __atomic_store_n(&widx, wpos, __ATOMIC_RELEASE);
+        wake_reader();
+    }
+
+    /*
+     * set_watermark() advances the watermark, which can also let a
+     * stalled reader proceed
+     */
+    void set_watermark(uint64_t seq) {
+        if (watermark == seq) {
+            return;
+        }
+        __atomic_store_n(&watermark, seq, __ATOMIC_RELEASE);
+        wake_reader();
+    }
+
+    /*
+     * advance_watermark() sets the watermark, unless it is already
+     * higher, since the writer's clock might step backwards
+     */
+    void advance_watermark(uint64_t w) {
+        if (w > watermark) {
+            set_watermark(w);
+        }
+    }
+
+    /*
+     * wake_reader() wakes the reader, if it is waiting for this queue
+     */
+    void wake_reader() {
+        if (wakeup == nullptr) {
+            return;
+        }
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);  // store widx before looking at the flag
+        if (__atomic_load_n(&reader_waiting, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&reader_waiting, 0, __ATOMIC_RELAXED);
+            __atomic_add_fetch(wakeup, 1, __ATOMIC_RELEASE);
+            llq_futex_wake(wakeup);
+        }
+    }
 
-            m->ts.tv_sec = sec;
-            m->ts.tv_nsec = nsec;
-            m->buf[0] = '\0';
+    void send_msg(struct llq_msg *m, size_t len) {
+        commit_msg(m, len);
+        publish();
+    }
 
-            return m;
+    /*
+     * head() returns the oldest published message, or nullptr if there
+     * is none; it is only called by the reader
+     */
+    struct llq_msg *head() {
+        while (true) {
+            if (rpos == widx_cache) {
+                widx_cache = __atomic_load_n(&widx, __ATOMIC_ACQUIRE);
+                if (rpos == widx_cache) {
+                    return nullptr;
+                }
+            }
+            struct llq_msg *m = msg_at(rpos);
+            if (m->len != LLQ_WRAP) {
+                return m;
+            }
+            rpos += m->size;
         }
-        //fprintf(stderr, "DEBUG: queue bucket used!\n");
+    }
+
+    /*
+     * pop() consumes the message returned by head(); its data remains
+     * valid until release() is called
+     */
+    void pop() {
+        rpos += msg_at(rpos)->size;
+    }
 
-        // TODO: this is where we'd update an output drop counter
-        // but currently this spot in the code doesn't have access to
-        // any thread stats pointer or similar and I don't want
-        // to update a global variable in this location.
-        return nullptr;
+    /*
+     * release() makes the space of all consumed messages available to
+     * the writer
+     */
+    void release() {
+        if (ridx == rpos) {
+            return;
+        }
+        __atomic_store_n(&ridx, rpos, __ATOMIC_RELEASE);
+        if (__atomic_load_n(&writer_waiting, __ATOMIC_RELAXED)) {
+            wake_writer();
+        }
     }
-    void write_buffer_to_queue() {
+
+    /*
+     * wake_writer() wakes the writer, if it is waiting for room.  The
+     * check in release() is not ordered after the store of ridx, so that
+     * the reader does not pay for a fence on every release; the reader
+     * calls wake_writer() before it sleeps, and a writer that is missed
+     * in between waits for at most LLQ_WAIT_NSEC.
+     */
+    void wake_writer() {
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&writer_waiting, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&writer_waiting, 0, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&room, 1, __ATOMIC_RELEASE);
+            llq_futex_wake(&room);
+        }
     }
-    void increment_widx() {
-        widx = (widx + 1) % LLQ_DEPTH;
+
+    /*
+     * progress() increases whenever the writer publishes a message or
+     * advances its watermark, which are the events a reader waits for
+     */
+    uint64_t progress() {
+        return __atomic_load_n(&widx, __ATOMIC_ACQUIRE) + __atomic_load_n(&watermark, __ATOMIC_ACQUIRE);
     }
 };
 
@@ -74,6 +349,7 @@ struct thread_queues {
     int qnum;             /* The number of queues that have been allocated */
     int qidx;             /* The index of the first free queue */
     struct ll_queue *queue;      /* The actual queue datastructure */
+    uint32_t wakeup;      /* futex on which the reader sleeps, with wakeups */
 };
 
 
@@ -82,6 +358,7 @@ struct tourn_tree {
     int qp2;
     int *tree;
     int stalled;
+    bool sequenced;  /* merge by llq_msg::seq instead of by ts */
 };
 
 #endif // LLQ_H
@@ -23,8 +23,13 @@
 #include "signal_handling.h"
 #include "config.h"
 #include "output.h"
-#include "rnd_pkt_drop.h"
+#include "flow_sampler.h"
 #include "control.h"
+#include "topology.h"
+#include "benchmark.h"
+#include "direct_io.h"
+#include "gzip_io.h"
+#include "deferred_json.h"
 
 char mercury_help[] =
     "%s [INPUT] [OUTPUT] [OPTIONS]:\n"
@@ -32,15 +37,28 @@ char mercury_help[] =
     "   [-c or --capture] capture_interface   # capture packets from interface\n"
     "   [-r or --read] read_file              # read packets from file\n"
     "   no input option                       # read packets from standard input\n"
+    "   --benchmark                           # replay read_file from memory, timed\n"
     "OUTPUT\n"
     "   [-f or --fingerprint] json_file_name  # write JSON fingerprints to file\n"
     "   [-w or --write] pcap_file_name        # write packets to PCAP/MCAP file\n"
     "   no output option                      # write JSON fingerprints to stdout\n"
+    "   --per-thread-output                   # write a file per thread, unordered\n"
+    "   --binary                              # write binary records instead of JSON\n"
+    "   --stream=s                            # stream records to Unix socket s\n"
+    "   --stream-policy=p                     # slow subscribers: drop-oldest,\n"
+    "                                         # drop-newest or block\n"
+    "   --deferred-json[=n]                   # render JSON on n output threads\n"
+    "   --fields=f                            # write only the JSON fields in list f\n"
+    "   --suppress-repeats[=s]                # count repeated events for s seconds\n"
     "--capture OPTIONS\n"
     "   [-b or --buffer] b                    # set RX_RING size to (b * PHYS_MEM)\n"
     "   [-t or --threads] [num_threads | cpu] # set number of threads\n"
     "   [-u or --user] u                      # set UID and GID to those of user u\n"
     "   [-d or --directory] d                 # set working directory to d\n"
+    "   --capture-engine=e                    # use engine e (af_packet or xdp)\n"
+    "   --snaplen=s                           # capture at most s bytes per packet\n"
+    "   --numa[=n]                            # run on NUMA node n (default: NIC's)\n"
+    "   --cpu-affinity=l                      # pin worker threads to cpulist l\n"
     "GENERAL OPTIONS\n"
     "   --config c                            # read configuration from file c\n"
     "   [-a or --analysis]                    # analyze fingerprints\n"
@@ -52,6 +70,9 @@ char mercury_help[] =
     "   --nonselected-tcp-data                # tcp data for nonselected traffic\n"
     "   --nonselected-udp-data                # udp data for nonselected traffic\n"
     "   [-l or --limit] l                     # rotate output file after l records\n"
+    "   --direct-io[=d]                       # write output with O_DIRECT, depth d\n"
+    "   --compress[=z]                        # gzip output at level z (1-9), or zstd[:z]\n"
+    "   --wakeup=w                            # output thread waits by w (poll or event)\n"
     "   --dns-json                            # output DNS as JSON, not base64\n"
     "   --certs-json                          # output certs as JSON, not base64\n"
     "   --metadata                            # output more protocol metadata in JSON\n"
@@ -72,19 +93,147 @@ char mercury_extended_help[] =
     "   is the available memory; USE b < 0.1 EXCEPT WHEN THERE ARE GIGABYTES OF SPARE\n"
     "   RAM to avoid OS failure due to memory starvation.\n"
     "\n"
+    "   \"--capture-engine=e\" selects the kernel interface used with [-c or --capture]:\n"
+    "   \"af_packet\" (the default) uses TPACKETv3 ring buffers with a fanout group,\n"
+    "   and \"xdp\" uses AF_XDP sockets, with worker thread i bound to receive queue\n"
+    "   i of the interface; the number of threads must not exceed the number of\n"
+    "   queues (see 'ethtool -L').  With xdp, packets are timestamped on receipt by\n"
+    "   mercury rather than by the kernel, and \"-b\" has no effect.\n"
+    "\n"
+    "   With the af_packet engine, a kernel packet filter derived from the\n"
+    "   [-s or --select] and --nonselected-*-data options discards packets that\n"
+    "   could not produce output before they reach the ring buffers.\n"
+    "   \"--snaplen=s\" also truncates each accepted packet to s bytes; this is\n"
+    "   suitable when only handshake metadata is needed, but it truncates packets\n"
+    "   written with [-w or --write], and can hide data (e.g. certificates, QUIC\n"
+    "   initial packets) that extends beyond s bytes.\n"
+    "\n"
+    "   During capture, if the output thread falls behind, the records of each\n"
+    "   worker thread are shed by priority, before they are formatted: once its\n"
+    "   output queue is half full, DNS and --nonselected-*-data records are\n"
+    "   discarded, and once it is three quarters full, only TLS, QUIC and DTLS\n"
+    "   fingerprints and certificates are kept.  With [-v or --verbose], the\n"
+    "   number of records shed at each priority is reported, and with --stats,\n"
+    "   it is also counted in each stats file.\n"
+    "\n"
+    "   \"--numa[=n]\" places mercury on NUMA node n, or with no argument, on the\n"
+    "   node to which the capture interface is attached: ring buffers, queues and\n"
+    "   flow tables are allocated from that node's memory, and all threads run on\n"
+    "   its CPUs, with worker thread i pinned to the i-th CPU.  With \"-t cpu\", one\n"
+    "   worker thread is created per CPU of the node.  \"--cpu-affinity=l\" pins the\n"
+    "   worker threads to the CPUs in the list l (e.g. 0-7,16-23) instead.\n"
+    "\n"
     "   \"[-f or --fingerprint] f\" writes a JSON record for each fingerprint observed,\n"
     "   which incorporates the flow key and the time of observation, into the file f.\n"
     "   With [-a or --analysis], fingerprints and destinations are analyzed and the\n"
     "   results are included in the JSON output.\n"
     "\n"
+    "   \"--direct-io[=d]\" writes the output file (-f or -w) in 1 MB blocks that\n"
+    "   bypass the page cache (O_DIRECT), with up to d blocks (default 8) being\n"
+    "   written at once through io_uring, or d at a time with pwritev() if io_uring\n"
+    "   is unavailable.  Records reach the file only when a block is full, or when\n"
+    "   the file is rotated or closed.\n"
+    "\n"
+    "   \"--compress[=z]\" writes the output file (-f or -w) compressed with gzip, at\n"
+    "   level z (default 6), and with .gz appended to its name.  The records are\n"
+    "   compressed in 1 MB frames by a pool of threads, and each frame becomes a\n"
+    "   gzip member of its own, which gzip and zlib read as one stream; a frame is\n"
+    "   written once it is full, or its first record is a second old.  Compressed\n"
+    "   files are written, rotated and closed by a thread other than the one that\n"
+    "   merges the output.  \"--compress=zstd[:z]\" compresses each frame with zstd\n"
+    "   instead, at level z (1-19, default 3), and appends .zst to the file name;\n"
+    "   it requires mercury to be built with libzstd.  \"--compress=gzip:z\" is the\n"
+    "   same as \"--compress=z\".\n"
+    "\n"
+    "   \"--wakeup=w\" sets how the output thread waits for records from the worker\n"
+    "   threads.  With \"poll\" (the default), it checks for them every millisecond,\n"
+    "   and a worker reading a file whose output queue is full checks for room every\n"
+    "   50 microseconds.  With \"event\", each side sleeps until the other wakes it,\n"
+    "   which it does only when a queue stops being empty or full; this reduces\n"
+    "   latency and idle CPU use, at the cost of a memory fence per batch of records.\n"
+    "\n"
+    "   \"--per-thread-output\" writes the output of each worker thread to its own\n"
+    "   file, without merging it with that of the other threads, so that no thread\n"
+    "   waits for another.  The output of thread t goes into the files\n"
+    "   <prefix>.<t>.<n>.json (or .pcap), where prefix is the -f or -w file name\n"
+    "   without that extension, and n is 0 unless the files are rotated with -l,\n"
+    "   which limits the records in each of them.  Within each file, the records\n"
+    "   are in the order in which its thread produced them.\n"
+    "\n"
+    "   \"--binary\" writes each record in a compact binary format instead of JSON,\n"
+    "   with byte strings, addresses and timestamps in their native form rather\n"
+    "   than in hex or text.  The program mercury-convert turns a file of binary\n"
+    "   records back into the JSON that would have been written without --binary.\n"
+    "\n"
+    "   \"--stream=s\" sends each record, instead of writing it to a file, as one\n"
+    "   message on the SOCK_SEQPACKET Unix-domain socket s, to each of up to 16\n"
+    "   local consumers connected to it, starting with the first record after they\n"
+    "   connect.  \"--stream-policy=p\" sets what happens to the records for a\n"
+    "   consumer that does not keep up, once its socket buffer is full: with\n"
+    "   \"drop-oldest\" (the default) or \"drop-newest\", up to 64k records (16 MB)\n"
+    "   are held for it, and then the oldest held record, or the new one, is\n"
+    "   dropped; with \"block\", the output thread waits for it, so that the worker\n"
+    "   threads' queues fill up and records are shed as described above (or, when\n"
+    "   reading files, the workers wait), until mercury is interrupted, after which\n"
+    "   records that do not fit are dropped.  When mercury finishes, it waits up to\n"
+    "   two seconds for the records still held to be read.  If another process\n"
+    "   is listening on s, mercury exits with an error.  With [-v or --verbose],\n"
+    "   the records sent to and dropped for each consumer are reported when it\n"
+    "   disconnects.\n"
+    "\n"
+    "   \"--deferred-json[=n]\" moves the rendering of JSON off the worker threads:\n"
+    "   they queue each record in the compact binary format of --binary, which\n"
+    "   holds byte strings and addresses as they are, and the output side renders\n"
+    "   each batch of records as JSON, identical to what the workers would have\n"
+    "   written, on n formatter threads (default 2) as well as the output thread\n"
+    "   (or on each thread's own output thread, with --per-thread-output).\n"
+    "\n"
+    "   \"--fields=f\" writes only the members of each JSON record that are in the\n"
+    "   comma-separated list f, in which each field is a path of member names\n"
+    "   separated by dots, such as tls.client.server_name; a field selects the\n"
+    "   member and all that it holds, and a member of an array selects it in each\n"
+    "   element.  What is not selected is not formatted at all, and objects left\n"
+    "   empty, and records, are omitted.  A field can also be one of the profiles\n"
+    "   @flow (the flow key and event_start), @minimal (that, fingerprints,\n"
+    "   analysis, TLS server name and HTTP host and user agent), or @tls, @http,\n"
+    "   @ssh or @dns (that protocol's fingerprints and identifying fields), for\n"
+    "   example --fields=@tls,@http,tls.server.certs.\n"
+    "\n"
+    "   \"--suppress-repeats[=s]\" writes the first of the events that have the same\n"
+    "   source address, fingerprint, destination address and port, and server name,\n"
+    "   and then counts the ones that follow within s seconds (default 60) rather\n"
+    "   than analyzing and writing them.  When the window ends, a summary record\n"
+    "   is written with a \"repeats\" object that holds the count and the times of\n"
+    "   the first event and the last repeat, and the next event is written and\n"
+    "   starts the next window.  Each thread keeps up to 16k events; when it is\n"
+    "   full, it evicts one that has not been seen recently, and writes its\n"
+    "   summary early.  The remaining summaries are written when mercury exits.\n"
+    "\n"
     "   \"[-w or --write] w\" writes packets to the file w, in PCAP format.  With the\n"
     "   option [-s or --select], packets are filtered so that only ones with\n"
     "   fingerprint metadata are written.\n"
     "\n"
-    "   \"[r or --read] r\" reads packets from the file r, in PCAP format.\n"
+    "   \"[r or --read] r\" reads packets from the file r, in PCAP or pcapng format.\n"
+    "   If r is a directory, a glob pattern (quoted, e.g. 'cap/*.mcap'), or a\n"
+    "   comma-separated list of files, then all of those files are read, by up to\n"
+    "   t threads with \"[-t or --thread] t\".  Each file is read by a single thread,\n"
+    "   and the output of all of the threads is merged in time order.  A single file\n"
+    "   read with more than one thread is instead split by flow: one thread reads\n"
+    "   it, and t worker threads process its flows, with the output in the same\n"
+    "   order as the input (compressed files are not split).  In pcapng files,\n"
+    "   only packets from Ethernet interfaces are processed.  Files compressed with\n"
+    "   gzip are decompressed as they are read, as are files compressed with zstd\n"
+    "   or lz4 if mercury was built with libzstd or liblz4.\n"
     "\n"
     "   if neither -r nor -c is specified, then packets are read from standard input,\n"
-    "   in PCAP format.\n"
+    "   in PCAP format, which may be compressed.\n"
+    "\n"
+    "   --benchmark loads all of the packets in the file(s) r into memory, then has\n"
+    "   t threads process them (divided by flow) [-p or --loop] times, and writes\n"
+    "   the packets, bytes, and records per second and the nanoseconds per packet\n"
+    "   of each thread, and of all threads, to stdout as a JSON object.  Records\n"
+    "   are written to the output file given with -f or -w, if any, and are\n"
+    "   otherwise discarded.\n"
     "\n"
     "   \"[-s or --select] f\" selects packets according to the metadata filter f, which\n"
     "   is a comma-separated list of the following strings:\n"
@@ -161,6 +310,7 @@ char mercury_extended_help[] =
     "   mercury -c eth0 -w foo.mcap -t cpu -s # as above, selecting packet metadata\n"
     "   mercury -r foo.mcap -f foo.json       # read foo.mcap, write fingerprints\n"
     "   mercury -r foo.mcap -f foo.json -a    # as above, with fingerprint analysis\n"
+    "   mercury -r cap/ -f foo.json -t cpu    # read all files in cap/, in parallel\n"
     "   mercury -c eth0 -t cpu -f foo.json -a # capture and analyze fingerprints\n";
 
 
@@ -197,7 +347,7 @@ int main(int argc, char *argv[]) {
     extern double malware_prob_threshold;  // TODO - expose hidden command
 
     while(1) {
-        enum opt { config=1, version=2, license=3, dns_json=4, certs_json=5, metadata=6, resources=7, tcp_init_data=8, udp_init_data=9, write_stats=10, stats_limit=11, stats_time=12 };
+        enum opt { config=1, version=2, license=3, dns_json=4, certs_json=5, metadata=6, resources=7, tcp_init_data=8, udp_init_data=9, write_stats=10, stats_limit=11, stats_time=12, capture_engine=13, snaplen=14, numa=15, cpu_affinity=16, benchmark=17, direct_io=18, wakeup=19, per_thread_output=20, compress=21, binary=22, stream=23, stream_policy=24, deferred_json=25, fields=26, suppress_repeats=27 };
         int opt_idx = 0;
         static struct option long_opts[] = {
             { "config",      required_argument, NULL, config  },
@@ -212,6 +362,21 @@ int main(int argc, char *argv[]) {
             { "nonselected-udp-data", no_argument, NULL, udp_init_data },
             { "stats-limit", required_argument, NULL, stats_limit },
             { "stats-time",  required_argument, NULL, stats_time },
+            { "capture-engine", required_argument, NULL, capture_engine },
+            { "snaplen",     required_argument, NULL, snaplen },
+            { "numa",        optional_argument, NULL, numa },
+            { "cpu-affinity", required_argument, NULL, cpu_affinity },
+            { "benchmark",   no_argument,       NULL, benchmark },
+            { "direct-io",   optional_argument, NULL, direct_io },
+            { "wakeup",      required_argument, NULL, wakeup },
+            { "per-thread-output", no_argument,  NULL, per_thread_output },
+            { "compress",    optional_argument, NULL, compress },
+            { "binary",      no_argument,       NULL, binary },
+            { "stream",      required_argument, NULL, stream },
+            { "stream-policy", required_argument, NULL, stream_policy },
+            { "deferred-json", optional_argument, NULL, deferred_json },
+            { "fields",      required_argument, NULL, fields },
+            { "suppress-repeats", optional_argument, NULL, suppress_repeats },
             { "read",        required_argument, NULL, 'r' },
             { "write",       required_argument, NULL, 'w' },
             { "directory",   required_argument, NULL, 'd' },
@@ -433,6 +598,110 @@ int main(int argc, char *argv[]) {
                 usage(argv[0], "option stats-time requires a numeric argument", extended_help_off);
             }
             break;
+        case capture_engine:
+            if (option_is_valid(optarg)) {
+                if (argument_parse_as_capture_engine(optarg, &cfg.capture_engine) != status_ok) {
+                    usage(argv[0], "option capture-engine requires argument af_packet or xdp", extended_help_off);
+                }
+            } else {
+                usage(argv[0], "option capture-engine requires argument af_packet or xdp", extended_help_off);
+            }
+            break;
+        case snaplen:
+            if (option_is_valid(optarg)) {
+                errno = 0;
+                cfg.snaplen = strtoul(optarg, NULL, 10);
+                if (errno) {
+                    printf("%s: could not convert argument \"%s\" to a number\n", strerror(errno), optarg);
+                }
+            } else {
+                usage(argv[0], "option snaplen requires a numeric argument", extended_help_off);
+            }
+            break;
+        case numa:
+            if (optarg == NULL) {
+                cfg.numa_node = NUMA_NODE_AUTO;
+            } else if (argument_parse_as_numa_node(optarg, &cfg.numa_node) != status_ok) {
+                usage(argv[0], "option numa requires a node number or auto as its argument", extended_help_off);
+            }
+            break;
+        case benchmark:
+            if (optarg) {
+                usage(argv[0], "option benchmark does not use an argument", extended_help_off);
+            } else {
+                cfg.benchmark = true;
+            }
+            break;
+        case direct_io:
+            cfg.direct_io_depth = DIRECT_IO_DEFAULT_DEPTH;
+            if (optarg && (argument_parse_as_direct_io_depth(optarg, &cfg.direct_io_depth) != status_ok)) {
+                usage(argv[0], "option direct-io requires a queue depth between 1 and 256, if any", extended_help_off);
+            }
+            break;
+        case compress:
+            cfg.compress_level = GZIP_DEFAULT_LEVEL;
+            cfg.compress_format = compress_format_gzip;
+            if (optarg && (argument_parse_as_compress(optarg, &cfg.compress_format, &cfg.compress_level) != status_ok)) {
+                usage(argv[0], "option compress requires a gzip level between 1 and 9, or gzip[:z] or zstd[:z] with a zstd level between 1 and 19, if any", extended_help_off);
+            }
+            break;
+        case stream:
+            if (option_is_valid(optarg)) {
+                cfg.stream_path = optarg;
+            } else {
+                usage(argv[0], "option stream requires a socket path argument", extended_help_off);
+            }
+            break;
+        case stream_policy:
+            if (!option_is_valid(optarg) || argument_parse_as_stream_policy(optarg, &cfg.stream_policy) != status_ok) {
+                usage(argv[0], "option stream-policy requires argument drop-oldest, drop-newest or block", extended_help_off);
+            }
+            break;
+        case fields:
+            if (option_is_valid(optarg)) {
+                libmerc_cfg.output_fields = optarg;
+            } else {
+                usage(argv[0], "option fields requires a list of fields", extended_help_off);
+            }
+            break;
+        case suppress_repeats:
+            libmerc_cfg.repeat_window = DEFAULT_REPEAT_WINDOW;
+            if (optarg && (argument_parse_as_repeat_window(optarg, &libmerc_cfg.repeat_window) != status_ok)) {
+                usage(argv[0], "option suppress-repeats requires a number of seconds between 1 and 86400, if any", extended_help_off);
+            }
+            break;
+        case deferred_json:
+            cfg.deferred_json_threads = DEFERRED_JSON_DEFAULT_THREADS;
+            if (optarg && (argument_parse_as_deferred_json_threads(optarg, &cfg.deferred_json_threads) != status_ok)) {
+                usage(argv[0], "option deferred-json requires a number of threads between 0 and 64, if any", extended_help_off);
+            }
+            break;
+        case binary:
+            if (optarg) {
+                usage(argv[0], "option binary does not use an argument", extended_help_off);
+            } else {
+                libmerc_cfg.binary_output = true;
+            }
+            break;
+        case per_thread_output:
+            if (optarg) {
+                usage(argv[0], "option per-thread-output does not use an argument", extended_help_off);
+            } else {
+                cfg.per_thread_output = true;
+            }
+            break;
+        case wakeup:
+            if (!option_is_valid(optarg) || argument_parse_as_output_wakeup(optarg, &cfg.output_wakeup) != status_ok) {
+                usage(argv[0], "option wakeup requires argument poll or event", extended_help_off);
+            }
+            break;
+        case cpu_affinity:
+            if (option_is_valid(optarg)) {
+                cfg.cpu_affinity = optarg;
+            } else {
+                usage(argv[0], "option cpu-affinity requires a cpulist argument", extended_help_off);
+            }
+            break;
         case stats_limit:
             if (option_is_valid(optarg)) {
                 errno = 0;
@@ -513,9 +782,45 @@ int main(int argc, char *argv[]) {
     if (cfg.read_filename != NULL && cfg.capture_interface != NULL) {
         usage(argv[0], "incompatible arguments read [r] and capture [c] specified on command line", extended_help_off);
     }
+    if (cfg.benchmark && cfg.capture_interface != NULL) {
+        usage(argv[0], "option benchmark requires read [r], not capture [c]", extended_help_off);
+    }
     if (cfg.fingerprint_filename && cfg.write_filename) {
         usage(argv[0], "both fingerprint [f] and write [w] specified on command line", extended_help_off);
     }
+    if (cfg.stream_path && (cfg.fingerprint_filename || cfg.write_filename)) {
+        usage(argv[0], "option stream cannot be used with fingerprint [f] or write [w]", extended_help_off);
+    }
+    if (cfg.stream_path && (cfg.compress_level || cfg.direct_io_depth || cfg.per_thread_output)) {
+        usage(argv[0], "option stream cannot be used with compress, direct-io or per-thread-output", extended_help_off);
+    }
+    if (libmerc_cfg.binary_output && cfg.write_filename) {
+        usage(argv[0], "option binary does not apply to write [w]", extended_help_off);
+    }
+    if (libmerc_cfg.output_fields && cfg.write_filename) {
+        usage(argv[0], "option fields does not apply to write [w]", extended_help_off);
+    }
+    if (libmerc_cfg.repeat_window && cfg.write_filename) {
+        usage(argv[0], "option suppress-repeats does not apply to write [w]", extended_help_off);
+    }
+    if (cfg.deferred_json_threads >= 0 && (libmerc_cfg.binary_output || cfg.write_filename)) {
+        usage(argv[0], "option deferred-json cannot be used with binary or write [w]", extended_help_off);
+    }
+    cfg.binary_output = libmerc_cfg.binary_output;
+    if (cfg.deferred_json_threads >= 0) {
+        libmerc_cfg.binary_output = true;  // the output thread renders the records as JSON
+    }
+    if (cfg.compress_level && cfg.fingerprint_filename == NULL && cfg.write_filename == NULL) {
+        usage(argv[0], "option compress requires fingerprint [f] or write [w]", extended_help_off);
+    }
+#ifndef HAVE_ZSTD
+    if (cfg.compress_level && cfg.compress_format == compress_format_zstd) {
+        usage(argv[0], "option compress=zstd requires mercury to be built with libzstd", extended_help_off);
+    }
+#endif
+    if (cfg.per_thread_output && cfg.fingerprint_filename == NULL && cfg.write_filename == NULL) {
+        usage(argv[0], "option per-thread-output requires fingerprint [f] or write [w]", extended_help_off);
+    }
     if (libmerc_cfg.max_stats_entries && cfg.stats_filename == NULL) {
         usage(argv[0], "stats-limit set, but no stats file specified", extended_help_off);
     }
@@ -527,6 +832,14 @@ int main(int argc, char *argv[]) {
         cfg.output_block = true;      // use blocking output, so that no packets are lost in copying
     }
 
+    /*
+     * bind to a NUMA node and/or CPUs, if configured, before any
+     * large allocations are made or threads are created
+     */
+    if (topology_placement_init(&cfg) != status_ok) {
+        return EXIT_FAILURE;
+    }
+
     mercury_context mc = mercury_init(&libmerc_cfg, cfg.verbosity);
     if (mc == nullptr) {
         fprintf(stderr, "error: could not initialize mercury\n");
@@ -562,7 +875,10 @@ int main(int argc, char *argv[]) {
 
     /* set the number of threads, if needed */
     if (cfg.num_threads == -1) {
-        int num_cpus = std::thread::hardware_concurrency();
+        int num_cpus = topology_num_cpus();
+        if (num_cpus == 0) {
+            num_cpus = std::thread::hardware_concurrency();
+        }
         cfg.num_threads = num_cpus;
         if (cfg.verbosity) {
             fprintf(stderr, "found %d CPU(s), creating %d thread(s)\n", num_cpus, cfg.num_threads);
@@ -577,6 +893,7 @@ int main(int argc, char *argv[]) {
         ctl = new controller{mc, cfg.stats_filename, cfg.stats_rotation_duration};
     }
 
+    int exit_code = 0;
     pthread_t output_thread;
     struct output_file out_file;
     if (output_thread_init(output_thread, out_file, cfg) != 0) {
@@ -594,8 +911,12 @@ int main(int argc, char *argv[]) {
         }
     } else if (cfg.read_filename) {
 
-        if (open_and_dispatch(&cfg, mc, &out_file) != status_ok) {
-            return EXIT_FAILURE;
+        enum status status = cfg.benchmark ? benchmark_dispatch(&cfg, mc, &out_file) : open_and_dispatch(&cfg, mc, &out_file);
+        if (status != status_ok) {
+            if (out_file.t_output_p == 0) {
+                return EXIT_FAILURE;  // no input was read, and the output thread was not started
+            }
+            exit_code = EXIT_FAILURE; // some input could not be read; flush the rest of the output
         }
     }
 
@@ -611,5 +932,5 @@ int main(int argc, char *argv[]) {
     output_thread_finalize(output_thread, &out_file);
 
 
-    return 0;
+    return exit_code;
 }
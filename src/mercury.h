@@ -37,6 +37,50 @@
 #define mercury_debug(...)  (fprintf(stdout, __VA_ARGS__))
 #endif
 
+/*
+ * enum capture_engine identifies the kernel interface used for live
+ * packet capture
+ */
+enum capture_engine {
+    capture_engine_af_packet = 0,   /* TPACKETv3 rings (af_packet_v3.c)               */
+    capture_engine_xdp       = 1    /* AF_XDP sockets (af_xdp.c)                      */
+};
+
+/*
+ * enum output_wakeup identifies how the output thread and the worker
+ * threads wait for each other
+ */
+enum output_wakeup {
+    output_wakeup_poll  = 0,        /* sleep for a fixed time, then check again       */
+    output_wakeup_event = 1         /* sleep until woken through a futex (llq.h)      */
+};
+
+/*
+ * enum stream_policy identifies what is done with the records for a
+ * stream subscriber that does not keep up (see stream_io.h)
+ */
+enum stream_policy {
+    stream_policy_drop_oldest = 0,  /* discard the oldest records held for it         */
+    stream_policy_drop_newest = 1,  /* discard new records until it catches up        */
+    stream_policy_block       = 2   /* wait for it, holding back the output thread    */
+};
+
+/*
+ * enum compress_format identifies how output files are compressed
+ * (see gzip_io.h)
+ */
+enum compress_format {
+    compress_format_gzip = 0,       /* gzip members, readable with zlib               */
+    compress_format_zstd = 1        /* zstd frames, if built with libzstd             */
+};
+
+/*
+ * special values of mercury_config.numa_node; other values are NUMA
+ * node numbers
+ */
+#define NUMA_NODE_NONE -1           /* no NUMA placement                              */
+#define NUMA_NODE_AUTO -2           /* use the node of the capture interface          */
+
 /*
  * struct mercury_config holds the configuration information for a run
  * of the program
@@ -60,10 +104,24 @@ struct mercury_config {
     int use_test_packet;            /* use test packet to write output file           */
     int adaptive;                   /* adaptively accept/skip packets for PCAP output */
     bool output_block;              /* use blocking output                            */
-    size_t stats_rotation_duration; /* number of seconds between stats file rotation  */}
-;
+    size_t stats_rotation_duration; /* number of seconds between stats file rotation  */
+    enum capture_engine capture_engine; /* live capture mechanism (af_packet or xdp)  */
+    unsigned int snaplen;           /* bytes captured per packet (af_packet), or 0    */
+    int numa_node;                  /* NUMA node for threads and memory (see below)   */
+    char *cpu_affinity;             /* cpulist to which worker threads are pinned     */
+    bool benchmark;                 /* replay read files from memory, report rates    */
+    unsigned int direct_io_depth;   /* O_DIRECT output queue depth, or 0 for stdio    */
+    enum output_wakeup output_wakeup; /* polling or event-driven output thread        */
+    bool per_thread_output;         /* write each thread's output to its own file     */
+    int compress_level;             /* compression level of output files, or 0 for none */
+    enum compress_format compress_format; /* gzip or zstd compression of output files */
+    bool binary_output;             /* write binary records instead of JSON           */
+    char *stream_path;              /* Unix socket to stream records to, if any       */
+    enum stream_policy stream_policy; /* handling of slow stream subscribers          */
+    int deferred_json_threads;      /* threads rendering deferred JSON, or -1 for none */
+};
 
-#define mercury_config_init() { NULL, NULL, NULL, NULL, NULL, NULL, O_EXCL, (char *)"w", 0, 8, 1, 0, NULL, 1, 0, 0, 0, false, 300 }
+#define mercury_config_init() { NULL, NULL, NULL, NULL, NULL, NULL, O_EXCL, (char *)"w", 0, 8, 1, 0, NULL, 1, 0, 0, 0, false, 300, capture_engine_af_packet, 0, NUMA_NODE_NONE, NULL, false, 0, output_wakeup_poll, false, 0, compress_format_gzip, false, NULL, stream_policy_drop_oldest, -1 }
 
 
 #endif /* MERCURY_H */
@@ -0,0 +1,147 @@
+/*
+ * mercury_convert.cc
+ *
+ * convert a file of binary records, written by mercury --binary, into
+ * the JSON that mercury would otherwise have written
+ *
+ * Copyright (c) 2021 Cisco Systems, Inc.  All rights reserved.  License at
+ * https://github.com/cisco/mercury/blob/master/LICENSE
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <vector>
+#include <zlib.h>
+
+#include "libmerc/mbin_decoder.h"
+#include "options.h"
+
+/*
+ * read_fully() reads exactly len bytes from f into buf, and returns
+ * len, or returns less than len at the end of the file or on error
+ */
+static size_t read_fully(gzFile f, void *buf, size_t len) {
+    size_t total = 0;
+    while (total < len) {
+        int r = gzread(f, (uint8_t *)buf + total, len - total);
+        if (r <= 0) {
+            break;
+        }
+        total += r;
+    }
+    return total;
+}
+
+/*
+ * convert() writes the JSON for each binary record read from in to
+ * out, and returns the number of records converted, or -1 if in holds
+ * anything other than complete binary records
+ */
+static ssize_t convert(gzFile in, FILE *out) {
+    std::vector<uint8_t> record;
+    std::vector<char> json;
+    ssize_t count = 0;
+
+    while (true) {
+        uint8_t header[MBIN_HEADER_LEN];
+        size_t len = read_fully(in, header, sizeof(header));
+        if (len == 0) {
+            return count;
+        }
+        if (len < sizeof(header) || header[0] != MBIN_VERSION) {
+            fprintf(stderr, "error: record %zd is not a binary record of version %u\n", count, MBIN_VERSION);
+            return -1;
+        }
+        size_t payload_len = header[1] | (header[2] << 8) | ((size_t)header[3] << 16);
+        record.resize(MBIN_HEADER_LEN + payload_len);
+        memcpy(record.data(), header, sizeof(header));
+        if (read_fully(in, record.data() + MBIN_HEADER_LEN, payload_len) != payload_len) {
+            fprintf(stderr, "error: record %zd is truncated\n", count);
+            return -1;
+        }
+
+        // JSON is usually two to four times the size of a binary
+        // record; if it does not fit, try again with more room
+        //
+        if (json.size() < 4 * record.size() + 4096) {
+            json.resize(4 * record.size() + 4096);
+        }
+        while (true) {
+            struct buffer_stream buf{json.data(), (int)json.size()};
+            if (mbin_record_write_json(buf, record.data(), record.size())) {
+                fwrite(buf.dstr, 1, buf.length(), out);
+                break;
+            }
+            if (buf.trunc == 0 || json.size() > 64 * record.size() + 65536) {
+                fprintf(stderr, "error: record %zd is malformed\n", count);
+                return -1;
+            }
+            json.resize(json.size() * 2);
+        }
+        count++;
+    }
+}
+
+int main(int argc, char *argv[]) {
+
+    const char summary[] =
+        "usage:\n"
+        "   mercury-convert <input> [OPTIONS]\n"
+        "\n"
+        "converts the binary records in <input>, which was written by mercury\n"
+        "with --binary and may be gzip-compressed, into JSON; if <input> is -,\n"
+        "the records are read from standard input\n"
+        "\n"
+        "OPTIONS\n"
+        ;
+    class option_processor opt({
+        { argument::positional, "input",    "read binary records from <input>" },
+        { argument::required,   "--output", "write JSON to file <arg> instead of stdout" },
+        { argument::none,       "--help",   "print out help message" }
+    });
+    if (!opt.process_argv(argc, argv)) {
+        opt.usage(stderr, argv[0], summary);
+        return EXIT_FAILURE;
+    }
+
+    auto [ input_is_set, input ] = opt.get_value("input");
+    auto [ output_is_set, output ] = opt.get_value("--output");
+    if (opt.is_set("--help")) {
+        opt.usage(stdout, argv[0], summary);
+        return 0;
+    }
+    if (!input_is_set) {
+        opt.usage(stderr, argv[0], summary);
+        return EXIT_FAILURE;
+    }
+
+    gzFile in;
+    if (input == "-") {
+        in = gzdopen(dup(STDIN_FILENO), "r");
+    } else {
+        in = gzopen(input.c_str(), "r");
+    }
+    if (in == nullptr) {
+        fprintf(stderr, "error: could not open %s\n", input.c_str());
+        return EXIT_FAILURE;
+    }
+    FILE *out = stdout;
+    if (output_is_set) {
+        out = fopen(output.c_str(), "w");
+        if (out == nullptr) {
+            fprintf(stderr, "error: could not open %s for writing\n", output.c_str());
+            gzclose(in);
+            return EXIT_FAILURE;
+        }
+    }
+
+    ssize_t count = convert(in, out);
+
+    gzclose(in);
+    if (fclose(out) != 0) {
+        fprintf(stderr, "error: could not write %s\n", output_is_set ? output.c_str() : "output");
+        return EXIT_FAILURE;
+    }
+    return count < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
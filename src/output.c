@@ -8,6 +8,8 @@
 #include <stdlib.h>
 #include <sys/time.h>
 #include <string.h>
+#include <errno.h>
+#include <unistd.h>
 #include "output.h"
 #include "pcap_file_io.h"  // for write_pcap_file_header()
 #include "libmerc/utils.h"
@@ -15,34 +17,277 @@
 
 #define output_file_needs_rotation(ojf) (--((ojf)->record_countdown) == 0)
 
-void thread_queues_init(struct thread_queues *tqs, int n) {
+/*
+ * output_file_writev() writes the n records in iov to the file
+ * descriptor fd, continuing after short writes
+ */
+static enum status output_file_writev(int fd, struct iovec *iov, int n) {
+    while (n > 0) {
+        ssize_t written = writev(fd, iov, n);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("error: could not write output file");
+            return status_err;
+        }
+        while (n > 0 && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0) {
+            iov->iov_base = (uint8_t *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return status_ok;
+}
+
+/*
+ * output_file_flush() writes the batch of records gathered by
+ * output_file_write(), and then releases their space in the queues.
+ * A large batch is written with a single writev() straight from the
+ * queues; a small one is copied into the stdio buffer, so that a
+ * trickle of records does not cost a system call each.  With deferred
+ * JSON, the batch is rendered first, and any record that could not be
+ * rendered is left out.
+ */
+static void output_file_flush(struct output_file *ojf) {
+    if (ojf->batch_count == 0) {
+        if (ojf->gzip) {
+            gzip_writer_flush(ojf->gzip);
+        } else if (ojf->stream) {
+            stream_writer_flush(ojf->stream);
+        }
+        return;
+    }
+    if (ojf->renderer) {
+        json_renderer_render(ojf->renderer, ojf->batch, ojf->batch_count);
+        int n = 0;
+        ojf->batch_bytes = 0;
+        for (int i = 0; i < ojf->batch_count; i++) {
+            if (ojf->batch[i].iov_len) {
+                ojf->batch[n++] = ojf->batch[i];
+                ojf->batch_bytes += ojf->batch[i].iov_len;
+            }
+        }
+        ojf->batch_count = n;
+    }
+    if (ojf->stream) {
+        for (int i = 0; i < ojf->batch_count; i++) {
+            stream_writer_write(ojf->stream, ojf->batch[i].iov_base, ojf->batch[i].iov_len);
+        }
+        stream_writer_flush(ojf->stream);
+    } else if (ojf->gzip) {
+        for (int i = 0; i < ojf->batch_count; i++) {
+            gzip_writer_write(ojf->gzip, ojf->batch[i].iov_base, ojf->batch[i].iov_len);
+        }
+    } else if (ojf->direct) {
+        for (int i = 0; i < ojf->batch_count; i++) {
+            direct_writer_write(ojf->direct, ojf->batch[i].iov_base, ojf->batch[i].iov_len);
+        }
+    } else if (ojf->batch_bytes < BUFSIZ) {
+        for (int i = 0; i < ojf->batch_count; i++) {
+            fwrite(ojf->batch[i].iov_base, ojf->batch[i].iov_len, 1, ojf->file);
+        }
+    } else {
+        fflush(ojf->file);  // anything buffered by stdio goes first
+        output_file_writev(fileno(ojf->file), ojf->batch, ojf->batch_count);
+    }
+    ojf->batch_count = 0;
+    ojf->batch_bytes = 0;
+
+    for (int i = 0; i < ojf->qs.qnum; i++) {
+        ojf->qs.queue[i].release();
+    }
+}
+
+/*
+ * output_file_write() adds a record, which must remain in its queue
+ * until output_file_flush() is called, to the batch to be written to
+ * the output file
+ */
+static inline void output_file_write(struct output_file *ojf, const void *buf, size_t len) {
+    ojf->batch[ojf->batch_count].iov_base = (void *)buf;
+    ojf->batch[ojf->batch_count].iov_len = len;
+    ojf->batch_count++;
+    ojf->batch_bytes += len;
+    if (ojf->batch_count == OUTPUT_BATCH_RECORDS || ojf->batch_bytes >= OUTPUT_BATCH_BYTES) {
+        output_file_flush(ojf);
+    }
+}
+
+/*
+ * struct output_file_closing holds a file that has been rotated out,
+ * for output_file_close_func()
+ */
+struct output_file_closing {
+    FILE *file;
+    struct direct_writer *direct;
+};
+
+/*
+ * output_file_close_func() closes a file that has been rotated out,
+ * so that the output thread does not wait for its last buffers to be
+ * written
+ */
+static void *output_file_close_func(void *arg) {
+    struct output_file_closing *c = (struct output_file_closing *)arg;
+    if (c->direct) {
+        if (direct_writer_close(c->direct) != status_ok) {
+            fprintf(stderr, "error: could not close output file\n");
+        }
+    } else if (c->file) {
+        if (fclose(c->file) != 0) {
+            perror("could not close json file");
+        }
+    }
+    free(c);
+
+    return NULL;
+}
+
+/*
+ * output_file_close() writes out any records that are waiting to be
+ * written, and closes the output file, if it is open
+ */
+static void output_file_close(struct output_file *ojf) {
+    output_file_flush(ojf);
+    if (ojf->closer_running) {
+        pthread_join(ojf->closer, NULL);
+        ojf->closer_running = false;
+    }
+    if (ojf->stream) {
+        stream_writer_close(ojf->stream);
+        ojf->stream = nullptr;
+    } else if (ojf->gzip) {
+        if (gzip_writer_close(ojf->gzip) != status_ok) {
+            fprintf(stderr, "error: could not write compressed output file\n");
+        }
+        ojf->gzip = nullptr;
+    } else if (ojf->direct) {
+        if (direct_writer_close(ojf->direct) != status_ok) {
+            fprintf(stderr, "error: could not close output file\n");
+        }
+        ojf->direct = nullptr;
+    } else if (ojf->file) {
+        if (fclose(ojf->file) != 0) {
+            perror("could not close json file");
+        }
+    }
+    ojf->file = NULL;
+}
+
+/*
+ * output_file_close_in_background() writes out any records that are
+ * waiting to be written, and hands the output file, if it is open, to
+ * a thread that closes it; only one such thread runs at a time
+ */
+static void output_file_close_in_background(struct output_file *ojf) {
+    output_file_flush(ojf);
+    if (ojf->file == NULL && ojf->direct == nullptr) {
+        return;
+    }
+    if (ojf->closer_running) {
+        pthread_join(ojf->closer, NULL);
+        ojf->closer_running = false;
+    }
+    struct output_file_closing *c = (struct output_file_closing *)malloc(sizeof(struct output_file_closing));
+    if (c == NULL) {
+        output_file_close(ojf);
+        return;
+    }
+    c->file = ojf->file;
+    c->direct = ojf->direct;
+    if (pthread_create(&ojf->closer, NULL, output_file_close_func, c) != 0) {
+        free(c);
+        output_file_close(ojf);
+        return;
+    }
+    ojf->closer_running = true;
+    ojf->file = NULL;
+    ojf->direct = nullptr;
+}
+
+void thread_queues_init(struct thread_queues *tqs, int n, bool wakeups) {
     tqs->qnum = n;
-    tqs->queue = (struct ll_queue *)calloc(n, sizeof(struct ll_queue));
+    tqs->wakeup = 0;
+    tqs->queue = (struct ll_queue *)aligned_alloc(alignof(struct ll_queue), n * sizeof(struct ll_queue));
 
     if (tqs->queue == NULL) {
         fprintf(stderr, "Failed to allocate memory for thread queues\n");
         exit(255);
     }
+    memset(tqs->queue, 0, n * sizeof(struct ll_queue));
 
     for (int i = 0; i < n; i++) {
         tqs->queue[i].qnum = i; /* only needed for debug output */
-        tqs->queue[i].ridx = 0;
-        tqs->queue[i].widx = 0;
+        tqs->queue[i].wakeup = wakeups ? &tqs->wakeup : nullptr;
 
-        for (int j = 0; j < LLQ_DEPTH; j++) {
-            tqs->queue[i].msgs[j].used = 0;
+        /* the pages of each ring are first touched, and thus placed, by its writer */
+        tqs->queue[i].ring = (uint8_t *)aligned_alloc(LLQ_ALIGN, LLQ_RING_SIZE);
+        if (tqs->queue[i].ring == NULL) {
+            fprintf(stderr, "Failed to allocate memory for thread queues\n");
+            exit(255);
         }
     }
 }
 
 
 void thread_queues_free(struct thread_queues *tqs) {
+    for (int i = 0; i < tqs->qnum; i++) {
+        free(tqs->queue[i].ring);
+    }
     free(tqs->queue);
     tqs->queue = NULL;
     tqs->qnum = 0;
 }
 
 
+/*
+ * thread_queues_wait() is called by the reader when it cannot make
+ * progress until a writer publishes a message or advances its
+ * watermark, or nsec nanoseconds pass; it sleeps unless that has
+ * already happened since the reader last looked at the queues (see
+ * thread_queues_progress()), or *stop is set
+ */
+static void thread_queues_wait(struct thread_queues *tqs, long nsec, const int *stop) {
+    uint32_t val = __atomic_load_n(&tqs->wakeup, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < tqs->qnum; i++) {
+        __atomic_store_n(&tqs->queue[i].reader_waiting, 1, __ATOMIC_RELAXED);
+        tqs->queue[i].wake_writer();
+    }
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);  // set the flags before looking at the queues
+    for (int i = 0; i < tqs->qnum; i++) {
+        if (tqs->queue[i].progress() != tqs->queue[i].progress_seen) {
+            return;
+        }
+    }
+    if (__atomic_load_n(stop, __ATOMIC_ACQUIRE) == 0) {
+        llq_futex_wait(&tqs->wakeup, val, nsec);
+    }
+}
+
+/*
+ * thread_queues_progress() notes the progress of each writer, before
+ * the reader looks at the queues
+ */
+static void thread_queues_progress(struct thread_queues *tqs) {
+    for (int i = 0; i < tqs->qnum; i++) {
+        tqs->queue[i].progress_seen = tqs->queue[i].progress();
+    }
+}
+
+/*
+ * thread_queues_wake() wakes the reader, so that it sees a change
+ * other than new messages, such as a request to stop
+ */
+static void thread_queues_wake(struct thread_queues *tqs) {
+    __atomic_add_fetch(&tqs->wakeup, 1, __ATOMIC_RELEASE);
+    llq_futex_wake(&tqs->wakeup);
+}
+
 int time_less(struct timespec *tsl, struct timespec *tsr) {
 
     if ((tsl->tv_sec < tsr->tv_sec) || ((tsl->tv_sec == tsr->tv_sec) && (tsl->tv_nsec < tsr->tv_nsec))) {
@@ -59,31 +304,31 @@ int queue_less(int ql, int qr, struct tourn_tree *t_tree, const struct thread_qu
      *
      * WARNING: This function is NOT thread safe!
      *
-     * Meaning the access to the 'used' member in the queue
-     * struct happens and then later the access to the
-     * struct timespec happens.
+     * Meaning the head of each queue is looked up (which
+     * may advance the reader's position past a wrap marker)
+     * and then later the struct timespec is accessed.
      * This function must be called by the output thread
      * and ONLY the output thread because if
      * queues are changed while this function is going
      * shit will hit the fan!
      */
 
-    int ql_used = 0; /* The (l)eft queue in the tree */
-    int qr_used = 0; /* The (r)ight queue in the tree */
+    struct llq_msg *ql_msg = nullptr; /* The head of the (l)eft queue in the tree */
+    struct llq_msg *qr_msg = nullptr; /* The head of the (r)ight queue in the tree */
 
     /* check for a queue stall before we return anything otherwise
      * we could short-circuit logic before realizing one of the
      * queues was stalled
      */
     if ((ql >= 0) && (ql < tqs->qnum)) {
-        ql_used = tqs->queue[ql].msgs[tqs->queue[ql].ridx].used;
-        if (ql_used == 0) {
+        ql_msg = tqs->queue[ql].head();
+        if (ql_msg == nullptr) {
             t_tree->stalled = 1;
         }
     }
     if ((qr >= 0) && (qr < tqs->qnum)) {
-        qr_used = tqs->queue[qr].msgs[tqs->queue[qr].ridx].used;
-        if (qr_used == 0) {
+        qr_msg = tqs->queue[qr].head();
+        if (qr_msg == nullptr) {
             t_tree->stalled = 1;
         }
     }
@@ -118,16 +363,71 @@ int queue_less(int ql, int qr, struct tourn_tree *t_tree, const struct thread_qu
     }
 
     /* This is where we do the actual less comparison */
-    if (ql_used == 0) {
+    if (ql_msg == nullptr) {
         return 0;
-    } else if (qr_used == 0) {
+    } else if (qr_msg == nullptr) {
         return 1;
+    } else if (t_tree->sequenced) {
+        return ql_msg->seq < qr_msg->seq;
     } else {
-        struct timespec *tsl = &(tqs->queue[ql].msgs[tqs->queue[ql].ridx].ts);
-        struct timespec *tsr = &(tqs->queue[qr].msgs[tqs->queue[qr].ridx].ts);
+        return time_less(&ql_msg->ts, &qr_msg->ts);
+    }
+}
 
-        return time_less(tsl, tsr);
+/*
+ * seq_is_next() returns 1 if the message with sequence number seq at
+ * the head of queue wq can be written before anything that might yet
+ * arrive in the other queues, which is the case if each other queue
+ * either holds a message with a larger seq or has a watermark above
+ * seq, and 0 otherwise.  The watermark is read before the queue head,
+ * since a writer publishes messages before advancing its watermark.
+ */
+int seq_is_next(int wq, uint64_t seq, const struct thread_queues *tqs) {
+    for (int q = 0; q < tqs->qnum; q++) {
+        if (q == wq) {
+            continue;
+        }
+        struct ll_queue *llq = &tqs->queue[q];
+        uint64_t watermark = __atomic_load_n(&llq->watermark, __ATOMIC_ACQUIRE);
+        struct llq_msg *msg = llq->head();
+        if (msg) {
+            if (msg->seq < seq) {
+                return 0;
+            }
+        } else if (watermark <= seq) {
+            return 0;
+        }
     }
+    return 1;
+}
+
+
+/*
+ * time_is_next() returns 1 if the message with timestamp ts at the
+ * head of queue wq can be written before anything that might yet
+ * arrive in the other queues, which is the case if each other queue
+ * either holds a message that is not older or has a watermark at or
+ * above ts, and 0 otherwise; as with seq_is_next(), the watermark is
+ * read before the queue head.
+ */
+int time_is_next(int wq, struct timespec *ts, const struct thread_queues *tqs) {
+    uint64_t t = llq_time_watermark(ts);
+    for (int q = 0; q < tqs->qnum; q++) {
+        if (q == wq) {
+            continue;
+        }
+        struct ll_queue *llq = &tqs->queue[q];
+        uint64_t watermark = __atomic_load_n(&llq->watermark, __ATOMIC_ACQUIRE);
+        struct llq_msg *msg = llq->head();
+        if (msg) {
+            if (time_less(&msg->ts, ts)) {
+                return 0;
+            }
+        } else if (watermark < t) {
+            return 0;
+        }
+    }
+    return 1;
 }
 
 
@@ -217,7 +517,7 @@ void debug_print_tour_tree(struct tourn_tree *t_tree, const struct thread_queues
 
     fprintf(stderr, "Ready queues:\n");
     for (int q = 0; q < t_tree->qnum; q++) {
-        if (tqs->queue[q].msgs[tqs->queue[q].ridx].used == 1) {
+        if (tqs->queue[q].head() != nullptr) {
             fprintf(stderr, "%d ", q);
         }
     }
@@ -227,20 +527,61 @@ void debug_print_tour_tree(struct tourn_tree *t_tree, const struct thread_queues
 enum status output_file_rotate(struct output_file *ojf) {
     char outfile[FILENAME_MAX];
 
+    if (ojf->render_threads >= 0 && ojf->renderer == nullptr) {
+        ojf->renderer = json_renderer_create(ojf->render_threads);
+        if (ojf->renderer == nullptr) {
+            return status_err;
+        }
+    }
     if (ojf->type == file_type_stdout) {
         ojf->file = stdout;
         return status_ok;
     }
-
-    if (ojf->file) {
-        // printf("rotating output file\n");
-
-        if (fclose(ojf->file) != 0) {
-            perror("could not close json file");
+    if (ojf->type == file_type_stream) {
+        if (ojf->stream == nullptr) {
+            ojf->stream = stream_writer_open(ojf->outfile_name, ojf->stream_policy, ojf->verbose);
+            if (ojf->stream == nullptr) {
+                return status_err;
+            }
         }
+        return status_ok;  // streams are not rotated
     }
 
-    if (ojf->max_records) {
+    // printf("rotating output file\n");
+    if (ojf->gzip == nullptr) {
+        output_file_close_in_background(ojf);
+    } else {
+        output_file_flush(ojf);  // the gzip writer finishes the file in the background
+    }
+
+    if (ojf->thread_num >= 0) {
+        /*
+         * create filename <prefix>.<thread>.<seq>.<ext>, where prefix
+         * is the output file name without its extension, if it has ext
+         */
+        const char *ext = ojf->type == file_type_pcap ? "pcap" : (ojf->type == file_type_mbin ? "mbin" : "json");
+        size_t prefix_len = strlen(ojf->outfile_name);
+        size_t ext_len = strlen(ext);
+        const char *suffix = compress_format_suffix(ojf->compress_format);
+        size_t suffix_len = strlen(suffix);
+        if (ojf->compress_level && prefix_len > suffix_len + 1 && ojf->outfile_name[prefix_len - suffix_len - 1] == '.'
+            && strcmp(ojf->outfile_name + prefix_len - suffix_len, suffix) == 0) {
+            prefix_len -= suffix_len + 1;
+        }
+        if (prefix_len > ext_len + 1 && ojf->outfile_name[prefix_len - ext_len - 1] == '.'
+            && strcmp(ojf->outfile_name + prefix_len - ext_len, ext) == 0) {
+            prefix_len -= ext_len + 1;
+        }
+        int len = snprintf(outfile, FILENAME_MAX, "%.*s.%d.%u.%s", (int)prefix_len, ojf->outfile_name,
+                           ojf->thread_num, ojf->file_num++, ext);
+        if (len < 0 || len >= FILENAME_MAX) {
+            fprintf(stderr, "error: output file name %s is too long\n", ojf->outfile_name);
+            return status_err;
+        }
+        if (ojf->max_records == 0) {
+            ojf->max_records = UINT64_MAX;
+        }
+    } else if (ojf->max_records) {
         /*
          * create filename that includes sequence number and date/timestamp
          */
@@ -264,6 +605,48 @@ enum status output_file_rotate(struct output_file *ojf) {
         strncpy(outfile, ojf->outfile_name, FILENAME_MAX - 1);
     }
 
+    if (ojf->compress_level) {
+        const char *suffix = compress_format_suffix(ojf->compress_format);
+        size_t len = strlen(outfile);
+        size_t suffix_len = strlen(suffix);
+        if (len < suffix_len + 1 || outfile[len - suffix_len - 1] != '.' || strcmp(outfile + len - suffix_len, suffix) != 0) {
+            enum status status = filename_append(outfile, outfile, ".", suffix);
+            if (status) {
+                return status;
+            }
+        }
+        if (ojf->gzip) {
+            if (gzip_writer_rotate(ojf->gzip, outfile) != status_ok) {
+                return status_err;
+            }
+        } else {
+            ojf->gzip = gzip_writer_open(outfile, ojf->mode, ojf->compress_format, ojf->compress_level,
+                                         ojf->compress_threads, ojf->direct_io_depth);
+            if (ojf->gzip == nullptr) {
+                return status_err;
+            }
+        }
+        if (ojf->type == file_type_pcap) {
+            uint8_t hdr[64];
+            gzip_writer_write(ojf->gzip, hdr, pcap_file_header_to_buffer(hdr, sizeof(hdr)));
+        }
+        ojf->record_countdown = ojf->max_records;
+        return status_ok;
+    }
+
+    if (ojf->direct_io_depth) {
+        ojf->direct = direct_writer_open(outfile, ojf->mode, ojf->direct_io_depth);
+        if (ojf->direct == nullptr) {
+            return status_err;
+        }
+        if (ojf->type == file_type_pcap) {
+            uint8_t hdr[64];
+            direct_writer_write(ojf->direct, hdr, pcap_file_header_to_buffer(hdr, sizeof(hdr)));
+        }
+        ojf->record_countdown = ojf->max_records;
+        return status_ok;
+    }
+
     ojf->file = fopen(outfile, ojf->mode);
     if (ojf->file == NULL) {
         perror("error: could not open fingerprint output file");
@@ -282,6 +665,124 @@ enum status output_file_rotate(struct output_file *ojf) {
     return status_ok;
 }
 
+/*
+ * output_queue_thread_func() writes the messages of a single queue,
+ * in the order in which they were queued, to its own output file; it
+ * is run by one thread per queue with per-thread output
+ */
+static void *output_queue_thread_func(void *arg) {
+    struct output_file *out_ctx = (struct output_file *)arg;
+    struct ll_queue *llq = &out_ctx->qs.queue[0];
+    bool wakeups = llq->wakeup != nullptr;
+
+    if (output_file_rotate(out_ctx) != status_ok) {
+        exit(EXIT_FAILURE);
+    }
+
+    while (true) {
+        if (wakeups) {
+            thread_queues_progress(&out_ctx->qs);
+        }
+        struct llq_msg *msg;
+        while ((msg = llq->head()) != nullptr) {
+            output_file_write(out_ctx, msg->buf(), msg->len);
+            llq->pop();
+            if (output_file_needs_rotation(out_ctx)) {
+                output_file_rotate(out_ctx);
+            }
+        }
+        output_file_flush(out_ctx);
+
+        if (__atomic_load_n(&out_ctx->sig_stop_output, __ATOMIC_ACQUIRE) != 0 && llq->head() == nullptr) {
+            break;  // no more output is coming
+        }
+        if (wakeups) {
+            thread_queues_wait(&out_ctx->qs, LLQ_READ_WAIT_NSEC, &out_ctx->sig_stop_output);
+        } else {
+            struct timespec sleep_ts;
+            sleep_ts.tv_sec = 0;
+            sleep_ts.tv_nsec = 1000000;
+            nanosleep(&sleep_ts, NULL);
+        }
+    }
+    output_file_close(out_ctx);
+    if (out_ctx->renderer) {
+        json_renderer_destroy(out_ctx->renderer);
+        out_ctx->renderer = nullptr;
+    }
+
+    return NULL;
+}
+
+/*
+ * output_per_thread_init() sets up an output file for each queue,
+ * whose thread is woken by that queue's writer; it is called before
+ * the writers start, since they read the wakeup pointer without a fence
+ */
+static void output_per_thread_init(struct output_file *out_ctx) {
+    int n = out_ctx->qs.qnum;
+    out_ctx->thread_files = new struct output_file[n];
+    for (int i = 0; i < n; i++) {
+        struct output_file *t = &out_ctx->thread_files[i];
+        t->file = NULL;
+        t->record_countdown = 0;
+        t->max_records = out_ctx->max_records;
+        t->file_num = 0;
+        t->outfile_name = out_ctx->outfile_name;
+        t->mode = out_ctx->mode;
+        t->type = out_ctx->type;
+        t->direct_io_depth = out_ctx->direct_io_depth;
+        t->compress_level = out_ctx->compress_level;
+        t->compress_format = out_ctx->compress_format;
+        t->compress_threads = 1;  // each thread already has its own file
+        t->render_threads = out_ctx->render_threads >= 0 ? 0 : -1;  // and renders its own records
+        t->thread_num = i;
+        t->qs.qnum = 1;
+        t->qs.qidx = 0;
+        t->qs.queue = &out_ctx->qs.queue[i];
+        t->qs.wakeup = 0;
+        if (t->qs.queue->wakeup != nullptr) {
+            t->qs.queue->wakeup = &t->qs.wakeup;  // wake this queue's thread, not the parent
+        }
+    }
+}
+
+/*
+ * output_per_thread() runs a thread for each queue, each of which
+ * writes its own output file, until output is stopped
+ */
+static void output_per_thread(struct output_file *out_ctx) {
+    int n = out_ctx->qs.qnum;
+    struct output_file *threads = out_ctx->thread_files;
+    pthread_t *tids = new pthread_t[n];
+    for (int i = 0; i < n; i++) {
+        int err = pthread_create(&tids[i], NULL, output_queue_thread_func, &threads[i]);
+        if (err != 0) {
+            fprintf(stderr, "%s: error creating output thread\n", strerror(err));
+            exit(255);
+        }
+    }
+
+    /* output_thread_finalize() wakes this thread when it sets sig_stop_output */
+    while (true) {
+        uint32_t val = __atomic_load_n(&out_ctx->qs.wakeup, __ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&out_ctx->sig_stop_output, __ATOMIC_ACQUIRE) != 0) {
+            break;
+        }
+        llq_futex_wait(&out_ctx->qs.wakeup, val, 1000000000L);
+    }
+    for (int i = 0; i < n; i++) {
+        __atomic_store_n(&threads[i].sig_stop_output, 1, __ATOMIC_RELEASE);
+        thread_queues_wake(&threads[i].qs);
+    }
+    for (int i = 0; i < n; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    delete[] tids;
+    delete[] threads;
+    out_ctx->thread_files = nullptr;
+}
+
 void *output_thread_func(void *arg) {
 
     struct output_file *out_ctx = (struct output_file *)arg;
@@ -308,6 +809,10 @@ void *output_thread_func(void *arg) {
     // note: we wait until we get an output start condition before we
     // open any output files, so that drop_privileges() can be called
     // before file creation
+    if (out_ctx->thread_files) {
+        output_per_thread(out_ctx);
+        return NULL;
+    }
     enum status status = output_file_rotate(out_ctx);
     if (status != status_ok) {
         exit(EXIT_FAILURE);
@@ -340,13 +845,16 @@ void *output_thread_func(void *arg) {
      *
      * To avoid things getting out-of-order the output thread won't
      * run a tournament until either 1) all queues have a message in
-     * them, or 2) one of the queues has a message older than
-     * LLQ_MAX_AGE (5 seconds by default).
+     * them, or 2) each empty queue has a watermark at or past the
+     * winning message (see time_is_next()).  Each worker advances its
+     * watermark after each batch of packets, and an idle capture
+     * thread does so every LLQ_HEARTBEAT_MSEC, to the time before
+     * which it has no packets left to process; so the merge is held
+     * back by an idle thread for no longer than that, plus however
+     * long the capture engine holds packets before handing them over.
      *
-     * This means that as long as no queue pauses for more than 5
-     * seconds the k-way merge will be perfectly in-order.  If a queue
-     * does pause for more than 5 seconds only messages older than 5
-     * seconds will be flushed.
+     * Once output is stopped, every worker has finished, and whatever
+     * remains in the queues is written out in merged order.
      *
      * The other big assumption is that each lockless queue is in
      * perfect order.  Testing shows that rarely, packets can be
@@ -355,10 +863,16 @@ void *output_thread_func(void *arg) {
      * dependant, or ethernet card dependant.  The exact situations
      * where packets can be recieved out of cronological order aren't
      * known (to me anyways).
+     *
+     * When a single file is sharded across several threads, the
+     * output must be in the same order as the input, so messages are
+     * merged by their sequence number instead of by time, and each
+     * queue's watermark is a sequence number (see seq_is_next()).
      */
 
     struct tourn_tree t_tree;
     t_tree.qnum = out_ctx->qs.qnum;
+    t_tree.sequenced = out_ctx->sequenced;
     t_tree.qp2 = 2; /* This is the smallest power of 2 >= the number of queues */
     while (t_tree.qp2 < t_tree.qnum) {
         t_tree.qp2 *= 2;
@@ -372,9 +886,17 @@ void *output_thread_func(void *arg) {
         t_tree.tree[i] = -1;
     }
 
+    bool wakeups = out_ctx->qs.qnum > 0 && out_ctx->qs.queue[0].wakeup != nullptr;
     int all_output_flushed = 0;
     while (all_output_flushed == 0) {
 
+        if (wakeups) {
+            thread_queues_progress(&out_ctx->qs);
+        }
+
+        /* the workers have all finished before output is stopped */
+        bool stopping = __atomic_load_n(&out_ctx->sig_stop_output, __ATOMIC_ACQUIRE) != 0;
+
         /* Bring the tree up-to-date */
         t_tree.stalled = 0;
         run_tourn_for_entire_tree(&t_tree, &out_ctx->qs);
@@ -391,21 +913,18 @@ void *output_thread_func(void *arg) {
         while (t_tree.stalled == 0) {
             wq = t_tree.tree[0]; /* the root node is always the winning queue */
 
-            struct llq_msg *wmsg = &(out_ctx->qs.queue[wq].msgs[out_ctx->qs.queue[wq].ridx]);
-            if (wmsg->used == 1) {
-                fwrite(wmsg->buf, wmsg->len, 1, out_ctx->file);
+            struct llq_msg *wmsg = out_ctx->qs.queue[wq].head();
+            if (wmsg != nullptr) {
+                output_file_write(out_ctx, wmsg->buf(), wmsg->len);
 
-                /* A full memory barrier prevents the following flag (un)set from happening too soon */
-                __sync_synchronize();
-                wmsg->used = 0;
+                /* the message stays in the queue until the batch is written */
+                out_ctx->qs.queue[wq].pop();
 
                 /* Handle rotating file if needed */
                 if (output_file_needs_rotation(out_ctx)) {
                     output_file_rotate(out_ctx);
                 }
 
-                out_ctx->qs.queue[wq].ridx = (out_ctx->qs.queue[wq].ridx + 1) % LLQ_DEPTH;
-
                 run_tourn_for_queue(&t_tree, wq, &out_ctx->qs);
             }
             else {
@@ -414,75 +933,76 @@ void *output_thread_func(void *arg) {
 
         }
 
-        /* The tree is now stalled because a queue has been emptied
-         * Now we must remove messages as long as they are "too old"
+        /* The tree is now stalled because a queue has been emptied.
+         * This loop runs the tournament even though the tree is
+         * stalled, but only pulls messages out of queues that no
+         * other queue can precede, as told by their watermarks, or
+         * any message once output is stopped.
          */
-        struct timespec old_ts;
-        if (clock_gettime(CLOCK_REALTIME, &old_ts) != 0) {
-            perror("Unable to get current time");
-        }
-
-        /* This is the time we compare against to flush */
-        old_ts.tv_sec -= LLQ_MAX_AGE;
-
-        /* This loop runs the tournament even though the tree is stalled
-         * but only pull messages out of queues that are older than
-         * LLQ_MAX_AGE (currently set to 5 seconds).
-         */
-
         int old_done = 0;
         while (old_done == 0) {
             wq = t_tree.tree[0];
 
-            struct llq_msg *wmsg = &(out_ctx->qs.queue[wq].msgs[out_ctx->qs.queue[wq].ridx]);
-            if (wmsg->used == 0) {
+            struct llq_msg *wmsg = out_ctx->qs.queue[wq].head();
+            if (wmsg == nullptr) {
                 /* Even the top queue has nothing so we can just stop now */
                 old_done = 1;
 
                 /* This is how we detect no more output is coming */
-                if (out_ctx->sig_stop_output != 0) {
+                if (stopping) {
                     all_output_flushed = 1;
                 }
 
                 break;
-            } else if (time_less(&(wmsg->ts), &old_ts) == 1) {
+            } else if (stopping || (t_tree.sequenced ? seq_is_next(wq, wmsg->seq, &out_ctx->qs) : time_is_next(wq, &wmsg->ts, &out_ctx->qs))) {
                 //fprintf(stderr, "DEBUG: writing old message from queue %d\n", wq);
-                fwrite(wmsg->buf, wmsg->len, 1, out_ctx->file);
+                output_file_write(out_ctx, wmsg->buf(), wmsg->len);
 
-                /* A full memory barrier prevents the following flag (un)set from happening too soon */
-                __sync_synchronize();
-                wmsg->used = 0;
+                /* the message stays in the queue until the batch is written */
+                out_ctx->qs.queue[wq].pop();
 
                 /* Handle rotating file if needed */
                 if (output_file_needs_rotation(out_ctx)) {
                     output_file_rotate(out_ctx);
                 }
 
-                out_ctx->qs.queue[wq].ridx = (out_ctx->qs.queue[wq].ridx + 1) % LLQ_DEPTH;
-
                 run_tourn_for_queue(&t_tree, wq, &out_ctx->qs);
             } else {
                 old_done = 1;
             }
         }
 
+        /* The batch is written out whenever the merge stalls, so
+         * that no record waits for more than one pass
+         */
+        output_file_flush(out_ctx);
+
+        if (all_output_flushed) {
+            break;
+        }
+
         /* This sleep slows us down so we don't spin the CPU.
-         * We probably could afford to call fflush() here
-         * the first time instead of sleeping and only sleep
-         * if we really aren't recieving any messages on
-         * any queues.
+         * With wakeups, we instead sleep until a writer publishes a
+         * message or advances its watermark; otherwise we sleep for a
+         * millisecond and poll again.
          */
-        struct timespec sleep_ts;
-        sleep_ts.tv_sec = 0;
-        sleep_ts.tv_nsec = 1000000;
-        nanosleep(&sleep_ts, NULL);
+        if (wakeups) {
+            thread_queues_wait(&out_ctx->qs, LLQ_READ_WAIT_NSEC, &out_ctx->sig_stop_output);
+        } else {
+            struct timespec sleep_ts;
+            sleep_ts.tv_sec = 0;
+            sleep_ts.tv_nsec = 1000000;
+            nanosleep(&sleep_ts, NULL);
+        }
     } /* End all_output_flushed == 0 meaning we got a signal to stop */
 
     if (t_tree.tree) {
         free(t_tree.tree);
     }
-    if (fclose(out_ctx->file) != 0) {
-        perror("could not close json file");
+    output_file_close(out_ctx);
+    if (out_ctx->renderer) {
+        json_renderer_destroy(out_ctx->renderer);
+        out_ctx->renderer = nullptr;
     }
 
     return NULL;
@@ -492,7 +1012,7 @@ void *output_thread_func(void *arg) {
 int output_thread_init(pthread_t &output_thread, struct output_file &out_ctx, const struct mercury_config &cfg) {
 
     /* make the thread queues */
-    thread_queues_init(&out_ctx.qs, cfg.num_threads);
+    thread_queues_init(&out_ctx.qs, cfg.num_threads, cfg.output_wakeup == output_wakeup_event);
 
     /* init the output context */
     if (pthread_cond_init(&(out_ctx.t_output_c), NULL) != 0) {
@@ -510,15 +1030,28 @@ int output_thread_init(pthread_t &output_thread, struct output_file &out_ctx, co
     out_ctx.record_countdown = 0;
     if (cfg.fingerprint_filename) {
         out_ctx.outfile_name = cfg.fingerprint_filename;
-        out_ctx.type = file_type_json;
+        out_ctx.type = cfg.binary_output ? file_type_mbin : file_type_json;
     } else if (cfg.write_filename) {
         out_ctx.outfile_name = cfg.write_filename;
         out_ctx.type = file_type_pcap;
+    } else if (cfg.stream_path) {
+        out_ctx.outfile_name = cfg.stream_path;
+        out_ctx.type = file_type_stream;
+        out_ctx.stream_policy = cfg.stream_policy;
+        out_ctx.verbose = cfg.verbosity;
     } else {
         out_ctx.type = file_type_stdout;  // default output type
     }
     out_ctx.file_num = 0;
     out_ctx.mode = cfg.mode;
+    out_ctx.direct_io_depth = cfg.direct_io_depth;
+    out_ctx.direct = nullptr;
+    out_ctx.compress_level = cfg.compress_level;
+    out_ctx.compress_format = cfg.compress_format;
+    out_ctx.render_threads = cfg.deferred_json_threads;
+    if (cfg.per_thread_output) {
+        output_per_thread_init(&out_ctx);
+    }
 
     //fprintf(stderr, "DEBUG: fingerprint filename: %s\n", cfg.fingerprint_filename);
     //fprintf(stderr, "DEBUG: max records: %ld\n", out_ctx.out_jf.max_records);
@@ -532,8 +1065,32 @@ int output_thread_init(pthread_t &output_thread, struct output_file &out_ctx, co
     return 0;
 }
 
+void output_thread_start(struct output_file *out_file) {
+    /*
+     * t_output_p is set with the mutex held, so that the broadcast
+     * can't fall between the output thread's check of it and its wait
+     */
+    int err = pthread_mutex_lock(&(out_file->t_output_m));
+    if (err != 0) {
+        fprintf(stderr, "%s: error locking output start mutex\n", strerror(err));
+        exit(255);
+    }
+    out_file->t_output_p = 1;
+    err = pthread_cond_broadcast(&(out_file->t_output_c)); /* Wake up output */
+    if (err != 0) {
+        printf("%s: error broadcasting all clear on output start condition\n", strerror(err));
+        exit(255);
+    }
+    err = pthread_mutex_unlock(&(out_file->t_output_m));
+    if (err != 0) {
+        fprintf(stderr, "%s: error unlocking output start mutex\n", strerror(err));
+        exit(255);
+    }
+}
+
 void output_thread_finalize(pthread_t output_thread, struct output_file *out_file) {
-    out_file->sig_stop_output = 1;
+    __atomic_store_n(&out_file->sig_stop_output, 1, __ATOMIC_RELEASE);
+    thread_queues_wake(&out_file->qs);
     pthread_join(output_thread, NULL);
     thread_queues_free(&out_file->qs);
 }
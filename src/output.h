@@ -9,14 +9,24 @@
 #define OUTPUT_H
 
 #include <pthread.h>
+#include <sys/uio.h>
 #include "mercury.h"
 #include "llq.h"
+#include "direct_io.h"
+#include "gzip_io.h"
+#include "stream_io.h"
+#include "deferred_json.h"
+
+#define OUTPUT_BATCH_RECORDS 256         /* most records gathered into one write */
+#define OUTPUT_BATCH_BYTES   (1 << 20)   /* most bytes gathered into one write   */
 
 enum file_type {
    file_type_unknown=0,
    file_type_json,
    file_type_pcap,
-   file_type_stdout
+   file_type_mbin,
+   file_type_stdout,
+   file_type_stream
 };
 
 struct output_file {
@@ -32,12 +42,46 @@ struct output_file {
     pthread_mutex_t t_output_m;
     struct thread_queues qs;
     int sig_stop_output = 0;
+    bool sequenced = false;  /* set before output starts to merge by sequence number */
+    unsigned int direct_io_depth = 0;  /* write through a direct_writer, if nonzero */
+    struct direct_writer *direct = nullptr;
+    int compress_level = 0;   /* compression level of the output, or 0 for none */
+    enum compress_format compress_format = compress_format_gzip;
+    unsigned int compress_threads = GZIP_DEFAULT_THREADS;
+    struct gzip_writer *gzip = nullptr;
+    enum stream_policy stream_policy = stream_policy_drop_oldest;
+    struct stream_writer *stream = nullptr;  /* streams to outfile_name, if file_type_stream */
+    bool verbose = false;
+    int render_threads = -1;  /* formatter threads that render binary records as JSON, or -1 for none */
+    struct json_renderer *renderer = nullptr;
+    pthread_t closer;         /* closes a file that has been rotated out */
+    bool closer_running = false;
+    struct output_file *thread_files = nullptr;  /* one per queue, written unmerged, if not nullptr */
+    int thread_num = -1;      /* the queue written to this file, if it is one of thread_files */
+    struct iovec batch[OUTPUT_BATCH_RECORDS];  /* records consumed from qs, not yet written */
+    int batch_count = 0;
+    size_t batch_bytes = 0;
 };
 
+/*
+ * thread_queues_init() allocates n queues; if wakeups is true, the
+ * reader and any blocking writers sleep until woken by each other (see
+ * ll_queue), rather than polling
+ */
+void thread_queues_init(struct thread_queues *tqs, int n, bool wakeups);
+
+void thread_queues_free(struct thread_queues *tqs);
+
 void *output_thread_func(void *arg);
 
 int output_thread_init(pthread_t &output_thread, struct output_file &out_ctx, const struct mercury_config &cfg);
 
+/*
+ * output_thread_start() wakes up the output thread, so that it opens
+ * its output file and starts polling the queues for data
+ */
+void output_thread_start(struct output_file *out_file);
+
 void output_thread_finalize(pthread_t output_thread, struct output_file *out_file);
 
 char *stdout_string();
@@ -2,7 +2,7 @@
  * pcap_file_io.c
  *
  * functions for reading and writing packets using the (old) libpcap
- * file format
+ * file format, and for reading packets in the pcapng format
  * 
  * Copyright (c) 2019 Cisco Systems, Inc. All rights reserved.  License at 
  * https://github.com/cisco/mercury/blob/master/LICENSE 
@@ -18,10 +18,19 @@
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <errno.h>
+#include <pthread.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LZ4
+#include <lz4frame.h>
+#endif
 
 #include "mercury.h"
 #include "pcap_file_io.h"
@@ -43,6 +52,21 @@ enum linktype {
 static uint32_t magic = 0xa1b2c3d4;
 static uint32_t cagim = 0xd4c3b2a1;
 
+/*
+ * pcapng block types and constants; the section header block type is
+ * the same in either byte order, and the byte-order magic in its body
+ * determines the byte order of the section
+ */
+enum pcapng_block_type {
+    PCAPNG_SECTION_HEADER   = 0x0a0d0d0a,
+    PCAPNG_INTERFACE_DESC   = 0x00000001,
+    PCAPNG_SIMPLE_PACKET    = 0x00000003,
+    PCAPNG_ENHANCED_PACKET  = 0x00000006
+};
+static uint32_t pcapng_byte_order_magic = 0x1a2b3c4d;
+#define PCAPNG_OPT_ENDOFOPT  0
+#define PCAPNG_OPT_IF_TSRESOL 9
+
 /*
  * global pcap header (one per file, at beginning)
  */
@@ -74,6 +98,7 @@ struct pcap_packet_hdr {
    #define STREAM_BUFFER_SIZE FBUFSIZE
 #endif
 #define PRE_ALLOCATE_DISK_SPACE  (100 * ONE_MB)
+#define MAP_READAHEAD            (64 * ONE_MB)
 
 static inline void set_file_io_buffer(struct pcap_file *f, const char *fname) {
     f->buffer = (unsigned char *) malloc(STREAM_BUFFER_SIZE);
@@ -90,15 +115,568 @@ static inline void set_file_io_buffer(struct pcap_file *f, const char *fname) {
     }
 }
 
+/*
+ * pcap_file_map_readahead() asks the kernel to start reading the
+ * MAP_READAHEAD bytes of a mapped file that follow the current
+ * offset, so that page faults are rarely taken on data that is not
+ * yet in the page cache; it is invoked every MAP_READAHEAD/2 bytes
+ */
+static void pcap_file_map_readahead(struct pcap_file *f) {
+    if (f->stream) {
+        return;  // the mapping holds compressed data, which is read sequentially
+    }
+    static const size_t page_mask = sysconf(_SC_PAGESIZE) - 1;
+    size_t start = f->map_advised & ~page_mask;
+    size_t end = f->map_offset + MAP_READAHEAD;
+    if (end > f->map_len) {
+        end = f->map_len;
+    }
+    if (end > start) {
+        madvise((void *)(f->map + start), end - start, MADV_WILLNEED);
+    }
+    f->map_advised = end;
+}
+
+/*
+ * pcap_file_map() maps a regular file that has been opened for
+ * reading; if that is not possible, f->map is left NULL and the file
+ * is read through stdio instead
+ */
+static void pcap_file_map(struct pcap_file *f) {
+    struct stat st;
+    if (fstat(f->fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size < (off_t)sizeof(struct pcap_file_hdr)) {
+        return;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, f->fd, 0);
+    if (map == MAP_FAILED) {
+        return;
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+    /* this only takes effect if the kernel supports huge pages in the page cache */
+    madvise(map, st.st_size, MADV_HUGEPAGE);
+#endif
+    f->map = (const uint8_t *)map;
+    f->map_len = st.st_size;
+    f->map_offset = 0;
+    f->map_advised = 0;
+    pcap_file_map_readahead(f);
+}
+
+/*
+ * compressed input
+ *
+ * A file that is compressed with gzip, or with zstd or lz4 if this
+ * build has those libraries, is decompressed by a separate thread
+ * into two buffers, which it fills alternately while the reader
+ * consumes the other one.  The buffer being read takes the place of
+ * the file mapping (f->map, f->map_len, and f->map_offset), so that
+ * packets are read from it by the same code that reads mapped files.
+ * Each buffer is preceded by a carry region; when a record is split
+ * across the end of a buffer, its first part is copied into the carry
+ * region of the next buffer, so that every record is contiguous in
+ * memory.  Records are valid only until the next one is read, as the
+ * buffer holding them is then handed back to be refilled.
+ */
+#define STREAM_CARRY  (1 * ONE_MB)   /* largest record that can span two buffers */
+#define STREAM_DATA   (8 * ONE_MB)   /* decompressed data per buffer              */
+#define STREAM_INPUT  (1 * ONE_MB)   /* compressed data per read                  */
+
+enum pcap_stream_format {
+    stream_format_gzip,
+    stream_format_zstd,
+    stream_format_lz4
+};
+
+/*
+ * the result of a decoding step: progress was made (decode_ok), a
+ * gzip member or a zstd or lz4 frame ended (decode_end), or the input
+ * could not be decoded (decode_error)
+ */
+enum pcap_stream_decode_result {
+    decode_ok,
+    decode_end,
+    decode_error
+};
+
+struct pcap_stream_buffer {
+    uint8_t *data;         /* STREAM_CARRY bytes, then STREAM_DATA bytes   */
+    size_t len;            /* bytes of decompressed data after the carry   */
+    bool last;             /* no data follows this buffer                  */
+    bool full;             /* owned by the reader, rather than the inflater */
+};
+
+struct pcap_stream {
+    FILE *in;              /* compressed input, if it is not mapped        */
+    const uint8_t *in_map; /* mapping of the compressed input, or NULL     */
+    size_t in_len;         /* length of in_map                             */
+    size_t in_offset;      /* offset of the next unread byte of in_map     */
+    uint8_t *input;        /* buffer for compressed input read from in     */
+    const uint8_t *next_in; /* next compressed byte to be decoded          */
+    size_t avail_in;       /* compressed bytes at next_in                  */
+    enum pcap_stream_format format;
+    z_stream z;
+#ifdef HAVE_ZSTD
+    ZSTD_DCtx *zstd;
+#endif
+#ifdef HAVE_LZ4
+    LZ4F_dctx *lz4;
+#endif
+    const char *error;     /* reason that decoding failed                  */
+    bool member_end;       /* the last member or frame read was complete   */
+    struct pcap_stream_buffer buf[2];
+    int cur;               /* buffer holding the window, if holding        */
+    bool holding;          /* the reader holds buf[cur]                    */
+    bool eof;              /* the reader holds the last buffer             */
+    bool stop;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+/*
+ * pcap_stream_read() sets the input of the decompressor to the next
+ * part of the compressed file, and returns false if there is none
+ */
+static bool pcap_stream_read(struct pcap_stream *s) {
+    size_t n;
+    if (s->in_map) {
+        n = s->in_len - s->in_offset;
+        if (n > STREAM_INPUT) {
+            n = STREAM_INPUT;
+        }
+        s->next_in = s->in_map + s->in_offset;
+        s->in_offset += n;
+    } else {
+        n = fread(s->input, 1, STREAM_INPUT, s->in);
+        s->next_in = s->input;
+    }
+    s->avail_in = n;
+    return n > 0;
+}
+
+/*
+ * pcap_stream_decode() decodes compressed input into the avail_out
+ * bytes at next_out, and advances both the input and the output past
+ * the bytes that it consumed and produced
+ */
+static enum pcap_stream_decode_result pcap_stream_decode(struct pcap_stream *s, uint8_t **next_out, size_t *avail_out) {
+    switch (s->format) {
+    case stream_format_gzip: {
+        s->z.next_in = (Bytef *)s->next_in;
+        s->z.avail_in = s->avail_in;
+        s->z.next_out = *next_out;
+        s->z.avail_out = *avail_out;
+        int ret = inflate(&s->z, Z_NO_FLUSH);
+        s->next_in = s->z.next_in;
+        s->avail_in = s->z.avail_in;
+        *next_out = s->z.next_out;
+        *avail_out = s->z.avail_out;
+        if (ret == Z_STREAM_END) {
+            inflateReset(&s->z);
+            return decode_end;
+        }
+        if (ret == Z_OK || ret == Z_BUF_ERROR) {
+            return decode_ok;
+        }
+        s->error = s->z.msg ? s->z.msg : "zlib error";
+        return decode_error;
+    }
+#ifdef HAVE_ZSTD
+    case stream_format_zstd: {
+        ZSTD_inBuffer in = { s->next_in, s->avail_in, 0 };
+        ZSTD_outBuffer out = { *next_out, *avail_out, 0 };
+        size_t ret = ZSTD_decompressStream(s->zstd, &out, &in);
+        s->next_in += in.pos;
+        s->avail_in -= in.pos;
+        *next_out += out.pos;
+        *avail_out -= out.pos;
+        if (ZSTD_isError(ret)) {
+            s->error = ZSTD_getErrorName(ret);
+            return decode_error;
+        }
+        return ret == 0 ? decode_end : decode_ok;  // zero: a frame is complete
+    }
+#endif
+#ifdef HAVE_LZ4
+    case stream_format_lz4: {
+        size_t in_len = s->avail_in;
+        size_t out_len = *avail_out;
+        size_t ret = LZ4F_decompress(s->lz4, *next_out, &out_len, s->next_in, &in_len, NULL);
+        s->next_in += in_len;
+        s->avail_in -= in_len;
+        *next_out += out_len;
+        *avail_out -= out_len;
+        if (LZ4F_isError(ret)) {
+            s->error = LZ4F_getErrorName(ret);
+            return decode_error;
+        }
+        return ret == 0 ? decode_end : decode_ok;  // zero: a frame is complete
+    }
+#endif
+    default:
+        s->error = "unsupported compression format";
+        return decode_error;
+    }
+}
+
+/*
+ * pcap_stream_fill() decompresses data into b until it is full or
+ * the input ends; concatenated gzip members, and concatenated zstd or
+ * lz4 frames, are read as one stream
+ */
+static void pcap_stream_fill(struct pcap_stream *s, struct pcap_stream_buffer *b) {
+    uint8_t *next_out = b->data + STREAM_CARRY;
+    size_t avail_out = STREAM_DATA;
+    b->last = false;
+    while (avail_out > 0) {
+        if (s->avail_in == 0 && !pcap_stream_read(s)) {
+            if (!s->member_end) {
+                fprintf(stderr, "warning: compressed input is truncated\n");
+            }
+            b->last = true;
+            break;
+        }
+        enum pcap_stream_decode_result ret = pcap_stream_decode(s, &next_out, &avail_out);
+        if (ret == decode_end) {
+            s->member_end = true;
+        } else if (ret == decode_ok) {
+            s->member_end = false;
+        } else {
+            if (s->member_end) {
+                fprintf(stderr, "warning: ignoring data that follows the compressed input\n");
+            } else {
+                fprintf(stderr, "error: could not decompress input (%s)\n", s->error);
+            }
+            b->last = true;
+            break;
+        }
+    }
+    b->len = STREAM_DATA - avail_out;
+}
+
+/*
+ * pcap_stream_decoder_init() creates the decoder for the format of s,
+ * and returns false if it cannot; pcap_stream_decoder_reset() returns
+ * it to the start of a stream, and pcap_stream_decoder_free() frees it
+ */
+static bool pcap_stream_decoder_init(struct pcap_stream *s) {
+    switch (s->format) {
+    case stream_format_gzip:
+        return inflateInit2(&s->z, 15 + 32) == Z_OK;  // 15 + 32: gzip or zlib header, detected automatically
+#ifdef HAVE_ZSTD
+    case stream_format_zstd:
+        s->zstd = ZSTD_createDCtx();
+        return s->zstd != NULL;
+#endif
+#ifdef HAVE_LZ4
+    case stream_format_lz4:
+        return !LZ4F_isError(LZ4F_createDecompressionContext(&s->lz4, LZ4F_VERSION));
+#endif
+    default:
+        return false;
+    }
+}
+
+static void pcap_stream_decoder_reset(struct pcap_stream *s) {
+    switch (s->format) {
+    case stream_format_gzip:
+        inflateReset(&s->z);
+        break;
+#ifdef HAVE_ZSTD
+    case stream_format_zstd:
+        ZSTD_DCtx_reset(s->zstd, ZSTD_reset_session_only);
+        break;
+#endif
+#ifdef HAVE_LZ4
+    case stream_format_lz4:
+        LZ4F_resetDecompressionContext(s->lz4);
+        break;
+#endif
+    default:
+        break;
+    }
+}
+
+static void pcap_stream_decoder_free(struct pcap_stream *s) {
+    switch (s->format) {
+    case stream_format_gzip:
+        inflateEnd(&s->z);
+        break;
+#ifdef HAVE_ZSTD
+    case stream_format_zstd:
+        ZSTD_freeDCtx(s->zstd);
+        break;
+#endif
+#ifdef HAVE_LZ4
+    case stream_format_lz4:
+        LZ4F_freeDecompressionContext(s->lz4);
+        break;
+#endif
+    default:
+        break;
+    }
+}
+
+static void *pcap_stream_inflater(void *arg) {
+    struct pcap_stream *s = (struct pcap_stream *)arg;
+
+    for (int i = 0; ; i ^= 1) {
+        pthread_mutex_lock(&s->lock);
+        while (s->buf[i].full && !s->stop) {
+            pthread_cond_wait(&s->cond, &s->lock);
+        }
+        bool stop = s->stop;
+        pthread_mutex_unlock(&s->lock);
+        if (stop) {
+            break;
+        }
+
+        pcap_stream_fill(s, &s->buf[i]);
+
+        pthread_mutex_lock(&s->lock);
+        s->buf[i].full = true;
+        pthread_cond_broadcast(&s->cond);
+        pthread_mutex_unlock(&s->lock);
+        if (s->buf[i].last) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * pcap_stream_start() starts decompression at the beginning of the
+ * input, with the window of f empty
+ */
+static enum status pcap_stream_start(struct pcap_file *f) {
+    struct pcap_stream *s = f->stream;
+    for (int i = 0; i < 2; i++) {
+        s->buf[i].len = 0;
+        s->buf[i].last = false;
+        s->buf[i].full = false;
+    }
+    s->cur = 1;
+    s->holding = false;
+    s->eof = false;
+    s->stop = false;
+    f->map = s->buf[s->cur].data;
+    f->map_len = f->map_offset = STREAM_CARRY;
+
+    int err = pthread_create(&s->thread, NULL, pcap_stream_inflater, s);
+    if (err != 0) {
+        fprintf(stderr, "%s: error creating decompression thread\n", strerror(err));
+        return status_err;
+    }
+    return status_ok;
+}
+
+static void pcap_stream_stop(struct pcap_stream *s) {
+    pthread_mutex_lock(&s->lock);
+    s->stop = true;
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+    pthread_join(s->thread, NULL);
+}
+
+static void pcap_stream_free(struct pcap_stream *s) {
+    pcap_stream_decoder_free(s);
+    for (int i = 0; i < 2; i++) {
+        free(s->buf[i].data);
+    }
+    if (s->in_map) {
+        munmap((void *)s->in_map, s->in_len);
+    }
+    free(s->input);
+    pthread_mutex_destroy(&s->lock);
+    pthread_cond_destroy(&s->cond);
+    free(s);
+}
+
+/*
+ * pcap_stream_open() starts the decompression of the file f, which is
+ * compressed in the given format; if f is mapped, the mapping is read
+ * by the decompressor, and otherwise the file is read through stdio,
+ * after the seed_len bytes in seed that have already been read from it
+ */
+static enum status pcap_stream_open(struct pcap_file *f, enum pcap_stream_format format, const uint8_t *seed, size_t seed_len) {
+    struct pcap_stream *s = (struct pcap_stream *)calloc(1, sizeof(struct pcap_stream));
+    if (s == NULL) {
+        fprintf(stderr, "error: could not allocate decompression state\n");
+        return status_err;
+    }
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->cond, NULL);
+    s->format = format;
+    if (!pcap_stream_decoder_init(s)) {
+        fprintf(stderr, "error: could not initialize decompressor\n");
+        free(s);
+        return status_err;
+    }
+    f->stream = s;
+
+    if (f->map) {
+        s->in_map = f->map;
+        s->in_len = f->map_len;
+    } else {
+        s->in = f->file_ptr;
+        s->input = (uint8_t *)malloc(STREAM_INPUT);
+        if (s->input == NULL) {
+            fprintf(stderr, "error: could not allocate decompression buffer\n");
+            return status_err;
+        }
+        memcpy(s->input, seed, seed_len);
+        s->next_in = s->input;
+        s->avail_in = seed_len;
+    }
+    for (int i = 0; i < 2; i++) {
+        s->buf[i].data = (uint8_t *)malloc(STREAM_CARRY + STREAM_DATA);
+        if (s->buf[i].data == NULL) {
+            fprintf(stderr, "error: could not allocate decompression buffer\n");
+            return status_err;
+        }
+    }
+    return pcap_stream_start(f);
+}
+
+/*
+ * pcap_stream_rewind() restarts the decompression of f from the
+ * beginning of the file, which is not possible for standard input
+ */
+static enum status pcap_stream_rewind(struct pcap_file *f) {
+    struct pcap_stream *s = f->stream;
+    pcap_stream_stop(s);
+    if (s->in_map) {
+        s->in_offset = 0;
+    } else if (fseek(s->in, 0, SEEK_SET) != 0) {
+        perror("error: could not rewind compressed file");
+        return status_err;
+    }
+    pcap_stream_decoder_reset(s);
+    s->avail_in = 0;
+    s->member_end = false;
+    return pcap_stream_start(f);
+}
+
+/*
+ * pcap_stream_refill() moves the window of f to the next buffer of
+ * decompressed data, carrying over the unread part of the current one,
+ * and returns true if at least len bytes follow the current offset
+ */
+static bool pcap_stream_refill(struct pcap_file *f, size_t len) {
+    struct pcap_stream *s = f->stream;
+    size_t leftover = f->map_len - f->map_offset;
+    if (s->eof) {
+        return false;
+    }
+    if (len > STREAM_CARRY) {
+        fprintf(stderr, "error: record of length %zu is too long to be decompressed\n", len);
+        return false;
+    }
+
+    int next = s->cur ^ 1;
+    pthread_mutex_lock(&s->lock);
+    while (!s->buf[next].full) {
+        pthread_cond_wait(&s->cond, &s->lock);
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    uint8_t *data = s->buf[next].data;
+    memcpy(data + STREAM_CARRY - leftover, f->map + f->map_offset, leftover);
+    if (s->holding) {
+        pthread_mutex_lock(&s->lock);
+        s->buf[s->cur].full = false;
+        pthread_cond_broadcast(&s->cond);
+        pthread_mutex_unlock(&s->lock);
+    }
+    s->cur = next;
+    s->holding = true;
+    s->eof = s->buf[next].last;
+    f->map = data;
+    f->map_offset = STREAM_CARRY - leftover;
+    f->map_len = STREAM_CARRY + s->buf[next].len;
+    return f->map_len - f->map_offset >= len;
+}
+
+/*
+ * pcap_file_window() returns true if at least len bytes follow the
+ * current offset of a mapped file; for a compressed file, the window
+ * onto the decompressed data is advanced if needed
+ */
+static inline bool pcap_file_window(struct pcap_file *f, size_t len) {
+    return f->map_len - f->map_offset >= len || (f->stream && pcap_stream_refill(f, len));
+}
+
+/*
+ * compression formats are identified by the magic numbers at the
+ * start of a file; zstd and lz4 can only be read if this build has
+ * their libraries, which configure detects
+ */
+static const uint8_t gzip_magic[] = { 0x1f, 0x8b };
+static const uint8_t zstd_magic[] = { 0x28, 0xb5, 0x2f, 0xfd };
+static const uint8_t lz4_magic[]  = { 0x04, 0x22, 0x4d, 0x18 };
+
+/*
+ * pcap_stream_format_detect() sets format to the compression format
+ * of a file that starts with the bytes h, and returns false if it is
+ * not compressed
+ */
+static bool pcap_stream_format_detect(const uint8_t *h, enum pcap_stream_format *format) {
+    if (memcmp(h, gzip_magic, sizeof(gzip_magic)) == 0) {
+        *format = stream_format_gzip;
+    } else if (memcmp(h, zstd_magic, sizeof(zstd_magic)) == 0) {
+        *format = stream_format_zstd;
+    } else if (memcmp(h, lz4_magic, sizeof(lz4_magic)) == 0) {
+        *format = stream_format_lz4;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+static bool pcap_stream_format_is_supported(enum pcap_stream_format format) {
+    switch (format) {
+    case stream_format_gzip:
+        return true;
+    case stream_format_zstd:
+#ifdef HAVE_ZSTD
+        return true;
+#else
+        return false;
+#endif
+    case stream_format_lz4:
+#ifdef HAVE_LZ4
+        return true;
+#else
+        return false;
+#endif
+    }
+    return false;
+}
+
+static void pcap_file_hdr_init(struct pcap_file_hdr *file_header) {
+    file_header->magic_number = magic;
+    file_header->version_major = 2;
+    file_header->version_minor = 4;
+    file_header->thiszone = 0;     /* no GMT correction for now */
+    file_header->sigfigs = 0;      /* we don't claim sigfigs for now */
+    file_header->snaplen = 65535;
+    file_header->network = LINKTYPE_ETHERNET;
+}
+
+size_t pcap_file_header_to_buffer(void *buf, size_t len) {
+    struct pcap_file_hdr file_header;
+    if (len < sizeof(file_header)) {
+        return 0;
+    }
+    pcap_file_hdr_init(&file_header);
+    memcpy(buf, &file_header, sizeof(file_header));
+    return sizeof(file_header);
+}
+
 enum status write_pcap_file_header(FILE *f) {
     struct pcap_file_hdr file_header;
-    file_header.magic_number = magic;
-    file_header.version_major = 2;
-    file_header.version_minor = 4;
-    file_header.thiszone = 0;     /* no GMT correction for now */
-    file_header.sigfigs = 0;      /* we don't claim sigfigs for now */
-    file_header.snaplen = 65535;
-    file_header.network = LINKTYPE_ETHERNET;
+    pcap_file_hdr_init(&file_header);
 
     size_t items_written = fwrite(&file_header, sizeof(file_header), 1, f);
     if (items_written == 0) {
@@ -108,6 +686,295 @@ enum status write_pcap_file_header(FILE *f) {
     return status_ok;
 }
 
+enum status advance(FILE *f, size_t length) {
+    if (f == stdin) {
+        uint8_t tmp[4096];
+        while (length > 0) {
+            size_t n = length < sizeof(tmp) ? length : sizeof(tmp);
+            if (fread(tmp, 1, n, f) != n) {
+                return status_err;
+            }
+            length -= n;
+        }
+    } else {
+        if (fseek(f, length, SEEK_CUR) != 0) {
+            perror("error: could not advance file pointer\n");
+            return status_err;
+        }
+    }
+    return status_ok;
+}
+
+/*
+ * pcapng support
+ *
+ * A pcapng file is a sequence of sections, each of which starts with
+ * a section header block (SHB) that sets the byte order of that
+ * section, followed by interface description blocks (IDBs) and packet
+ * blocks.  Enhanced packet blocks (EPBs) refer to an interface, whose
+ * if_tsresol option sets the units of their 64-bit timestamps; simple
+ * packet blocks (SPBs) belong to the first interface, and have no
+ * timestamp, so they are given the timestamp of the previous packet.
+ * Other blocks are skipped.  Blocks are read directly from the mapping
+ * of a mapped file, and otherwise into f->block.
+ */
+
+static inline uint32_t pcapng_u32(const struct pcap_file *f, const uint8_t *p) {
+    uint32_t x;
+    memcpy(&x, p, sizeof(x));
+    return f->byteswap ? __builtin_bswap32(x) : x;
+}
+
+static inline uint16_t pcapng_u16(const struct pcap_file *f, const uint8_t *p) {
+    uint16_t x;
+    memcpy(&x, p, sizeof(x));
+    return f->byteswap ? __builtin_bswap16(x) : x;
+}
+
+/*
+ * pcapng_section_start() sets the byte order from the first twelve
+ * bytes of a section header block, and forgets the interfaces of the
+ * previous section
+ */
+static enum status pcapng_section_start(struct pcap_file *f, const uint8_t *shb) {
+    uint32_t bom;
+    memcpy(&bom, shb + 8, sizeof(bom));
+    if (bom == pcapng_byte_order_magic) {
+        f->byteswap = 0;
+    } else if (bom == __builtin_bswap32(pcapng_byte_order_magic)) {
+        f->byteswap = 1;
+    } else {
+        fprintf(stderr, "error: pcapng section header has invalid byte-order magic (%08x)\n", bom);
+        return status_err;
+    }
+    f->num_interfaces = 0;
+    return status_ok;
+}
+
+/*
+ * pcapng_file_open() completes the opening of a pcapng file, given the
+ * hdr_len bytes of it that have already been read
+ */
+static enum status pcapng_file_open(struct pcap_file *f, const uint8_t *hdr, size_t hdr_len) {
+    if (pcapng_section_start(f, hdr) != status_ok) {
+        return status_err;
+    }
+    if (f->map) {
+        f->map_offset -= hdr_len;  // the section header block is read again as a block
+        return status_ok;
+    }
+    uint32_t block_len = pcapng_u32(f, hdr + 4);
+    if (block_len < hdr_len) {
+        fprintf(stderr, "error: pcapng section header block has invalid length %u\n", block_len);
+        return status_err;
+    }
+    return advance(f->file_ptr, block_len - hdr_len);  // skip the rest of the section header block
+}
+
+/*
+ * pcapng_next_block() sets *block to point to the next block in the
+ * file f, and *block_len to its total length
+ */
+static enum status pcapng_next_block(struct pcap_file *f, const uint8_t **block, uint32_t *block_len) {
+    const size_t min_len = 12;  // block type, block length, and trailing block length
+    uint8_t hdr[min_len];
+    const uint8_t *b;
+
+    if (f->map) {
+        if (!pcap_file_window(f, min_len)) {
+            return status_err_no_more_data;
+        }
+        b = f->map + f->map_offset;
+    } else {
+        if (fread(hdr, min_len, 1, f->file_ptr) != 1) {
+            return status_err_no_more_data;
+        }
+        b = hdr;
+    }
+    if (pcapng_u32(f, b) == PCAPNG_SECTION_HEADER && pcapng_section_start(f, b) != status_ok) {
+        return status_err;
+    }
+    uint32_t len = pcapng_u32(f, b + 4);
+    if (len < min_len) {
+        fprintf(stderr, "error: pcapng block has invalid length %u\n", len);
+        return status_err;
+    }
+
+    if (f->map) {
+        if (!pcap_file_window(f, len)) {
+            fprintf(stderr, "error: could not read pcapng block with length %u\n", len);
+            f->map_offset = f->map_len;
+            return status_err;
+        }
+        b = f->map + f->map_offset;  // the window may have moved
+        f->map_offset += len;
+        if (f->map_offset + MAP_READAHEAD / 2 > f->map_advised) {
+            pcap_file_map_readahead(f);
+        }
+    } else {
+        if (len > f->block_len) {
+            uint8_t *tmp = (uint8_t *)realloc(f->block, len);
+            if (tmp == NULL) {
+                fprintf(stderr, "error: could not allocate buffer for pcapng block with length %u\n", len);
+                return status_err;
+            }
+            f->block = tmp;
+            f->block_len = len;
+        }
+        memcpy(f->block, hdr, min_len);
+        if (fread(f->block + min_len, len - min_len, 1, f->file_ptr) != 1 && len > min_len) {
+            fprintf(stderr, "error: could not read pcapng block with length %u\n", len);
+            return status_err;
+        }
+        b = f->block;
+    }
+    *block = b;
+    *block_len = len;
+    return status_ok;
+}
+
+/*
+ * pcapng_add_interface() records the link type and timestamp
+ * resolution of the interface described by the IDB b of length len
+ */
+static enum status pcapng_add_interface(struct pcap_file *f, const uint8_t *b, uint32_t len) {
+    if (len < 20) {
+        fprintf(stderr, "error: pcapng interface description block has invalid length %u\n", len);
+        return status_err;
+    }
+    struct pcapng_interface *tmp = (struct pcapng_interface *)realloc(f->interfaces, (f->num_interfaces + 1) * sizeof(struct pcapng_interface));
+    if (tmp == NULL) {
+        return status_err;
+    }
+    f->interfaces = tmp;
+    struct pcapng_interface *intf = &f->interfaces[f->num_interfaces++];
+    intf->linktype = pcapng_u16(f, b + 8);
+    intf->ts_units = 1000000;  // default resolution is microseconds
+    intf->skipped = intf->linktype != LINKTYPE_ETHERNET;
+    if (intf->skipped) {
+        fprintf(stderr, "warning: skipping packets from pcapng interface %u, which has unsupported link type %u\n",
+                f->num_interfaces - 1, intf->linktype);
+    }
+
+    const uint8_t *opt = b + 16;
+    const uint8_t *end = b + len - 4;
+    while (opt + 4 <= end) {
+        uint16_t code = pcapng_u16(f, opt);
+        uint16_t opt_len = pcapng_u16(f, opt + 2);
+        opt += 4;
+        if (code == PCAPNG_OPT_ENDOFOPT || opt + opt_len > end) {
+            break;
+        }
+        if (code == PCAPNG_OPT_IF_TSRESOL && opt_len >= 1) {
+            uint8_t exp = opt[0] & 0x7f;
+            uint64_t units = 1;
+            if (opt[0] & 0x80) {
+                units = exp < 64 ? (uint64_t)1 << exp : 0;  // negative power of two
+            } else {
+                for (unsigned int i = 0; i < exp && units; i++) {
+                    units = units <= UINT64_MAX / 10 ? units * 10 : 0;  // negative power of ten
+                }
+            }
+            if (units == 0) {
+                fprintf(stderr, "error: pcapng interface has unsupported timestamp resolution (0x%02x)\n", opt[0]);
+                return status_err;
+            }
+            intf->ts_units = units;
+        }
+        opt += (opt_len + 3) & ~3;  // options are padded to 32 bits
+    }
+    return status_ok;
+}
+
+/*
+ * pcapng_usec() converts frac, a fraction of a second in units of
+ * 1/units seconds, to microseconds; decimal resolutions are converted
+ * exactly
+ */
+static inline uint32_t pcapng_usec(uint64_t frac, uint64_t units) {
+    if (units >= 1000000 && units % 1000000 == 0) {
+        return frac / (units / 1000000);
+    }
+    if (1000000 % units == 0) {
+        return frac * (1000000 / units);
+    }
+    return (long double)frac * 1000000 / units;
+}
+
+/*
+ * pcapng_next_packet() sets *packet to point to the next packet in the
+ * file f and sets pkthdr to its header; the packet is in the mapping of
+ * a mapped file, and otherwise in f->block
+ */
+static enum status pcapng_next_packet(struct pcap_file *f,
+                                      struct pcap_pkthdr *pkthdr, /* output */
+                                      const uint8_t **packet      /* output */
+                                      ) {
+    const uint8_t *b;
+    uint32_t len;
+    enum status status;
+
+    while ((status = pcapng_next_block(f, &b, &len)) == status_ok) {
+        uint32_t interface_id = 0;
+        uint32_t caplen;
+        uint64_t ts;
+        bool has_ts = true;
+
+        switch (pcapng_u32(f, b)) {
+        case PCAPNG_INTERFACE_DESC:
+            if (pcapng_add_interface(f, b, len) != status_ok) {
+                return status_err;
+            }
+            continue;
+        case PCAPNG_ENHANCED_PACKET:
+            if (len < 32) {
+                fprintf(stderr, "error: pcapng enhanced packet block has invalid length %u\n", len);
+                return status_err;
+            }
+            interface_id = pcapng_u32(f, b + 8);
+            ts = (uint64_t)pcapng_u32(f, b + 12) << 32 | pcapng_u32(f, b + 16);
+            caplen = pcapng_u32(f, b + 20);
+            pkthdr->len = pcapng_u32(f, b + 24);
+            if (caplen > len - 32) {
+                fprintf(stderr, "error: pcapng enhanced packet block has invalid captured length %u\n", caplen);
+                return status_err;
+            }
+            *packet = b + 28;
+            break;
+        case PCAPNG_SIMPLE_PACKET:
+            if (len < 16) {
+                fprintf(stderr, "error: pcapng simple packet block has invalid length %u\n", len);
+                return status_err;
+            }
+            pkthdr->len = pcapng_u32(f, b + 8);
+            caplen = pkthdr->len < len - 16 ? pkthdr->len : len - 16;
+            *packet = b + 12;
+            has_ts = false;
+            break;
+        default:
+            continue;  // a block that does not contain a packet
+        }
+
+        if (interface_id >= f->num_interfaces) {
+            fprintf(stderr, "error: pcapng packet refers to undefined interface %u\n", interface_id);
+            return status_err;
+        }
+        const struct pcapng_interface *intf = &f->interfaces[interface_id];
+        if (intf->skipped) {
+            continue;
+        }
+        f->linktype = intf->linktype;
+        if (has_ts) {
+            f->last_ts.tv_sec = ts / intf->ts_units;
+            f->last_ts.tv_usec = pcapng_usec(ts % intf->ts_units, intf->ts_units);
+        }
+        pkthdr->ts = f->last_ts;
+        pkthdr->caplen = caplen;
+        return status_ok;
+    }
+    return status;
+}
+
 enum status pcap_file_open(struct pcap_file *f,
                            const char *fname,
                            enum io_direction dir,
@@ -115,6 +982,16 @@ enum status pcap_file_open(struct pcap_file *f,
     struct pcap_file_hdr file_header;
     ssize_t items_read;
 
+    f->map = NULL;
+    f->stream = NULL;
+    f->buffer = NULL;
+    f->buf_len = 0;
+    f->pcapng = false;
+    f->interfaces = NULL;
+    f->num_interfaces = 0;
+    f->block = NULL;
+    f->block_len = 0;
+    f->last_ts = { 0, 0 };
     switch(dir) {
     case io_direction_reader:
         f->flags = O_RDONLY;
@@ -196,20 +1073,32 @@ enum status pcap_file_open(struct pcap_file *f,
             return status_err; /* system call failed */
         }
 
-        // set the file advisory for the read file, if it is not stdin
-#ifdef POSIX_FADV_SEQUENTIAL
-        if (f->file_ptr != stdin && posix_fadvise(f->fd, 0, 0, POSIX_FADV_SEQUENTIAL) != 0) {
-            printf("%s: Could not set file advisory for read file %s\n", strerror(errno), fname);
+        if (f->file_ptr != stdin) {
+            pcap_file_map(f);
         }
+        if (f->map == NULL) {
+
+            // set the file advisory for the read file, if it is not stdin
+#ifdef POSIX_FADV_SEQUENTIAL
+            if (f->file_ptr != stdin && posix_fadvise(f->fd, 0, 0, POSIX_FADV_SEQUENTIAL) != 0) {
+                printf("%s: Could not set file advisory for read file %s\n", strerror(errno), fname);
+            }
 #endif
 
-        // set file i/o buffer
-        set_file_io_buffer(f, fname);
+            // set file i/o buffer
+            set_file_io_buffer(f, fname);
+        }
         f->bytes_written = 0L;  // will never write any bytes to this file opened for reading
 
         // printf("info: file %s opened\n", fname);
 
-        items_read = fread(&file_header, sizeof(file_header), 1, f->file_ptr);
+        if (f->map) {
+            memcpy(&file_header, f->map, sizeof(file_header));
+            f->map_offset = sizeof(file_header);
+            items_read = 1;
+        } else {
+            items_read = fread(&file_header, sizeof(file_header), 1, f->file_ptr);
+        }
         if (items_read == 0) {
             if (errno) {
                 perror("error: could not read PCAP file header");
@@ -218,20 +1107,39 @@ enum status pcap_file_open(struct pcap_file *f,
             }
             return status_err; /* could not read packet header from file */
         }
+        const uint8_t *h = (const uint8_t *)&file_header;
+        enum pcap_stream_format format;
+        if (pcap_stream_format_detect(h, &format)) {
+            if (!pcap_stream_format_is_supported(format)) {
+                fprintf(stderr, "error: file %s is compressed with %s, which is not supported by this build (%s was not found by configure)\n",
+                        fname, format == stream_format_zstd ? "zstd" : "lz4", format == stream_format_zstd ? "libzstd" : "liblz4");
+                return status_err;
+            }
+            if (pcap_stream_open(f, format, h, sizeof(file_header)) != status_ok) {
+                return status_err;
+            }
+            if (!pcap_file_window(f, sizeof(file_header))) {
+                fprintf(stderr, "error: could not read PCAP file header from compressed file %s\n", fname);
+                return status_err;
+            }
+            memcpy(&file_header, f->map + f->map_offset, sizeof(file_header));
+            f->map_offset += sizeof(file_header);
+        }
         if (file_header.magic_number == magic) {
             f->byteswap = 0;
             // printf("file is in pcap format\nno byteswap needed\n");
         } else if (file_header.magic_number == cagim) {
             f->byteswap = 1;
             // printf("file is in pcap format\nbyteswap is needed\n");
+        } else if (file_header.magic_number == PCAPNG_SECTION_HEADER) {
+            f->pcapng = true;
+            return pcapng_file_open(f, (const uint8_t *)&file_header, sizeof(file_header));
         } else {
             fprintf(stderr, "error: file %s not in pcap format (file header: %08x)\n",
                     fname, file_header.magic_number);
-            if (file_header.magic_number == 0x0a0d0d0a) {
-                fprintf(stderr, "error: pcap-ng format found; this format is currently unsupported\n");
-            }
             exit(255);
         }
+        f->linktype = f->byteswap ? ntohl(file_header.network) : file_header.network;
         if (f->byteswap) {
             file_header.version_major = htons(file_header.version_major);
             file_header.version_minor = htons(file_header.version_minor);
@@ -361,23 +1269,57 @@ enum status pcap_file_write_packet_direct(struct pcap_file *f,
 }
 
 
-enum status advance(FILE *f, size_t length) {
-    if (f == stdin) {
-        for (size_t i=0; i < length; i++) {
-            uint8_t tmp = getc(f);
-            (void)tmp;
+enum status pcap_file_map_next_packet(struct pcap_file *f,
+                                      struct pcap_pkthdr *pkthdr, /* output */
+                                      const uint8_t **packet      /* output */
+                                      ) {
+    struct pcap_packet_hdr packet_hdr;
+
+    if (f->pcapng) {
+        enum status status = pcapng_next_packet(f, pkthdr, packet);
+        if (status == status_ok && pkthdr->caplen > BUFLEN) {
+            fprintf(stderr, "warning: buffer size %u cannot store packet of length %u\n", BUFLEN, pkthdr->caplen);
+            pkthdr->caplen = BUFLEN;
         }
+        return status;
+    }
+
+    if (!pcap_file_window(f, sizeof(packet_hdr))) {
+        return status_err_no_more_data;
+    }
+    memcpy(&packet_hdr, f->map + f->map_offset, sizeof(packet_hdr));
+
+    if (f->byteswap) {
+        pkthdr->ts.tv_sec = ntohl(packet_hdr.ts_sec);
+        pkthdr->ts.tv_usec = ntohl(packet_hdr.ts_usec);
+        pkthdr->caplen = ntohl(packet_hdr.incl_len);
     } else {
-        if (fseek(f, length, SEEK_CUR) != 0) {
-            perror("error: could not advance file pointer\n");
-            return status_err;
-        }
+        pkthdr->ts.tv_sec = packet_hdr.ts_sec;
+        pkthdr->ts.tv_usec = packet_hdr.ts_usec;
+        pkthdr->caplen = packet_hdr.incl_len;
+    }
+
+    if (!pcap_file_window(f, sizeof(packet_hdr) + (size_t)pkthdr->caplen)) {
+        fprintf(stderr, "error: could not read packet with caplen %u\n", pkthdr->caplen);
+        f->map_offset = f->map_len;
+        return status_err;          /* could not read packet from file */
+    }
+    f->map_offset += sizeof(packet_hdr);
+    *packet = f->map + f->map_offset;
+    f->map_offset += pkthdr->caplen;
+
+    if (f->map_offset + MAP_READAHEAD / 2 > f->map_advised) {
+        pcap_file_map_readahead(f);
+    }
+
+    if (pkthdr->caplen > BUFLEN) {
+        fprintf(stderr, "warning: buffer size %u cannot store packet of length %u\n", BUFLEN, pkthdr->caplen);
+        pkthdr->len = pkthdr->caplen;
+        pkthdr->caplen = BUFLEN;
     }
     return status_ok;
 }
 
-#define BUFLEN  65536
-
 enum status pcap_file_read_packet(struct pcap_file *f,
                                   struct pcap_pkthdr *pkthdr, /* output */
                                   void *packet_data           /* output */
@@ -390,6 +1332,15 @@ enum status pcap_file_read_packet(struct pcap_file *f,
         return status_err;
     }
 
+    if (f->map || f->pcapng) {
+        const uint8_t *packet;
+        enum status status = pcap_file_map_next_packet(f, pkthdr, &packet);
+        if (status == status_ok) {
+            memcpy(packet_data, packet, pkthdr->caplen);
+        }
+        return status;
+    }
+
     items_read = fread(&packet_hdr, sizeof(packet_hdr), 1, f->file_ptr);
     if (items_read == 0) {
         return status_err_no_more_data; /* could not read packet header from file */
@@ -452,6 +1403,58 @@ void packet_info_init_from_pkthdr(struct packet_info *pi,
     pi->caplen = pkthdr->caplen;
     pi->ts.tv_sec = pkthdr->ts.tv_sec;
     pi->ts.tv_nsec = pkthdr->ts.tv_usec * 1000;
+    pi->seq = 0;
+}
+
+enum status pcap_file_map_rewind(struct pcap_file *f) {
+    if (f->stream) {
+        if (pcap_stream_rewind(f) != status_ok || !pcap_file_window(f, sizeof(struct pcap_file_hdr))) {
+            return status_err;
+        }
+        f->map_offset += f->pcapng ? 0 : sizeof(struct pcap_file_hdr);  // the first packet
+        return status_ok;
+    }
+    f->map_offset = f->pcapng ? 0 : sizeof(struct pcap_file_hdr);  // the first packet
+    f->map_advised = 0;
+    pcap_file_map_readahead(f);
+    return status_ok;
+}
+
+/*
+ * pcap_file_dispatch_mapped() hands every remaining packet in a
+ * mapped file to pkt_processor, in batches, as pointers into the
+ * mapping
+ */
+static enum status pcap_file_dispatch_mapped(struct pcap_file *f,
+                                             struct pkt_proc *pkt_processor,
+                                             unsigned long *num_packets,
+                                             unsigned long *total_length) {
+    enum status status = status_ok;
+    struct pcap_pkthdr pkthdr;
+    struct packet_info pi[APPLY_BATCH_SIZE];
+    uint8_t *eth[APPLY_BATCH_SIZE];
+
+    while (status == status_ok && sig_close_flag == 0) {
+        size_t batch_len = 0;
+        while (batch_len < APPLY_BATCH_SIZE) {
+            const uint8_t *packet;
+            status = pcap_file_map_next_packet(f, &pkthdr, &packet);
+            if (status != status_ok) {
+                break;
+            }
+            packet_info_init_from_pkthdr(&pi[batch_len], &pkthdr);
+            pi[batch_len].seq = *num_packets + batch_len;
+            eth[batch_len] = (uint8_t *)packet;
+            batch_len++;
+            *total_length += pkthdr.caplen + sizeof(struct pcap_packet_hdr);
+        }
+        if (batch_len > 0) {
+            pkt_processor->apply_batch(pi, eth, batch_len);
+            pkt_processor->advance(&pi[batch_len - 1].ts);
+            *num_packets += batch_len;
+        }
+    }
+    return status;
 }
 
 enum status pcap_file_dispatch_pkt_processor(struct pcap_file *f,
@@ -465,30 +1468,41 @@ enum status pcap_file_dispatch_pkt_processor(struct pcap_file *f,
     struct packet_info pi;
 
     for (int i=0; i < loop_count && sig_close_flag == 0; i++) {
+        if (f->map && f->stream == NULL) {
+            status = pcap_file_dispatch_mapped(f, pkt_processor, &num_packets, &total_length);
+            if (i < loop_count - 1) {
+                pcap_file_map_rewind(f);
+            }
+            continue;
+        }
         do {
             status = pcap_file_read_packet(f, &pkthdr, packet_data);
             if (status == status_ok) {
                 packet_info_init_from_pkthdr(&pi, &pkthdr);
+                pi.seq = num_packets;
                 // process the packet that was read
                 pkt_processor->apply(&pi, packet_data);
-                num_packets++;
+                if (++num_packets % APPLY_BATCH_SIZE == 0) {
+                    pkt_processor->advance(&pi.ts);
+                }
                 total_length += pkthdr.caplen + sizeof(struct pcap_packet_hdr);
             }
         } while (status == status_ok && sig_close_flag == 0);
 
-        if (i < loop_count - 1) {
-            // Rewind the file to the first packet after skipping file header.
-            if (fseek(f->file_ptr, sizeof(struct pcap_file_hdr), SEEK_SET) != 0) {
+        if (i < loop_count - 1 && f->stream) {
+            status = pcap_file_map_rewind(f);
+        } else if (i < loop_count - 1) {
+            // Rewind the file to the first packet after skipping file header;
+            // a pcapng file is rewound to its first section header block
+            if (fseek(f->file_ptr, f->pcapng ? 0 : sizeof(struct pcap_file_hdr), SEEK_SET) != 0) {
                 perror("error: could not rewind file pointer\n");
                 status = status_err;
             }
         }
     }
 
-    pkt_processor->finalize();  // clear out buffers
-
-    pkt_processor->bytes_written = total_length;
-    pkt_processor->packets_written = num_packets;
+    pkt_processor->bytes_written += total_length;
+    pkt_processor->packets_written += num_packets;
 
     if (status == status_err_no_more_data) {
         return status_ok;
@@ -497,6 +1511,16 @@ enum status pcap_file_dispatch_pkt_processor(struct pcap_file *f,
 }
 
 enum status pcap_file_close(struct pcap_file *f) {
+    if (f->stream) {
+        pcap_stream_stop(f->stream);
+        pcap_stream_free(f->stream);  // also unmaps the file, if it was mapped
+        f->stream = NULL;
+        f->map = NULL;
+    }
+    if (f->map) {
+        munmap((void *)f->map, f->map_len);
+        f->map = NULL;
+    }
     if (f->file_ptr != stdin && fclose(f->file_ptr) != 0) {
         perror("could not close input pcap file");
         return status_err;
@@ -504,6 +1528,8 @@ enum status pcap_file_close(struct pcap_file *f) {
     if (f->buffer) {
         free(f->buffer);
     }
+    free(f->interfaces);
+    free(f->block);
     return status_ok;
 }
 
@@ -513,72 +1539,50 @@ enum status pcap_file_close(struct pcap_file *f) {
  * start of serialized output code - first cut
  */
 
-void pcap_queue_write(struct ll_queue *llq,
+bool pcap_queue_write(struct ll_queue *llq,
                       uint8_t *packet,
                       size_t length,
                       unsigned int sec,
                       unsigned int nsec,
+                      uint64_t seq,
                       bool blocking) {
 
-    if (blocking) {
-        while (llq->msgs[llq->widx].used != 0) {
-            usleep(50); // sleep for fifty microseconds
-        }
+    struct llq_msg *msg = llq->init_msg(blocking, sec, nsec);
+    if (msg == nullptr) {
+        return false;
     }
 
-    if (llq->msgs[llq->widx].used == 0) {
-
-        //char obuf[LLQ_MSG_SIZE];
-        int olen = LLQ_MSG_SIZE;
-        int ooff = 0;
-        int trunc = 0;
-
-        llq->msgs[llq->widx].ts.tv_sec = sec;
-        llq->msgs[llq->widx].ts.tv_nsec = nsec;
-
-        //obuf[sizeof(struct timespec)] = '\0';
-        llq->msgs[llq->widx].buf[0] = '\0';
-
-        if (packet && !length) {
-            fprintf(stderr, "warning: attempt to write an empty packet\n");
-        }
-
-        /* note: we never perform byteswap when writing */
-        struct pcap_packet_hdr packet_hdr;
-        packet_hdr.ts_sec = sec;
-        packet_hdr.ts_usec = nsec;
-        packet_hdr.incl_len = length;
-        packet_hdr.orig_len = length;
-
-        // write the packet header
-        int r = append_memcpy(llq->msgs[llq->widx].buf, &ooff, olen, &trunc, &packet_hdr, sizeof(packet_hdr));
+    int olen = LLQ_MSG_SIZE;
+    int ooff = 0;
+    int trunc = 0;
 
-        // write the packet
-        r += append_memcpy(llq->msgs[llq->widx].buf, &ooff, olen, &trunc, packet, length);
+    msg->seq = seq;
 
-        // f->bytes_written += length + sizeof(struct pcap_packet_hdr);
-        // f->packets_written++;
+    if (packet && !length) {
+        fprintf(stderr, "warning: attempt to write an empty packet\n");
+    }
 
-        if ((trunc == 0) && (r > 0)) {
+    /* note: we never perform byteswap when writing */
+    struct pcap_packet_hdr packet_hdr;
+    packet_hdr.ts_sec = sec;
+    packet_hdr.ts_usec = nsec / 1000;
+    packet_hdr.incl_len = length;
+    packet_hdr.orig_len = length;
 
-            llq->msgs[llq->widx].len = r;
+    // write the packet header
+    int r = append_memcpy(msg->buf(), &ooff, olen, &trunc, &packet_hdr, sizeof(packet_hdr));
 
-            //fprintf(stderr, "DEBUG: sent a message!\n");
-            __sync_synchronize(); /* A full memory barrier prevents the following flag set from happening too soon */
-            llq->msgs[llq->widx].used = 1;
+    // write the packet
+    r += append_memcpy(msg->buf(), &ooff, olen, &trunc, packet, length);
 
-            //llq->next_write();
-            llq->widx = (llq->widx + 1) % LLQ_DEPTH;
-        }
-    }
-    else {
-        //fprintf(stderr, "DEBUG: queue bucket used!\n");
+    // f->bytes_written += length + sizeof(struct pcap_packet_hdr);
+    // f->packets_written++;
 
-        // TODO: this is where we'd update an output drop counter
-        // but currently this spot in the code doesn't have access to
-        // any thread stats pointer or similar and I don't want
-        // to update a global variable in this location.
+    if ((trunc == 0) && (r > 0)) {
+        llq->send_msg(msg, r);
+        return true;
     }
 
+    return false;
 }
 
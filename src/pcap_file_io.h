@@ -38,6 +38,16 @@ enum io_direction {
     io_direction_writer = 2
 };
 
+/*
+ * struct pcapng_interface holds the properties of an interface
+ * described by a pcapng Interface Description Block
+ */
+struct pcapng_interface {
+    uint16_t linktype;     /* data link type                               */
+    uint64_t ts_units;     /* timestamp units per second (from if_tsresol) */
+    bool skipped;          /* packets are skipped, as the link type is unsupported */
+};
+
 struct pcap_file {
     FILE *file_ptr;
     int fd;                /* file descriptor that is returned by fileno() */
@@ -49,21 +59,70 @@ struct pcap_file {
     uint64_t bytes_written; /* number of bytes written to this file       */
     uint64_t packets_written; /* number of packets written to this file   */
     uint16_t linktype;        /* data link type                           */
+    const uint8_t *map;    /* read-only mapping of the file, or NULL       */
+    size_t map_len;        /* length of the mapping                        */
+    size_t map_offset;     /* offset of the next packet in the mapping     */
+    size_t map_advised;    /* end of the region advised to be read ahead   */
+    bool pcapng;           /* file is in pcapng format                     */
+    struct pcapng_interface *interfaces; /* interfaces of the current section */
+    uint32_t num_interfaces;
+    uint8_t *block;        /* pcapng block read through stdio              */
+    size_t block_len;      /* size of block buffer                         */
+    struct timeval last_ts; /* timestamp of the previous pcapng packet     */
+    struct pcap_stream *stream; /* decompressor of a compressed file, or NULL;
+                                   the map fields are then its output buffer */
 };
 
 #define pcap_file_init() { NULL, 0, 0, 0, NULL, NULL, NULL }
 
+/*
+ * pcap_file_open() opens the file fname for reading or writing.  A
+ * regular file opened for reading is memory mapped, so that packets
+ * can be handed to a packet processor without being copied; standard
+ * input, pipes, and files that cannot be mapped are read through a
+ * stdio buffer.  Files are read in either the classic libpcap format
+ * or the pcapng format; they are written in the classic format.  A
+ * file that is compressed with gzip, or with zstd or lz4 if the build
+ * has those libraries, is decompressed ahead of the reader by a
+ * separate thread.
+ */
 enum status pcap_file_open(struct pcap_file *f,
 			   const char *fname,
 			   enum io_direction dir,
 			   int flags);
 
+/*
+ * pcap_file_read_packet() copies the next packet into packet_data,
+ * which must have room for BUFLEN bytes; longer packets are truncated
+ */
+#define BUFLEN  65536
 
 enum status pcap_file_read_packet(struct pcap_file *f,
 				  struct pcap_pkthdr *pkthdr, /* output */
 				  void *packet_data           /* output */
 				  );
 
+/*
+ * pcap_file_map_next_packet() sets *packet to point to the next
+ * packet in a mapped file (one for which f->map is not NULL) and sets
+ * pkthdr to its header, without copying; as with
+ * pcap_file_read_packet(), packets longer than BUFLEN are truncated.
+ * It can also be used with a pcapng file that is not mapped, or with
+ * a compressed file, in which case *packet is only valid until the
+ * next call.
+ */
+enum status pcap_file_map_next_packet(struct pcap_file *f,
+                                      struct pcap_pkthdr *pkthdr, /* output */
+                                      const uint8_t **packet      /* output */
+                                      );
+
+/*
+ * pcap_file_map_rewind() makes the first packet in the mapped file f
+ * the next one to be read; a compressed file is decompressed again
+ * from its start, which fails for standard input
+ */
+enum status pcap_file_map_rewind(struct pcap_file *f);
+
 enum status pcap_file_write_packet(struct pcap_file *f,
 				   const void *packet,
 				   size_t length);
@@ -76,6 +135,13 @@ enum status pcap_file_write_packet_direct(struct pcap_file *f,
 
 enum status pcap_file_close(struct pcap_file *f);
 
+/*
+ * pcap_file_dispatch_pkt_processor() applies pkt_processor to each
+ * packet in the file f, loop_count times, and adds the number of
+ * packets and bytes read to its packets_written and bytes_written
+ * counts; since a processor may be applied to several files, the
+ * caller is responsible for invoking its finalize() method
+ */
 enum status pcap_file_dispatch_pkt_processor(struct pcap_file *f,
                                              struct pkt_proc *pkt_processor,
                                              int loop_count);
@@ -84,13 +150,29 @@ enum status pcap_file_dispatch_pkt_processor(struct pcap_file *f,
  * start of serialized output code - first cut
  */
 
-void pcap_queue_write(struct ll_queue *llq,
+/*
+ * pcap_queue_write() writes a packet in PCAP format into the next
+ * message in llq, marked with the packet number seq, and returns
+ * false if it could not do so because the queue was full (or the
+ * packet did not fit into a message).  The message keeps the time
+ * sec.nsec in nanoseconds, as the output merge expects; only the
+ * PCAP record header is rounded down to microseconds.
+ */
+bool pcap_queue_write(struct ll_queue *llq,
                       uint8_t *packet,
                       size_t length,
                       unsigned int sec,
                       unsigned int nsec,
+                      uint64_t seq,
                       bool blocking);
 
 enum status write_pcap_file_header(FILE *f);
 
+/*
+ * pcap_file_header_to_buffer() writes the header that
+ * write_pcap_file_header() would write into buf, and returns its
+ * length, or 0 if it is longer than len
+ */
+size_t pcap_file_header_to_buffer(void *buf, size_t len);
+
 #endif /* PCAP_FILE_IO_H */
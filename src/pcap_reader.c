@@ -6,22 +6,128 @@
  */
 
 #include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <dirent.h>
+#include <glob.h>
+#include <sys/stat.h>
 #include "pcap_reader.h"
+#include "flow_hash.h"
 #include "output.h"
 #include "pkt_processing.h"
+#include "signal_handling.h"
 #include "libmerc/utils.h"
 
 #define BILLION 1000000000L
 
+static enum status input_file_list_append(struct input_file_list *list, const char *dir, const char *name) {
+    char filename[FILENAME_MAX];
+    if (filename_append(filename, dir ? dir : name, "/", dir ? name : NULL) != status_ok) {
+        fprintf(stderr, "error: filename too long (%s)\n", name);
+        return status_err;
+    }
+    char **tmp = (char **)realloc(list->filenames, (list->num_files + 1) * sizeof(char *));
+    if (tmp == NULL) {
+        return status_err;
+    }
+    list->filenames = tmp;
+    list->filenames[list->num_files] = strdup(filename);
+    if (list->filenames[list->num_files] == NULL) {
+        return status_err;
+    }
+    list->num_files++;
+    return status_ok;
+}
+
+static int is_visible_entry(const struct dirent *d) {
+    return d->d_name[0] != '.';
+}
+
+enum status input_file_list_init(struct input_file_list *list, const char *arg) {
+    enum status status = status_ok;
+    list->filenames = NULL;
+    list->num_files = 0;
+
+    struct stat st;
+    if (strcmp(arg, "-") != 0 && stat(arg, &st) == 0 && S_ISDIR(st.st_mode)) {
+        struct dirent **entries;
+        int n = scandir(arg, &entries, is_visible_entry, alphasort);
+        if (n < 0) {
+            fprintf(stderr, "%s: could not read directory %s\n", strerror(errno), arg);
+            return status_err;
+        }
+        for (int i = 0; i < n; i++) {
+            char filename[FILENAME_MAX];
+            if (status == status_ok
+                && filename_append(filename, arg, "/", entries[i]->d_name) == status_ok
+                && stat(filename, &st) == 0 && S_ISREG(st.st_mode)) {
+                status = input_file_list_append(list, arg, entries[i]->d_name);
+            }
+            free(entries[i]);
+        }
+        free(entries);
+
+    } else if (strcmp(arg, "-") != 0 && stat(arg, &st) != 0 && strpbrk(arg, "*?[") != NULL) {
+        glob_t g;
+        int err = glob(arg, 0, NULL, &g);
+        if (err == GLOB_NOMATCH) {
+            fprintf(stderr, "error: no files match %s\n", arg);
+            return status_err;
+        } else if (err != 0) {
+            fprintf(stderr, "error: could not expand %s\n", arg);
+            return status_err;
+        }
+        for (size_t i = 0; i < g.gl_pathc && status == status_ok; i++) {
+            status = input_file_list_append(list, NULL, g.gl_pathv[i]);
+        }
+        globfree(&g);
+
+    } else if (strcmp(arg, "-") != 0 && stat(arg, &st) != 0 && strchr(arg, ',') != NULL) {
+        char *names = strdup(arg);
+        if (names == NULL) {
+            return status_err;
+        }
+        char *saveptr = NULL;
+        for (char *name = strtok_r(names, ",", &saveptr); name != NULL && status == status_ok; name = strtok_r(NULL, ",", &saveptr)) {
+            status = input_file_list_append(list, NULL, name);
+        }
+        free(names);
+
+    } else {
+        status = input_file_list_append(list, NULL, arg);
+    }
+
+    if (status == status_ok && list->num_files == 0) {
+        fprintf(stderr, "error: no input files found in %s\n", arg);
+        status = status_err;
+    }
+    if (status != status_ok) {
+        input_file_list_free(list);
+    }
+    return status;
+}
+
+void input_file_list_free(struct input_file_list *list) {
+    for (int i = 0; i < list->num_files; i++) {
+        free(list->filenames[i]);
+    }
+    free(list->filenames);
+    list->filenames = NULL;
+    list->num_files = 0;
+}
+
 enum status pcap_reader_thread_context_init_from_config(struct pcap_reader_thread_context *tc,
                                                         struct mercury_config *cfg,
                                                         mercury_context mc,
                                                         int tnum,
-                                                        struct ll_queue *llq) {
-    char input_filename[FILENAME_MAX];
+                                                        struct ll_queue *llq,
+                                                        const struct input_file_list *files,
+                                                        int file_stride) {
     tc->tnum = tnum;
 	tc->loop_count = cfg->loop_count;
-    enum status status;
+    tc->files = files;
+    tc->file_stride = file_stride;
+    tc->status = status_ok;
 
     tc->pkt_processor = pkt_proc_new_from_config(cfg, mc, tnum, llq);
     if (tc->pkt_processor == NULL) {
@@ -29,23 +135,10 @@ enum status pcap_reader_thread_context_init_from_config(struct pcap_reader_threa
         return status_err;
     }
 
-    // if cfg->use_test_packet is on, read_filename will be NULL
-    if (cfg->read_filename != NULL) {
-        status = filename_append(input_filename, cfg->read_filename, "/", NULL);
-        if (status) {
-            return status;
-        }
-        status = pcap_file_open(&tc->rf, input_filename, io_direction_reader, cfg->flags);
-        if (status) {
-            printf("error: could not open pcap input file %s\n", cfg->read_filename);
-            return status;
-        }
-    }
     return status_ok;
 }
 
 void pcap_reader_thread_context_finalize(struct pcap_reader_thread_context *tc) {
-    pcap_file_close(&(tc->rf));
     delete tc->pkt_processor;
 }
 
@@ -53,15 +146,283 @@ void *pcap_file_processing_thread_func(void *userdata) {
     struct pcap_reader_thread_context *tc = (struct pcap_reader_thread_context *)userdata;
     enum status status;
 
-    status = pcap_file_dispatch_pkt_processor(&tc->rf, tc->pkt_processor, tc->loop_count);
-    if (status) {
-        printf("error in pcap file dispatch (code: %d)\n", (int)status);
-        return NULL;
+    for (int i = tc->tnum; i < tc->files->num_files && sig_close_flag == 0; i += tc->file_stride) {
+        const char *input_filename = tc->files->filenames[i];
+        status = pcap_file_open(&tc->rf, input_filename, io_direction_reader, 0);
+        if (status) {
+            printf("error: could not open pcap input file %s\n", input_filename);
+            tc->status = status_err;
+            continue;
+        }
+        status = pcap_file_dispatch_pkt_processor(&tc->rf, tc->pkt_processor, tc->loop_count);
+        if (status) {
+            printf("error in pcap file dispatch (code: %d)\n", (int)status);
+            tc->status = status_err;
+        }
+        pcap_file_close(&tc->rf);
+    }
+    tc->pkt_processor->finalize();  // clear out buffers
+
+    return NULL;
+}
+
+/*
+ * dispatch_files() reads the files in the list, with one thread per
+ * file (up to cfg->num_threads); each thread has its own queue and
+ * packet processor
+ */
+static enum status dispatch_files(struct mercury_config *cfg,
+                                  mercury_context mc,
+                                  struct output_file *of,
+                                  const struct input_file_list *files,
+                                  uint64_t *packets_written,
+                                  uint64_t *bytes_written) {
+    enum status status = status_ok;
+
+    /*
+     * each thread has its own queue and packet processor; there are
+     * no more threads than files
+     */
+    int num_threads = cfg->num_threads < files->num_files ? cfg->num_threads : files->num_files;
+    struct pcap_reader_thread_context *tc = new pcap_reader_thread_context[num_threads]();
+
+    for (int thread = 0; thread < num_threads; thread++) {
+        status = pcap_reader_thread_context_init_from_config(&tc[thread], cfg, mc, thread, &of->qs.queue[thread],
+                                                            files, num_threads);
+        if (status != status_ok) {
+            if (errno) {
+                perror("could not initialize pcap reader thread context");
+            }
+            return status;
+        }
+    }
+    for (int q = num_threads; q < of->qs.qnum; q++) {
+        of->qs.queue[q].set_watermark(LLQ_WATERMARK_END);  // no thread writes to this queue
+    }
+    if (cfg->verbosity && files->num_files > 1) {
+        fprintf(stderr, "reading %d files with %d thread(s)\n", files->num_files, num_threads);
+    }
+
+    output_thread_start(of);
+
+#ifdef DONT_USE_THREADS
+    for (int thread = 0; thread < num_threads; thread++) {
+        pcap_file_processing_thread_func(&tc[thread]);
+    }
+#else
+    for (int thread = 0; thread < num_threads; thread++) {
+        int err = pthread_create(&(tc[thread].tid), NULL, pcap_file_processing_thread_func, &tc[thread]);
+        if (err) {
+            printf("%s: error creating file reader thread\n", strerror(err));
+            exit(255);
+        }
+    }
+    for (int thread = 0; thread < num_threads; thread++) {
+        pthread_join(tc[thread].tid, NULL);
+    }
+#endif
+    //    struct pkt_proc_stats pkt_stats = tc.pkt_processor->get_stats();
+    for (int thread = 0; thread < num_threads; thread++) {
+        *bytes_written += tc[thread].pkt_processor->bytes_written;
+        *packets_written += tc[thread].pkt_processor->packets_written;
+        if (tc[thread].status != status_ok) {
+            status = status_err;
+        }
+        pcap_reader_thread_context_finalize(&tc[thread]);
+    }
+    delete[] tc;
+
+    return status;
+}
+
+/*
+ * flow-sharded processing of a single file
+ *
+ * When a single mapped file is read with more than one thread, the
+ * calling thread reads the file, and hands each packet (as a pointer
+ * into the mapping) to one of the workers, chosen by a symmetric hash
+ * of its flow key, so that both directions of a flow reach the same
+ * stateful packet processor.  Each worker has its own ring and its own
+ * output queue.  Packets are numbered in file order, and the output
+ * thread merges the queues by that number (see seq_is_next() in
+ * output.c), so the output is the same as it would be with a single
+ * thread.
+ */
+
+#define SHARD_RING_SIZE 4096   /* packets per worker ring; a power of two */
+
+/*
+ * struct shard_ring is a single-producer, single-consumer ring of
+ * packets; head is only written by the reader, and tail only by the
+ * worker
+ */
+struct shard_ring {
+    struct packet_info pi[SHARD_RING_SIZE];
+    uint8_t *eth[SHARD_RING_SIZE];
+    alignas(64) uint64_t head;  /* number of packets added */
+    alignas(64) uint64_t tail;  /* number of packets processed */
+};
+
+/*
+ * struct shard_progress is written by the reader: every packet
+ * numbered below dispatched has been added to a ring, and done is set
+ * once no more packets will be
+ */
+struct shard_progress {
+    alignas(64) uint64_t dispatched;
+    int done;
+};
+
+struct shard_worker {
+    struct shard_ring ring;
+    struct pkt_proc *pkt_processor;
+    struct ll_queue *llq;
+    const struct shard_progress *progress;
+    pthread_t tid;
+};
+
+/*
+ * shard_worker_func() processes the packets in a worker's ring, in
+ * batches, and advances the watermark of its output queue past each
+ * batch.  When its ring is empty, every one of its packets numbered
+ * below the reader's dispatched count has been processed, so the
+ * watermark advances to that count; this keeps an idle worker from
+ * holding back the merge.  The progress is read before the ring, since
+ * the reader adds a packet before counting it.
+ */
+static void *shard_worker_func(void *arg) {
+    struct shard_worker *w = (struct shard_worker *)arg;
+    struct shard_ring *r = &w->ring;
+    uint64_t tail = r->tail;
+
+    while (true) {
+        int done = __atomic_load_n(&w->progress->done, __ATOMIC_ACQUIRE);
+        uint64_t dispatched = __atomic_load_n(&w->progress->dispatched, __ATOMIC_ACQUIRE);
+        uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        if (head == tail) {
+            w->llq->set_watermark(dispatched);
+            if (done) {
+                break;
+            }
+            usleep(50); // sleep for fifty microseconds
+            continue;
+        }
+        size_t idx = tail % SHARD_RING_SIZE;
+        size_t n = head - tail;
+        if (n > APPLY_BATCH_SIZE) {
+            n = APPLY_BATCH_SIZE;
+        }
+        if (n > SHARD_RING_SIZE - idx) {
+            n = SHARD_RING_SIZE - idx;  // do not wrap around within a batch
+        }
+        w->pkt_processor->apply_batch(&r->pi[idx], &r->eth[idx], n);
+        uint64_t next_seq = r->pi[idx + n - 1].seq + 1;
+        tail += n;
+        w->llq->set_watermark(next_seq);
+        __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
     }
+    w->pkt_processor->finalize();  // clear out buffers
 
     return NULL;
 }
 
+/*
+ * shard_file() reads the mapped file f loop_count times, and adds each
+ * packet to the ring of the worker selected by its flow hash; packets
+ * that are not IP go to the first worker
+ */
+static enum status shard_file(struct pcap_file *f,
+                              struct shard_worker *workers,
+                              int num_workers,
+                              struct shard_progress *progress,
+                              int loop_count,
+                              uint64_t *packets_read,
+                              uint64_t *bytes_read) {
+    enum status status = status_ok;
+    struct pcap_pkthdr pkthdr;
+    const uint8_t *packet;
+    uint64_t seq = 0;
+    size_t start = f->map_offset;
+
+    *bytes_read += start;  // file header
+    for (int i = 0; i < loop_count && sig_close_flag == 0; i++) {
+        if (i > 0) {
+            pcap_file_map_rewind(f);
+        }
+        while (sig_close_flag == 0 && (status = pcap_file_map_next_packet(f, &pkthdr, &packet)) == status_ok) {
+            struct flow_fields ff;
+            int w = 0;
+            if (flow_fields_parse(&ff, packet, pkthdr.caplen)) {
+                w = flow_fields_hash(&ff, 0) % num_workers;
+            }
+            struct shard_ring *r = &workers[w].ring;
+            uint64_t head = r->head;
+            while (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == SHARD_RING_SIZE) {
+                usleep(50); // sleep for fifty microseconds
+            }
+            size_t idx = head % SHARD_RING_SIZE;
+            packet_info_init_from_pkthdr(&r->pi[idx], &pkthdr);
+            r->pi[idx].seq = seq++;
+            r->eth[idx] = (uint8_t *)packet;
+            __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+            __atomic_store_n(&progress->dispatched, seq, __ATOMIC_RELEASE);
+        }
+        *bytes_read += f->map_offset - start;
+        if (status == status_err_no_more_data) {
+            status = status_ok;
+        } else if (status != status_ok) {
+            break;
+        }
+    }
+    __atomic_store_n(&progress->done, 1, __ATOMIC_RELEASE);
+    *packets_read += seq;
+
+    return status;
+}
+
+static enum status dispatch_sharded(struct mercury_config *cfg,
+                                    mercury_context mc,
+                                    struct output_file *of,
+                                    struct pcap_file *f,
+                                    uint64_t *packets_written,
+                                    uint64_t *bytes_written) {
+    int num_workers = cfg->num_threads;
+    struct shard_worker *workers = new shard_worker[num_workers]();
+    struct shard_progress progress = {};
+
+    for (int w = 0; w < num_workers; w++) {
+        workers[w].llq = &of->qs.queue[w];
+        workers[w].progress = &progress;
+        workers[w].pkt_processor = pkt_proc_new_from_config(cfg, mc, w, workers[w].llq);
+        if (workers[w].pkt_processor == NULL) {
+            printf("error: could not initialize frame handler\n");
+            return status_err;
+        }
+    }
+    if (cfg->verbosity) {
+        fprintf(stderr, "reading one file with %d flow-sharded worker thread(s)\n", num_workers);
+    }
+
+    of->sequenced = true;
+    output_thread_start(of);
+
+    for (int w = 0; w < num_workers; w++) {
+        int err = pthread_create(&workers[w].tid, NULL, shard_worker_func, &workers[w]);
+        if (err) {
+            printf("%s: error creating file reader thread\n", strerror(err));
+            exit(255);
+        }
+    }
+    enum status status = shard_file(f, workers, num_workers, &progress, cfg->loop_count, packets_written, bytes_written);
+    for (int w = 0; w < num_workers; w++) {
+        pthread_join(workers[w].tid, NULL);
+        delete workers[w].pkt_processor;
+    }
+    delete[] workers;
+
+    return status;
+}
+
 enum status open_and_dispatch(struct mercury_config *cfg, mercury_context mc, struct output_file *of) {
     enum status status;
     struct timer t;
@@ -71,38 +432,44 @@ enum status open_and_dispatch(struct mercury_config *cfg, mercury_context mc, st
 
     timer_start(&t); // get timestamp before we start processing
 
-    struct pcap_reader_thread_context tc;
-
-    status = pcap_reader_thread_context_init_from_config(&tc, cfg, mc, 0, &of->qs.queue[0]);
+    struct input_file_list files;
+    status = input_file_list_init(&files, cfg->read_filename);
     if (status != status_ok) {
-        if (errno) {
-            perror("could not initialize pcap reader thread context");
-        }
         return status;
     }
 
-    /* Wake up output thread so it's polling the queues waiting for data */
-    of->t_output_p = 1;
-    int err = pthread_cond_broadcast(&(of->t_output_c)); /* Wake up output */
-    if (err != 0) {
-        printf("%s: error broadcasting all clear on output start condition\n", strerror(err));
-        exit(255);
+    /*
+     * a single regular file that is read with several threads is
+     * sharded by flow, if it can be mapped and is not compressed
+     */
+    bool sharded = false;
+#ifndef DONT_USE_THREADS
+    struct stat st;
+    sharded = files.num_files == 1 && cfg->num_threads > 1
+        && stat(files.filenames[0], &st) == 0 && S_ISREG(st.st_mode);
+#endif
+    if (sharded) {
+        struct pcap_file rf;
+        status = pcap_file_open(&rf, files.filenames[0], io_direction_reader, 0);
+        if (status) {
+            printf("error: could not open pcap input file %s\n", files.filenames[0]);
+            input_file_list_free(&files);
+            return status;
+        }
+        if (rf.map && rf.stream == NULL) {
+            status = dispatch_sharded(cfg, mc, of, &rf, &packets_written, &bytes_written);
+        } else {
+            if (cfg->verbosity) {
+                fprintf(stderr, "%s is compressed or cannot be mapped; reading it with one thread\n", files.filenames[0]);
+            }
+            sharded = false;
+        }
+        pcap_file_close(&rf);
     }
-
-#ifdef DONT_USE_THREADS
-    pcap_file_processing_thread_func(&tc);
-#else
-    err = pthread_create(&(tc.tid), NULL, pcap_file_processing_thread_func, &tc);
-    if (err) {
-        printf("%s: error creating file reader thread\n", strerror(err));
-        exit(255);
+    if (!sharded) {
+        status = dispatch_files(cfg, mc, of, &files, &packets_written, &bytes_written);
     }
-    pthread_join(tc.tid, NULL);
-#endif
-    //    struct pkt_proc_stats pkt_stats = tc.pkt_processor->get_stats();
-    bytes_written = tc.pkt_processor->bytes_written;
-    packets_written = tc.pkt_processor->packets_written;
-    pcap_reader_thread_context_finalize(&tc);
+    input_file_list_free(&files);
 
     nano_seconds = timer_stop(&t);
     double byte_rate = ((double)bytes_written * BILLION) / (double)nano_seconds;
@@ -112,6 +479,5 @@ enum status open_and_dispatch(struct mercury_config *cfg, mercury_context mc, st
                packets_written, bytes_written, nano_seconds, byte_rate);
     }
 
-    return status_ok;
+    return status;
 }
-
@@ -13,11 +13,34 @@
 #include "mercury.h"
 #include "llq.h"
 
+/*
+ * struct input_file_list holds the names of the files to be read,
+ * which are determined from the [-r or --read] argument; see
+ * input_file_list_init()
+ */
+struct input_file_list {
+    char **filenames;
+    int num_files;
+};
+
+/*
+ * input_file_list_init() sets list to the files named by arg, which
+ * is either a directory (all of the regular files in it, in
+ * alphabetical order), a glob pattern (the matching files, in
+ * alphabetical order), a comma-separated list of files (in the order
+ * given), or a single file ("-" denoting standard input); it returns
+ * status_ok on success
+ */
+enum status input_file_list_init(struct input_file_list *list, const char *arg);
+
+void input_file_list_free(struct input_file_list *list);
+
 /*
  * struct pcap_reader_thread_context holds thread-specific information
  * for a pcap-file-reading thread; it is a sister to struct
  * thread_context, which has the equivalent role for network capture
- * threads
+ * threads.  Each thread reads the files tnum, tnum + file_stride,
+ * tnum + 2 * file_stride, and so on, from the input file list.
  */
 struct pcap_reader_thread_context {
     struct pkt_proc *pkt_processor;
@@ -25,13 +48,18 @@ struct pcap_reader_thread_context {
     pthread_t tid;            /* Thread ID */
     struct pcap_file rf;
     int loop_count;           /* loop count */
+    const struct input_file_list *files; /* files to be read by all threads */
+    int file_stride;          /* number of threads reading files */
+    enum status status;       /* status_err if any file could not be read */
 };
 
 enum status pcap_reader_thread_context_init_from_config(struct pcap_reader_thread_context *tc,
                                                         struct mercury_config *cfg,
                                                         mercury_context mc,
                                                         int tnum,
-                                                        struct ll_queue *llq);
+                                                        struct ll_queue *llq,
+                                                        const struct input_file_list *files,
+                                                        int file_stride);
 
 void pcap_reader_thread_context_finalize(struct pcap_reader_thread_context *tc);
 
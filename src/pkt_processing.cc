@@ -7,7 +7,7 @@
 
 #include <string.h>
 #include "pcap_file_io.h"
-#include "rnd_pkt_drop.h"
+#include "flow_sampler.h"
 #include "pkt_processing.h"
 #include "libmerc/utils.h"
 
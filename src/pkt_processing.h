@@ -12,22 +12,30 @@
 #include <stdio.h>
 #include <sys/time.h>
 #include "pcap_file_io.h"
-#include "rnd_pkt_drop.h"
+#include "flow_sampler.h"
 #include "llq.h"
+#include "thread_stats.h"
 #include "libmerc/libmerc.h"
 #include "libmerc/pkt_proc.h"
 
 constexpr static size_t PREALLOC_SIZE = 65536;
 
+constexpr static size_t APPLY_BATCH_SIZE = 64;  // maximum packets per apply_batch() call from capture
+
 // struct packet_info contains timestamp and length information about
-// a packet
+// a packet, and its position in the input, which orders the output
+// when the input is processed by several threads
 //
 struct packet_info {
     struct timespec ts;   // timestamp
     uint32_t caplen;      // length of portion present
     uint32_t len;         // length this packet (off wire)
+    uint64_t seq;         // packet number
 };
 
+void packet_info_init_from_pkthdr(struct packet_info *pi,
+                                  struct pcap_pkthdr *pkthdr);
+
 /*
  * struct pkt_proc is a packet processor; this abstract class defines
  * the interface to packet processing that can be used by packet
@@ -36,11 +44,37 @@ struct packet_info {
 
 struct pkt_proc {
     virtual void apply(struct packet_info *pi, uint8_t *eth) = 0;
+
+    /*
+     * apply_batch() processes n packets, in order; packet processors
+     * that can amortize per-packet costs over a batch override it
+     */
+    virtual void apply_batch(struct packet_info *pi, uint8_t **eth, size_t n) {
+        for (size_t i = 0; i < n; i++) {
+            apply(&pi[i], eth[i]);
+        }
+    }
+
+    /*
+     * advance() tells the output thread that no packet with a
+     * timestamp earlier than ts remains to be processed, so that an
+     * idle thread does not hold back the time-ordered merge of the
+     * others; it is not used when the output is merged by sequence
+     * number, and processors that do not write to a queue ignore it
+     */
+    virtual void advance(const struct timespec *ts) { (void)ts; }
+
     virtual void flush() = 0;
     virtual void finalize() = 0;
     virtual ~pkt_proc() {};
     size_t bytes_written = 0;
     size_t packets_written = 0;
+
+    /*
+     * counters are written by the thread that calls apply(), and may
+     * be read concurrently by a stats thread with counter_read()
+     */
+    struct thread_counters counters = {};
 };
 
 
@@ -57,15 +91,21 @@ struct pkt_proc_pcap_writer_llq : public pkt_proc {
     }
 
     void apply(struct packet_info *pi, uint8_t *eth) override {
-        extern int rnd_pkt_drop_percent_accept;  /* defined in rnd_pkt_drop.c */
-
-        if (rnd_pkt_drop_percent_accept && drop_this_packet()) {
-            return;  /* random packet drop configured, and this packet got selected to be discarded */
+        if (flow_sampler_drop(eth, pi->len)) {
+            return;  /* flow sampling configured, and this packet's flow was not selected */
+        }
+        if (!pcap_queue_write(llq, eth, pi->len, pi->ts.tv_sec, pi->ts.tv_nsec, pi->seq, block)) {
+            counter_add(&counters.llq_full, 1);
         }
-        pcap_queue_write(llq, eth, pi->len, pi->ts.tv_sec, pi->ts.tv_nsec / 1000, block);
     }
 
-    void finalize() override { }
+    void advance(const struct timespec *ts) override {
+        llq->advance_watermark(llq_time_watermark(ts));
+    }
+
+    void finalize() override {
+        llq->set_watermark(LLQ_WATERMARK_END);
+    }
 
     void flush() override {
     }
@@ -94,10 +134,8 @@ struct pkt_proc_pcap_writer : public pkt_proc {
     }
 
     void apply(struct packet_info *pi, uint8_t *eth) override {
-        extern int rnd_pkt_drop_percent_accept;  /* defined in rnd_pkt_drop.c */
-
-        if (rnd_pkt_drop_percent_accept && drop_this_packet()) {
-            return;  /* random packet drop configured, and this packet got selected to be discarded */
+        if (flow_sampler_drop(eth, pi->len)) {
+            return;  /* flow sampling configured, and this packet's flow was not selected */
         }
         pcap_file_write_packet_direct(&pcap_file, eth, pi->len, pi->ts.tv_sec, pi->ts.tv_nsec / 1000);
     }
@@ -135,15 +173,15 @@ struct pkt_proc_filter_pcap_writer : public pkt_proc {
         uint8_t *packet = eth;
         unsigned int length = pi->len;
 
-        extern int rnd_pkt_drop_percent_accept;  /* defined in rnd_pkt_drop.c */
-
-        if (rnd_pkt_drop_percent_accept && drop_this_packet()) {
-            return;  /* random packet drop configured, and this packet got selected to be discarded */
+        if (flow_sampler_drop(eth, pi->len)) {
+            return;  /* flow sampling configured, and this packet's flow was not selected */
         }
 
         uint8_t buf[LLQ_MSG_SIZE];
         if (processor.write_json(buf, LLQ_MSG_SIZE, packet, length, &pi->ts) != 0) {
             pcap_file_write_packet_direct(&pcap_file, eth, pi->len, pi->ts.tv_sec, pi->ts.tv_nsec / 1000);
+        } else {
+            counter_add(&counters.no_output, 1);
         }
 
     }
@@ -171,6 +209,11 @@ struct pkt_proc_json_writer_llq : public pkt_proc {
     struct ll_queue *llq;
     bool block;
     mercury_packet_processor processor;
+    bool repeats;              /* repeats are suppressed, and summarized */
+    struct timespec last_ts;   /* time of the last packet, or advance()  */
+    uint64_t last_seq;         /* number of the last packet              */
+    enum record_priority min_priority;          /* as last set in processor  */
+    uint64_t records_shed[RECORD_PRIORITIES];   /* as last counted           */
 
     /*
      * pkt_proc_json_writer(outfile_name, mode, max_records)
@@ -184,7 +227,12 @@ struct pkt_proc_json_writer_llq : public pkt_proc {
      */
     explicit pkt_proc_json_writer_llq(mercury_context mc, struct ll_queue *llq_ptr, bool blocking) :
         block{blocking},
-        processor{NULL}
+        processor{NULL},
+        repeats{mc->global_vars.repeat_window != 0},
+        last_ts{0, 0},
+        last_seq{0},
+        min_priority{record_priority_low},
+        records_shed{}
     {
         llq = llq_ptr;
         processor = mercury_packet_processor_construct(mc);
@@ -196,16 +244,144 @@ struct pkt_proc_json_writer_llq : public pkt_proc {
     void apply(struct packet_info *pi, uint8_t *eth) override {
         struct llq_msg *msg = llq->init_msg(block, pi->ts.tv_sec, pi->ts.tv_nsec);
         if (msg) {
-            size_t write_len = mercury_packet_processor_write_json(processor, msg->buf, LLQ_MSG_SIZE, eth, pi->len, &(msg->ts));
-            if (write_len > 0) {
-                msg->send(write_len);
-                llq->increment_widx();
+            msg->seq = pi->seq;
+            bool shedding = set_min_priority();
+            size_t write_len = mercury_packet_processor_write_json(processor, msg->buf(), LLQ_MSG_SIZE, eth, pi->len, &(msg->ts));
+            if (write_len != 0) {
+                llq->send_msg(msg, write_len);
+            } else if (!shedding || count_shed() == 0) {
+                counter_add(&counters.no_output, 1);
+            }
+        } else {
+            counter_add(&counters.llq_full, 1);
+        }
+        write_repeats(&pi->ts, pi->seq, false);
+    }
+
+    /*
+     * set_min_priority() tells the processor which records to shed,
+     * rather than format, given how far the queue is filled, and
+     * returns true if it may shed any; a blocking writer never does
+     */
+    bool set_min_priority() {
+        if (block) {
+            return false;
+        }
+        enum record_priority p = llq->min_priority();
+        if (p != min_priority) {
+            mercury_packet_processor_set_min_priority(processor, p);
+            min_priority = p;
+        }
+        return p != record_priority_low;
+    }
+
+    /*
+     * count_shed() adds the records that the processor has shed since
+     * it was last called to counters.llq_shed, and returns their number
+     */
+    uint64_t count_shed() {
+        uint64_t now[RECORD_PRIORITIES];
+        mercury_packet_processor_get_records_shed(processor, now);
+        uint64_t total = 0;
+        for (int p = 0; p < RECORD_PRIORITIES; p++) {
+            if (now[p] != records_shed[p]) {
+                counter_add(&counters.llq_shed[p], now[p] - records_shed[p]);
+                total += now[p] - records_shed[p];
+                records_shed[p] = now[p];
+            }
+        }
+        return total;
+    }
+
+    /*
+     * write_repeats() queues the summaries of the repeat windows that
+     * have closed by the time ts, or of all of them, marked with ts
+     * and the packet number seq of the last packet processed; those
+     * that do not fit into the queue are written later
+     */
+    void write_repeats(const struct timespec *ts, uint64_t seq, bool all) {
+        if (!repeats) {
+            return;
+        }
+        last_ts = *ts;
+        last_seq = seq;
+        while (true) {
+            struct llq_msg *msg = llq->init_msg(block, ts->tv_sec, ts->tv_nsec);
+            if (msg == nullptr) {
+                return;
             }
+            size_t write_len = mercury_packet_processor_write_repeats(processor, msg->buf(), LLQ_MSG_SIZE, &(msg->ts), all);
+            if (write_len == 0) {
+                return;
+            }
+            msg->seq = seq;
+            llq->send_msg(msg, write_len);
         }
     }
 
+    /*
+     * apply_batch() writes the JSON for each packet that produces any
+     * into the next message in the queue, and then publishes all of
+     * those messages to the reader with a single release store.  As
+     * with apply(), packets that arrive when the queue is full are not
+     * processed, and records are shed by priority as the queue fills;
+     * the shedding threshold is updated before each message is filled.
+     */
+    void apply_batch(struct packet_info *pi, uint8_t **eth, size_t n) override {
+        constexpr size_t max_batch = 256;
+        size_t lengths[max_batch];
+        struct timespec ts[max_batch];
+
+        while (n > 0) {
+            size_t batch = n < max_batch ? n : max_batch;
+            for (size_t i = 0; i < batch; i++) {
+                lengths[i] = pi[i].len;
+                ts[i] = pi[i].ts;
+            }
+            size_t offset = 0;
+            while (offset < batch) {
+                struct llq_msg *msg = llq->init_msg(block, 0, 0);
+                if (msg == nullptr) {
+                    counter_add(&counters.llq_full, n - offset);  // queue is full
+                    llq->publish();
+                    return;
+                }
+                void *buffer = msg->buf();
+                size_t output_length = 0;
+                size_t output_packet = 0;
+                size_t num_outputs = 0;
+                bool shedding = set_min_priority();
+                size_t processed = mercury_packet_processor_write_json_batch(processor, batch - offset, eth + offset,
+                                                                             lengths + offset, ts + offset,
+                                                                             1, &buffer, LLQ_MSG_SIZE,
+                                                                             &output_length, &output_packet, &num_outputs);
+                if (num_outputs) {
+                    msg->ts = ts[offset + output_packet];
+                    msg->seq = pi[offset + output_packet].seq;
+                    llq->commit_msg(msg, output_length);
+                }
+                uint64_t shed = shedding ? count_shed() : 0;
+                counter_add(&counters.no_output, processed - num_outputs - shed);
+                offset += processed;
+            }
+            llq->publish();
+            write_repeats(&pi[batch - 1].ts, pi[batch - 1].seq, false);
+
+            pi += batch;
+            eth += batch;
+            n -= batch;
+        }
+    }
+
+    void advance(const struct timespec *ts) override {
+        write_repeats(ts, last_seq, false);
+        llq->advance_watermark(llq_time_watermark(ts));
+    }
+
     void finalize() override {
+        write_repeats(&last_ts, last_seq, true);
         mercury_packet_processor_destruct(processor);
+        llq->set_watermark(LLQ_WATERMARK_END);
     }
 
     void flush() override {
@@ -225,6 +401,10 @@ struct pkt_proc_json_writer_llq_CPP : public pkt_proc {
     struct ll_queue *llq;
     bool block;
     struct stateful_pkt_proc processor;
+    bool repeats;
+    struct timespec last_ts;
+    uint64_t last_seq;
+    uint64_t records_shed[RECORD_PRIORITIES];
 
     /*
      * pkt_proc_json_writer(outfile_name, mode, max_records)
@@ -238,7 +418,11 @@ struct pkt_proc_json_writer_llq_CPP : public pkt_proc {
      */
     explicit pkt_proc_json_writer_llq_CPP(mercury_context mc, struct ll_queue *llq_ptr, bool blocking) :
         block{blocking},
-        processor{mc, PREALLOC_SIZE}
+        processor{mc, PREALLOC_SIZE},
+        repeats{mc->global_vars.repeat_window != 0},
+        last_ts{0, 0},
+        last_seq{0},
+        records_shed{}
     {
         llq = llq_ptr;
     }
@@ -246,16 +430,67 @@ struct pkt_proc_json_writer_llq_CPP : public pkt_proc {
     void apply(struct packet_info *pi, uint8_t *eth) override {
         struct llq_msg *msg = llq->init_msg(block, pi->ts.tv_sec, pi->ts.tv_nsec);
         if (msg) {
-            size_t write_len = processor.write_json(msg->buf, LLQ_MSG_SIZE, eth, pi->len, &(msg->ts));
-            if (write_len > 0) {
-                msg->send(write_len);
-                llq->increment_widx();
+            msg->seq = pi->seq;
+            if (!block) {
+                processor.min_priority = llq->min_priority();
             }
+            size_t write_len = processor.write_json(msg->buf(), LLQ_MSG_SIZE, eth, pi->len, &(msg->ts));
+            if (write_len != 0) {
+                llq->send_msg(msg, write_len);
+            } else if (processor.min_priority == record_priority_low || count_shed() == 0) {
+                counter_add(&counters.no_output, 1);
+            }
+        } else {
+            counter_add(&counters.llq_full, 1);
         }
+        write_repeats(&pi->ts, pi->seq, false);
+    }
+
+    // as in pkt_proc_json_writer_llq
+    //
+    uint64_t count_shed() {
+        uint64_t total = 0;
+        for (int p = 0; p < RECORD_PRIORITIES; p++) {
+            if (processor.records_shed[p] != records_shed[p]) {
+                counter_add(&counters.llq_shed[p], processor.records_shed[p] - records_shed[p]);
+                total += processor.records_shed[p] - records_shed[p];
+                records_shed[p] = processor.records_shed[p];
+            }
+        }
+        return total;
+    }
+
+    // as in pkt_proc_json_writer_llq
+    //
+    void write_repeats(const struct timespec *ts, uint64_t seq, bool all) {
+        if (!repeats) {
+            return;
+        }
+        last_ts = *ts;
+        last_seq = seq;
+        while (true) {
+            struct llq_msg *msg = llq->init_msg(block, ts->tv_sec, ts->tv_nsec);
+            if (msg == nullptr) {
+                return;
+            }
+            size_t write_len = processor.write_repeats(msg->buf(), LLQ_MSG_SIZE, &(msg->ts), all);
+            if (write_len == 0) {
+                return;
+            }
+            msg->seq = seq;
+            llq->send_msg(msg, write_len);
+        }
+    }
+
+    void advance(const struct timespec *ts) override {
+        write_repeats(ts, last_seq, false);
+        llq->advance_watermark(llq_time_watermark(ts));
     }
 
     void finalize() override {
+        write_repeats(&last_ts, last_seq, true);
         processor.finalize();
+        llq->set_watermark(LLQ_WATERMARK_END);
     }
 
     void flush() override {
@@ -288,19 +523,27 @@ struct pkt_proc_filter_pcap_writer_llq : public pkt_proc {
         uint8_t *packet = eth;
         unsigned int length = pi->len;
 
-        extern int rnd_pkt_drop_percent_accept;  /* defined in rnd_pkt_drop.c */
-
-        if (rnd_pkt_drop_percent_accept && drop_this_packet()) {
-            return;  /* random packet drop configured, and this packet got selected to be discarded */
+        if (flow_sampler_drop(eth, pi->len)) {
+            return;  /* flow sampling configured, and this packet's flow was not selected */
         }
 
         uint8_t buf[LLQ_MSG_SIZE];
         if (processor.write_json(buf, LLQ_MSG_SIZE, packet, length, &pi->ts) != 0) {
-            pcap_queue_write(llq, eth, pi->len, pi->ts.tv_sec, pi->ts.tv_nsec / 1000, block);
+            if (!pcap_queue_write(llq, eth, pi->len, pi->ts.tv_sec, pi->ts.tv_nsec, pi->seq, block)) {
+                counter_add(&counters.llq_full, 1);
+            }
+        } else {
+            counter_add(&counters.no_output, 1);
         }
     }
 
-    void finalize() override { }
+    void advance(const struct timespec *ts) override {
+        llq->advance_watermark(llq_time_watermark(ts));
+    }
+
+    void finalize() override {
+        llq->set_watermark(LLQ_WATERMARK_END);
+    }
 
     void flush() override {
     }
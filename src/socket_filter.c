@@ -0,0 +1,266 @@
+/*
+ * socket_filter.c
+ *
+ * kernel-side (classic BPF) packet filter derived from the protocol
+ * selection, for use with AF_PACKET sockets
+ *
+ * Copyright (c) 2021 Cisco Systems, Inc.  All rights reserved.  License at
+ * https://github.com/cisco/mercury/blob/master/LICENSE
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "socket_filter.h"
+#include "libmerc/eth.h"
+#include "libmerc/pkt_proc.h"
+#include "libmerc/extractor.h"
+#include "libmerc/udp.h"
+
+/*
+ * the filter is written with symbolic jump targets, which are
+ * resolved into the relative offsets used by classic BPF once the
+ * whole program has been emitted
+ */
+enum label {
+    label_none = 0,
+    label_vlan,
+    label_qinq,
+    label_l3,
+    label_ipv4,
+    label_ipv6,
+    label_tcp,
+    label_tcp_data,
+    label_udp,
+    label_accept,
+    label_reject,
+    num_labels
+};
+
+struct bpf_builder {
+    struct sock_filter *code;
+    unsigned int len;
+    bool overflow;
+    unsigned int label_pc[num_labels];
+    struct {
+        enum label jt;
+        enum label jf;
+    } fixup[SOCKET_FILTER_MAX_LEN];
+};
+
+static void emit(struct bpf_builder *b, uint16_t code, uint32_t k, enum label jt=label_none, enum label jf=label_none) {
+    if (b->len >= SOCKET_FILTER_MAX_LEN) {
+        b->overflow = true;
+        return;
+    }
+    b->code[b->len] = BPF_STMT(code, k);
+    b->fixup[b->len].jt = jt;
+    b->fixup[b->len].jf = jf;
+    b->len++;
+}
+
+static void set_label(struct bpf_builder *b, enum label l) {
+    b->label_pc[l] = b->len;
+}
+
+static bool resolve_labels(struct bpf_builder *b) {
+    for (unsigned int pc = 0; pc < b->len; pc++) {
+        struct sock_filter *insn = &b->code[pc];
+        enum label labels[2] = { b->fixup[pc].jt, b->fixup[pc].jf };
+        for (int i = 0; i < 2; i++) {
+            if (labels[i] == label_none) {
+                continue;
+            }
+            unsigned int target = b->label_pc[labels[i]];
+            if (target <= pc) {
+                return false;  /* classic BPF only jumps forward */
+            }
+            unsigned int offset = target - (pc + 1);
+            if (BPF_OP(insn->code) == BPF_JA) {
+                insn->k = offset;
+            } else if (offset > 255) {
+                return false;
+            } else if (i == 0) {
+                insn->jt = offset;
+            } else {
+                insn->jf = offset;
+            }
+        }
+    }
+    return true;
+}
+
+static uint32_t pattern_word(const unsigned char *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+/*
+ * emit_pattern_match() emits code that jumps to label_accept if the
+ * eight bytes at X + offset match the masked pattern, and otherwise
+ * falls through; patterns that cannot match, because their mask has
+ * been zeroed by the protocol selection, are omitted
+ */
+static void emit_pattern_match(struct bpf_builder *b, const struct msg_pattern *p, uint32_t offset) {
+    uint32_t mask[2]  = { pattern_word(p->mask),  pattern_word(p->mask + 4)  };
+    uint32_t value[2] = { pattern_word(p->value), pattern_word(p->value + 4) };
+    if ((value[0] & ~mask[0]) || (value[1] & ~mask[1])) {
+        return;
+    }
+    if (mask[0] == 0 && mask[1] == 0) {
+        /* matches any data field of at least eight bytes */
+        emit(b, BPF_LD | BPF_W | BPF_IND, offset + 4);
+        emit(b, BPF_JMP | BPF_JA, 0, label_accept);
+        return;
+    }
+
+    /*
+     * the last word compared jumps to accept on a match; a mismatch
+     * on an earlier word skips the rest of this pattern
+     */
+    uint32_t remaining = (mask[1] ? 3 : 0);
+    for (int i = 0; i < 2; i++) {
+        if (mask[i] == 0) {
+            continue;
+        }
+        emit(b, BPF_LD | BPF_W | BPF_IND, offset + 4 * i);
+        emit(b, BPF_ALU | BPF_AND | BPF_K, mask[i]);
+        if (i == 1 || remaining == 0) {
+            emit(b, BPF_JMP | BPF_JEQ | BPF_K, value[i], label_accept);
+        } else {
+            emit(b, BPF_JMP | BPF_JEQ | BPF_K, value[i]);
+            b->code[b->len - 1].jf = remaining;
+        }
+    }
+}
+
+enum status socket_filter_compile(struct socket_filter *f,
+                                  mercury_context mc,
+                                  unsigned int snaplen) {
+
+    struct bpf_builder *b = new bpf_builder{};
+    b->code = f->code;
+
+    bool accept_all_tcp_data = mc->global_vars.output_tcp_initial_data;
+#ifdef USE_TCP_REASSEMBLY
+    accept_all_tcp_data = true;  /* reassembly needs every segment */
+#endif
+    bool accept_tcp_syn = select_tcp_syn || mc->global_vars.output_tcp_initial_data;
+    bool accept_all_udp_data = mc->global_vars.output_udp_initial_data;
+
+    /*
+     * layer 2: Ethernet, with up to two VLAN tags (outer 802.1ad); A
+     * holds the ethertype and X the offset of the layer 3 header
+     */
+    emit(b, BPF_LD | BPF_H | BPF_ABS, 12);
+    emit(b, BPF_JMP | BPF_JEQ | BPF_K, ETH_TYPE_1AD, label_vlan);
+    emit(b, BPF_JMP | BPF_JEQ | BPF_K, ETH_TYPE_VLAN, label_vlan);
+    emit(b, BPF_LDX | BPF_W | BPF_IMM, 14);
+    emit(b, BPF_JMP | BPF_JA, 0, label_l3);
+    set_label(b, label_vlan);
+    emit(b, BPF_LD | BPF_H | BPF_ABS, 16);
+    emit(b, BPF_JMP | BPF_JEQ | BPF_K, ETH_TYPE_VLAN, label_qinq);
+    emit(b, BPF_LDX | BPF_W | BPF_IMM, 18);
+    emit(b, BPF_JMP | BPF_JA, 0, label_l3);
+    set_label(b, label_qinq);
+    emit(b, BPF_LD | BPF_H | BPF_ABS, 20);
+    emit(b, BPF_LDX | BPF_W | BPF_IMM, 22);
+    set_label(b, label_l3);
+    emit(b, BPF_JMP | BPF_JEQ | BPF_K, ETH_TYPE_IP, label_ipv4);
+    emit(b, BPF_JMP | BPF_JEQ | BPF_K, ETH_TYPE_IPV6, label_ipv6);
+    emit(b, BPF_JMP | BPF_JEQ | BPF_K, ETH_TYPE_MPLS, label_accept, label_reject);
+
+    /*
+     * layer 3: M[0] is set to the offset of the transport header;
+     * fragments and IPv6 extension headers are accepted unexamined
+     */
+    set_label(b, label_ipv4);
+    emit(b, BPF_LD | BPF_H | BPF_IND, 6);
+    emit(b, BPF_JMP | BPF_JSET | BPF_K, 0x3fff, label_accept);
+    emit(b, BPF_LD | BPF_B | BPF_IND, 0);
+    emit(b, BPF_ALU | BPF_AND | BPF_K, 0x0f);
+    emit(b, BPF_ALU | BPF_LSH | BPF_K, 2);
+    emit(b, BPF_ALU | BPF_ADD | BPF_X, 0);
+    emit(b, BPF_ST, 0);
+    emit(b, BPF_LD | BPF_B | BPF_IND, 9);
+    emit(b, BPF_JMP | BPF_JEQ | BPF_K, 6, label_tcp);
+    emit(b, BPF_JMP | BPF_JEQ | BPF_K, 17, label_udp, label_reject);
+
+    set_label(b, label_ipv6);
+    emit(b, BPF_MISC | BPF_TXA, 0);
+    emit(b, BPF_ALU | BPF_ADD | BPF_K, 40);
+    emit(b, BPF_ST, 0);
+    emit(b, BPF_LD | BPF_B | BPF_IND, 6);
+    emit(b, BPF_JMP | BPF_JEQ | BPF_K, 6, label_tcp);
+    emit(b, BPF_JMP | BPF_JEQ | BPF_K, 17, label_udp);
+    emit(b, BPF_JMP | BPF_JEQ | BPF_K, 58, label_reject);   /* ICMPv6 */
+    emit(b, BPF_JMP | BPF_JEQ | BPF_K, 59, label_reject, label_accept);  /* no next header */
+
+    /*
+     * TCP: SYN and SYN/ACK packets, and data whose first eight bytes
+     * match an enabled message pattern
+     */
+    set_label(b, label_tcp);
+    emit(b, BPF_LDX | BPF_W | BPF_MEM, 0);
+    emit(b, BPF_LD | BPF_B | BPF_IND, 13);
+    emit(b, BPF_JMP | BPF_JSET | BPF_K, 0x02, accept_tcp_syn ? label_accept : label_tcp_data);
+    set_label(b, label_tcp_data);
+    emit(b, BPF_LD | BPF_B | BPF_IND, 12);
+    emit(b, BPF_ALU | BPF_RSH | BPF_K, 4);
+    emit(b, BPF_ALU | BPF_LSH | BPF_K, 2);
+    emit(b, BPF_ALU | BPF_ADD | BPF_X, 0);
+    emit(b, BPF_MISC | BPF_TAX, 0);
+    if (accept_all_tcp_data) {
+        /* accept if there is anything after the TCP header (including Ethernet padding) */
+        emit(b, BPF_LD | BPF_W | BPF_LEN, 0);
+        emit(b, BPF_JMP | BPF_JGT | BPF_X, 0, label_accept, label_reject);
+    } else {
+        for (const struct msg_pattern *p = tcp_msg_patterns; p->mask != nullptr; p++) {
+            emit_pattern_match(b, p, 0);
+        }
+        emit(b, BPF_JMP | BPF_JA, 0, label_reject);
+    }
+
+    /*
+     * UDP: mDNS (if selected), and data whose first eight bytes match
+     * an enabled message pattern
+     */
+    set_label(b, label_udp);
+    emit(b, BPF_LDX | BPF_W | BPF_MEM, 0);
+    if (accept_all_udp_data) {
+        emit(b, BPF_MISC | BPF_TXA, 0);
+        emit(b, BPF_ALU | BPF_ADD | BPF_K, 8);
+        emit(b, BPF_MISC | BPF_TAX, 0);
+        emit(b, BPF_LD | BPF_W | BPF_LEN, 0);
+        emit(b, BPF_JMP | BPF_JGT | BPF_X, 0, label_accept, label_reject);
+    } else {
+        if (select_mdns) {
+            emit(b, BPF_LD | BPF_H | BPF_IND, 0);
+            emit(b, BPF_JMP | BPF_JEQ | BPF_K, 5353, label_accept);
+            emit(b, BPF_LD | BPF_H | BPF_IND, 2);
+            emit(b, BPF_JMP | BPF_JEQ | BPF_K, 5353, label_accept);
+        }
+        for (const struct msg_pattern *p = udp_msg_patterns; p->mask != nullptr; p++) {
+            emit_pattern_match(b, p, 8);
+        }
+    }
+
+    set_label(b, label_reject);
+    emit(b, BPF_RET | BPF_K, 0);
+    set_label(b, label_accept);
+    emit(b, BPF_RET | BPF_K, snaplen ? snaplen : 0xffffffff);
+
+    bool ok = !b->overflow && resolve_labels(b);
+    f->prog.len = b->len;
+    f->prog.filter = f->code;
+    delete b;
+    if (!ok) {
+        fprintf(stderr, "error: could not compile socket filter\n");
+        return status_err;
+    }
+    return status_ok;
+}
+
+int socket_filter_attach(int sockfd, const struct socket_filter *f) {
+    return setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_FILTER, &f->prog, sizeof(f->prog));
+}
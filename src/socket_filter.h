@@ -0,0 +1,48 @@
+/*
+ * socket_filter.h
+ *
+ * kernel-side (classic BPF) packet filter derived from the protocol
+ * selection, for use with AF_PACKET sockets
+ *
+ * Copyright (c) 2021 Cisco Systems, Inc.  All rights reserved.  License at
+ * https://github.com/cisco/mercury/blob/master/LICENSE
+ */
+
+#ifndef SOCKET_FILTER_H
+#define SOCKET_FILTER_H
+
+#include <linux/filter.h>
+#include "libmerc/libmerc.h"
+
+#define SOCKET_FILTER_MAX_LEN 512
+
+/*
+ * struct socket_filter holds a classic BPF program that accepts only
+ * the packets from which the packet processor could produce output,
+ * given the --select and --nonselected-*-data options; it is
+ * conservative, in that it accepts some packets (e.g. IP fragments,
+ * MPLS, and IPv6 extension headers) that are later discarded in user
+ * space.  Accepted packets are truncated to snaplen bytes, if snaplen
+ * is nonzero.
+ */
+struct socket_filter {
+    struct sock_filter code[SOCKET_FILTER_MAX_LEN];
+    struct sock_fprog prog;
+};
+
+/*
+ * socket_filter_compile() builds the filter for the mercury context
+ * mc, whose protocol selection has already been configured, and
+ * returns status_ok on success
+ */
+enum status socket_filter_compile(struct socket_filter *f,
+                                  mercury_context mc,
+                                  unsigned int snaplen);
+
+/*
+ * socket_filter_attach() attaches the filter to a socket, and returns
+ * zero on success
+ */
+int socket_filter_attach(int sockfd, const struct socket_filter *f);
+
+#endif /* SOCKET_FILTER_H */
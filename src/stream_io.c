@@ -0,0 +1,363 @@
+/*
+ * stream_io.c
+ *
+ * output writer that streams records to local subscribers over a
+ * SOCK_SEQPACKET Unix-domain socket
+ *
+ * Copyright (c) 2021 Cisco Systems, Inc.  All rights reserved.  License at
+ * https://github.com/cisco/mercury/blob/master/LICENSE
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "stream_io.h"
+#include "signal_handling.h"
+
+/*
+ * Records are sent to each subscriber straight from the caller's
+ * buffer while its socket has room.  Once it has none, with the drop
+ * policies, copies of the records are held in the subscriber's
+ * backlog, a ring of up to STREAM_BACKLOG_RECORDS records and
+ * STREAM_BACKLOG_BYTES bytes, and sent as the subscriber catches up;
+ * the policy decides which record is dropped when the backlog is full.
+ * With stream_policy_block, there is no backlog: the caller waits
+ * until the socket has room, or until mercury is told to stop, after
+ * which a record that does not fit is dropped rather than waited for.
+ */
+struct stream_record {
+    uint8_t *data;
+    size_t len;
+};
+
+struct stream_subscriber {
+    int fd;
+    unsigned int id;               /* order in which subscribers connected */
+    struct stream_record *backlog; /* allocated when first needed          */
+    unsigned int head;             /* oldest record in backlog             */
+    unsigned int count;
+    size_t backlog_bytes;
+    uint64_t sent;
+    uint64_t dropped;
+};
+
+struct stream_writer {
+    int listen_fd;
+    char *path;
+    enum stream_policy policy;
+    bool verbose;
+    struct stream_subscriber subscribers[STREAM_MAX_SUBSCRIBERS];
+    unsigned int num_subscribers;
+    unsigned int next_id;
+    uint64_t unsubscribed;         /* records written with no subscriber   */
+};
+
+enum send_result {
+    send_ok,
+    send_full,
+    send_closed
+};
+
+static enum send_result stream_subscriber_send(struct stream_subscriber *sub, const void *data, size_t len) {
+    while (true) {
+        if (send(sub->fd, data, len, MSG_DONTWAIT | MSG_NOSIGNAL) >= 0) {
+            sub->sent++;
+            return send_ok;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+            return send_full;
+        }
+        if (errno == EMSGSIZE) {
+            sub->dropped++;        // too large for the socket; skip it
+            return send_ok;
+        }
+        return send_closed;
+    }
+}
+
+static void stream_subscriber_pop(struct stream_subscriber *sub) {
+    struct stream_record *r = &sub->backlog[sub->head];
+    sub->backlog_bytes -= r->len;
+    free(r->data);
+    r->data = NULL;
+    sub->head = (sub->head + 1) % STREAM_BACKLOG_RECORDS;
+    sub->count--;
+}
+
+/*
+ * stream_subscriber_drain() sends records from the backlog until it
+ * is empty or the socket is full, and returns send_closed if the
+ * subscriber has gone
+ */
+static enum send_result stream_subscriber_drain(struct stream_subscriber *sub) {
+    while (sub->count) {
+        struct stream_record *r = &sub->backlog[sub->head];
+        enum send_result result = stream_subscriber_send(sub, r->data, r->len);
+        if (result != send_ok) {
+            return result;
+        }
+        stream_subscriber_pop(sub);
+    }
+    return send_ok;
+}
+
+/*
+ * stream_subscriber_hold() copies a record into the backlog, making
+ * room for it, or not, as set by policy
+ */
+static void stream_subscriber_hold(struct stream_subscriber *sub, enum stream_policy policy, const void *data, size_t len) {
+    if (sub->backlog == NULL) {
+        sub->backlog = (struct stream_record *)calloc(STREAM_BACKLOG_RECORDS, sizeof(struct stream_record));
+        if (sub->backlog == NULL) {
+            sub->dropped++;
+            return;
+        }
+    }
+    while (sub->count == STREAM_BACKLOG_RECORDS || (sub->count && sub->backlog_bytes + len > STREAM_BACKLOG_BYTES)) {
+        if (policy == stream_policy_drop_newest) {
+            sub->dropped++;
+            return;
+        }
+        stream_subscriber_pop(sub);  // stream_policy_drop_oldest
+        sub->dropped++;
+    }
+    uint8_t *copy = (uint8_t *)malloc(len);
+    if (copy == NULL) {
+        sub->dropped++;
+        return;
+    }
+    memcpy(copy, data, len);
+    struct stream_record *r = &sub->backlog[(sub->head + sub->count) % STREAM_BACKLOG_RECORDS];
+    r->data = copy;
+    r->len = len;
+    sub->backlog_bytes += len;
+    sub->count++;
+}
+
+static void stream_writer_report(struct stream_writer *s, struct stream_subscriber *sub, const char *event) {
+    if (s->verbose) {
+        fprintf(stderr, "stream subscriber %u %s: %" PRIu64 " records sent, %" PRIu64 " dropped\n",
+                sub->id, event, sub->sent, sub->dropped);
+    }
+}
+
+/*
+ * stream_writer_remove() disconnects subscriber i; records still held
+ * for it are counted as dropped
+ */
+static void stream_writer_remove(struct stream_writer *s, unsigned int i, const char *event) {
+    struct stream_subscriber *sub = &s->subscribers[i];
+    sub->dropped += sub->count;
+    while (sub->count) {
+        stream_subscriber_pop(sub);
+    }
+    free(sub->backlog);
+    close(sub->fd);
+    stream_writer_report(s, sub, event);
+    s->subscribers[i] = s->subscribers[--s->num_subscribers];
+}
+
+static void stream_writer_accept(struct stream_writer *s) {
+    while (true) {
+        int fd = accept4(s->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("warning: could not accept stream subscriber");
+            }
+            return;
+        }
+        if (s->num_subscribers == STREAM_MAX_SUBSCRIBERS) {
+            fprintf(stderr, "warning: stream subscriber refused; %u are connected already\n", STREAM_MAX_SUBSCRIBERS);
+            close(fd);
+            continue;
+        }
+        int sndbuf = STREAM_SNDBUF;
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));  // best effort
+        struct stream_subscriber *sub = &s->subscribers[s->num_subscribers++];
+        memset(sub, 0, sizeof(*sub));
+        sub->fd = fd;
+        sub->id = s->next_id++;
+        if (s->verbose) {
+            fprintf(stderr, "stream subscriber %u connected\n", sub->id);
+        }
+    }
+}
+
+/*
+ * stream_socket_in_use() returns true unless a connection to the
+ * socket at addr is refused, which shows that no process is listening
+ * on it any longer
+ */
+static bool stream_socket_in_use(const struct sockaddr_un *addr) {
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return true;
+    }
+    int status;
+    do {
+        status = connect(fd, (const struct sockaddr *)addr, sizeof(*addr));
+    } while (status != 0 && errno == EINTR);
+    bool refused = status != 0 && errno == ECONNREFUSED;
+    close(fd);
+    return !refused;
+}
+
+struct stream_writer *stream_writer_open(const char *path, enum stream_policy policy, bool verbose) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "error: stream socket path %s is too long\n", path);
+        return NULL;
+    }
+    strcpy(addr.sun_path, path);
+
+    struct stat st;
+    if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        if (stream_socket_in_use(&addr)) {
+            fprintf(stderr, "error: stream socket %s is in use by another process\n", path);
+            return NULL;
+        }
+        unlink(path);  // left behind by an earlier run
+    }
+
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("error: could not create stream socket");
+        return NULL;
+    }
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, STREAM_MAX_SUBSCRIBERS) != 0) {
+        fprintf(stderr, "error: could not listen on stream socket %s (%s)\n", path, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    struct stream_writer *s = (struct stream_writer *)calloc(1, sizeof(struct stream_writer));
+    if (s == NULL || (s->path = strdup(path)) == NULL) {
+        fprintf(stderr, "error: could not allocate stream writer\n");
+        free(s);
+        close(fd);
+        unlink(path);
+        return NULL;
+    }
+    s->listen_fd = fd;
+    s->policy = policy;
+    s->verbose = verbose;
+    return s;
+}
+
+void stream_writer_write(struct stream_writer *s, const void *data, size_t len) {
+    if (s->num_subscribers == 0) {
+        s->unsubscribed++;
+        return;
+    }
+    unsigned int i = 0;
+    while (i < s->num_subscribers) {
+        struct stream_subscriber *sub = &s->subscribers[i];
+        enum send_result result = stream_subscriber_drain(sub);
+        if (result == send_ok) {
+            result = stream_subscriber_send(sub, data, len);
+        }
+        if (result == send_full) {
+            if (s->policy == stream_policy_block) {
+                while (result == send_full && sig_close_flag == 0) {
+                    struct pollfd p = { sub->fd, POLLOUT, 0 };
+                    poll(&p, 1, STREAM_BLOCK_POLL_MSEC);
+                    result = stream_subscriber_send(sub, data, len);
+                }
+                if (result == send_full) {
+                    sub->dropped++;   // shutting down; don't wait on a stuck reader
+                    result = send_ok;
+                }
+            } else {
+                stream_subscriber_hold(sub, s->policy, data, len);
+                result = send_ok;
+            }
+        }
+        if (result == send_closed) {
+            stream_writer_remove(s, i, "disconnected");
+            continue;  // another subscriber has taken its place
+        }
+        i++;
+    }
+}
+
+void stream_writer_flush(struct stream_writer *s) {
+    stream_writer_accept(s);
+    unsigned int i = 0;
+    while (i < s->num_subscribers) {
+        if (stream_subscriber_drain(&s->subscribers[i]) == send_closed) {
+            stream_writer_remove(s, i, "disconnected");
+            continue;
+        }
+        i++;
+    }
+}
+
+/*
+ * stream_writer_drain() waits up to msec milliseconds for the records
+ * held for subscribers to be sent, and returns early once they all have
+ */
+static void stream_writer_drain(struct stream_writer *s, int msec) {
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (true) {
+        struct pollfd p[STREAM_MAX_SUBSCRIBERS];
+        nfds_t n = 0;
+        for (unsigned int i = 0; i < s->num_subscribers; i++) {
+            if (s->subscribers[i].count) {
+                p[n].fd = s->subscribers[i].fd;
+                p[n].events = POLLOUT;
+                p[n].revents = 0;
+                n++;
+            }
+        }
+        if (n == 0) {
+            return;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        int elapsed = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+        if (elapsed >= msec) {
+            return;
+        }
+        poll(p, n, msec - elapsed);
+        unsigned int i = 0;
+        while (i < s->num_subscribers) {
+            if (s->subscribers[i].count && stream_subscriber_drain(&s->subscribers[i]) == send_closed) {
+                stream_writer_remove(s, i, "disconnected");
+                continue;
+            }
+            i++;
+        }
+    }
+}
+
+void stream_writer_close(struct stream_writer *s) {
+    stream_writer_flush(s);
+    stream_writer_drain(s, STREAM_CLOSE_DRAIN_MSEC);
+    while (s->num_subscribers) {
+        stream_writer_remove(s, s->num_subscribers - 1, "closed");
+    }
+    if (s->verbose && s->unsubscribed) {
+        fprintf(stderr, "stream: %" PRIu64 " records written with no subscriber\n", s->unsubscribed);
+    }
+    close(s->listen_fd);
+    unlink(s->path);
+    free(s->path);
+    free(s);
+}
@@ -0,0 +1,62 @@
+/*
+ * stream_io.h
+ *
+ * output writer that streams records to local subscribers over a
+ * SOCK_SEQPACKET Unix-domain socket
+ *
+ * Copyright (c) 2021 Cisco Systems, Inc.  All rights reserved.  License at
+ * https://github.com/cisco/mercury/blob/master/LICENSE
+ */
+
+#ifndef STREAM_IO_H
+#define STREAM_IO_H
+
+#include <stddef.h>
+#include "mercury.h"
+
+#define STREAM_MAX_SUBSCRIBERS   16          /* subscribers connected at once          */
+#define STREAM_BACKLOG_RECORDS   65536       /* most records held for a subscriber     */
+#define STREAM_BACKLOG_BYTES     (1 << 24)   /* most bytes held for a subscriber       */
+#define STREAM_SNDBUF            (1 << 22)   /* requested socket send buffer size      */
+#define STREAM_BLOCK_POLL_MSEC   100         /* wait between checks for a slow reader  */
+#define STREAM_CLOSE_DRAIN_MSEC  2000        /* longest wait to send held records at close */
+
+struct stream_writer;
+
+/*
+ * stream_writer_open() creates a SOCK_SEQPACKET Unix-domain socket
+ * bound to path (removing a socket left there by an earlier run, but
+ * not one on which another process is listening), on which any
+ * number of local consumers, up to STREAM_MAX_SUBSCRIBERS, can connect
+ * to receive records, each record as one message, starting with the
+ * first record written after they connect.  What happens when a
+ * subscriber does not keep up is set by policy (see enum
+ * stream_policy).  It returns NULL if the socket could not be created.
+ */
+struct stream_writer *stream_writer_open(const char *path, enum stream_policy policy, bool verbose);
+
+/*
+ * stream_writer_write() sends the len bytes at data to each
+ * subscriber as one message; it waits only with stream_policy_block,
+ * and only for a subscriber that has stopped reading, until
+ * sig_close_flag is set
+ */
+void stream_writer_write(struct stream_writer *s, const void *data, size_t len);
+
+/*
+ * stream_writer_flush() accepts any new subscribers, and sends records
+ * held for slow subscribers as far as they can take them, without
+ * waiting
+ */
+void stream_writer_flush(struct stream_writer *s);
+
+/*
+ * stream_writer_close() sends the records still held for subscribers,
+ * waiting up to STREAM_CLOSE_DRAIN_MSEC for them to be read, then
+ * disconnects the subscribers, counting any records left as dropped,
+ * removes the socket, reports the counters of each subscriber on
+ * stderr if verbose, and frees s
+ */
+void stream_writer_close(struct stream_writer *s);
+
+#endif /* STREAM_IO_H */
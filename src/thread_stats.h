@@ -0,0 +1,128 @@
+/*
+ * thread_stats.h
+ *
+ * per-thread capture statistics that are written by a single capture
+ * thread and read by the stats thread without locking
+ *
+ * Copyright (c) 2021 Cisco Systems, Inc.  All rights reserved.  License at
+ * https://github.com/cisco/mercury/blob/master/LICENSE
+ */
+
+#ifndef THREAD_STATS_H
+#define THREAD_STATS_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include "libmerc/libmerc.h"
+
+/*
+ * struct thread_counters holds cumulative counters that are only ever
+ * written by the thread that owns them; the owner updates them with
+ * counter_add(), and other threads read them with counter_read().
+ * Neither needs a locked instruction, since there is only one
+ * writer, but both are atomic so that readers never see a torn value.
+ */
+struct thread_counters {
+    uint64_t packets;      /* packets received                             */
+    uint64_t bytes;        /* bytes received                               */
+    uint64_t no_output;    /* packets from which no output was produced    */
+    uint64_t llq_full;     /* packets discarded due to a full output queue */
+    uint64_t llq_shed[RECORD_PRIORITIES];  /* records of each priority that were
+                                              shed, before they were formatted, to
+                                              keep queue headroom for records of
+                                              higher priority (see record_priority) */
+};
+
+static inline void counter_add(uint64_t *counter, uint64_t n) {
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t counter_read(const uint64_t *counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static inline void thread_counters_read(const struct thread_counters *c, struct thread_counters *snapshot) {
+    snapshot->packets   = counter_read(&c->packets);
+    snapshot->bytes     = counter_read(&c->bytes);
+    snapshot->no_output = counter_read(&c->no_output);
+    snapshot->llq_full  = counter_read(&c->llq_full);
+    for (int p = 0; p < RECORD_PRIORITIES; p++) {
+        snapshot->llq_shed[p] = counter_read(&c->llq_shed[p]);
+    }
+}
+
+/*
+ * thread_counters_shed() returns the number of records of any
+ * priority that were shed
+ */
+static inline uint64_t thread_counters_shed(const struct thread_counters *c) {
+    uint64_t total = 0;
+    for (int p = 0; p < RECORD_PRIORITIES; p++) {
+        total += c->llq_shed[p];
+    }
+    return total;
+}
+
+/*
+ * struct ring_usage_hist is a histogram of the time (in nanoseconds)
+ * that a capture thread spent at each ring usage level, where the
+ * level is the number of blocks that were processed in a row before
+ * the ring was found empty.  The bins are cumulative, and are
+ * protected by a sequence lock: the capture thread (the only writer)
+ * never waits, and the stats thread retries its snapshot in the rare
+ * case that it overlaps with an update.
+ */
+struct ring_usage_hist {
+    uint32_t seq;       /* odd while an update is in progress       */
+    uint32_t num_bins;
+    uint64_t *bins;     /* written by the capture thread            */
+    uint64_t *last;     /* previous snapshot, used by the reader    */
+
+    bool init(uint32_t n) {
+        seq = 0;
+        num_bins = n;
+        bins = (uint64_t *)calloc(n, sizeof(uint64_t));
+        last = (uint64_t *)calloc(n, sizeof(uint64_t));
+        return bins != nullptr && last != nullptr;
+    }
+
+    void free_bins() {
+        free(bins);
+        free(last);
+        bins = last = nullptr;
+    }
+
+    /* add() is called only by the capture thread */
+    void add(uint32_t bin, uint64_t ns) {
+        uint32_t s = __atomic_load_n(&seq, __ATOMIC_RELAXED);
+        __atomic_store_n(&seq, s + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        __atomic_store_n(&bins[bin], bins[bin] + ns, __ATOMIC_RELAXED);
+        __atomic_store_n(&seq, s + 2, __ATOMIC_RELEASE);
+    }
+
+    /*
+     * interval() is called only by the stats thread; it writes the
+     * time spent in each bin since its previous invocation into
+     * delta, which must have room for num_bins values
+     */
+    void interval(uint64_t *delta) {
+        uint32_t s0, s1;
+        do {
+            s0 = __atomic_load_n(&seq, __ATOMIC_ACQUIRE);
+            for (uint32_t i = 0; i < num_bins; i++) {
+                delta[i] = __atomic_load_n(&bins[i], __ATOMIC_RELAXED);
+            }
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            s1 = __atomic_load_n(&seq, __ATOMIC_RELAXED);
+        } while ((s0 & 1) || s0 != s1);
+
+        for (uint32_t i = 0; i < num_bins; i++) {
+            uint64_t total = delta[i];
+            delta[i] = total - last[i];
+            last[i] = total;
+        }
+    }
+};
+
+#endif /* THREAD_STATS_H */
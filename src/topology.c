@@ -0,0 +1,199 @@
+/*
+ * topology.c
+ *
+ * CPU and NUMA topology discovery and thread placement
+ *
+ * Copyright (c) 2021 Cisco Systems, Inc.  All rights reserved.  License at
+ * https://github.com/cisco/mercury/blob/master/LICENSE
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#include "topology.h"
+
+/*
+ * placement holds the CPUs to which worker threads are pinned, in
+ * ascending order; it is set once, before any threads are created
+ */
+static struct {
+    int node;
+    int num_cpus;
+    int cpus[CPU_SETSIZE];
+} placement = { -1, 0, { 0 } };
+
+static enum status read_sysfs_line(const char *path, char *line, size_t len) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        return status_err;
+    }
+    char *result = fgets(line, len, f);
+    fclose(f);
+    if (result == NULL) {
+        return status_err;
+    }
+    line[strcspn(line, "\n")] = '\0';
+    return status_ok;
+}
+
+int topology_interface_numa_node(const char *if_name) {
+    char path[FILENAME_MAX];
+    char line[32];
+    snprintf(path, sizeof(path), "/sys/class/net/%s/device/numa_node", if_name);
+    if (read_sysfs_line(path, line, sizeof(line)) != status_ok) {
+        return -1;
+    }
+    return atoi(line);
+}
+
+enum status topology_parse_cpulist(const char *cpulist, cpu_set_t *set) {
+    CPU_ZERO(set);
+    const char *s = cpulist;
+    while (*s != '\0') {
+        char *end;
+        long first = strtol(s, &end, 10);
+        if (end == s || first < 0 || first >= CPU_SETSIZE) {
+            return status_err;
+        }
+        long last = first;
+        s = end;
+        if (*s == '-') {
+            s++;
+            last = strtol(s, &end, 10);
+            if (end == s || last < first || last >= CPU_SETSIZE) {
+                return status_err;
+            }
+            s = end;
+        }
+        for (long cpu = first; cpu <= last; cpu++) {
+            CPU_SET(cpu, set);
+        }
+        if (*s == ',') {
+            s++;
+        } else if (*s != '\0') {
+            return status_err;
+        }
+    }
+    return CPU_COUNT(set) > 0 ? status_ok : status_err;
+}
+
+static enum status node_cpus(int node, cpu_set_t *set) {
+    char path[FILENAME_MAX];
+    char line[4096];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    if (read_sysfs_line(path, line, sizeof(line)) != status_ok) {
+        return status_err;
+    }
+    return topology_parse_cpulist(line, set);
+}
+
+static long set_preferred_node(int node) {
+    unsigned long nodemask[16] = { 0 };
+    const unsigned long bits = 8 * sizeof(nodemask[0]);
+    if ((unsigned long)node >= bits * 16) {
+        errno = EINVAL;
+        return -1;
+    }
+    nodemask[node / bits] = 1UL << (node % bits);
+    return syscall(SYS_set_mempolicy, MPOL_PREFERRED, nodemask, bits * 16);
+}
+
+enum status topology_placement_init(const struct mercury_config *cfg) {
+    if (cfg->numa_node == NUMA_NODE_NONE && cfg->cpu_affinity == NULL) {
+        return status_ok;
+    }
+
+    int node = cfg->numa_node;
+    if (node == NUMA_NODE_AUTO) {
+        if (cfg->capture_interface == NULL) {
+            fprintf(stderr, "error: option numa requires a node number when not capturing from an interface\n");
+            return status_err;
+        }
+        node = topology_interface_numa_node(cfg->capture_interface);
+        if (node < 0) {
+            fprintf(stderr, "warning: NUMA node of interface %s is unknown; memory and threads will not be bound to a node\n",
+                    cfg->capture_interface);
+        }
+    }
+
+    cpu_set_t cpus;
+    if (cfg->cpu_affinity) {
+        if (topology_parse_cpulist(cfg->cpu_affinity, &cpus) != status_ok) {
+            fprintf(stderr, "error: could not parse cpu affinity list '%s'\n", cfg->cpu_affinity);
+            return status_err;
+        }
+    } else if (node >= 0) {
+        if (node_cpus(node, &cpus) != status_ok) {
+            fprintf(stderr, "error: could not read the CPUs of NUMA node %d\n", node);
+            return status_err;
+        }
+    } else {
+        return status_ok;  /* nothing to bind to */
+    }
+
+    /* restrict to the CPUs that this process is allowed to use */
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+        CPU_AND(&cpus, &cpus, &allowed);
+    }
+    if (CPU_COUNT(&cpus) == 0) {
+        fprintf(stderr, "error: none of the selected CPUs are available\n");
+        return status_err;
+    }
+
+    placement.node = node;
+    placement.num_cpus = 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &cpus)) {
+            placement.cpus[placement.num_cpus++] = cpu;
+        }
+    }
+
+    /*
+     * bind this thread before any setup allocations are made;
+     * threads created later inherit both settings, and worker
+     * threads are then narrowed to a single CPU
+     */
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    if (err != 0) {
+        fprintf(stderr, "%s: could not set CPU affinity\n", strerror(err));
+        return status_err;
+    }
+    if (node >= 0 && set_preferred_node(node) != 0) {
+        fprintf(stderr, "warning: %s: could not set memory policy for NUMA node %d\n", strerror(errno), node);
+    }
+
+    if (cfg->verbosity) {
+        fprintf(stderr, "thread placement: NUMA node %d, %d CPU(s):", node, placement.num_cpus);
+        for (int i = 0; i < placement.num_cpus; i++) {
+            fprintf(stderr, " %d", placement.cpus[i]);
+        }
+        fprintf(stderr, "\n");
+    }
+
+    return status_ok;
+}
+
+int topology_num_cpus(void) {
+    return placement.num_cpus;
+}
+
+enum status topology_set_worker_affinity(pthread_attr_t *attr, int tnum) {
+    if (placement.num_cpus == 0) {
+        return status_ok;
+    }
+    cpu_set_t cpu;
+    CPU_ZERO(&cpu);
+    CPU_SET(placement.cpus[tnum % placement.num_cpus], &cpu);
+    int err = pthread_attr_setaffinity_np(attr, sizeof(cpu), &cpu);
+    if (err != 0) {
+        fprintf(stderr, "%s: could not set CPU affinity for thread %d\n", strerror(err), tnum);
+        return status_err;
+    }
+    return status_ok;
+}
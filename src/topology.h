@@ -0,0 +1,56 @@
+/*
+ * topology.h
+ *
+ * CPU and NUMA topology discovery and thread placement
+ *
+ * Copyright (c) 2021 Cisco Systems, Inc.  All rights reserved.  License at
+ * https://github.com/cisco/mercury/blob/master/LICENSE
+ */
+
+#ifndef TOPOLOGY_H
+#define TOPOLOGY_H
+
+#include <sched.h>
+#include <pthread.h>
+#include "mercury.h"
+
+/*
+ * topology_interface_numa_node() returns the NUMA node to which the
+ * network interface if_name is attached, as reported by sysfs, or -1
+ * if that is unknown (e.g. for virtual interfaces)
+ */
+int topology_interface_numa_node(const char *if_name);
+
+/*
+ * topology_parse_cpulist() parses a cpulist string in the sysfs
+ * format (e.g. "0-3,8,10-11") into set, and returns status_ok on
+ * success
+ */
+enum status topology_parse_cpulist(const char *cpulist, cpu_set_t *set);
+
+/*
+ * topology_placement_init() sets up the thread placement policy from
+ * the --numa and --cpu-affinity options in cfg.  If a NUMA node is
+ * selected, the calling thread is bound to the CPUs of that node and
+ * its memory policy is set to prefer that node, so that memory
+ * allocated during setup (rings, queues, and tables) is node-local
+ * and threads created afterwards (e.g. the output thread) run on that
+ * node.  It returns status_ok if there is no placement policy.
+ */
+enum status topology_placement_init(const struct mercury_config *cfg);
+
+/*
+ * topology_num_cpus() returns the number of CPUs available to worker
+ * threads under the placement policy, or 0 if there is no policy
+ */
+int topology_num_cpus(void);
+
+/*
+ * topology_set_worker_affinity() sets the CPU affinity in attr for
+ * worker thread tnum, which is pinned to the tnum-th CPU (modulo the
+ * number of CPUs) of the placement policy; it does nothing if there
+ * is no policy
+ */
+enum status topology_set_worker_affinity(pthread_attr_t *attr, int tnum);
+
+#endif /* TOPOLOGY_H */
@@ -0,0 +1,106 @@
+#!/bin/python
+#
+# USAGE: benchmark-test.py <mercury> <pcap_input_file> <threads>
+#
+# runs mercury --benchmark on pcap_input_file, and on a gzip-compressed
+# copy of it, and checks that each JSON report is well formed, that its
+# totals are the sums over its threads, and that it counts every packet
+# and byte in the file, and the records that mercury writes without
+# --benchmark, once per loop
+#
+# RETURN: 0 on success, nonzero otherwise
+
+import gzip
+import json
+import shutil
+import struct
+import subprocess
+import sys
+
+counters = ('packets', 'bytes', 'records')
+
+
+def benchmark(mercury, pcap_file, threads, loops):
+    out = subprocess.run([mercury, '-r', pcap_file, '--benchmark', '-t', threads, '-p', str(loops)],
+                         stdout=subprocess.PIPE, check=True).stdout
+    lines = out.splitlines()
+    if len(lines) != 1:
+        raise ValueError('%d lines written with --benchmark, expected 1' % len(lines))
+    return json.loads(lines[0])['benchmark']
+
+
+def pcap_totals(pcap_file):
+    """
+    returns the number of packets in pcap_file, and the sum of their
+    captured lengths
+    """
+    with open(pcap_file, 'rb') as f:
+        data = f.read()
+    magic = struct.unpack('<I', data[:4])[0]
+    if magic in (0xa1b2c3d4, 0xa1b23c4d):
+        endian = '<'
+    elif magic in (0xd4c3b2a1, 0x4d3cb2a1):
+        endian = '>'
+    else:
+        raise ValueError('%s is not a PCAP file' % pcap_file)
+    packets = 0
+    total = 0
+    off = 24
+    while off + 16 <= len(data):
+        incl_len = struct.unpack(endian + 'I', data[off+8:off+12])[0]
+        packets += 1
+        total += incl_len
+        off += 16 + incl_len
+    return packets, total
+
+
+def record_count(mercury, pcap_file):
+    out = subprocess.run([mercury, '-r', pcap_file], stdout=subprocess.PIPE, check=True).stdout
+    return len(out.splitlines())
+
+
+def check(report, pcap_file, threads, loops, packets, nbytes, records):
+    if report['threads'] != int(threads) or len(report['per_thread']) != int(threads):
+        print('error: %s: report has %d threads, expected %s' % (pcap_file, len(report['per_thread']), threads))
+        return False
+    if report['loop_count'] != loops:
+        print('error: %s: report has loop_count %d, expected %d' % (pcap_file, report['loop_count'], loops))
+        return False
+    for c in counters:
+        total = sum(t[c] for t in report['per_thread'])
+        if report['total'][c] != total:
+            print('error: %s: total %s %d, but the threads sum to %d' % (pcap_file, c, report['total'][c], total))
+            return False
+    if report['total']['packets'] != packets * loops:
+        print('error: %s: %d packets processed, expected %d' % (pcap_file, report['total']['packets'], packets * loops))
+        return False
+    if report['total']['bytes'] != nbytes * loops:
+        print('error: %s: %d bytes processed, expected %d' % (pcap_file, report['total']['bytes'], nbytes * loops))
+        return False
+    if report['total']['records'] != records * loops:
+        print('error: %s: %d records counted, expected %d' % (pcap_file, report['total']['records'], records * loops))
+        return False
+    return True
+
+
+def main():
+    mercury, pcap_file, threads = sys.argv[1:4]
+    loops = 2
+
+    gz_file = 'tmp-benchmark.pcap.gz'
+    with open(pcap_file, 'rb') as f, gzip.open(gz_file, 'wb') as g:
+        shutil.copyfileobj(f, g)
+
+    packets, nbytes = pcap_totals(pcap_file)
+    records = record_count(mercury, pcap_file)
+    plain = benchmark(mercury, pcap_file, threads, loops)
+    compressed = benchmark(mercury, gz_file, threads, loops)
+    if not check(plain, pcap_file, threads, loops, packets, nbytes, records):
+        return 1
+    if not check(compressed, gz_file, threads, loops, packets, nbytes, records):
+        return 1
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
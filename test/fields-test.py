@@ -0,0 +1,77 @@
+#!/bin/python
+#
+# USAGE: fields-test.py <mercury> <pcap_input_file> <fields> [<mercury option>...]
+#
+# runs mercury on pcap_input_file with the given options, once with
+# --fields=<fields> and once without, and checks that the records
+# written with it are those written without it, projected onto fields
+#
+# RETURN: 0 on success, nonzero otherwise
+
+import json
+import subprocess
+import sys
+
+
+def compile_fields(fields):
+    root = {}
+    for field in fields.split(','):
+        node = root
+        names = field.strip().split('.')
+        for name in names[:-1]:
+            if node.get(name) is True:
+                break
+            node = node.setdefault(name, {})
+        else:
+            node[names[-1]] = True
+    return root
+
+
+def project(value, node):
+    if isinstance(value, dict):
+        out = {}
+        for k, v in value.items():
+            if k not in node:
+                continue
+            if node[k] is True:
+                out[k] = v
+            else:
+                v = project(v, node[k])
+                if v is not None:
+                    out[k] = v
+        return out if out else None   # an object left empty is omitted
+    if isinstance(value, list):
+        elements = (project(e, node) for e in value)
+        return [e for e in elements if e is not None]
+    return value
+
+
+def records(args):
+    out = subprocess.run(args, stdout=subprocess.PIPE, check=True).stdout
+    return [json.loads(line) for line in out.splitlines()]
+
+
+def main():
+    mercury, pcap_file, fields = sys.argv[1:4]
+    options = sys.argv[4:]
+    if fields.startswith('@'):
+        print('error: profiles are not expanded by this test')
+        return 1
+
+    full = records([mercury, '-r', pcap_file] + options)
+    projected = records([mercury, '-r', pcap_file, '--fields=' + fields] + options)
+
+    root = compile_fields(fields)
+    expected = [r for r in (project(r, root) for r in full) if r is not None]
+    if projected != expected:
+        print('error: %d records written with --fields=%s, expected %d' % (len(projected), fields, len(expected)))
+        for got, want in zip(projected, expected):
+            if got != want:
+                print('first difference:\n  got:      %s\n  expected: %s' % (json.dumps(got), json.dumps(want)))
+                break
+        return 1
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,157 @@
+/*
+ * flow-sampler-test.cc
+ *
+ * checks which packets flow_sampler_drop() always keeps: TCP SYNs,
+ * TLS ClientHellos and QUIC Initial packets on port 443 are never
+ * dropped, while DNS and other UDP flows are sampled, including those
+ * whose payload starts like a QUIC long header
+ *
+ * USAGE: flow-sampler-test
+ *
+ * RETURN: 0 on success, nonzero otherwise
+ *
+ * Copyright (c) 2021 Cisco Systems, Inc.  All rights reserved.  License at
+ * https://github.com/cisco/mercury/blob/master/LICENSE
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "flow_sampler.h"
+
+#define NUM_FLOWS 1000
+#define PERCENT_ACCEPT 30
+
+/*
+ * packet() writes an Ethernet/IPv4 frame from 10.0.0.1:src_port to
+ * 10.0.0.2:dst_port into buf, with a TCP header (flags tcp_flags) if
+ * protocol is 6 and a UDP header otherwise, followed by the payload,
+ * and returns its length
+ */
+static size_t packet(uint8_t *buf, uint8_t protocol, uint16_t src_port, uint16_t dst_port, uint8_t tcp_flags,
+                     const uint8_t *payload, size_t payload_len) {
+    size_t th_len = protocol == 6 ? 20 : 8;
+    size_t ip_len = 20 + th_len + payload_len;
+
+    memset(buf, 0, 14 + ip_len);
+    buf[12] = 0x08;                       /* ethertype IPv4 */
+    uint8_t *ip = buf + 14;
+    ip[0] = 0x45;
+    ip[2] = ip_len >> 8;
+    ip[3] = ip_len & 0xff;
+    ip[8] = 64;
+    ip[9] = protocol;
+    const uint8_t src[4] = { 10, 0, 0, 1 };
+    const uint8_t dst[4] = { 10, 0, 0, 2 };
+    memcpy(ip + 12, src, 4);
+    memcpy(ip + 16, dst, 4);
+    uint8_t *th = ip + 20;
+    th[0] = src_port >> 8;
+    th[1] = src_port & 0xff;
+    th[2] = dst_port >> 8;
+    th[3] = dst_port & 0xff;
+    if (protocol == 6) {
+        th[12] = 0x50;                    /* data offset: five words */
+        th[13] = tcp_flags;
+    } else {
+        th[4] = (th_len + payload_len) >> 8;
+        th[5] = (th_len + payload_len) & 0xff;
+    }
+    memcpy(th + th_len, payload, payload_len);
+    return 14 + ip_len;
+}
+
+/*
+ * count_drops() returns the number of NUM_FLOWS flows, each from a
+ * different source port, that are dropped when their first packet
+ * has the given protocol, destination port, TCP flags and payload;
+ * if vary_first_byte is true, the first byte of the payload of each
+ * flow is set to the low byte of its source port
+ */
+static unsigned int count_drops(uint8_t protocol, uint16_t dst_port, uint8_t tcp_flags,
+                                const uint8_t *payload, size_t payload_len, bool vary_first_byte=false) {
+    uint8_t buf[2048];
+    uint8_t data[1500];
+    memcpy(data, payload, payload_len);
+    unsigned int drops = 0;
+    for (unsigned int i = 0; i < NUM_FLOWS; i++) {
+        uint16_t src_port = 20000 + i;
+        if (vary_first_byte) {
+            data[0] = src_port & 0xff;
+        }
+        size_t len = packet(buf, protocol, src_port, dst_port, tcp_flags, data, payload_len);
+        if (flow_sampler_drop(buf, len)) {
+            drops++;
+        }
+    }
+    return drops;
+}
+
+static int failures = 0;
+
+static void expect(bool condition, const char *name, unsigned int drops) {
+    fprintf(stderr, "%-48s %4u of %u flows dropped: %s\n", name, drops, NUM_FLOWS, condition ? "ok" : "FAILED");
+    if (!condition) {
+        failures++;
+    }
+}
+
+int main(int, char *[]) {
+
+    set_percent_accept(PERCENT_ACCEPT);
+
+    /* a DNS query for example.com, with an id starting with 0xc3 */
+    const uint8_t dns_query[] = {
+        0xc3, 0x5a, 0x01, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x07, 'e', 'x', 'a', 'm', 'p', 'l', 'e', 0x03, 'c', 'o', 'm', 0x00,
+        0x00, 0x01, 0x00, 0x01
+    };
+
+    /* the start of a QUIC version 1 Initial, padded to 1200 bytes */
+    uint8_t quic_initial[1200] = {
+        0xc3, 0x00, 0x00, 0x00, 0x01, 0x08, 0x83, 0x94, 0xc8, 0xf0, 0x3e, 0x51, 0x57, 0x08, 0x00, 0x00,
+        0x44, 0x9e
+    };
+    uint8_t quic_version_negotiation[32] = {
+        0xc0, 0x00, 0x00, 0x00, 0x00, 0x08, 0x83, 0x94, 0xc8, 0xf0, 0x3e, 0x51, 0x57, 0x08, 0x00
+    };
+    uint8_t quic_short_header[64] = {
+        0x43, 0x83, 0x94, 0xc8, 0xf0, 0x3e, 0x51, 0x57, 0x08
+    };
+
+    /* a TLS handshake record holding the start of a ClientHello */
+    const uint8_t client_hello[] = {
+        0x16, 0x03, 0x01, 0x02, 0x00, 0x01, 0x00, 0x01, 0xfc, 0x03, 0x03
+    };
+    const uint8_t tcp_data[64] = { 0x17, 0x03, 0x03, 0x00, 0x3b };
+
+    /*
+     * sampled flows: about 70% of them should be dropped, so more than
+     * half that many must be; the DNS query starts like a QUIC long
+     * header Initial packet, as one in sixteen DNS queries do
+     */
+    unsigned int low = NUM_FLOWS * (100 - PERCENT_ACCEPT) / 200;
+
+    unsigned int drops = count_drops(17, 53, 0, dns_query, sizeof(dns_query));
+    expect(drops > low, "DNS queries", drops);
+    drops = count_drops(17, 53, 0, dns_query, sizeof(dns_query), true);
+    expect(drops > low, "DNS queries with varying ids", drops);
+    drops = count_drops(17, 4433, 0, quic_initial, sizeof(quic_initial));
+    expect(drops > low, "QUIC Initials on port 4433", drops);
+    drops = count_drops(17, 443, 0, quic_version_negotiation, sizeof(quic_version_negotiation));
+    expect(drops > low, "QUIC version negotiation on port 443", drops);
+    drops = count_drops(17, 443, 0, quic_short_header, sizeof(quic_short_header));
+    expect(drops > low, "QUIC short headers on port 443", drops);
+    drops = count_drops(6, 443, 0x18, tcp_data, sizeof(tcp_data));
+    expect(drops > low, "TLS application data", drops);
+
+    /* handshakes: never dropped */
+    drops = count_drops(17, 443, 0, quic_initial, sizeof(quic_initial));
+    expect(drops == 0, "QUIC Initials on port 443", drops);
+    drops = count_drops(6, 443, 0x02, tcp_data, 0);
+    expect(drops == 0, "TCP SYNs", drops);
+    drops = count_drops(6, 443, 0x18, client_hello, sizeof(client_hello));
+    expect(drops == 0, "TLS ClientHellos", drops);
+
+    return failures != 0;
+}
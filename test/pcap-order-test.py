@@ -0,0 +1,83 @@
+#!/bin/python
+#
+# USAGE: pcap-order-test.py <mercury> <pcap_input_file> <threads>
+#
+# writes a copy of pcap_input_file with each packet moved forward by
+# a fraction of a second, so that the packets of the two files are
+# interleaved within each second, then has mercury write the packets
+# of both files, read by threads threads, to a PCAP file with -w, and
+# checks that it holds the packets that it writes for each file on its
+# own, in time order
+#
+# RETURN: 0 on success, nonzero otherwise
+
+import struct
+import subprocess
+import sys
+
+shift_usec = 137   # less than the spacing of most packets in a capture
+
+
+def read_pcap(path):
+    with open(path, 'rb') as f:
+        data = f.read()
+    magic = struct.unpack('<I', data[:4])[0]
+    if magic == 0xa1b2c3d4:
+        endian = '<'
+    elif magic == 0xd4c3b2a1:
+        endian = '>'
+    else:
+        raise ValueError('%s is not a PCAP file with microsecond timestamps' % path)
+    header = data[:24]
+    packets = []
+    off = 24
+    while off + 16 <= len(data):
+        sec, usec, incl_len, orig_len = struct.unpack(endian + 'IIII', data[off:off+16])
+        packets.append((sec, usec, orig_len, data[off+16:off+16+incl_len]))
+        off += 16 + incl_len
+    return endian, header, packets
+
+
+def write_pcap(path, endian, header, packets):
+    with open(path, 'wb') as f:
+        f.write(header)
+        for sec, usec, orig_len, body in packets:
+            f.write(struct.pack(endian + 'IIII', sec, usec, len(body), orig_len))
+            f.write(body)
+
+
+def main():
+    mercury, pcap_file, threads = sys.argv[1:4]
+
+    endian, header, packets = read_pcap(pcap_file)
+    shifted = []
+    for sec, usec, orig_len, body in packets:
+        usec += shift_usec
+        shifted.append((sec + usec // 1000000, usec % 1000000, orig_len, body))
+    write_pcap('tmp-shifted.pcap', endian, header, shifted)
+
+    # the packets written by a single thread from each file, which
+    # are those that the merged output should hold
+    #
+    expected = []
+    for f in [pcap_file, 'tmp-shifted.pcap']:
+        subprocess.run([mercury, '-r', f, '-w', 'tmp-order.pcap'], check=True)
+        expected += read_pcap('tmp-order.pcap')[2]
+
+    subprocess.run([mercury, '-r', pcap_file + ',tmp-shifted.pcap', '-t', threads, '-w', 'tmp-order.pcap'], check=True)
+    written = read_pcap('tmp-order.pcap')[2]
+
+    times = [(sec, usec) for sec, usec, _, _ in written]
+    for i in range(1, len(times)):
+        if times[i] < times[i-1]:
+            print('error: packet %d (%d.%06d) written after packet %d (%d.%06d)' %
+                  (i, times[i][0], times[i][1], i - 1, times[i-1][0], times[i-1][1]))
+            return 1
+    if sorted(written) != sorted(expected):
+        print('error: %d packets written, expected %d' % (len(written), len(expected)))
+        return 1
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
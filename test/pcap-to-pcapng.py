@@ -0,0 +1,75 @@
+#!/bin/python
+#
+# USAGE: pcap-to-pcapng.py <pcap_input_file> <pcapng_output_file>
+#
+# converts a classic (microsecond, Ethernet) pcap file to pcapng, in a
+# way that exercises the pcapng reader: the packets are written as
+# enhanced packet blocks, alternately on an interface with the default
+# (microsecond) timestamp resolution and one with nanosecond
+# resolution, and the second half of the packets is written in a
+# second section with the opposite byte order, preceded by a block
+# that the reader must skip
+#
+# RETURN: 0 on success, nonzero otherwise
+
+import struct
+import sys
+
+
+def block(endian, block_type, body):
+    body += b'\0' * (-len(body) % 4)
+    length = len(body) + 12
+    return struct.pack(endian + 'II', block_type, length) + body + struct.pack(endian + 'I', length)
+
+
+def section_header(endian):
+    return block(endian, 0x0a0d0d0a, struct.pack(endian + 'IHHq', 0x1a2b3c4d, 1, 0, -1))
+
+
+def interface_description(endian, tsresol=None):
+    options = b''
+    if tsresol is not None:
+        options = struct.pack(endian + 'HHB3x', 9, 1, tsresol) + struct.pack(endian + 'HH', 0, 0)
+    return block(endian, 1, struct.pack(endian + 'HHI', 1, 0, 0) + options)
+
+
+def enhanced_packet(endian, interface, ts, data, orig_len):
+    hdr = struct.pack(endian + 'IIIII', interface, ts >> 32, ts & 0xffffffff, len(data), orig_len)
+    return block(endian, 6, hdr + data)
+
+
+def read_pcap(filename):
+    with open(filename, 'rb') as f:
+        hdr = f.read(24)
+        endian = '<' if struct.unpack('<I', hdr[:4])[0] == 0xa1b2c3d4 else '>'
+        while True:
+            rec = f.read(16)
+            if len(rec) < 16:
+                break
+            sec, usec, incl_len, orig_len = struct.unpack(endian + 'IIII', rec)
+            yield sec, usec, f.read(incl_len), orig_len
+
+
+def main():
+    if len(sys.argv) != 3:
+        print('usage: %s <pcap_input_file> <pcapng_output_file>' % sys.argv[0])
+        return 1
+
+    packets = list(read_pcap(sys.argv[1]))
+    half = len(packets) // 2
+    with open(sys.argv[2], 'wb') as out:
+        for endian, section in (('<', packets[:half]), ('>', packets[half:])):
+            out.write(section_header(endian))
+            out.write(interface_description(endian))
+            out.write(interface_description(endian, tsresol=9))
+            out.write(block(endian, 5, struct.pack(endian + 'III', 0, 0, 0)))  # interface statistics
+            for i, (sec, usec, data, orig_len) in enumerate(section):
+                if i % 2 == 0:
+                    out.write(enhanced_packet(endian, 0, sec * 1000000 + usec, data, orig_len))
+                else:
+                    out.write(enhanced_packet(endian, 1, (sec * 1000000 + usec) * 1000, data, orig_len))
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,99 @@
+#!/bin/python
+#
+# USAGE: repeats-test.py <mercury> <pcap_input_file> <window> [<mercury option>...]
+#
+# runs mercury on pcap_input_file with the given options, once with
+# --suppress-repeats=<window> and once without, and checks that the
+# records written with it are those written without it, less the
+# repeats within each window, and that each window with repeats has a
+# summary record that counts them
+#
+# RETURN: 0 on success, nonzero otherwise
+
+import json
+import subprocess
+import sys
+
+# fingerprints of the messages in TCP data, which are the only events
+# that are suppressed
+#
+suppressible = { 'tls', 'tls_server', 'http', 'http_server', 'ssh', 'ssh_kex', 'smtp_server' }
+
+
+def records(args):
+    out = subprocess.run(args, stdout=subprocess.PIPE, check=True).stdout
+    return [json.loads(line) for line in out.splitlines()]
+
+
+def event(r):
+    fps = r.get('fingerprints', {})
+    if len(fps) != 1 or next(iter(fps)) not in suppressible:
+        return None
+    server_name = r.get('tls', {}).get('client', {}).get('server_name', '')
+    return (r['src_ip'], next(iter(fps.values())), r['dst_ip'], r['dst_port'], server_name)
+
+
+def suppress(full, window):
+    """
+    returns the records that should be written, and the summaries
+    (event, window start, count, last seen) of the repeats that should
+    be reported, if the full records are written with the given window
+    """
+    windows = {}   # event -> [window start, count, last seen]
+    expected = []
+    summaries = []
+    for r in full:
+        e = event(r)
+        if e is None:
+            expected.append(r)
+            continue
+        t = r['event_start']
+        w = windows.get(e)
+        if w is not None and int(w[0]) <= int(t) and int(t) - int(w[0]) < window:
+            w[1] += 1
+            w[2] = t
+            continue
+        if w is not None and w[1] > 0:
+            summaries.append((e, w[0], w[1], w[2]))
+        windows[e] = [t, 0, None]
+        expected.append(r)
+    for e, w in windows.items():
+        if w[1] > 0:
+            summaries.append((e, w[0], w[1], w[2]))
+    return expected, summaries
+
+
+def main():
+    mercury, pcap_file, window = sys.argv[1:4]
+    options = sys.argv[4:]
+
+    full = records([mercury, '-r', pcap_file] + options)
+    output = records([mercury, '-r', pcap_file, '--suppress-repeats=' + window] + options)
+    written = [r for r in output if 'repeats' not in r]
+    summaries = [(event(r), r['repeats']['window_start'], r['repeats']['count'], r['repeats']['last_seen'])
+                 for r in output if 'repeats' in r]
+
+    expected, expected_summaries = suppress(full, int(window))
+    if [list(r.items()) for r in written] != [list(r.items()) for r in expected]:
+        print('error: %d records written with --suppress-repeats=%s, expected %d' % (len(written), window, len(expected)))
+        for got, want in zip(written, expected):
+            if list(got.items()) != list(want.items()):
+                print('first difference:\n  got:      %s\n  expected: %s' % (json.dumps(got), json.dumps(want)))
+                break
+        return 1
+
+    # every suppressed event is counted in exactly one summary
+    #
+    suppressed = len(full) - len(expected)
+    reported = sum(count for _, _, count, _ in summaries)
+    if reported != suppressed:
+        print('error: %d repeats reported in summaries, but %d suppressed' % (reported, suppressed))
+        return 1
+    if sorted(summaries) != sorted(expected_summaries):
+        print('error: summaries %s, expected %s' % (sorted(summaries), sorted(expected_summaries)))
+        return 1
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,190 @@
+#!/bin/python
+#
+# USAGE: stream-test.py <mercury> <pcap_input_file> <json_file> <policy>
+#
+# runs mercury with --stream and --stream-policy=<policy>, with two
+# subscribers connected to its socket, one of which reads every record
+# and one of which reads none until the input is finished, feeds it the
+# packets in pcap_input_file, and checks that each subscriber received
+# the records in json_file (mercury's output for the same input),
+# one per message, in order.  It also checks that mercury replaces a
+# socket left behind by an earlier run, but refuses to take over one
+# that is in use, and, with a drop policy, that the records held for a
+# slow subscriber when mercury finishes are still sent to it, or, with
+# the block policy, that a subscriber that stops reading does not keep
+# mercury from stopping when it is interrupted
+#
+# RETURN: 0 on success, nonzero otherwise
+
+import os
+import signal
+import socket
+import subprocess
+import sys
+import threading
+import time
+
+
+def receive_all(sock, records):
+    while True:
+        msg = sock.recv(1 << 16)
+        if not msg:
+            return
+        records.append(msg)
+
+
+def connect(sock_path):
+    """
+    returns a socket connected to sock_path, once mercury listens on
+    it, or None if it does not within five seconds
+    """
+    for _ in range(100):
+        sock = socket.socket(socket.AF_UNIX, socket.SOCK_SEQPACKET)
+        try:
+            sock.connect(sock_path)
+            return sock
+        except OSError:
+            sock.close()
+            time.sleep(0.05)
+    return None
+
+
+def check_close_drain(mercury, pcap_file, policy, sock_path):
+    """
+    streams more records than fit in a socket buffer to a subscriber
+    that starts reading only once mercury has had time to finish, and
+    checks that mercury waits for it to receive all of them
+    """
+    # the packets of pcap_file, thirty times over, after its header
+    #
+    with open(pcap_file, 'rb') as f:
+        data = f.read()
+    with open('tmp-stream.pcap', 'wb') as f:
+        f.write(data[:24] + data[24:] * 30)
+    subprocess.run([mercury, '-r', 'tmp-stream.pcap', '-f', 'tmp-stream.json'], check=True)
+    with open('tmp-stream.json', 'rb') as f:
+        expected = f.read().splitlines(keepends=True)
+
+    proc = subprocess.Popen([mercury, '--stream=' + sock_path, '--stream-policy=' + policy],
+                            stdin=subprocess.PIPE)
+    slow = connect(sock_path)
+    if slow is None:
+        print('error: mercury did not listen on', sock_path)
+        proc.kill()
+        return 1
+    time.sleep(0.5)     # mercury accepts subscribers between batches
+    with open('tmp-stream.pcap', 'rb') as f:
+        proc.stdin.write(f.read())
+    proc.stdin.close()
+    time.sleep(0.5)
+    records = []
+    receive_all(slow, records)
+    proc.wait(timeout=60)
+    os.remove('tmp-stream.pcap')
+    os.remove('tmp-stream.json')
+    if records != expected:
+        print('error: slow subscriber received %d records, expected %d' % (len(records), len(expected)))
+        return 1
+    return 0
+
+
+def check_block_shutdown(mercury, pcap_file, sock_path):
+    """
+    streams records to a subscriber that never reads, until mercury is
+    blocked on it, then interrupts mercury and checks that it exits
+    """
+    proc = subprocess.Popen([mercury, '-r', pcap_file, '-p', '100000', '--stream=' + sock_path,
+                             '--stream-policy=block'], stdout=subprocess.DEVNULL)
+    stuck = connect(sock_path)
+    if stuck is None:
+        print('error: mercury did not listen on', sock_path)
+        proc.kill()
+        return 1
+    time.sleep(2)       # long enough to fill the socket buffer
+    if proc.poll() is not None:
+        print('error: mercury exited before it was interrupted')
+        return 1
+    proc.send_signal(signal.SIGINT)
+    try:
+        proc.wait(timeout=10)
+    except subprocess.TimeoutExpired:
+        print('error: mercury did not exit after SIGINT while blocked on a subscriber')
+        proc.kill()
+        proc.wait()
+        return 1
+    finally:
+        stuck.close()
+    return 0
+
+
+def main():
+    mercury, pcap_file, json_file, policy = sys.argv[1:5]
+    sock_path = 'tmp-stream.sock'
+
+    with open(json_file, 'rb') as f:
+        expected = f.read().splitlines(keepends=True)
+
+    # a socket left behind by an earlier run, which no process listens on
+    #
+    stale = socket.socket(socket.AF_UNIX, socket.SOCK_SEQPACKET)
+    stale.bind(sock_path)
+    stale.close()
+
+    proc = subprocess.Popen([mercury, '--stream=' + sock_path, '--stream-policy=' + policy, '-v'],
+                            stdin=subprocess.PIPE, stderr=subprocess.PIPE)
+    fast = connect(sock_path)
+    if fast is None:
+        print('error: mercury did not listen on', sock_path)
+        proc.kill()
+        return 1
+    slow = socket.socket(socket.AF_UNIX, socket.SOCK_SEQPACKET)
+    slow.connect(sock_path)
+
+    # a second mercury must not take over the socket in use
+    #
+    second = subprocess.run([mercury, '--stream=' + sock_path], stdin=subprocess.DEVNULL,
+                            stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    if second.returncode == 0 or not os.path.exists(sock_path):
+        print('error: a second mercury took over the stream socket in use')
+        proc.kill()
+        return 1
+
+    time.sleep(0.5)     # mercury accepts subscribers between batches
+
+    fast_records = []
+    reader = threading.Thread(target=receive_all, args=(fast, fast_records))
+    reader.start()
+
+    with open(pcap_file, 'rb') as f:
+        proc.stdin.write(f.read())
+    proc.stdin.close()
+
+    slow_records = []
+    if policy != 'block':
+        # with a drop policy, mercury finishes without waiting for us
+        proc.wait(timeout=60)
+    receive_all(slow, slow_records)
+    reader.join()
+    proc.wait(timeout=60)
+    stderr = proc.stderr.read().decode()
+
+    status = 0
+    if proc.returncode != 0:
+        print('error: mercury exited with status', proc.returncode)
+        status = 1
+    for name, records in (('fast', fast_records), ('slow', slow_records)):
+        if records != expected:
+            print('error: %s subscriber received %d records, expected %d' % (name, len(records), len(expected)))
+            status = 1
+    if status:
+        sys.stdout.write(stderr)
+        return status
+    if policy != 'block':
+        status = check_close_drain(mercury, pcap_file, policy, sock_path)
+    else:
+        status = check_block_shutdown(mercury, pcap_file, sock_path)
+    return status
+
+
+if __name__ == '__main__':
+    sys.exit(main())